@@ -0,0 +1,213 @@
+/*
+ * render_bench.c
+ *
+ * Benchmark of the client's map rendering.
+ *
+ * Snapshot streams are played through the same
+ * framebuffer code the client uses, drawing to the
+ * in-memory render backend. For each stream we report
+ * the time taken per frame and the bytes that would
+ * have been written to the terminal per frame.
+ *
+ * With no arguments, streams of players wandering
+ * about are generated for a range of map sizes and
+ * player counts. A stream recorded by the client
+ * (mp_client -R) can be given instead.
+ */
+
+#include "pch.h"
+#include "mp_state.h"
+#include "mp_render.h"
+#include "mp_frame.h"
+#include "mp_snaplog.h"
+
+// Default number of frames for generated streams.
+#define BENCH_FRAMES 1000
+
+// Results of one run.
+typedef struct
+{
+	unsigned frames;
+	double avg_us, p99_us, max_us;
+	double bytes, tiles;
+} bench_result;
+
+// Simple deterministic RNG so generated streams are
+// the same every run.
+static unsigned bench_seed = 12345;
+static unsigned bench_rand(void)
+{
+	bench_seed = bench_seed * 1103515245 + 12345;
+	return (bench_seed >> 16) & 0x7FFF;
+}
+
+// Comparison for sorting frame times.
+static int cmp_ull(const void* a, const void* b)
+{
+	unsigned long long x = *(const unsigned long long*)a;
+	unsigned long long y = *(const unsigned long long*)b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Draw a stream of snapshots, the same way the
+ * client's draw_map does.
+ */
+static bench_result bench_run(const mp_state* snaps, unsigned count, unsigned wid, unsigned hei)
+{
+	bench_result res;
+	memset(&res, 0, sizeof(res));
+
+	mp_frame frame;
+	mp_render* r = render_new_mem(hei, wid * FRAME_TILE_WID);
+	unsigned long long* times = malloc((count ? count : 1) * sizeof(unsigned long long));
+	if (!r || !times || !frame_init(&frame, wid, hei))
+	{
+		printf("Failed to allocate for benchmark.\n");
+		exit(-1);
+	}
+
+	unsigned long long total = 0, tiles = 0;
+	for (unsigned f = 0; f < count; ++f)
+	{
+		const mp_state* st = &snaps[f];
+		unsigned long long t0 = time_now_ns();
+
+		frame_fill(&frame, '.');
+		for (unsigned p = 0; p < st->player_count; ++p)
+		{
+			frame_put(&frame, st->players[p].x, st->players[p].y, 'X');
+		}
+		tiles += frame_present(&frame, r);
+
+		times[f] = time_now_ns() - t0;
+		total += times[f];
+	}
+
+	qsort(times, count, sizeof(unsigned long long), cmp_ull);
+	res.frames = count;
+	if (count)
+	{
+		res.avg_us = (double)total / count / NS_PER_US;
+		res.p99_us = (double)times[(count - 1) * 99 / 100] / NS_PER_US;
+		res.max_us = (double)times[count - 1] / NS_PER_US;
+		res.bytes = (double)r->bytes / count;
+		res.tiles = (double)tiles / count;
+	}
+
+	free(times);
+	frame_deinit(&frame);
+	render_free(r);
+	return res;
+}
+
+/*
+ * Generate a stream of players randomly wandering
+ * around a map.
+ */
+static mp_state* bench_generate(unsigned wid, unsigned hei, unsigned players, unsigned frames)
+{
+	mp_state* snaps = calloc(frames, sizeof(mp_state));
+	for (unsigned f = 0; f < frames; ++f)
+	{
+		mp_state* st = &snaps[f];
+		st->players = malloc(players * sizeof(player));
+		st->player_count = players;
+		for (unsigned p = 0; p < players; ++p)
+		{
+			player* pl = &st->players[p];
+			if (f == 0)
+			{
+				pl->index = p;
+				pl->x = bench_rand() % wid;
+				pl->y = bench_rand() % hei;
+				continue;
+			}
+
+			// Each player moves about a quarter of the time.
+			*pl = snaps[f - 1].players[p];
+			switch (bench_rand() % 16)
+			{
+				case 0: pl->x = (pl->x + 1) % wid; break;
+				case 1: pl->x = (pl->x + wid - 1) % wid; break;
+				case 2: pl->y = (pl->y + 1) % hei; break;
+				case 3: pl->y = (pl->y + hei - 1) % hei; break;
+			}
+		}
+	}
+	return snaps;
+}
+
+/*
+ * Print a result line.
+ */
+static void bench_print(const char* name, unsigned wid, unsigned hei, unsigned players, bench_result* r)
+{
+	printf("%-12s %4ux%-4u %7u %7u %10.2f %10.2f %10.2f %12.1f %10.1f\n",
+		name, wid, hei, players, r->frames,
+		r->avg_us, r->p99_us, r->max_us, r->bytes, r->tiles);
+}
+
+/*
+ * Entry point.
+ */
+int main(int argc, char** argv)
+{
+	const char* path = 0;
+	unsigned frames = BENCH_FRAMES;
+	int opt;
+	while ((opt = getopt(argc, argv, "r:f:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'r': path = optarg; break;
+			case 'f': frames = (unsigned)atoi(optarg); break;
+			default:
+			{
+				printf("Usage: %s [-r snapshot_file] [-f frames]\n", argv[0]);
+				return opt == 'h' ? 0 : -1;
+			}
+		}
+	}
+
+	printf("%-12s %9s %7s %7s %10s %10s %10s %12s %10s\n",
+		"stream", "map", "players", "frames",
+		"avg us", "p99 us", "max us", "bytes/frame", "tiles/frm");
+
+	// Play back a recorded stream.
+	if (path)
+	{
+		mp_snaplog log;
+		if (!snaplog_load(&log, path))
+		{
+			printf("Failed to load snapshots from %s\n", path);
+			return -1;
+		}
+		bench_result r = bench_run(log.snaps, log.count, log.map_wid, log.map_hei);
+		bench_print("recorded", log.map_wid, log.map_hei, log.max_players, &r);
+		snaplog_close(&log);
+		return 0;
+	}
+
+	// Otherwise generate streams of different sizes.
+	const unsigned sizes[][2] = { { 32, 12 }, { 128, 48 }, { 512, 192 } };
+	const unsigned counts[] = { 4, 64, 1024 };
+	for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+	{
+		for (unsigned c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c)
+		{
+			unsigned wid = sizes[s][0], hei = sizes[s][1];
+			mp_state* snaps = bench_generate(wid, hei, counts[c], frames);
+			bench_result r = bench_run(snaps, frames, wid, hei);
+			bench_print("generated", wid, hei, counts[c], &r);
+
+			for (unsigned f = 0; f < frames; ++f)
+			{
+				free(snaps[f].players);
+			}
+			free(snaps);
+		}
+	}
+
+	return 0;
+}
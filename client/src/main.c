@@ -23,6 +23,12 @@
 
 #include "pch.h"
 #include "mp_tcp.h"
+#include "mp_state.h"
+#include "mp_predict.h"
+#include "mp_interp.h"
+#include "mp_render.h"
+#include "mp_frame.h"
+#include "mp_snaplog.h"
 
 // Debugging
 #define DEBUG_SKIP_SERVER 0
@@ -32,13 +38,45 @@
 #define CURSOR_HIDE 0
 #define CURSOR_SHOW 0
 #define GAME_SPEED 25
+#define HEARTBEAT_MS 1000
+
+// How many times, and how often, to try and get back
+// into the game if the connection drops.
+#define RECONNECT_TRIES 20
+#define RECONNECT_MS 500
+
+// Most of the map that's shown at once. (In tiles)
+#define VIEW_WID 40
+#define VIEW_HEI 20
+
+// Map chunks that can be waiting for the main thread.
+#define MAP_QUEUE_SIZE 256
+
+// A chunk of map, handed from the network thread
+// to the main thread.
+typedef struct
+{
+	unsigned short cx, cy;
+	unsigned char tiles[MAP_CHUNK_TILES];
+} map_update;
 
 // Function prototypes
-void draw_map(void);
+void print_error(enum mp_packet_err);
+void apply_state(const mp_state* const);
+void apply_map(void);
+void draw_map(const mp_state* const);
 int get_input(void);
 int start_worker(void);
 void stop_worker(void);
+void wake_worker(void);
 void* worker_func(void*);
+int send_inputs(void);
+int recv_packet(void);
+int reconnect(void);
+int rejoin(void);
+void known_set(const player* const);
+void known_remove(int);
+void known_publish(void);
 
 // For signal interupt handler.
 static volatile sig_atomic_t signal_interrupt_caught = 0;
@@ -48,26 +86,8 @@ void signal_interrupt_handler(int param)
 	signal_interrupt_caught = 1;
 }
 
-// Structure for players in the game.
-typedef struct
-{
-	// Whether this player is the actually player
-	// on this computer.
-	int is_player;
-
-	// X/Y position.
-	int x, y;
-
-	// Player's index.
-	int index;
-} player;
-
-
 // Main variables.
-static player* players = 0;
-static size_t player_count = 0;
 static size_t max_players = 0;
-static int player_idx = 0;
 static int glob_player_idx = 0;
 static unsigned map_width = 0;
 static unsigned map_height = 0;
@@ -75,16 +95,65 @@ static mp_tcp* tcp;
 static mp_istream* is;
 static mp_ostream* os;
 static pthread_t thr;
-static int thr_running = FALSE;
+static volatile int thr_running = FALSE;
+static volatile int server_error = ERR_SUCCESS;
+static int wake_fd = -1;
+static mp_state_buf states;
+static char* server_ip;
+static player* known;
+static unsigned known_count = 0;
+static unsigned short known_ack = 0;
+static unsigned last_tick = 0;
+static unsigned long long resume_token = 0;
+static unsigned room = 0;
+static int spectating = FALSE;
+static int camera_x = 0, camera_y = 0;
+static mp_input sent_inputs[PREDICT_MAX_PENDING];
+static unsigned sent_count = 0, sent_next = 0;
+static mp_spsc inputs;
+static mp_spsc map_updates;
+static mp_map map;
+static mp_predict predict;
+static mp_interp interp;
+static unsigned interp_delay = INTERP_DEFAULT_DELAY;
+static unsigned interp_extrapolate = INTERP_DEFAULT_EXTRAPOLATE;
+static mp_frame frame;
+static mp_render* render;
+static const char* snaplog_path = 0;
+static mp_snaplog snaplog;
 
 /*
  * Entry point of the application.
  */
-int main(void)
+int main(int argc, char** argv)
 {
 	// Status code.
 	int status = 0;
 
+	// Parse options.
+	int opt;
+	while ((opt = getopt(argc, argv, "r:sd:e:R:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'r': room = (unsigned)atoi(optarg); break;
+			case 's': spectating = TRUE; break;
+			case 'd': interp_delay = (unsigned)atoi(optarg); break;
+			case 'e': interp_extrapolate = (unsigned)atoi(optarg); break;
+			case 'R': snaplog_path = optarg; break;
+			default:
+			{
+				printf("Usage: %s [-r room] [-s] [-d interp_delay_ms] [-e max_extrapolate_ms] [-R snapshot_file]\n", argv[0]);
+				return opt == 'h' ? 0 : -1;
+			}
+		}
+	}
+	if (spectating && !room)
+	{
+		printf("Give the room to watch with -r.\n");
+		return -1;
+	}
+
 	// Register signal interrupt handler.
 	struct sigaction sigact_inter;
 	sigact_inter.sa_handler = signal_interrupt_handler;
@@ -125,6 +194,7 @@ int main(void)
 #endif
 
 	// Set up our TCP socket.
+	server_ip = serverip;
 	if (!(tcp = tcp_new(serverip)))
 	{
 		printf("Error initialising TCP connection!\n");
@@ -151,6 +221,15 @@ int main(void)
 		goto fail;
 	}
 
+	// Ask to join, or just to watch.
+	ostream_begin(os, spectating ? P_SPECTATE : P_JOIN);
+	owrite_u16(os, (unsigned short)room);
+	if (!spectating)
+	{
+		owrite_u64(os, 0);
+	}
+	ostream_flush(os);
+
 	// Read the server's response packet to our connection.
 	// If we get a P_HELLO then we are good to go.
 	{
@@ -158,29 +237,7 @@ int main(void)
 		if (res == P_ERROR)
 		{
 			// Got an error. Check what it is:
-			enum mp_packet_err err = iread_err(is);
-			switch (err)
-			{
-				case ERR_TIMED_OUT:
-				{
-					printf("Error: Timed out\n");
-				} break;
-
-				case ERR_SERVER_FULL:
-				{
-					printf("Error: Server full\n");
-				} break;
-
-				case ERR_INTERNAL:
-				{
-					printf("Error: Internal server error.\n");
-				} break;
-
-				default:
-				{
-					printf("Unknown error occurred.\n");
-				} break;
-			}
+			print_error(iread_err(is));
 			goto fail;
 		}
 		else if (res != P_HELLO)
@@ -190,25 +247,73 @@ int main(void)
 		}
 
 		// We got a P_HELLO. Now read data that server sent.
-		player_count = (unsigned)iread_u8(is);
 		max_players = (unsigned)iread_u8(is);
 		glob_player_idx = (int)iread_u8(is);
-		map_width = (unsigned)iread_u8(is);
-		map_height = (unsigned)iread_u8(is);
+		if (glob_player_idx == 0xFF)
+		{
+			// We're only watching.
+			glob_player_idx = -1;
+		}
+		map_width = iread_u16(is);
+		map_height = iread_u16(is);
+		int spawn_x = (int)iread_u16(is);
+		int spawn_y = (int)iread_u16(is);
+		(void)iread_u16(is); // Size of the join stream.
+		resume_token = iread_u64(is);
+		room = iread_u16(is);
 
-		// Read players
-		players = malloc(sizeof(player) * player_count);
-		for (unsigned i = 0; i < player_count; ++i)
+		// Set up state handoff between threads.
+		if (!state_init(&states, max_players) ||
+			!spsc_init(&inputs, sizeof(mp_input), PREDICT_MAX_PENDING) ||
+			!spsc_init(&map_updates, sizeof(map_update), MAP_QUEUE_SIZE) ||
+			!map_new_sparse(&map, map_width, map_height) ||
+			!(known = malloc(max_players * sizeof(player))))
 		{
-			players[i].index = (int)iread_u8(is);
-			players[i].x = (int)iread_u8(is);
-			players[i].y = (int)iread_u8(is);
+			printf("Failed to allocate game state.\n");
+			goto fail;
+		}
 
-			if (players[i].index == glob_player_idx)
-			{
-				players[i].is_player = TRUE;
-				player_idx = i;
-			}
+		// To begin with it's just us. Everyone else
+		// arrives in the join stream. Spectators start
+		// looking at the middle of the map.
+		if (spectating)
+		{
+			camera_x = map_width / 2;
+			camera_y = map_height / 2;
+		}
+		else
+		{
+			player self = { spawn_x, spawn_y, glob_player_idx };
+			known_set(&self);
+		}
+		known_publish();
+
+		// Start predicting from our spawn.
+		predict_init(&predict, map_width, map_height, spawn_x, spawn_y);
+
+		// Set up interpolation of everyone else.
+		if (!interp_init(&interp, max_players, map_width, map_height,
+			interp_delay, interp_extrapolate))
+		{
+			printf("Failed to allocate interpolation buffer.\n");
+			goto fail;
+		}
+
+		// And the framebuffer for the part of the map
+		// that's on screen.
+		if (!frame_init(&frame,
+			map_width < VIEW_WID ? map_width : VIEW_WID,
+			map_height < VIEW_HEI ? map_height : VIEW_HEI))
+		{
+			printf("Failed to allocate framebuffer.\n");
+			goto fail;
+		}
+
+		// Record the snapshots we get if asked to.
+		if (snaplog_path && !snaplog_open(&snaplog, snaplog_path, map_width, map_height, max_players))
+		{
+			printf("Failed to open snapshot file %s\n", snaplog_path);
+			goto fail;
 		}
 	}
 
@@ -226,11 +331,35 @@ int main(void)
 	timeout(GAME_SPEED);   // Non block.
 	keypad(stdscr, TRUE);  // Special keys (i.e arrows)
 
-	// Run game until we send exit signal.
+	// Everything is drawn through the renderer.
+	if (!(render = render_new_curses()))
+	{
+		printf("Failed to create renderer.\n");
+		goto fail;
+	}
+
+	// Run game until we send exit signal, or lose
+	// the server.
 	while(!signal_interrupt_caught)
 	{
+		// If our session's gone but the server's still
+		// there, start over as a new player.
+		if (!thr_running && (server_error != ERR_NO_SESSION || !rejoin()))
+		{
+			break;
+		}
+
+		// Pick up the latest state from the network thread.
+		int fresh;
+		const mp_state* st = state_front(&states, &fresh);
+		if (fresh)
+		{
+			apply_state(st);
+		}
+		apply_map();
+
 		// Draw map
-		draw_map();
+		draw_map(st);
 
 		// Get input, and exit if necessary
 		if (!get_input())
@@ -247,6 +376,7 @@ int main(void)
 	// Wait for thread to stop.
 	stop_worker();
 	while(thr_running);
+	close(wake_fd);
 
 	// Tell server that we disconnected.
 	ostream_begin(os, P_DISCONN);
@@ -257,48 +387,187 @@ fail:
 	curs_set(CURSOR_SHOW);
 	endwin();
 
+	// Say why the server got rid of us.
+	if (server_error != ERR_SUCCESS)
+	{
+		print_error(server_error);
+		status = -1;
+	}
+
 	// Free memory.
 	if (os) { ostream_free(os); }
 	if (is) { istream_free(is); }
-	if (players) { free(players); }
+	state_deinit(&states);
+	spsc_deinit(&inputs);
+	spsc_deinit(&map_updates);
+	map_free(&map);
+	free(known);
+	interp_deinit(&interp);
+	frame_deinit(&frame);
+	render_free(render);
+	snaplog_close(&snaplog);
 
 	return status;
 }
 
 /*
- * Draws the map with players, etc.
+ * Print an error the server sent.
+ *
+ * @param err  Error code.
+ */
+void print_error(enum mp_packet_err err)
+{
+	switch (err)
+	{
+		case ERR_TIMED_OUT:
+		{
+			printf("Error: Timed out\n");
+		} break;
+
+		case ERR_SERVER_FULL:
+		{
+			printf("Error: Server full\n");
+		} break;
+
+		case ERR_NO_SESSION:
+		{
+			printf("Error: Lost connection, and couldn't get back in.\n");
+		} break;
+
+		case ERR_NO_ROOM:
+		{
+			printf("Error: No such room.\n");
+		} break;
+
+		case ERR_OVERLOADED:
+		{
+			printf("Error: Server too busy.\n");
+		} break;
+
+		case ERR_INTERNAL:
+		{
+			printf("Error: Internal server error.\n");
+		} break;
+
+		default:
+		{
+			printf("Unknown error occurred.\n");
+		} break;
+	}
+}
+
+/*
+ * Take in a new state from the server.
+ *
+ * @param st  The state.
  */
-void draw_map(void)
+void apply_state(const mp_state* const st)
 {
-	// Clear old map
-	clear();
+	// Our own position is predicted. Correct the
+	// prediction using the server's state.
+	for (unsigned p = 0; p < st->player_count; ++p)
+	{
+		if (st->players[p].index == glob_player_idx)
+		{
+			predict_reconcile(&predict, st->ack, st->players[p].x, st->players[p].y);
+			break;
+		}
+	}
+
+	// Everyone else is interpolated.
+	interp_push(&interp, st);
+
+	// Keep a copy if we're recording.
+	snaplog_write(&snaplog, st);
+}
+
+/*
+ * Copy in any parts of the map the network thread
+ * has received. The map only takes up memory for the
+ * chunks we've been sent.
+ */
+void apply_map(void)
+{
+	map_update m;
+	int took = FALSE;
+	while (spsc_pop(&map_updates, &m))
+	{
+		map_set_chunk(&map, m.cx, m.cy, m.tiles);
+		took = TRUE;
+	}
+
+	// The network thread may be waiting for room.
+	if (took)
+	{
+		wake_worker();
+	}
+}
 
+/*
+ * Draws the map with players, etc. Only the tiles
+ * that changed since last time are redrawn. If the
+ * map doesn't fit, the view follows us around, or
+ * the camera if we're spectating.
+ *
+ * @param st  Latest state from the server.
+ */
+void draw_map(const mp_state* const st)
+{
 	// Constants
-	const int TILE_WID = 2;
-	const char TILE_DEFAULT = '.';
+	const char TILE_CHARS[] = { [TILE_FLOOR] = '.', [TILE_WALL] = '#' };
+	const char TILE_BLANK = ' ';
 	const char TILE_PLAYER = 'X';
 
-	// Draw map from top, left-to-right
-	for (unsigned y = 0; y < map_height; ++y)
+	// Centre the view on where we think we are.
+	int self_x = camera_x, self_y = camera_y;
+	if (!spectating)
 	{
-		for (unsigned x = 0; x < map_width; ++x)
-		{
-			// Draw tile
-			mvaddch(y, TILE_WID * x, TILE_DEFAULT);
+		predict_position(&predict, &self_x, &self_y);
+	}
+	unsigned view_x = 0, view_y = 0;
+	if (frame.wid < map_width)
+	{
+		view_x = (self_x - (int)frame.wid / 2 + map_width) % map_width;
+	}
+	if (frame.hei < map_height)
+	{
+		view_y = (self_y - (int)frame.hei / 2 + map_height) % map_height;
+	}
 
-			// Draw space
-			mvaddch(y, TILE_WID * x + 1, ' ');
+	// Lay out the map
+	for (unsigned y = 0; y < frame.hei; ++y)
+	{
+		for (unsigned x = 0; x < frame.wid; ++x)
+		{
+			int t = map_tile(&map, (view_x + x) % map_width, (view_y + y) % map_height);
+			frame_put(&frame, x, y, t < (int)sizeof(TILE_CHARS) ? TILE_CHARS[t] : TILE_BLANK);
 		}
 	}
 
-	// Draw players
-	for (unsigned p = 0; p < player_count; ++p)
+	// Draw players. We're drawn where we predict we
+	// are, everyone else where the interpolation buffer
+	// says they are.
+	unsigned long long now = time_now_ns();
+	for (unsigned p = 0; p < st->player_count; ++p)
 	{
-		mvaddch(players[p].y, players[p].x * TILE_WID, TILE_PLAYER);
+		int x = st->players[p].x, y = st->players[p].y;
+		if (st->players[p].index == glob_player_idx)
+		{
+			x = self_x;
+			y = self_y;
+		}
+		else
+		{
+			interp_sample(&interp, now, st->players[p].index, &x, &y);
+		}
+		frame_put(&frame,
+			(x - (int)view_x + (int)map_width) % (int)map_width,
+			(y - (int)view_y + (int)map_height) % (int)map_height,
+			TILE_PLAYER);
 	}
 
-	// Tell ncurses to redraw
-	refresh();
+	// Put whatever changed on screen.
+	frame_present(&frame, render);
 }
 
 /*
@@ -309,6 +578,7 @@ void draw_map(void)
 int get_input(void)
 {
 	int ch;
+	int dx = 0, dy = 0;
 	switch (ch = getch())
 	{
 		// Quit
@@ -318,6 +588,12 @@ int get_input(void)
 			return FALSE;
 		} break;
 
+		// Terminal changed size, so redraw everything
+		case (KEY_RESIZE):
+		{
+			frame_invalidate(&frame);
+		} break;
+
 		// Move left
 		case ('A'):
 		case ('a'):
@@ -325,8 +601,7 @@ int get_input(void)
 		case ('h'):
 		case (KEY_LEFT):
 		{
-			// Move player position 1 left.
-			players[player_idx].x = (players[player_idx].x - 1) % (int)map_width;
+			dx = -1;
 		} break;
 
 		// Move right
@@ -336,8 +611,7 @@ int get_input(void)
 		case ('l'):
 		case (KEY_RIGHT):
 		{
-			// Move player position 1 right.
-			players[player_idx].x = (players[player_idx].x + 1) % (int)map_width;
+			dx = 1;
 		} break;
 
 		// Move up
@@ -347,8 +621,7 @@ int get_input(void)
 		case ('k'):
 		case (KEY_UP):
 		{
-			// Move player position 1 up.
-			players[player_idx].y = (players[player_idx].y - 1) % (int)map_height;
+			dy = -1;
 		} break;
 
 		// Move down
@@ -358,19 +631,39 @@ int get_input(void)
 		case ('j'):
 		case (KEY_DOWN):
 		{
-			// Move player position 1 down.
-			players[player_idx].y = (players[player_idx].y + 1) % (int)map_height;
+			dy = 1;
 		} break;
 	}
 
-	// Wrap for below zero.
-	if (players[player_idx].x < 0)
+	// Spectators just move the camera.
+	if (spectating)
 	{
-		players[player_idx].x = map_width - 1;
+		camera_x = (camera_x + dx + (int)map_width) % (int)map_width;
+		camera_y = (camera_y + dy + (int)map_height) % (int)map_height;
+		return TRUE;
+	}
+
+	// Don't bother trying to walk into walls.
+	if (dx || dy)
+	{
+		int x, y;
+		predict_position(&predict, &x, &y);
+		x = (x + dx + (int)map_width) % (int)map_width;
+		y = (y + dy + (int)map_height) % (int)map_height;
+		if (map_tile(&map, x, y) == TILE_WALL)
+		{
+			dx = dy = 0;
+		}
 	}
-	if (players[player_idx].y < 0)
+
+	// Move the player straight away, and hand the input
+	// to the network thread. The server will catch up
+	// when it gets it.
+	mp_input in;
+	if ((dx || dy) && predict_move(&predict, dx, dy, &in))
 	{
-		players[player_idx].y = map_height - 1;
+		spsc_push(&inputs, &in);
+		wake_worker();
 	}
 
 	return TRUE;
@@ -381,6 +674,12 @@ int get_input(void)
  */
 int start_worker(void)
 {
+	// Used to wake the thread when there's input to send.
+	if ((wake_fd = eventfd(0, EFD_NONBLOCK)) < 0)
+	{
+		return FALSE;
+	}
+
 	// Create and start thread.
 	thr_running = TRUE;
 	if (pthread_create(&thr, 0, worker_func, 0) != 0)
@@ -403,72 +702,81 @@ void stop_worker(void)
 	if (thr_running)
 	{
 		thr_running = FALSE;
-		pthread_join(thr, 0);
+		wake_worker();
+	}
+}
+
+/*
+ * Wake the network thread up, e.g because there
+ * is input for it to send.
+ */
+void wake_worker(void)
+{
+	if (wake_fd >= 0)
+	{
+		eventfd_write(wake_fd, 1);
 	}
 }
 
 /*
- * Actual worker method
+ * Actual worker method. Sending and receiving are
+ * independent: inputs go out as soon as they're made
+ * (with a heartbeat while idle), and the server's
+ * state updates are read whenever they arrive.
  */
 void* worker_func(void* arg)
 {
+	unsigned long long heartbeat_ns = HEARTBEAT_MS * NS_PER_MS;
+	unsigned long long next_heartbeat = time_now_ns() + heartbeat_ns;
+	struct pollfd pfds[2] =
+	{
+		{ tcp->handle, POLLIN, 0 },
+		{ wake_fd, POLLIN, 0 },
+	};
+
 	// Network loop
 	while(thr_running && !signal_interrupt_caught)
 	{
-		// Here we constantly send our position to the server.
-		// The server will respond with the positions of all
-		// the players in the game.
-		ostream_begin(os, P_POS_UPDATE);
-		owrite_u8(os, (unsigned char)players[player_idx].x);
-		owrite_u8(os, (unsigned char)players[player_idx].y);
-		ostream_flush(os);
-
-		// On success the server will respond with P_UPDATE
-		enum mp_packet res = iread_begin(is);
-		switch (res)
+		// Sleep until the server sends something, there
+		// are inputs to send, or a heartbeat is due.
+		unsigned long long now = time_now_ns();
+		int wait_ms = now < next_heartbeat ? (int)((next_heartbeat - now + NS_PER_MS - 1) / NS_PER_MS) : 0;
+		if (poll(pfds, 2, wait_ms) < 0 && errno != EINTR)
 		{
-			case P_UPDATE:
-			{
-				// Normal update. Server responds with the
-				// current server state.
-				unsigned pcount = (unsigned)iread_u8(is);
-				if (player_count != pcount)
-				{
-					players = realloc(players, pcount * sizeof(player));
-					player_count = pcount;
-				}
+			break;
+		}
 
-				for (unsigned i = 0; i < player_count; ++i)
-				{
-					// Read this player.
-					int idx = (int)iread_u8(is);
-					int x = (int)iread_u8(is);
-					int y = (int)iread_u8(is);
-
-					if (idx == glob_player_idx)
-					{
-						player_idx = i;
-					}
-					else
-					{
-						players[i].index = idx;
-						players[i].x = x;
-						players[i].y = y;
-					}
-				}
-			} break;
+		// Clear the wakeup.
+		if (pfds[1].revents & POLLIN)
+		{
+			eventfd_t v;
+			eventfd_read(wake_fd, &v);
+		}
 
-			case P_ERROR:
-			{
-				// An error occurred.
-				enum mp_packet_err err = iread_err(is);
-				(void)err;
-			} break;
+		// Send inputs, or let the server know we're
+		// still here if we've been idle a while.
+		now = time_now_ns();
+		if (send_inputs())
+		{
+			next_heartbeat = now + heartbeat_ns;
+		}
+		else if (now >= next_heartbeat)
+		{
+			ostream_begin(os, P_HEARTBEAT);
+			ostream_flush(os);
+			next_heartbeat = now + heartbeat_ns;
+		}
 
-			default:
+		// Handle whatever the server sent. If we lose the
+		// connection, try and pick up where we left off.
+		// (Spectators have nothing to pick up)
+		if ((pfds[0].revents & (POLLIN | POLLHUP | POLLERR)) && !recv_packet())
+		{
+			if (server_error != ERR_SUCCESS || !thr_running || spectating || !reconnect())
 			{
 				break;
 			}
+			pfds[0].fd = tcp->handle;
 		}
 	}
 
@@ -477,3 +785,364 @@ void* worker_func(void* arg)
 	pthread_exit(NULL);
 	return 0;
 }
+
+/*
+ * Send any inputs that haven't been sent yet.
+ *
+ * @return TRUE if anything was sent.
+ */
+int send_inputs(void)
+{
+	// Take everything the main thread has queued.
+	mp_input batch[PREDICT_MAX_PENDING];
+	unsigned count = 0;
+	while (count < PREDICT_MAX_PENDING && spsc_pop(&inputs, &batch[count]))
+	{
+		++count;
+	}
+	if (!count)
+	{
+		return FALSE;
+	}
+
+	ostream_begin(os, P_INPUT);
+	owrite_u8(os, (unsigned char)count);
+	for (unsigned i = 0; i < count; ++i)
+	{
+		owrite_u16(os, batch[i].seq);
+		owrite_8(os, batch[i].dx);
+		owrite_8(os, batch[i].dy);
+
+		// Remember it in case it gets lost on the way.
+		sent_inputs[sent_next] = batch[i];
+		sent_next = (sent_next + 1) % PREDICT_MAX_PENDING;
+		if (sent_count < PREDICT_MAX_PENDING) ++sent_count;
+	}
+	ostream_flush(os);
+	return TRUE;
+}
+
+/*
+ * Try to get back into our session after the
+ * connection has dropped.
+ *
+ * @return FALSE if we couldn't.
+ */
+int reconnect(void)
+{
+	for (unsigned i = 0; i < RECONNECT_TRIES && thr_running; ++i)
+	{
+		if (i) usleep(RECONNECT_MS * 1000);
+
+		// Connect again.
+		mp_tcp* t = tcp_new(server_ip);
+		if (!t) continue;
+		if (!tcp_connect(t))
+		{
+			tcp_free(t);
+			continue;
+		}
+		istream_set_sock(is, t->handle);
+		os->sock = t->handle;
+
+		// Ask for our session back.
+		ostream_begin(os, P_RESUME);
+		owrite_u64(os, resume_token);
+		owrite_u32(os, last_tick);
+		ostream_flush(os);
+
+		enum mp_packet res = iread_begin(is);
+		if (res == P_ERROR)
+		{
+			// It's gone. No point trying again.
+			server_error = iread_err(is);
+			tcp_free(t);
+			return FALSE;
+		}
+		if (res != P_HELLO)
+		{
+			tcp_free(t);
+			continue;
+		}
+
+		// Should be just as we left it.
+		unsigned max = (unsigned)iread_u8(is);
+		int idx = (int)iread_u8(is);
+		unsigned w = iread_u16(is), h = iread_u16(is);
+		int x = (int)iread_u16(is), y = (int)iread_u16(is);
+		player self = { x, y, idx };
+		(void)iread_u16(is); // Size of the join stream. (None)
+		resume_token = iread_u64(is);
+		unsigned r = iread_u16(is);
+		if (max != max_players || idx != glob_player_idx || w != map_width || h != map_height || r != room)
+		{
+			server_error = ERR_NO_SESSION;
+			tcp_free(t);
+			return FALSE;
+		}
+		tcp_free(tcp);
+		tcp = t;
+		known_set(&self);
+		known_publish();
+
+		// Send again whatever inputs might not have made
+		// it. The server skips any it has already seen.
+		if (sent_count)
+		{
+			ostream_begin(os, P_INPUT);
+			owrite_u8(os, (unsigned char)sent_count);
+			for (unsigned n = 0; n < sent_count; ++n)
+			{
+				const mp_input* in = &sent_inputs[(sent_next + PREDICT_MAX_PENDING - sent_count + n) % PREDICT_MAX_PENDING];
+				owrite_u16(os, in->seq);
+				owrite_8(os, in->dx);
+				owrite_8(os, in->dy);
+			}
+			ostream_flush(os);
+		}
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ * Join the game again as a new player, after our
+ * session has gone. Called once the network thread
+ * has stopped, which this starts again.
+ *
+ * @return FALSE if we couldn't.
+ */
+int rejoin(void)
+{
+	mp_tcp* t = tcp_new(server_ip);
+	if (!t)
+	{
+		return FALSE;
+	}
+	if (!tcp_connect(t))
+	{
+		tcp_free(t);
+		return FALSE;
+	}
+	istream_set_sock(is, t->handle);
+	os->sock = t->handle;
+
+	// Our old token gets us our old spot back, if
+	// it's still free.
+	ostream_begin(os, P_JOIN);
+	owrite_u16(os, (unsigned short)room);
+	owrite_u64(os, resume_token);
+	ostream_flush(os);
+
+	enum mp_packet res = iread_begin(is);
+	if (res == P_ERROR)
+	{
+		server_error = iread_err(is);
+		tcp_free(t);
+		return FALSE;
+	}
+	if (res != P_HELLO)
+	{
+		tcp_free(t);
+		return FALSE;
+	}
+
+	// Same map, but we're somebody else now.
+	unsigned max = (unsigned)iread_u8(is);
+	int idx = (int)iread_u8(is);
+	unsigned w = iread_u16(is), h = iread_u16(is);
+	int x = (int)iread_u16(is), y = (int)iread_u16(is);
+	(void)iread_u16(is); // Size of the join stream.
+	unsigned long long token = iread_u64(is);
+	unsigned r = iread_u16(is);
+	if (max != max_players || w != map_width || h != map_height)
+	{
+		tcp_free(t);
+		return FALSE;
+	}
+	tcp_free(tcp);
+	tcp = t;
+	server_error = ERR_SUCCESS;
+	glob_player_idx = idx;
+	resume_token = token;
+	room = r;
+	last_tick = 0;
+
+	// Forget everyone, and any inputs the old session
+	// never got, and start predicting from our spawn.
+	mp_input in;
+	while (spsc_pop(&inputs, &in));
+	sent_count = sent_next = 0;
+	known_count = 0;
+	known_ack = 0;
+	player self = { x, y, idx };
+	known_set(&self);
+	known_publish();
+	predict_init(&predict, map_width, map_height, x, y);
+
+	close(wake_fd);
+	return start_worker();
+}
+
+/*
+ * Add a player to the players we know of, or
+ * update them if we already know of them. Only
+ * the network thread touches these.
+ *
+ * @param p  The player.
+ */
+void known_set(const player* const p)
+{
+	for (unsigned i = 0; i < known_count; ++i)
+	{
+		if (known[i].index == p->index)
+		{
+			known[i] = *p;
+			return;
+		}
+	}
+	if (known_count < max_players)
+	{
+		known[known_count++] = *p;
+	}
+}
+
+/*
+ * Forget about a player that has left.
+ *
+ * @param index  The player's index.
+ */
+void known_remove(int index)
+{
+	for (unsigned i = 0; i < known_count; ++i)
+	{
+		if (known[i].index == index)
+		{
+			known[i] = known[--known_count];
+			return;
+		}
+	}
+}
+
+/*
+ * Hand the players we know of to the main thread.
+ */
+void known_publish(void)
+{
+	mp_state* st = state_back(&states);
+	st->ack = known_ack;
+	st->player_count = known_count;
+	memcpy(st->players, known, known_count * sizeof(player));
+	st->time = time_now_ns();
+	state_publish(&states);
+}
+
+/*
+ * Read and handle a packet from the server.
+ *
+ * @return FALSE if the connection was lost.
+ */
+int recv_packet(void)
+{
+	enum mp_packet res = iread_begin(is);
+	unsigned long long rx_time = time_now_ns();
+	switch (res)
+	{
+		case P_UPDATE:
+		{
+			// Normal update. Server sends what changed since
+			// the last one, which we apply to what we know.
+			last_tick = iread_u32(is);
+			known_ack = (unsigned short)iread_u16(is);
+			unsigned pcount = (unsigned)iread_u8(is);
+			for (unsigned i = 0; i < pcount; ++i)
+			{
+				// Read this player.
+				player p;
+				p.index = (int)iread_u8(is);
+				p.x = (int)iread_u16(is);
+				p.y = (int)iread_u16(is);
+				known_set(&p);
+			}
+			unsigned gone = (unsigned)iread_u8(is);
+			for (unsigned i = 0; i < gone; ++i)
+			{
+				known_remove((int)iread_u8(is));
+			}
+
+			// Hand it over to the main thread.
+			known_publish();
+		} break;
+
+		// More of the initial state. Add it to what we
+		// have so far, and show it straight away.
+		case P_JOIN_CHUNK:
+		{
+			unsigned pcount = (unsigned)iread_u8(is);
+			for (unsigned i = 0; i < pcount; ++i)
+			{
+				player p;
+				p.index = (int)iread_u8(is);
+				p.x = (int)iread_u16(is);
+				p.y = (int)iread_u16(is);
+				known_set(&p);
+			}
+			known_publish();
+		} break;
+
+		// Part of the map. Pass it on to the main thread,
+		// waiting for it to catch up if need be. (It
+		// wakes us when it takes some)
+		case P_MAP_CHUNK:
+		{
+			map_update m;
+			m.cx = (unsigned short)iread_u16(is);
+			m.cy = (unsigned short)iread_u16(is);
+			for (unsigned t = 0; t < MAP_CHUNK_TILES; ++t)
+			{
+				m.tiles[t] = iread_u8(is);
+			}
+			while (!spsc_push(&map_updates, &m) && thr_running)
+			{
+				struct pollfd pfd = { wake_fd, POLLIN, 0 };
+				if (poll(&pfd, 1, -1) > 0)
+				{
+					eventfd_t v;
+					eventfd_read(wake_fd, &v);
+				}
+			}
+		} break;
+
+		// Server is measuring latency. Reply straight away.
+		case P_PING:
+		{
+			unsigned long long t0 = iread_u64(is);
+			ostream_begin(os, P_PONG);
+			owrite_u64(os, t0);
+			owrite_u64(os, rx_time);
+			owrite_u64(os, time_now_ns());
+			ostream_flush(os);
+		} break;
+
+		case P_ERROR:
+		{
+			// An error occurred. The server drops us
+			// after any error, so we're done.
+			server_error = iread_err(is);
+			return FALSE;
+		}
+
+		// Connection closed.
+		case P_UNKNOWN:
+		{
+			return FALSE;
+		}
+
+		default:
+		{
+			break;
+		}
+	}
+
+	return TRUE;
+}
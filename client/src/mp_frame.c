@@ -0,0 +1,128 @@
+/*
+ * mp_frame.c
+ *
+ * Shadow framebuffer, for only redrawing the
+ * parts of the map that changed.
+ */
+
+#include "pch.h"
+#include "mp_render.h"
+#include "mp_frame.h"
+
+/*
+ * Initialise a framebuffer.
+ *
+ * @param f    Framebuffer to initialise.
+ * @param wid  Width in tiles.
+ * @param hei  Height in tiles.
+ *
+ * @return FALSE on failure.
+ */
+int frame_init(mp_frame* const f, unsigned wid, unsigned hei)
+{
+	memset(f, 0, sizeof(mp_frame));
+	f->wid = wid;
+	f->hei = hei;
+	f->full = TRUE;
+	if (!(f->cells = calloc(wid * hei, 1)) ||
+		!(f->shadow = calloc(wid * hei, 1)))
+	{
+		frame_deinit(f);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Free a framebuffer's memory.
+ *
+ * @param f  Framebuffer to deinitialise.
+ */
+void frame_deinit(mp_frame* const f)
+{
+	free(f->cells);
+	free(f->shadow);
+	f->cells = f->shadow = 0;
+}
+
+/*
+ * Set every tile.
+ *
+ * @param f   Framebuffer.
+ * @param ch  Character to fill with.
+ */
+void frame_fill(mp_frame* const f, char ch)
+{
+	memset(f->cells, ch, f->wid * f->hei);
+}
+
+/*
+ * Set a single tile. Out of range tiles are ignored.
+ *
+ * @param f   Framebuffer.
+ * @param x   Tile X.
+ * @param y   Tile Y.
+ * @param ch  Character to draw.
+ */
+void frame_put(mp_frame* const f, int x, int y, char ch)
+{
+	if (x < 0 || y < 0 || (unsigned)x >= f->wid || (unsigned)y >= f->hei) return;
+	f->cells[y * f->wid + x] = ch;
+}
+
+/*
+ * Draw whatever has changed since the last present.
+ * Nothing is sent to the renderer if nothing changed.
+ *
+ * @param f  Framebuffer.
+ * @param r  Renderer to draw to.
+ *
+ * @return number of tiles that were redrawn.
+ */
+unsigned frame_present(mp_frame* const f, mp_render* const r)
+{
+	unsigned drawn = 0;
+
+	// Start from a blank screen for full redraws.
+	if (f->full)
+	{
+		render_clear(r);
+	}
+
+	for (unsigned y = 0; y < f->hei; ++y)
+	{
+		for (unsigned x = 0; x < f->wid; ++x)
+		{
+			unsigned i = y * f->wid + x;
+			if (!f->full && f->cells[i] == f->shadow[i]) continue;
+
+			// Draw tile, then the space after it.
+			render_put(r, y, FRAME_TILE_WID * x, f->cells[i]);
+			if (f->full)
+			{
+				render_put(r, y, FRAME_TILE_WID * x + 1, ' ');
+			}
+			f->shadow[i] = f->cells[i];
+			++drawn;
+		}
+	}
+	f->full = FALSE;
+
+	// Tell the renderer to redraw, if there's anything to redraw.
+	if (drawn)
+	{
+		render_present(r);
+	}
+	return drawn;
+}
+
+/*
+ * Force everything to be redrawn next present, e.g
+ * when the terminal is resized.
+ *
+ * @param f  Framebuffer.
+ */
+void frame_invalidate(mp_frame* const f)
+{
+	f->full = TRUE;
+}
@@ -0,0 +1,39 @@
+#ifndef MP_FRAME_H
+#define MP_FRAME_H
+
+// Width of a tile on screen. (Tile char, then a space)
+#define FRAME_TILE_WID 2
+
+/*
+ * Framebuffer for the map.
+ *
+ * Each frame is built up in cells, then compared with
+ * a shadow copy of what's already on screen so only
+ * the tiles that changed get redrawn.
+ */
+typedef struct mp_frame
+{
+	// Size in tiles.
+	unsigned wid, hei;
+
+	// What we want on screen.
+	char* cells;
+
+	// What is on screen.
+	char* shadow;
+
+	// Set to redraw everything on next present.
+	int full;
+} mp_frame;
+
+// Allocation
+int frame_init(mp_frame* const, unsigned, unsigned);
+void frame_deinit(mp_frame* const);
+
+// Drawing
+void frame_fill(mp_frame* const, char);
+void frame_put(mp_frame* const, int, int, char);
+unsigned frame_present(mp_frame* const, mp_render* const);
+void frame_invalidate(mp_frame* const);
+
+#endif
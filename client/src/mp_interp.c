@@ -0,0 +1,193 @@
+/*
+ * mp_interp.c
+ *
+ * Interpolation of remote players between
+ * server snapshots.
+ */
+
+#include "pch.h"
+#include "mp_state.h"
+#include "mp_interp.h"
+
+/*
+ * Shortest signed distance from a to b on a
+ * map that wraps around.
+ */
+static double wrap_delta(int a, int b, int size)
+{
+	int d = b - a;
+	if (d > size / 2) d -= size;
+	if (d < -size / 2) d += size;
+	return (double)d;
+}
+
+/*
+ * Round a position to the nearest tile, wrapping it
+ * back onto the map.
+ */
+static int wrap_round(double v, int size)
+{
+	int i = (int)(v < 0 ? v - 0.5 : v + 0.5);
+	return ((i % size) + size) % size;
+}
+
+/*
+ * Initialise an interpolation buffer.
+ *
+ * @param in           Buffer to initialise.
+ * @param max_players  Highest player index + 1.
+ * @param wid          Map width.
+ * @param hei          Map height.
+ * @param delay        Interpolation delay. (ms)
+ * @param extrapolate  Maximum time to extrapolate for. (ms)
+ *
+ * @return FALSE on failure.
+ */
+int interp_init(mp_interp* const in, unsigned max_players, int wid, int hei, unsigned delay, unsigned extrapolate)
+{
+	memset(in, 0, sizeof(mp_interp));
+	in->max_players = max_players;
+	in->map_wid = wid;
+	in->map_hei = hei;
+	in->delay = delay * NS_PER_MS;
+	in->max_extrapolate = extrapolate * NS_PER_MS;
+
+	// Allocate storage for each snapshot.
+	for (unsigned i = 0; i < INTERP_SNAPSHOTS; ++i)
+	{
+		mp_snapshot* s = &in->snaps[i];
+		s->present = calloc(max_players, sizeof(unsigned char));
+		s->x = calloc(max_players, sizeof(int));
+		s->y = calloc(max_players, sizeof(int));
+		if (!s->present || !s->x || !s->y)
+		{
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * De-initialise an interpolation buffer.
+ *
+ * @param in  Buffer to deinitialise.
+ */
+void interp_deinit(mp_interp* const in)
+{
+	for (unsigned i = 0; i < INTERP_SNAPSHOTS; ++i)
+	{
+		free(in->snaps[i].present);
+		free(in->snaps[i].x);
+		free(in->snaps[i].y);
+	}
+}
+
+/*
+ * Add a state from the server to the buffer,
+ * replacing the oldest snapshot if it's full.
+ *
+ * @param in  Buffer.
+ * @param st  State to take the snapshot from.
+ */
+void interp_push(mp_interp* const in, const mp_state* const st)
+{
+	// Take over the next slot.
+	unsigned slot = (in->head + in->count) % INTERP_SNAPSHOTS;
+	if (in->count == INTERP_SNAPSHOTS)
+	{
+		in->head = (in->head + 1) % INTERP_SNAPSHOTS;
+	}
+	else
+	{
+		++in->count;
+	}
+
+	mp_snapshot* s = &in->snaps[slot];
+	s->time = st->time;
+	memset(s->present, 0, in->max_players);
+	for (unsigned i = 0; i < st->player_count; ++i)
+	{
+		const player* p = &st->players[i];
+		if (p->index < 0 || (unsigned)p->index >= in->max_players) continue;
+		s->present[p->index] = TRUE;
+		s->x[p->index] = p->x;
+		s->y[p->index] = p->y;
+	}
+}
+
+/*
+ * Work out where to draw a remote player.
+ *
+ * @param in     Buffer.
+ * @param now    Current time. (ns)
+ * @param index  Player index.
+ * @param x      Set to the X position to draw at.
+ * @param y      Set to the Y position to draw at.
+ *
+ * @return FALSE if we know nothing about the player.
+ */
+int interp_sample(const mp_interp* const in, unsigned long long now, int index, int* x, int* y)
+{
+	if (index < 0 || (unsigned)index >= in->max_players)
+	{
+		return FALSE;
+	}
+
+	// Time we're rendering at.
+	unsigned long long rt = now > in->delay ? now - in->delay : 0;
+
+	// Walk back from the newest snapshot, looking for the
+	// snapshots containing the player either side of rt.
+	const mp_snapshot *before = 0, *after = 0, *prev = 0;
+	for (unsigned i = in->count; i-- > 0;)
+	{
+		const mp_snapshot* s = &in->snaps[(in->head + i) % INTERP_SNAPSHOTS];
+		if (!s->present[index]) continue;
+		if (before)
+		{
+			prev = s;
+			break;
+		}
+		if (s->time <= rt)
+		{
+			before = s;
+		}
+		else
+		{
+			after = s;
+		}
+	}
+
+	int found = TRUE;
+	if (before && after)
+	{
+		// Interpolate between the two.
+		double f = (double)(rt - before->time) / (double)(after->time - before->time);
+		*x = wrap_round(before->x[index] + f * wrap_delta(before->x[index], after->x[index], in->map_wid), in->map_wid);
+		*y = wrap_round(before->y[index] + f * wrap_delta(before->y[index], after->y[index], in->map_hei), in->map_hei);
+	}
+	else if (before && prev && before->time > prev->time)
+	{
+		// Snapshot is late. Carry on in the direction the
+		// player was heading, but only for so long.
+		unsigned long long dt = rt - before->time;
+		if (dt > in->max_extrapolate) dt = in->max_extrapolate;
+		double f = (double)dt / (double)(before->time - prev->time);
+		*x = wrap_round(before->x[index] + f * wrap_delta(prev->x[index], before->x[index], in->map_wid), in->map_wid);
+		*y = wrap_round(before->y[index] + f * wrap_delta(prev->y[index], before->y[index], in->map_hei), in->map_hei);
+	}
+	else if (before || after)
+	{
+		// Only have the one point to go on.
+		const mp_snapshot* s = before ? before : after;
+		*x = s->x[index];
+		*y = s->y[index];
+	}
+	else
+	{
+		found = FALSE;
+	}
+
+	return found;
+}
@@ -0,0 +1,62 @@
+#ifndef MP_INTERP_H
+#define MP_INTERP_H
+
+// Number of snapshots kept.
+#define INTERP_SNAPSHOTS 32
+
+// Defaults for how far behind the server we render
+// remote players, and how long we'll guess where
+// they are when snapshots are late. (milliseconds)
+#define INTERP_DEFAULT_DELAY 100
+#define INTERP_DEFAULT_EXTRAPOLATE 250
+
+/*
+ * A snapshot of where all the players were.
+ */
+typedef struct mp_snapshot
+{
+	// Time the snapshot arrived. (ns)
+	unsigned long long time;
+
+	// Whether each player index was in the snapshot.
+	unsigned char* present;
+
+	// Position of each player index.
+	int* x;
+	int* y;
+} mp_snapshot;
+
+/*
+ * Interpolation buffer for remote players.
+ *
+ * Snapshots are timestamped as they arrive, and remote
+ * players are drawn slightly in the past, between the
+ * two snapshots either side of that time. This hides
+ * jitter in when snapshots arrive.
+ */
+typedef struct mp_interp
+{
+	// Ring buffer of snapshots.
+	mp_snapshot snaps[INTERP_SNAPSHOTS];
+	unsigned head, count;
+
+	// Number of player indices each snapshot can hold.
+	unsigned max_players;
+
+	// Map size, for wrapping.
+	int map_wid, map_hei;
+
+	// How far in the past to render, and how long to
+	// extrapolate for at most. (ns)
+	unsigned long long delay, max_extrapolate;
+} mp_interp;
+
+// Initialisation
+int interp_init(mp_interp* const, unsigned, int, int, unsigned, unsigned);
+void interp_deinit(mp_interp* const);
+
+// Snapshots
+void interp_push(mp_interp* const, const mp_state* const);
+int interp_sample(const mp_interp* const, unsigned long long, int, int*, int*);
+
+#endif
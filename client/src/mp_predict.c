@@ -0,0 +1,112 @@
+/*
+ * mp_predict.c
+ *
+ * Client-side prediction and server reconciliation
+ * for the local player.
+ */
+
+#include "pch.h"
+#include "mp_predict.h"
+
+/*
+ * Apply a single input to a position, wrapping
+ * around the edges of the map.
+ */
+static void apply_input(const mp_predict* const p, const mp_input* in, int* x, int* y)
+{
+	*x = (*x + in->dx + p->map_wid) % p->map_wid;
+	*y = (*y + in->dy + p->map_hei) % p->map_hei;
+}
+
+/*
+ * Initialise prediction.
+ *
+ * @param p    Predictor to initialise.
+ * @param wid  Map width.
+ * @param hei  Map height.
+ * @param x    Local player's spawn X.
+ * @param y    Local player's spawn Y.
+ */
+void predict_init(mp_predict* const p, int wid, int hei, int x, int y)
+{
+	memset(p, 0, sizeof(mp_predict));
+	p->next_seq = 1;
+	p->map_wid = wid;
+	p->map_hei = hei;
+	p->x = x;
+	p->y = y;
+}
+
+/*
+ * Move the local player. The move takes effect
+ * immediately, and is kept until acknowledged.
+ *
+ * @param p    Predictor.
+ * @param dx   X movement.
+ * @param dy   Y movement.
+ * @param out  Set to the input to send to the server.
+ *
+ * @return FALSE if too many inputs are waiting on the
+ *         server, in which case the move is dropped.
+ */
+int predict_move(mp_predict* const p, int dx, int dy, mp_input* out)
+{
+	if (p->count == PREDICT_MAX_PENDING)
+	{
+		return FALSE;
+	}
+
+	// Queue input.
+	mp_input* in = &p->pending[(p->head + p->count) % PREDICT_MAX_PENDING];
+	in->seq = p->next_seq++;
+	in->dx = (signed char)dx;
+	in->dy = (signed char)dy;
+	++p->count;
+
+	// Apply it now.
+	apply_input(p, in, &p->x, &p->y);
+
+	*out = *in;
+	return TRUE;
+}
+
+/*
+ * Get the predicted position of the local player.
+ *
+ * @param p  Predictor.
+ * @param x  Set to the X position.
+ * @param y  Set to the Y position.
+ */
+void predict_position(const mp_predict* const p, int* x, int* y)
+{
+	*x = p->x;
+	*y = p->y;
+}
+
+/*
+ * Reconcile with the server's authoritative state.
+ * Inputs up to the acknowledged one are dropped, and
+ * the rest are replayed on top of the server position.
+ *
+ * @param p    Predictor.
+ * @param ack  Last input sequence the server processed.
+ * @param x    Server's X position for the local player.
+ * @param y    Server's Y position for the local player.
+ */
+void predict_reconcile(mp_predict* const p, unsigned short ack, int x, int y)
+{
+	// Drop acknowledged inputs.
+	while (p->count && (short)(p->pending[p->head].seq - ack) <= 0)
+	{
+		p->head = (p->head + 1) % PREDICT_MAX_PENDING;
+		--p->count;
+	}
+
+	// Replay whatever the server hasn't seen yet.
+	for (unsigned i = 0; i < p->count; ++i)
+	{
+		apply_input(p, &p->pending[(p->head + i) % PREDICT_MAX_PENDING], &x, &y);
+	}
+	p->x = x;
+	p->y = y;
+}
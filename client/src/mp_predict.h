@@ -0,0 +1,54 @@
+#ifndef MP_PREDICT_H
+#define MP_PREDICT_H
+
+// Maximum number of inputs that can be waiting on
+// acknowledgement from the server.
+#define PREDICT_MAX_PENDING 64
+
+/*
+ * A single movement input.
+ */
+typedef struct mp_input
+{
+	// Sequence number.
+	unsigned short seq;
+
+	// Movement.
+	signed char dx, dy;
+} mp_input;
+
+/*
+ * Client-side prediction of the local player.
+ *
+ * Inputs are applied locally straight away and kept
+ * in a buffer until the server acknowledges them.
+ * When an authoritative position comes in, any inputs
+ * the server hasn't seen yet are replayed on top of it.
+ *
+ * This belongs entirely to the main thread.
+ */
+typedef struct mp_predict
+{
+	// Pending (unacknowledged) inputs, as a ring buffer.
+	mp_input pending[PREDICT_MAX_PENDING];
+	unsigned head, count;
+
+	// Next sequence number to hand out.
+	unsigned short next_seq;
+
+	// Map size, for wrapping.
+	int map_wid, map_hei;
+
+	// Predicted position of the local player.
+	int x, y;
+} mp_predict;
+
+// Initialisation
+void predict_init(mp_predict* const, int, int, int, int);
+
+// Prediction
+int predict_move(mp_predict* const, int, int, mp_input*);
+void predict_position(const mp_predict* const, int*, int*);
+void predict_reconcile(mp_predict* const, unsigned short, int, int);
+
+#endif
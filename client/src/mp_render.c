@@ -0,0 +1,131 @@
+/*
+ * mp_render.c
+ *
+ * Render backends: ncurses, and an in-memory
+ * framebuffer for running without a terminal.
+ */
+
+#include "pch.h"
+#include "mp_render.h"
+
+/*
+ * ncurses backend.
+ */
+static void curses_clear(mp_render* const r) { clear(); }
+static void curses_put(mp_render* const r, int row, int col, char ch) { mvaddch(row, col, ch); }
+static void curses_present(mp_render* const r) { refresh(); }
+static void curses_free(mp_render* const r) { }
+
+static const mp_render_ops curses_ops =
+{
+	curses_clear,
+	curses_put,
+	curses_present,
+	curses_free,
+};
+
+/*
+ * Memory backend. Draws into a plain character buffer,
+ * and keeps count of the bytes an ANSI terminal would
+ * have been sent for the same drawing: a clear is
+ * "ESC[H ESC[2J", moving the cursor anywhere other than
+ * the next column is "ESC[row;colH", then one byte for
+ * each character.
+ */
+static void mem_clear(mp_render* const r)
+{
+	memset(r->fb, ' ', r->rows * r->cols);
+	r->cur_row = r->cur_col = 0;
+	r->bytes += 7;
+}
+
+static void mem_put(mp_render* const r, int row, int col, char ch)
+{
+	if (row < 0 || col < 0 || (unsigned)row >= r->rows || (unsigned)col >= r->cols) return;
+
+	// Move the cursor if it isn't already there.
+	if (row != r->cur_row || col != r->cur_col)
+	{
+		char esc[32];
+		r->bytes += snprintf(esc, sizeof(esc), "\033[%d;%dH", row + 1, col + 1);
+	}
+
+	r->fb[row * r->cols + col] = ch;
+	r->cur_row = row;
+	r->cur_col = col + 1;
+	++r->bytes;
+}
+
+static void mem_present(mp_render* const r) { }
+
+static void mem_free(mp_render* const r)
+{
+	free(r->fb);
+}
+
+static const mp_render_ops mem_ops =
+{
+	mem_clear,
+	mem_put,
+	mem_present,
+	mem_free,
+};
+
+/*
+ * @return a renderer that draws with ncurses. (Which
+ *         must already be initialised)
+ */
+mp_render* render_new_curses(void)
+{
+	mp_render* r = calloc(1, sizeof(mp_render));
+	if (!r)
+	{
+		return FAIL;
+	}
+	r->ops = &curses_ops;
+	return r;
+}
+
+/*
+ * Create a renderer that draws into memory.
+ *
+ * @param rows  Height of the screen.
+ * @param cols  Width of the screen.
+ *
+ * @return the renderer. FAIL on failure.
+ */
+mp_render* render_new_mem(unsigned rows, unsigned cols)
+{
+	mp_render* r = calloc(1, sizeof(mp_render));
+	if (!r)
+	{
+		return FAIL;
+	}
+	if (!(r->fb = malloc(rows * cols)))
+	{
+		free(r);
+		return FAIL;
+	}
+	memset(r->fb, ' ', rows * cols);
+	r->ops = &mem_ops;
+	r->rows = rows;
+	r->cols = cols;
+	return r;
+}
+
+/*
+ * Free a renderer.
+ *
+ * @param r  Renderer to free.
+ */
+void render_free(mp_render* const r)
+{
+	if (!r) return;
+	r->ops->free(r);
+	free(r);
+}
+
+// Drawing, which just goes to the backend.
+void render_clear(mp_render* const r) { r->ops->clear_screen(r); }
+void render_put(mp_render* const r, int row, int col, char ch) { r->ops->put(r, row, col, ch); }
+void render_present(mp_render* const r) { r->ops->present(r); }
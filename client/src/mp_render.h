@@ -0,0 +1,55 @@
+#ifndef MP_RENDER_H
+#define MP_RENDER_H
+
+typedef struct mp_render mp_render;
+
+/*
+ * Operations a render backend provides.
+ */
+typedef struct mp_render_ops
+{
+	// Blank the whole screen.
+	void (*clear_screen)(mp_render* const);
+
+	// Draw a character at a row/column.
+	void (*put)(mp_render* const, int, int, char);
+
+	// Show everything drawn since the last present.
+	void (*present)(mp_render* const);
+
+	// Free backend resources.
+	void (*free)(mp_render* const);
+} mp_render_ops;
+
+/*
+ * Something that can be drawn to. The game draws
+ * through one of these rather than calling ncurses
+ * directly, so rendering can also be done headless
+ * (e.g for benchmarking).
+ */
+struct mp_render
+{
+	const mp_render_ops* ops;
+
+	// Bytes that have been written to the terminal. Only
+	// tracked by the memory backend, which counts what an
+	// ANSI terminal would need to be sent.
+	unsigned long long bytes;
+
+	// Memory backend framebuffer, and its cursor.
+	unsigned rows, cols;
+	char* fb;
+	int cur_row, cur_col;
+};
+
+// Backends
+mp_render* render_new_curses(void);
+mp_render* render_new_mem(unsigned, unsigned);
+void render_free(mp_render* const);
+
+// Drawing
+void render_clear(mp_render* const);
+void render_put(mp_render* const, int, int, char);
+void render_present(mp_render* const);
+
+#endif
@@ -0,0 +1,169 @@
+/*
+ * mp_snaplog.c
+ *
+ * Recording and loading of snapshot streams.
+ */
+
+#include "pch.h"
+#include "mp_state.h"
+#include "mp_snaplog.h"
+
+// Write x to a file as n little-endian bytes.
+static void put_le(FILE* f, unsigned long long x, unsigned n)
+{
+	for (unsigned i = 0; i < n; ++i)
+	{
+		fputc((int)((x >> (i * 8)) & 0xFF), f);
+	}
+}
+
+// Read n little-endian bytes from a file.
+static unsigned long long get_le(FILE* f, unsigned n, int* ok)
+{
+	unsigned long long x = 0;
+	for (unsigned i = 0; i < n; ++i)
+	{
+		int c = fgetc(f);
+		if (c == EOF) *ok = FALSE;
+		x |= (unsigned long long)(c & 0xFF) << (i * 8);
+	}
+	return x;
+}
+
+/*
+ * Start recording snapshots to a file.
+ *
+ * @param l            Log to initialise.
+ * @param path         File to write to. Truncated if it exists.
+ * @param wid          Map width.
+ * @param hei          Map height.
+ * @param max_players  Maximum player count.
+ *
+ * @return FALSE on failure.
+ */
+int snaplog_open(mp_snaplog* const l, const char* path, unsigned wid, unsigned hei, unsigned max_players)
+{
+	memset(l, 0, sizeof(mp_snaplog));
+	if (!(l->file = fopen(path, "wb")))
+	{
+		return FALSE;
+	}
+	l->map_wid = wid;
+	l->map_hei = hei;
+	l->max_players = max_players;
+
+	fwrite(SNAPLOG_MAGIC, 4, 1, l->file);
+	put_le(l->file, SNAPLOG_VERSION, 4);
+	put_le(l->file, wid, 4);
+	put_le(l->file, hei, 4);
+	put_le(l->file, max_players, 4);
+	return TRUE;
+}
+
+/*
+ * Append a snapshot.
+ *
+ * @param l   Log being written.
+ * @param st  State to record.
+ */
+void snaplog_write(mp_snaplog* const l, const mp_state* const st)
+{
+	if (!l->file) return;
+	if (!l->start) l->start = st->time;
+
+	put_le(l->file, st->time - l->start, 8);
+	put_le(l->file, st->player_count, 2);
+	for (unsigned i = 0; i < st->player_count; ++i)
+	{
+		put_le(l->file, st->players[i].index, 2);
+		put_le(l->file, st->players[i].x, 2);
+		put_le(l->file, st->players[i].y, 2);
+	}
+}
+
+/*
+ * Load a whole snapshot log into memory.
+ *
+ * @param l     Log to initialise.
+ * @param path  File to load.
+ *
+ * @return FALSE on failure.
+ */
+int snaplog_load(mp_snaplog* const l, const char* path)
+{
+	memset(l, 0, sizeof(mp_snaplog));
+	FILE* f = fopen(path, "rb");
+	if (!f)
+	{
+		return FALSE;
+	}
+
+	// Check header.
+	char magic[4];
+	int ok = fread(magic, 4, 1, f) == 1 && memcmp(magic, SNAPLOG_MAGIC, 4) == 0;
+	ok = ok && get_le(f, 4, &ok) == SNAPLOG_VERSION;
+	l->map_wid = (unsigned)get_le(f, 4, &ok);
+	l->map_hei = (unsigned)get_le(f, 4, &ok);
+	l->max_players = (unsigned)get_le(f, 4, &ok);
+	if (!ok || !l->map_wid || !l->map_hei)
+	{
+		fclose(f);
+		return FALSE;
+	}
+
+	// Read snapshots until we run out.
+	unsigned cap = 0;
+	for (;;)
+	{
+		unsigned long long t = get_le(f, 8, &ok);
+		unsigned count = (unsigned)get_le(f, 2, &ok);
+		if (!ok) break;
+
+		if (l->count == cap)
+		{
+			cap = cap ? cap * 2 : 256;
+			l->snaps = realloc(l->snaps, cap * sizeof(mp_state));
+		}
+		mp_state* st = &l->snaps[l->count];
+		memset(st, 0, sizeof(mp_state));
+		st->time = t;
+		st->players = malloc((count ? count : 1) * sizeof(player));
+		for (unsigned i = 0; i < count; ++i)
+		{
+			st->players[i].index = (int)get_le(f, 2, &ok);
+			st->players[i].x = (int)get_le(f, 2, &ok);
+			st->players[i].y = (int)get_le(f, 2, &ok);
+		}
+		st->player_count = count;
+		if (!ok)
+		{
+			free(st->players);
+			break;
+		}
+		++l->count;
+	}
+
+	fclose(f);
+	return TRUE;
+}
+
+/*
+ * Finish writing, or free a loaded log.
+ *
+ * @param l  Log to close.
+ */
+void snaplog_close(mp_snaplog* const l)
+{
+	if (l->file)
+	{
+		fclose(l->file);
+		l->file = 0;
+	}
+	for (unsigned i = 0; i < l->count; ++i)
+	{
+		free(l->snaps[i].players);
+	}
+	free(l->snaps);
+	l->snaps = 0;
+	l->count = 0;
+}
@@ -0,0 +1,56 @@
+#ifndef MP_SNAPLOG_H
+#define MP_SNAPLOG_H
+
+/*
+ * Recording of the snapshots a client receives, so
+ * they can be played back later (e.g by the render
+ * benchmark).
+ *
+ * The file begins with a header:
+ *   + [4 bytes] magic "MPSS"
+ *   + [u32] format version
+ *   + [u32] map width
+ *   + [u32] map height
+ *   + [u32] maximum player count
+ *
+ * followed by any number of snapshots:
+ *   + [u64] time since the first snapshot, in nanoseconds
+ *   + [u16] number of players
+ *   + An array of players, each with:
+ *     - [u16] player index
+ *     - [u16] x position
+ *     - [u16] y position
+ *
+ * All values are little-endian.
+ */
+#define SNAPLOG_MAGIC "MPSS"
+#define SNAPLOG_VERSION 1
+
+/*
+ * A snapshot log, either being written or loaded.
+ */
+typedef struct mp_snaplog
+{
+	// File being written.
+	FILE* file;
+	unsigned long long start;
+
+	// Map the snapshots are for.
+	unsigned map_wid, map_hei, max_players;
+
+	// Loaded snapshots.
+	mp_state* snaps;
+	unsigned count;
+} mp_snaplog;
+
+// Writing
+int snaplog_open(mp_snaplog* const, const char*, unsigned, unsigned, unsigned);
+void snaplog_write(mp_snaplog* const, const mp_state* const);
+
+// Reading
+int snaplog_load(mp_snaplog* const, const char*);
+
+// Either
+void snaplog_close(mp_snaplog* const);
+
+#endif
@@ -0,0 +1,94 @@
+/*
+ * mp_state.c
+ *
+ * Handoff of game state between threads.
+ */
+
+#include "pch.h"
+#include "mp_state.h"
+
+// Marks the middle buffer as holding a new state.
+#define STATE_FRESH ((uintptr_t)1)
+
+/*
+ * Initialise the state buffers.
+ *
+ * @param b            Buffers to initialise.
+ * @param max_players  Most players a state can hold.
+ *
+ * @return FALSE on failure.
+ */
+int state_init(mp_state_buf* const b, unsigned max_players)
+{
+	memset(b, 0, sizeof(mp_state_buf));
+	for (unsigned i = 0; i < 3; ++i)
+	{
+		if (!(b->states[i].players = calloc(max_players, sizeof(player))))
+		{
+			return FALSE;
+		}
+	}
+	b->back = &b->states[0];
+	b->front = &b->states[1];
+	atomic_init(&b->middle, (uintptr_t)&b->states[2]);
+	return TRUE;
+}
+
+/*
+ * Free the state buffers.
+ *
+ * @param b  Buffers to deinitialise.
+ */
+void state_deinit(mp_state_buf* const b)
+{
+	for (unsigned i = 0; i < 3; ++i)
+	{
+		free(b->states[i].players);
+		b->states[i].players = 0;
+	}
+}
+
+/*
+ * @return the buffer for the network thread to build
+ *         the next state in.
+ */
+mp_state* state_back(mp_state_buf* const b)
+{
+	return b->back;
+}
+
+/*
+ * Publish the back buffer to the main thread. The
+ * network thread gets a new back buffer in exchange.
+ *
+ * @param b  Buffers.
+ */
+void state_publish(mp_state_buf* const b)
+{
+	uintptr_t old = atomic_exchange_explicit(&b->middle,
+		(uintptr_t)b->back | STATE_FRESH, memory_order_acq_rel);
+	b->back = (mp_state*)(old & ~STATE_FRESH);
+}
+
+/*
+ * Get the latest state, for the main thread.
+ *
+ * @param b      Buffers.
+ * @param fresh  Set to whether the state is new since
+ *               last call. (May be null)
+ *
+ * @return the latest published state. This stays valid
+ *         until the next call.
+ */
+const mp_state* state_front(mp_state_buf* const b, int* fresh)
+{
+	int is_fresh = (atomic_load_explicit(&b->middle, memory_order_relaxed) & STATE_FRESH) != 0;
+	if (is_fresh)
+	{
+		uintptr_t old = atomic_exchange_explicit(&b->middle,
+			(uintptr_t)b->front, memory_order_acq_rel);
+		b->front = (mp_state*)(old & ~STATE_FRESH);
+	}
+	if (fresh) *fresh = is_fresh;
+	return b->front;
+}
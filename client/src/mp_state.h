@@ -0,0 +1,68 @@
+#ifndef MP_STATE_H
+#define MP_STATE_H
+
+// Structure for players in the game.
+typedef struct
+{
+	// X/Y position.
+	int x, y;
+
+	// Player's index.
+	int index;
+} player;
+
+/*
+ * The game state, as last sent by the server.
+ */
+typedef struct mp_state
+{
+	// Time the state arrived. (ns)
+	unsigned long long time;
+
+	// Last of our inputs the server had processed.
+	unsigned short ack;
+
+	// Players. (Storage for up to the max player count)
+	player* players;
+	unsigned player_count;
+} mp_state;
+
+/*
+ * Lock-free handoff of game state from the network
+ * thread to the main thread.
+ *
+ * The network thread builds each new state in its back
+ * buffer, then publishes it by atomically swapping it
+ * with the shared middle buffer. The main thread swaps
+ * the middle buffer with its front buffer whenever a
+ * new one has been published. Nobody ever waits, and
+ * each side always has a buffer all to itself.
+ */
+typedef struct mp_state_buf
+{
+	// Storage for the three buffers.
+	mp_state states[3];
+
+	// Owned by the network thread.
+	mp_state* back;
+
+	// Owned by the main thread.
+	mp_state* front;
+
+	// Shared. The low bit is set when it holds a state
+	// the main thread hasn't seen yet.
+	atomic_uintptr_t middle;
+} mp_state_buf;
+
+// Allocation
+int state_init(mp_state_buf* const, unsigned);
+void state_deinit(mp_state_buf* const);
+
+// Network thread
+mp_state* state_back(mp_state_buf* const);
+void state_publish(mp_state_buf* const);
+
+// Main thread
+const mp_state* state_front(mp_state_buf* const, int*);
+
+#endif
@@ -5,16 +5,28 @@
 #include <errno.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 // Networking
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+// Files
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 // Libraries
 #include <ncurses.h>
@@ -30,5 +42,8 @@
 #include "comm/mp_packet.h"
 #include "comm/mp_ostream.h"
 #include "comm/mp_istream.h"
+#include "comm/mp_time.h"
+#include "comm/mp_spsc.h"
+#include "comm/mp_map.h"
 
 #endif
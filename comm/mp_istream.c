@@ -7,6 +7,8 @@
 #include "pch.h"
 #include "mp_packet.h"
 #include "mp_istream.h"
+#include "mp_pool.h"
+#include "mp_shm.h"
 
 /*
  * Initialise a new input stream.
@@ -16,19 +18,33 @@
  * @return the newly allocated stream.
  */
 mp_istream* const istream_new(SOCKET sock)
+{
+	return istream_new_pool(sock, 0);
+}
+
+/*
+ * Initialise a new input stream, taking it from a
+ * pool.
+ *
+ * @param sock  Socket stream will use
+ * @param pool  Pool to allocate from, or 0 to use
+ *              malloc.
+ *
+ * @return the newly allocated stream.
+ */
+mp_istream* const istream_new_pool(SOCKET sock, mp_pool* const pool)
 {
 	// Allocate the structure.
-	mp_istream* i = malloc(sizeof(mp_istream));
+	mp_istream* i = pool_alloc(pool, sizeof(mp_istream));
 	if (!i)
 	{
 		return 0;
 	}
 
-	// Only need this if we end up adding more
-	// members to the structure.
-	//memset(i, 0, sizeof(mp_istream));
+	memset(i, 0, sizeof(mp_istream));
 
 	i->sock = sock;
+	i->pool = pool;
 	return i;
 }
 
@@ -39,7 +55,173 @@ mp_istream* const istream_new(SOCKET sock)
  */
 void istream_free(mp_istream* const i)
 {
-	if (i) free(i);
+	if (!i) return;
+	pool_free(i->pool, i->cap);
+	pool_free(i->pool, i);
+}
+
+/*
+ * Point a stream at a different socket, e.g after
+ * reconnecting.
+ *
+ * @param i     Stream to modify.
+ * @param sock  Socket to read from.
+ */
+void istream_set_sock(mp_istream* const i, SOCKET sock)
+{
+	i->sock = sock;
+	i->eof = FALSE;
+}
+
+/*
+ * Point a stream at a block of memory. Subsequent
+ * reads will come from this rather than the socket.
+ *
+ * @param i    Stream to modify.
+ * @param mem  Memory to read from. (Not copied)
+ * @param len  Number of bytes available.
+ */
+void istream_set_mem(mp_istream* const i, const unsigned char* mem, size_t len)
+{
+	i->mem = mem;
+	i->mem_len = len;
+	i->mem_pos = 0;
+	i->eof = FALSE;
+}
+
+/*
+ * Enable or disable capturing of read bytes.
+ *
+ * @param i  Stream to modify.
+ * @param c  Non-zero to enable capture.
+ */
+void istream_capture(mp_istream* const i, int c)
+{
+	i->capturing = c;
+	i->cap_len = 0;
+}
+
+/*
+ * Discard everything captured so far. Called once the
+ * bytes of a packet have been consumed.
+ *
+ * @param i  Stream to reset.
+ */
+void istream_capture_reset(mp_istream* const i)
+{
+	i->cap_len = 0;
+}
+
+/*
+ * Enable or disable kernel receive timestamps
+ * (SO_TIMESTAMPING) on the stream's socket.
+ *
+ * @param i   Stream to modify.
+ * @param on  Non-zero to enable.
+ *
+ * @return FALSE if the socket doesn't support it.
+ */
+int istream_timestamps(mp_istream* const i, int on)
+{
+	int flags = on ? (SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE) : 0;
+	if (setsockopt(i->sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) != 0)
+	{
+		i->timestamps = FALSE;
+		return FALSE;
+	}
+	i->timestamps = on;
+	i->rx_time = 0;
+	return TRUE;
+}
+
+/*
+ * Receive from the stream's socket, picking up the
+ * kernel's receive timestamp as we go.
+ */
+static ssize_t istream_recv_ts(mp_istream* const i, void* buf, size_t len)
+{
+	struct iovec iov = { buf, len };
+	char ctrl[CMSG_SPACE(sizeof(struct scm_timestamping))];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl;
+	msg.msg_controllen = sizeof(ctrl);
+
+	ssize_t got = TEMP_FAILURE_RETRY(recvmsg(i->sock, &msg, MSG_WAITALL));
+	for (struct cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+	{
+		if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING)
+		{
+			struct scm_timestamping ts;
+			memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+			i->rx_time = (unsigned long long)ts.ts[0].tv_sec * NS_PER_SEC + ts.ts[0].tv_nsec;
+		}
+	}
+	return got;
+}
+
+/*
+ * Read exactly len bytes from the stream's source. All
+ * of the read methods below are built on this.
+ *
+ * On end of stream the remaining bytes are zeroed and
+ * the eof flag is set.
+ */
+static void istream_read(mp_istream* const i, void* buf, size_t len)
+{
+	ssize_t got = 0;
+	if (i->mem)
+	{
+		// Read from memory.
+		size_t avail = i->mem_len - i->mem_pos;
+		got = (ssize_t)(len < avail ? len : avail);
+		memcpy(buf, i->mem + i->mem_pos, got);
+		i->mem_pos += got;
+	}
+	else if (i->shm && !i->eof)
+	{
+		// Read from shared memory, likewise.
+		got = (ssize_t)shm_read(i->shm, buf, len);
+	}
+	else if (!i->eof)
+	{
+		// Read from socket, waiting for the whole amount.
+		if (i->timestamps)
+		{
+			got = istream_recv_ts(i, buf, len);
+		}
+		else
+		{
+			got = TEMP_FAILURE_RETRY(recv(i->sock, buf, len, MSG_WAITALL));
+		}
+		if (got < 0) got = 0;
+	}
+
+	if ((size_t)got < len)
+	{
+		memset((unsigned char*)buf + got, 0, len - got);
+		i->eof = TRUE;
+	}
+
+	// Append to capture buffer.
+	if (i->capturing && got > 0)
+	{
+		if (i->cap_len + got > i->cap_size)
+		{
+			unsigned size = (i->cap_len + got) * 2;
+			unsigned char* cap = pool_realloc(i->pool, i->cap, i->cap_len, size);
+			if (!cap)
+			{
+				return;
+			}
+			i->cap = cap;
+			i->cap_size = size;
+		}
+		memcpy(i->cap + i->cap_len, buf, got);
+		i->cap_len += got;
+	}
 }
 
 /*
@@ -51,7 +233,8 @@ void istream_free(mp_istream* const i)
  */
 enum mp_packet iread_begin(mp_istream* const i)
 {
-	return (enum mp_packet)iread_u8(i);
+	enum mp_packet p = (enum mp_packet)iread_u8(i);
+	return i->eof ? P_UNKNOWN : p;
 }
 
 /* @return error code read from packet.  */
@@ -65,7 +248,7 @@ enum mp_packet_err iread_err(mp_istream* const i)
 unsigned char iread_u8(mp_istream* const i)
 {
 	unsigned char x;
-	TEMP_FAILURE_RETRY(recv(i->sock, &x, sizeof(x), 0));
+	istream_read(i, &x, sizeof(x));
 	return x;
 }
 
@@ -74,7 +257,7 @@ unsigned iread_u16(mp_istream* const i)
 {
 	// Read 2 bytes from packet
 	char bytes[sizeof(unsigned short)];
-	TEMP_FAILURE_RETRY(recv(i->sock, &bytes, sizeof(bytes), 0));
+	istream_read(i, bytes, sizeof(bytes));
 
 	// Reconstruct from little-endian order
 	return (unsigned short)(
@@ -88,7 +271,7 @@ unsigned iread_u32(mp_istream* const i)
 {
 	// Read 4 bytes from packet
 	char bytes[sizeof(unsigned)];
-	TEMP_FAILURE_RETRY(recv(i->sock, &bytes, sizeof(bytes), 0));
+	istream_read(i, bytes, sizeof(bytes));
 
 	// Reconstruct from little-endian order
 	return (unsigned)(
@@ -99,6 +282,22 @@ unsigned iread_u32(mp_istream* const i)
 	);
 }
 
+/* @return 64-bit unsigned from packet */
+unsigned long long iread_u64(mp_istream* const i)
+{
+	// Read 8 bytes from packet
+	unsigned char bytes[sizeof(unsigned long long)];
+	istream_read(i, bytes, sizeof(bytes));
+
+	// Reconstruct from little-endian order
+	unsigned long long x = 0;
+	for (unsigned b = 0; b < sizeof(bytes); ++b)
+	{
+		x |= (unsigned long long)bytes[b] << (b * 8);
+	}
+	return x;
+}
+
 char* iread_str(mp_istream* const i, size_t* l)
 {
 	// Read length
@@ -106,7 +305,7 @@ char* iread_str(mp_istream* const i, size_t* l)
 
 	// Read bytes
 	char* bytes = malloc(len + 1);
-	TEMP_FAILURE_RETRY(recv(i->sock, bytes, len, 0));
+	istream_read(i, bytes, len);
 
 	// Insert null-terminator.
 	bytes[len] = '\0';
@@ -6,26 +6,73 @@
 #define FALSE 0
 #define SOCKET int
 
+struct mp_pool;
+struct mp_shm;
+
 /*
  * This is a basic "input stream" that
  * lets us read data from a socket.
+ *
+ * A stream can alternatively be pointed at a block
+ * of memory (see istream_set_mem), in which case
+ * reads come from there instead. This is used to
+ * replay captured traffic without any sockets. Or it
+ * can be given a shared memory session to read from,
+ * for peers on the same host. (See mp_shm.h)
  */
 typedef struct mp_istream
 {
 	// Socket
 	SOCKET sock;
+
+	// Set once the peer has closed the connection (or
+	// the memory source has been exhausted)
+	int eof;
+
+	// Memory source. Used instead of the socket if non-null.
+	const unsigned char* mem;
+	size_t mem_len, mem_pos;
+
+	// Shared memory session. Used instead of the socket
+	// if non-null.
+	struct mp_shm* shm;
+
+	// Receive timestamps. When enabled, rx_time is when
+	// the kernel received the last data we read.
+	// (CLOCK_REALTIME, ns)
+	int timestamps;
+	unsigned long long rx_time;
+
+	// Capture buffer. When capturing, every byte read is
+	// also appended here until istream_capture_reset.
+	int capturing;
+	unsigned char* cap;
+	unsigned cap_len, cap_size;
+
+	// Pool the stream came from, or 0 if it's from
+	// malloc.
+	struct mp_pool* pool;
 } mp_istream;
 
 // Allocation
 mp_istream* const istream_new(SOCKET);
+mp_istream* const istream_new_pool(SOCKET, struct mp_pool* const);
 void istream_free(mp_istream* const);
 
+// Sources/capture
+void istream_set_sock(mp_istream* const, SOCKET);
+void istream_set_mem(mp_istream* const, const unsigned char*, size_t);
+void istream_capture(mp_istream* const, int);
+void istream_capture_reset(mp_istream* const);
+int istream_timestamps(mp_istream* const, int);
+
 // Read methods
 enum mp_packet iread_begin(mp_istream* const);
 enum mp_packet_err iread_err(mp_istream* const);
 unsigned char iread_u8(mp_istream* const);
 unsigned iread_u16(mp_istream* const);
 unsigned iread_u32(mp_istream* const);
+unsigned long long iread_u64(mp_istream* const);
 char* iread_str(mp_istream* const, size_t*);
 
 #endif
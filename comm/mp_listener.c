@@ -0,0 +1,95 @@
+/*
+ * mp_listener.c
+ *
+ * Listening for TCP connections.
+ */
+#include "pch.h"
+#include "mp_listener.h"
+
+/*
+ * Start listening for connections on a port, on every
+ * interface.
+ *
+ * @param port     Port to listen on.
+ * @param backlog  Connections that can wait to be
+ *                 accepted. (SOMAXCONN for as many as
+ *                 the system allows)
+ *
+ * @return the listener, or 0 on failure (with errno
+ *         saying why).
+ */
+mp_listener* listener_new(unsigned short port, int backlog)
+{
+	// Allocate
+	mp_listener* l = malloc(sizeof(mp_listener));
+	if (!l)
+	{
+		return FAIL;
+	}
+	memset(l, 0, sizeof(mp_listener));
+
+	// Create TCP socket file descriptor.
+	if ((l->handle = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+	{
+		goto fail;
+	}
+
+	// Let a restart bind while old connections linger.
+	// (Not SO_REUSEPORT: a second program on the same
+	// port should fail, not quietly share its clients)
+	int opt = 1;
+	if (setsockopt(l->handle, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt)))
+	{
+		goto fail;
+	}
+
+	// Set attributes.
+	l->addr.sin_family = AF_INET;
+	l->addr.sin_addr.s_addr = INADDR_ANY;
+	l->addr.sin_port = htons(port);
+	l->addr_len = sizeof(struct sockaddr_in);
+
+	// Bind to port, and start accepting connections.
+	if (bind(l->handle, (struct sockaddr*)&l->addr, l->addr_len) < 0 ||
+		listen(l->handle, backlog) < 0)
+	{
+		goto fail;
+	}
+
+	// Set to non-blocking mode
+	if (fcntl(l->handle, F_SETFL, O_NONBLOCK) < 0)
+	{
+		goto fail;
+	}
+
+	// Normal return
+	return l;
+
+	// Use this label for fails after the allocation.
+fail:
+	if (l->handle >= 0)
+	{
+		int err = errno;
+		close(l->handle);
+		errno = err;
+	}
+	free(l);
+	return FAIL;
+}
+
+/*
+ * Stop listening, and free the listener.
+ *
+ * @param l  Listener to free.
+ */
+void listener_free(mp_listener* const l)
+{
+	// Close handle.
+	if (l->handle >= 0)
+	{
+		close(l->handle);
+	}
+
+	// Free memory
+	free(l);
+}
@@ -0,0 +1,26 @@
+#ifndef MP_LISTENER_H
+#define MP_LISTENER_H
+
+/*
+ * Non-blocking TCP socket that programs accept their
+ * connections on. The server, gateway, relay and
+ * network emulator all listen the same way, apart
+ * from how long a backlog they want.
+ */
+typedef struct mp_listener
+{
+	// Listener handle
+	SOCKET handle;
+
+	// Address structure
+	struct sockaddr_in addr;
+
+	// Size of address structure.
+	socklen_t addr_len;
+} mp_listener;
+
+// Allocation methods
+mp_listener* listener_new(unsigned short, int);
+void listener_free(mp_listener* const);
+
+#endif
@@ -0,0 +1,256 @@
+/*
+ * mp_log.c
+ *
+ * Asynchronous logging through per-thread rings.
+ */
+
+#include "pch.h"
+#include "mp_spsc.h"
+#include "mp_time.h"
+#include "mp_log.h"
+
+/*
+ * A message waiting to be written.
+ */
+typedef struct mp_log_entry
+{
+	// When it was logged. (ns)
+	unsigned long long time;
+
+	unsigned char level;
+	char text[LOG_TEXT_MAX];
+} mp_log_entry;
+
+/*
+ * A thread's messages. Rings outlive their threads,
+ * and are handed on to new ones.
+ */
+typedef struct mp_log_ring
+{
+	mp_spsc queue;
+
+	// Set while a thread is logging into it.
+	atomic_int owned;
+
+	struct mp_log_ring* next;
+} mp_log_ring;
+
+// Every ring there is. Only ever added to.
+static _Atomic(mp_log_ring*) rings;
+
+// The calling thread's ring, and the key that hands it
+// back when the thread exits.
+static _Thread_local mp_log_ring* ring;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+// Messages lost to full rings since the writer last
+// said so.
+static atomic_uint dropped;
+
+// Lowest level logged, and when logging started.
+static enum mp_log_level min_level = LOG_INFO;
+static unsigned long long start_time;
+
+// The writer thread, and whether it's taking messages.
+static pthread_t writer;
+static atomic_int running;
+
+// Batch of text waiting to be written.
+static char out[64 * 1024];
+static size_t out_len;
+
+static const char* level_names[] = { "DEBUG", "INFO ", "WARN ", "ERROR" };
+
+// Write out everything that's been batched up.
+static void log_flush(void)
+{
+	size_t done = 0;
+	while (done < out_len)
+	{
+		ssize_t n = write(STDOUT_FILENO, out + done, out_len - done);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) break;
+		done += n;
+	}
+	out_len = 0;
+}
+
+// Add a message to the batch, making room first if
+// it's full.
+static void log_append(unsigned long long time, unsigned level, const char* text)
+{
+	if (out_len + LOG_TEXT_MAX + 32 > sizeof(out))
+	{
+		log_flush();
+	}
+	unsigned long long t = time > start_time ? time - start_time : 0;
+	out_len += snprintf(out + out_len, sizeof(out) - out_len, "[%6llu.%03llu] %s %s\n",
+		t / NS_PER_SEC, t % NS_PER_SEC / NS_PER_MS, level_names[level], text);
+}
+
+// Empty every ring into the batch.
+//
+// @return the number of messages written.
+static unsigned log_drain(void)
+{
+	unsigned n = 0;
+	mp_log_entry e;
+	for (mp_log_ring* r = atomic_load(&rings); r; r = r->next)
+	{
+		while (spsc_pop(&r->queue, &e))
+		{
+			log_append(e.time, e.level, e.text);
+			++n;
+		}
+	}
+
+	unsigned lost = atomic_exchange_explicit(&dropped, 0, memory_order_relaxed);
+	if (lost)
+	{
+		char text[64];
+		snprintf(text, sizeof(text), "%u log messages dropped", lost);
+		log_append(time_now_ns(), LOG_WARN, text);
+	}
+	log_flush();
+	return n;
+}
+
+// Writer thread. Wakes up every so often while there's
+// nothing to write.
+static void* log_writer(void* arg)
+{
+	(void)arg;
+	struct timespec idle = { 0, LOG_IDLE_MS * NS_PER_MS };
+	while (atomic_load_explicit(&running, memory_order_acquire))
+	{
+		if (!log_drain())
+		{
+			nanosleep(&idle, 0);
+		}
+	}
+	log_drain();
+	return 0;
+}
+
+// Give a thread's ring back for another to use.
+static void log_release(void* r)
+{
+	atomic_store_explicit(&((mp_log_ring*)r)->owned, FALSE, memory_order_release);
+}
+
+static void log_make_key(void)
+{
+	pthread_key_create(&ring_key, log_release);
+}
+
+// Find the calling thread a ring: one that a thread
+// that has gone left behind, or failing that a new one.
+static mp_log_ring* log_claim(void)
+{
+	for (mp_log_ring* r = atomic_load(&rings); r; r = r->next)
+	{
+		int owned = FALSE;
+		if (atomic_compare_exchange_strong(&r->owned, &owned, TRUE))
+		{
+			return r;
+		}
+	}
+
+	mp_log_ring* r = malloc(sizeof(mp_log_ring));
+	if (!r) return 0;
+	if (!spsc_init(&r->queue, sizeof(mp_log_entry), LOG_RING_SIZE))
+	{
+		free(r);
+		return 0;
+	}
+	atomic_init(&r->owned, TRUE);
+	r->next = atomic_load(&rings);
+	while (!atomic_compare_exchange_weak(&rings, &r->next, r));
+	return r;
+}
+
+/*
+ * Start the writer thread. Until this is called,
+ * messages are written as they're logged.
+ *
+ * @param level  Lowest level to log.
+ *
+ * @return FALSE on failure.
+ */
+int log_init(enum mp_log_level level)
+{
+	// Anything printed so far goes out first.
+	fflush(stdout);
+	min_level = level;
+	start_time = time_now_ns();
+	pthread_once(&ring_key_once, log_make_key);
+	atomic_store(&running, TRUE);
+	if (pthread_create(&writer, 0, log_writer, 0) != 0)
+	{
+		atomic_store(&running, FALSE);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Write out whatever is waiting and stop the writer.
+ * Anything logged after is written straight out.
+ * Rings are kept, as other threads may still have
+ * hold of theirs.
+ */
+void log_deinit(void)
+{
+	if (!atomic_exchange(&running, FALSE))
+	{
+		return;
+	}
+	pthread_join(writer, 0);
+}
+
+/*
+ * Log a message.
+ *
+ * @param level  How much it matters.
+ * @param fmt    printf-style format, then its
+ *               arguments.
+ */
+void log_write(enum mp_log_level level, const char* fmt, ...)
+{
+	if (level < min_level)
+	{
+		return;
+	}
+
+	// The arguments can't outlive the call, so the
+	// message is put together here; the rest is left to
+	// the writer.
+	mp_log_entry e;
+	e.time = time_now_ns();
+	e.level = (unsigned char)level;
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(e.text, sizeof(e.text), fmt, args);
+	va_end(args);
+
+	if (!atomic_load_explicit(&running, memory_order_acquire))
+	{
+		printf("%s\n", e.text);
+		return;
+	}
+
+	if (!ring)
+	{
+		if (!(ring = log_claim()))
+		{
+			atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+			return;
+		}
+		pthread_setspecific(ring_key, ring);
+	}
+	if (!spsc_push(&ring->queue, &e))
+	{
+		atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+	}
+}
@@ -0,0 +1,53 @@
+#ifndef MP_LOG_H
+#define MP_LOG_H
+
+/*
+ * Logging that never blocks the thread doing it.
+ *
+ * Each thread that logs gets a ring of its own to put
+ * messages in, and a writer thread empties them all in
+ * batches, stamps and writes them out. A thread whose
+ * ring is full loses the message, which is counted and
+ * reported, rather than waiting for the writer.
+ *
+ * Until log_init (and after log_deinit) messages are
+ * written straight out by the thread logging them, so
+ * it's always safe to log.
+ */
+
+// Messages each thread can have waiting to be written.
+#define LOG_RING_SIZE 256
+
+// Longest message. Anything longer is cut short.
+#define LOG_TEXT_MAX 240
+
+// How long the writer sleeps when there's nothing to
+// write. (ms)
+#define LOG_IDLE_MS 10
+
+/*
+ * How much a message matters. Messages below the level
+ * given to log_init aren't logged.
+ */
+enum mp_log_level
+{
+	LOG_DEBUG,
+	LOG_INFO,
+	LOG_WARN,
+	LOG_ERROR
+};
+
+// Setup
+int log_init(enum mp_log_level);
+void log_deinit(void);
+
+// Logging. Messages are printf-style, without a
+// trailing newline.
+void log_write(enum mp_log_level, const char*, ...) __attribute__((format(printf, 2, 3)));
+
+#define log_debug(...) log_write(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...) log_write(LOG_INFO, __VA_ARGS__)
+#define log_warn(...) log_write(LOG_WARN, __VA_ARGS__)
+#define log_error(...) log_write(LOG_ERROR, __VA_ARGS__)
+
+#endif
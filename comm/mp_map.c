@@ -0,0 +1,318 @@
+/*
+ * mp_map.c
+ *
+ * Loading, saving and reading of maps.
+ */
+
+#include "pch.h"
+#include "mp_map.h"
+
+// Fill in the size fields of a map from its header.
+static void map_read_header(mp_map* const m)
+{
+	const mp_map_header* hdr = (const mp_map_header*)m->base;
+	m->tiles = m->base + sizeof(mp_map_header);
+	m->wid = hdr->wid;
+	m->hei = hdr->hei;
+	m->chunks_x = hdr->chunks_x;
+	m->chunks_y = hdr->chunks_y;
+}
+
+/*
+ * Create a new map in memory.
+ *
+ * @param m     Map to initialise.
+ * @param wid   Width in tiles.
+ * @param hei   Height in tiles.
+ * @param fill  Tile to fill the map with.
+ *
+ * @return FALSE on failure.
+ */
+int map_new(mp_map* const m, unsigned wid, unsigned hei, enum mp_tile fill)
+{
+	memset(m, 0, sizeof(mp_map));
+	if (!wid || !hei || wid > MAP_MAX_SIZE || hei > MAP_MAX_SIZE)
+	{
+		return FALSE;
+	}
+
+	unsigned cx = (wid + MAP_CHUNK_SIZE - 1) / MAP_CHUNK_SIZE;
+	unsigned cy = (hei + MAP_CHUNK_SIZE - 1) / MAP_CHUNK_SIZE;
+	m->size = sizeof(mp_map_header) + (size_t)cx * cy * MAP_CHUNK_TILES;
+	if (!(m->base = malloc(m->size)))
+	{
+		return FALSE;
+	}
+
+	mp_map_header* hdr = (mp_map_header*)m->base;
+	memset(hdr, 0, sizeof(mp_map_header));
+	memcpy(hdr->magic, MAP_MAGIC, 4);
+	hdr->version = MAP_VERSION;
+	hdr->wid = wid;
+	hdr->hei = hei;
+	hdr->chunk_size = MAP_CHUNK_SIZE;
+	hdr->chunks_x = cx;
+	hdr->chunks_y = cy;
+	map_read_header(m);
+
+	// Padding is wall, everything else is the fill.
+	memset(m->tiles, TILE_WALL, m->size - sizeof(mp_map_header));
+	for (unsigned y = 0; y < hei; ++y)
+	{
+		for (unsigned x = 0; x < wid; ++x)
+		{
+			map_set_tile(m, x, y, fill);
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Create a map whose chunks are only allocated as
+ * they're set, for when it arrives a chunk at a time.
+ * Until then its tiles are TILE_UNKNOWN. Only the
+ * table of chunks is allocated up front, which is a
+ * fraction of the size of the tiles, and most of it
+ * never gets touched.
+ *
+ * @param m    Map to initialise.
+ * @param wid  Width in tiles.
+ * @param hei  Height in tiles.
+ *
+ * @return FALSE on failure.
+ */
+int map_new_sparse(mp_map* const m, unsigned wid, unsigned hei)
+{
+	memset(m, 0, sizeof(mp_map));
+	if (!wid || !hei || wid > MAP_MAX_SIZE || hei > MAP_MAX_SIZE)
+	{
+		return FALSE;
+	}
+
+	m->wid = wid;
+	m->hei = hei;
+	m->chunks_x = (wid + MAP_CHUNK_SIZE - 1) / MAP_CHUNK_SIZE;
+	m->chunks_y = (hei + MAP_CHUNK_SIZE - 1) / MAP_CHUNK_SIZE;
+	if (!(m->chunks = calloc((size_t)m->chunks_x * m->chunks_y, sizeof(unsigned char*))))
+	{
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Map a map file into memory. The mapping is private,
+ * so changes made to the map aren't written back.
+ *
+ * @param m     Map to initialise.
+ * @param path  Map file to open.
+ *
+ * @return FALSE on failure, or if the file isn't a
+ *         valid map.
+ */
+int map_open(mp_map* const m, const char* path)
+{
+	memset(m, 0, sizeof(mp_map));
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		return FALSE;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(mp_map_header))
+	{
+		close(fd);
+		return FALSE;
+	}
+
+	void* base = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+	{
+		return FALSE;
+	}
+	m->base = base;
+	m->size = st.st_size;
+	m->mapped = TRUE;
+
+	// Make sure the header agrees with itself and the
+	// size of the file before trusting it.
+	const mp_map_header* hdr = (const mp_map_header*)m->base;
+	if (memcmp(hdr->magic, MAP_MAGIC, 4) != 0 ||
+		hdr->version != MAP_VERSION ||
+		hdr->chunk_size != MAP_CHUNK_SIZE ||
+		!hdr->wid || hdr->wid > MAP_MAX_SIZE ||
+		!hdr->hei || hdr->hei > MAP_MAX_SIZE ||
+		hdr->chunks_x != (hdr->wid + MAP_CHUNK_SIZE - 1) / MAP_CHUNK_SIZE ||
+		hdr->chunks_y != (hdr->hei + MAP_CHUNK_SIZE - 1) / MAP_CHUNK_SIZE ||
+		m->size != sizeof(mp_map_header) + (size_t)hdr->chunks_x * hdr->chunks_y * MAP_CHUNK_TILES)
+	{
+		map_free(m);
+		return FALSE;
+	}
+
+	map_read_header(m);
+	return TRUE;
+}
+
+/*
+ * Write a map out to a file. Sparse maps can't be
+ * saved.
+ *
+ * @param m     Map to save.
+ * @param path  File to write. Truncated if it exists.
+ *
+ * @return FALSE on failure.
+ */
+int map_save(const mp_map* const m, const char* path)
+{
+	if (!m->base)
+	{
+		return FALSE;
+	}
+	FILE* f = fopen(path, "wb");
+	if (!f)
+	{
+		return FALSE;
+	}
+	int ok = fwrite(m->base, m->size, 1, f) == 1;
+	if (fclose(f) != 0) ok = FALSE;
+	return ok;
+}
+
+/*
+ * Free or unmap a map.
+ *
+ * @param m  Map to free.
+ */
+void map_free(mp_map* const m)
+{
+	if (m->chunks)
+	{
+		for (size_t i = 0; i < (size_t)m->chunks_x * m->chunks_y; ++i)
+		{
+			free(m->chunks[i]);
+		}
+		free(m->chunks);
+	}
+	else if (!m->base)
+	{
+		return;
+	}
+	else if (m->mapped)
+	{
+		munmap(m->base, m->size);
+	}
+	else
+	{
+		free(m->base);
+	}
+	memset(m, 0, sizeof(mp_map));
+}
+
+// Index of a tile within the tile data.
+static size_t map_index(const mp_map* const m, unsigned x, unsigned y)
+{
+	size_t chunk = (size_t)(y / MAP_CHUNK_SIZE) * m->chunks_x + x / MAP_CHUNK_SIZE;
+	return chunk * MAP_CHUNK_TILES + (y % MAP_CHUNK_SIZE) * MAP_CHUNK_SIZE + x % MAP_CHUNK_SIZE;
+}
+
+/*
+ * Get a tile.
+ *
+ * @param m  Map to look in.
+ * @param x  X position.
+ * @param y  Y position.
+ *
+ * @return the tile, or TILE_WALL if off the map.
+ */
+int map_tile(const mp_map* const m, unsigned x, unsigned y)
+{
+	if (x >= m->wid || y >= m->hei)
+	{
+		return TILE_WALL;
+	}
+	if (m->chunks)
+	{
+		const unsigned char* tiles = map_chunk(m, x / MAP_CHUNK_SIZE, y / MAP_CHUNK_SIZE);
+		return tiles ? tiles[(y % MAP_CHUNK_SIZE) * MAP_CHUNK_SIZE + x % MAP_CHUNK_SIZE] : TILE_UNKNOWN;
+	}
+	return m->tiles[map_index(m, x, y)];
+}
+
+/*
+ * Set a tile. Does nothing if off the map, or in a
+ * chunk a sparse map doesn't have yet.
+ *
+ * @param m  Map to modify.
+ * @param x  X position.
+ * @param y  Y position.
+ * @param t  Tile to set it to.
+ */
+void map_set_tile(mp_map* const m, unsigned x, unsigned y, enum mp_tile t)
+{
+	if (x >= m->wid || y >= m->hei)
+	{
+		return;
+	}
+	if (m->chunks)
+	{
+		unsigned char* tiles = map_chunk(m, x / MAP_CHUNK_SIZE, y / MAP_CHUNK_SIZE);
+		if (tiles) tiles[(y % MAP_CHUNK_SIZE) * MAP_CHUNK_SIZE + x % MAP_CHUNK_SIZE] = (unsigned char)t;
+		return;
+	}
+	m->tiles[map_index(m, x, y)] = (unsigned char)t;
+}
+
+/*
+ * Get the tiles of a chunk.
+ *
+ * @param m   Map to look in.
+ * @param cx  Chunk's X position. (In chunks)
+ * @param cy  Chunk's Y position. (In chunks)
+ *
+ * @return MAP_CHUNK_TILES tiles in rows, or 0 if the
+ *         chunk is off the map (or a sparse map doesn't
+ *         have it yet).
+ */
+unsigned char* map_chunk(const mp_map* const m, unsigned cx, unsigned cy)
+{
+	if (cx >= m->chunks_x || cy >= m->chunks_y)
+	{
+		return 0;
+	}
+	if (m->chunks)
+	{
+		return m->chunks[(size_t)cy * m->chunks_x + cx];
+	}
+	return m->tiles + ((size_t)cy * m->chunks_x + cx) * MAP_CHUNK_TILES;
+}
+
+/*
+ * Set the tiles of a chunk, allocating it first if
+ * the map is sparse and doesn't have it yet.
+ *
+ * @param m      Map to modify.
+ * @param cx     Chunk's X position. (In chunks)
+ * @param cy     Chunk's Y position. (In chunks)
+ * @param tiles  MAP_CHUNK_TILES tiles in rows.
+ *
+ * @return FALSE if the chunk is off the map, or
+ *         couldn't be allocated.
+ */
+int map_set_chunk(mp_map* const m, unsigned cx, unsigned cy, const unsigned char* tiles)
+{
+	unsigned char* dst = map_chunk(m, cx, cy);
+	if (!dst && m->chunks && cx < m->chunks_x && cy < m->chunks_y)
+	{
+		dst = m->chunks[(size_t)cy * m->chunks_x + cx] = malloc(MAP_CHUNK_TILES);
+	}
+	if (!dst)
+	{
+		return FALSE;
+	}
+	memcpy(dst, tiles, MAP_CHUNK_TILES);
+	return TRUE;
+}
@@ -0,0 +1,100 @@
+#ifndef MP_MAP_H
+#define MP_MAP_H
+
+/*
+ * Binary map format.
+ *
+ * A map file is a fixed header followed by the tiles,
+ * one byte each. Tiles are stored a chunk at a time,
+ * each chunk being MAP_CHUNK_SIZE x MAP_CHUNK_SIZE
+ * tiles in rows, and the chunks themselves in rows.
+ * Maps whose size isn't a multiple of the chunk size
+ * have their edge chunks padded out with walls.
+ *
+ * Since the file on disk is exactly what's in memory,
+ * it's simply mapped in rather than read and parsed,
+ * so opening a map takes the same time whatever its
+ * size. Chunks are also how maps are sent to clients.
+ */
+#define MAP_MAGIC "MPMP"
+#define MAP_VERSION 1
+
+// Width and height of a chunk in tiles, and the
+// number of tiles in one.
+#define MAP_CHUNK_SIZE 16
+#define MAP_CHUNK_TILES (MAP_CHUNK_SIZE * MAP_CHUNK_SIZE)
+
+// Largest map size. (Positions are sent as u16)
+#define MAP_MAX_SIZE 65535
+
+/*
+ * Types of tiles.
+ */
+enum mp_tile
+{
+	TILE_FLOOR = 0,
+	TILE_WALL = 1,
+
+	// Client only: not been sent this tile yet.
+	TILE_UNKNOWN = 255,
+};
+
+/*
+ * Header at the start of a map file.
+ */
+typedef struct mp_map_header
+{
+	char magic[4];
+	uint32_t version;
+
+	// Size in tiles.
+	uint32_t wid, hei;
+
+	// Size of chunks in tiles, and number of chunks
+	// across and down.
+	uint32_t chunk_size;
+	uint32_t chunks_x, chunks_y;
+
+	uint32_t pad;
+} mp_map_header;
+
+/*
+ * A loaded map.
+ */
+typedef struct mp_map
+{
+	// Start of the map's memory (header, then tiles)
+	unsigned char* base;
+	size_t size;
+
+	// Non-zero if base was mapped from a file rather
+	// than allocated.
+	int mapped;
+
+	// Tiles, chunk by chunk.
+	unsigned char* tiles;
+
+	// Sparse maps (see map_new_sparse) have no tiles,
+	// just a pointer to each chunk, or 0 until it's
+	// been set.
+	unsigned char** chunks;
+
+	// Copied out of the header.
+	unsigned wid, hei;
+	unsigned chunks_x, chunks_y;
+} mp_map;
+
+// Allocation
+int map_new(mp_map* const, unsigned, unsigned, enum mp_tile);
+int map_new_sparse(mp_map* const, unsigned, unsigned);
+int map_open(mp_map* const, const char*);
+int map_save(const mp_map* const, const char*);
+void map_free(mp_map* const);
+
+// Tiles
+int map_tile(const mp_map* const, unsigned, unsigned);
+void map_set_tile(mp_map* const, unsigned, unsigned, enum mp_tile);
+unsigned char* map_chunk(const mp_map* const, unsigned, unsigned);
+int map_set_chunk(mp_map* const, unsigned, unsigned, const unsigned char*);
+
+#endif
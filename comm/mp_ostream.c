@@ -7,6 +7,8 @@
 #include "pch.h"
 #include "mp_packet.h"
 #include "mp_ostream.h"
+#include "mp_pool.h"
+#include "mp_shm.h"
 
 /*
  * Initialise a new output stream with default
@@ -30,9 +32,26 @@ mp_ostream* const ostream_new(SOCKET sock)
  * @return the newly allocated stream.
  */
 mp_ostream* const ostream_new_ex(SOCKET sock, unsigned size)
+{
+	return ostream_new_pool(sock, size, 0);
+}
+
+/*
+ * Initialise a new output stream, taking it and its
+ * buffer from a pool. Make the buffer big enough for
+ * the largest packet, and sending never allocates.
+ *
+ * @param sock  Socket stream will use
+ * @param size  Initial size of the buffer.
+ * @param pool  Pool to allocate from, or 0 to use
+ *              malloc.
+ *
+ * @return the newly allocated stream.
+ */
+mp_ostream* const ostream_new_pool(SOCKET sock, unsigned size, mp_pool* const pool)
 {
 	// Allocate the struct.
-	mp_ostream* o = malloc(sizeof(mp_ostream));
+	mp_ostream* o = pool_alloc(pool, sizeof(mp_ostream));
 	if (!o)
 	{
 		return 0;
@@ -40,15 +59,16 @@ mp_ostream* const ostream_new_ex(SOCKET sock, unsigned size)
 	memset(o, 0, sizeof(mp_ostream));
 
 	o->sock = sock;
+	o->pool = pool;
 
 	// Allocate the internal buffer
 	o->buf_size = size * sizeof(unsigned char);
 	o->buf_len = 0;
-	if (!(o->buf = malloc(o->buf_size)))
+	if (!(o->buf = pool_alloc(pool, o->buf_size)))
 	{
+		pool_free(pool, o);
 		return 0;
 	}
-	memset(o->buf, 0, o->buf_size);
 
 	return o;
 }
@@ -61,8 +81,8 @@ mp_ostream* const ostream_new_ex(SOCKET sock, unsigned size)
 void ostream_free(mp_ostream* const o)
 {
 	if (!o) return;
-	if (o->buf) free(o->buf);
-	free(o);
+	pool_free(o->pool, o->buf);
+	pool_free(o->pool, o);
 }
 
 /*
@@ -92,11 +112,19 @@ void ostream_flush(mp_ostream* const o)
 	// }
 	// printf(">\n");
 
-	// Send the data.
-	send(o->sock, o->buf, o->buf_len, 0);
+	// Send the data. A negative socket is a null sink,
+	// which is used when replaying captured traffic.
+	if (o->shm)
+	{
+		shm_write(o->shm, o->buf, o->buf_len);
+	}
+	else if (o->sock >= 0)
+	{
+		send(o->sock, o->buf, o->buf_len, MSG_NOSIGNAL);
+	}
 
-	// Clear the stream
-	memset(o->buf, 0, o->buf_size);
+	// Clear the stream. Nothing past buf_len is ever
+	// read, so the old bytes can stay.
 	o->buf_len = 0;
 }
 
@@ -122,8 +150,14 @@ mp_ostream* const owrite_u8(mp_ostream* const o, unsigned char x)
 	if (next_size > o->buf_size)
 	{
 		// We allocate double the size for now.
-		o->buf_size = o->buf_size * 2 + 4;
-		o->buf = realloc(o->buf, o->buf_size);
+		unsigned size = o->buf_size * 2 + 4;
+		unsigned char* buf = pool_realloc(o->pool, o->buf, o->buf_len, size);
+		if (!buf)
+		{
+			return o;
+		}
+		o->buf = buf;
+		o->buf_size = size;
 		// printf("REALLOCATED (to %d)\n", o->buf_size);
 	}
 
@@ -139,6 +173,7 @@ mp_ostream* const owrite_err(mp_ostream* const o, const enum mp_packet_err e)
 }
 mp_ostream* const owrite_u16(mp_ostream* const o, unsigned short x) { WRITE_BYTES(o, x); return o; }
 mp_ostream* const owrite_u32(mp_ostream* const o, unsigned x) { WRITE_BYTES(o, x); return o; }
+mp_ostream* const owrite_u64(mp_ostream* const o, unsigned long long x) { WRITE_BYTES(o, x); return o; }
 mp_ostream* const owrite_8(mp_ostream* const o, char x) { WRITE_BYTES(o, x); return o; }
 mp_ostream* const owrite_16(mp_ostream* const o, short x) { WRITE_BYTES(o, x); return o; }
 mp_ostream* const owrite_32(mp_ostream* const o, int x) { WRITE_BYTES(o, x); return o; }
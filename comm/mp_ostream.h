@@ -7,6 +7,9 @@
 #define SOCKET int
 #define OSTREAM_INIT_BUF_SIZE 16
 
+struct mp_pool;
+struct mp_shm;
+
 /*
  * This is a basic "output stream" that allows
  * us to write data to a socket in a fairly
@@ -19,6 +22,10 @@ typedef struct mp_ostream
 	// Socket
 	SOCKET sock;
 
+	// Shared memory session to write to instead of the
+	// socket, or 0. (See mp_shm.h)
+	struct mp_shm* shm;
+
 	// Data buffer.
 	unsigned char* buf;
 
@@ -27,11 +34,16 @@ typedef struct mp_ostream
 
 	// Total storage size of buffer
 	unsigned buf_size;
+
+	// Pool the stream and its buffer came from, or 0
+	// if they're from malloc.
+	struct mp_pool* pool;
 } mp_ostream;
 
 // Allocation
 mp_ostream* const ostream_new(SOCKET);
 mp_ostream* const ostream_new_ex(SOCKET, unsigned);
+mp_ostream* const ostream_new_pool(SOCKET, unsigned, struct mp_pool* const);
 void ostream_free(mp_ostream* const);
 
 // Stream functions
@@ -43,6 +55,7 @@ mp_ostream* const owrite_err(mp_ostream* const, const enum mp_packet_err);
 mp_ostream* const owrite_u8(mp_ostream* const, unsigned char);
 mp_ostream* const owrite_u16(mp_ostream* const, unsigned short);
 mp_ostream* const owrite_u32(mp_ostream* const, unsigned);
+mp_ostream* const owrite_u64(mp_ostream* const, unsigned long long);
 mp_ostream* const owrite_8(mp_ostream* const, char);
 mp_ostream* const owrite_16(mp_ostream* const, short);
 mp_ostream* const owrite_32(mp_ostream* const, int);
@@ -18,17 +18,19 @@ enum mp_packet
 
 	/*
 	 * Server: client's request to join is accepted.
-	 * to join the server.
-	 * + [u8] number of players in server.
+	 * The rest of the players follow in P_JOIN_CHUNKs.
 	 * + [u8] maximum player count.
 	 * + [u8] index of client in terms of the player list.
-	 * + [u8] map width
-	 * + [u8] map height
-	 * + An array of all the players, with following data
-	 *   for each:
-	 *   - [u8] player's index
-	 *   - [u8] player's X spawn position
-	 *   - [u8] player's Y spawn position
+	 * + [u16] map width
+	 * + [u16] map height
+	 * + [u16] client's X spawn position
+	 * + [u16] client's Y spawn position
+	 *   (Spectators have index 255 and no position)
+	 * + [u16] number of players that will be sent in
+	 *   P_JOIN_CHUNKs.
+	 * + [u64] token the client can P_RESUME with if its
+	 *   connection drops.
+	 * + [u16] room the client is in.
 	 */
 	P_HELLO   = 2, // Connect client to server.
 
@@ -38,23 +40,130 @@ enum mp_packet
 	P_DISCONN = 3, // Disconnect from server.
 
 	/*
-	 * Client: Position changed.
-	 * (needs to constantly be called to keep in sync)
-	 * + [u8] this client's X
-	 * + [u8] this client's Y
+	 * Client: movement inputs. Sent whenever the player
+	 * moves.
+	 * + [u8] number of inputs that follow this byte.
+	 * + An array of inputs, oldest first, each with:
+	 *   - [u16] input sequence number
+	 *   - [8] X movement (-1, 0 or 1)
+	 *   - [8] Y movement (-1, 0 or 1)
 	 */
-	P_POS_UPDATE = 4,
+	P_INPUT = 4,
 
 	/*
-	 * Server: state update.
+	 * Server: state update. Sent to every client each tick,
+	 * with only the players that changed since the last.
+	 * + [u32] server tick of this update.
+	 * + [u16] sequence number of the last input that was
+	 *   processed for the receiving client.
 	 * + [u8] number of players that follow this byte.
-	 * + An array of players that need update
+	 * + An array of players that joined or moved
 	 *   in the following structure:
 	 *   - [u8] player index
-	 *   - [u8] x position
-	 *   - [u8] y position
+	 *   - [u16] x position
+	 *   - [u16] y position
+	 * + [u8] number of players that follow this byte.
+	 * + An array of the indices of players that left.
+	 *   - [u8] player index
 	 */
 	P_UPDATE = 5,
+
+	/*
+	 * Client: still connected. Sent every so often while
+	 * the player isn't doing anything.
+	 */
+	P_HEARTBEAT = 6,
+
+	/*
+	 * Server: measuring latency. Client responds with P_PONG
+	 * straight away.
+	 * + [u64] server's clock when sent (ns)
+	 */
+	P_PING = 7,
+
+	/*
+	 * Client: response to P_PING.
+	 * + [u64] server's clock from the P_PING
+	 * + [u64] client's clock when the P_PING arrived (ns)
+	 * + [u64] client's clock when this was sent (ns)
+	 */
+	P_PONG = 8,
+
+	/*
+	 * Server: part of the initial state, streamed to a
+	 * client after P_HELLO, nearest to their spawn first.
+	 * State updates start once it has all been sent.
+	 * + [u8] number of players that follow this byte.
+	 * + An array of players, each with:
+	 *   - [u8] player index
+	 *   - [u16] x position
+	 *   - [u16] y position
+	 */
+	P_JOIN_CHUNK = 9,
+
+	/*
+	 * Server: tiles of one chunk of the map. Chunks are
+	 * sent as the player gets near them, nearest first.
+	 * + [u16] chunk's X position (in chunks)
+	 * + [u16] chunk's Y position (in chunks)
+	 * + [u8 * MAP_CHUNK_TILES] the chunk's tiles, in rows
+	 */
+	P_MAP_CHUNK = 10,
+
+	/*
+	 * Client: join as a new player. Must be the first
+	 * thing sent after connecting (or P_RESUME).
+	 * + [u16] room to join, or 0 for any room with space.
+	 *   Rooms that nobody is in yet are opened. If the
+	 *   room is full (or doesn't exist) the server responds
+	 *   with ERR_SERVER_FULL, or if the server is too busy
+	 *   to take anyone else, ERR_OVERLOADED.
+	 * + [u64] token from an earlier session's P_HELLO, or
+	 *   0. A player the server remembers (see the world
+	 *   file) gets their old spot back.
+	 */
+	P_JOIN = 11,
+
+	/*
+	 * Client: reconnecting after the connection dropped.
+	 * If the session is still being held the server
+	 * responds with P_HELLO (with no join stream), then
+	 * carries on with updates from the given tick.
+	 * Otherwise it responds with ERR_NO_SESSION.
+	 * + [u64] token from the session's P_HELLO
+	 * + [u32] tick of the last P_UPDATE received
+	 */
+	P_RESUME = 12,
+
+	/*
+	 * Client: asking for the server's load instead of
+	 * joining. Sent as the first packet; the server
+	 * responds with P_LOAD and closes the connection.
+	 */
+	P_STATUS = 13,
+
+	/*
+	 * Server: how busy the server is.
+	 * + [u32] players in the server (counting held
+	 *   sessions)
+	 * + [u32] most players the server can take
+	 * + [u16] rooms open
+	 * + [u16] most rooms the server can open
+	 */
+	P_LOAD = 14,
+
+	/*
+	 * Client: watch a room without playing in it. Sent
+	 * as the first packet. The server responds with
+	 * P_HELLO (with player index 255 and no token), then
+	 * sends everyone in P_JOIN_CHUNKs, the whole map in
+	 * P_MAP_CHUNKs, and P_UPDATEs as usual. Anything the
+	 * spectator sends other than heartbeats is ignored.
+	 * If the room isn't open the server responds with
+	 * ERR_NO_ROOM, or if it's too busy, ERR_OVERLOADED.
+	 * + [u16] room to watch
+	 */
+	P_SPECTATE = 15,
 };
 
 /*
@@ -65,6 +174,9 @@ enum mp_packet_err
 	ERR_SUCCESS = 0,
 	ERR_TIMED_OUT = 1,
 	ERR_SERVER_FULL = 2,
+	ERR_NO_SESSION = 3,
+	ERR_NO_ROOM = 4,
+	ERR_OVERLOADED = 5,
 
 	ERR_INTERNAL = 255,
 };
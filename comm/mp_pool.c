@@ -0,0 +1,282 @@
+/*
+ * mp_pool.c
+ *
+ * Preallocated memory blocks in size classes.
+ */
+
+#include "pch.h"
+#include "mp_log.h"
+#include "mp_pool.h"
+
+/*
+ * @return the smallest size class a block of the
+ *         given size fits in, or -1 if it's too big
+ *         for any of them.
+ */
+int pool_class(size_t size)
+{
+	for (int i = 0; i < POOL_CLASSES; ++i)
+	{
+		if (size <= pool_class_size(i))
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * @return the size of the blocks in a class.
+ */
+size_t pool_class_size(int i)
+{
+	return (size_t)POOL_MIN_SIZE << i;
+}
+
+/*
+ * Add blocks to a set of counts to build a pool from.
+ * Blocks too big for any class aren't counted; they'll
+ * come from malloc.
+ *
+ * @param counts  Blocks in each class. (POOL_CLASSES)
+ * @param size    Size of the blocks needed.
+ * @param n       Number of blocks needed.
+ */
+void pool_reserve(unsigned* const counts, size_t size, unsigned n)
+{
+	int i = pool_class(size);
+	if (i >= 0)
+	{
+		counts[i] += n;
+	}
+}
+
+/*
+ * Set up a pool. All of its memory is mapped at once,
+ * though normal pages are only really allocated once
+ * they're first used.
+ *
+ * @param p       Pool to initialise.
+ * @param counts  Blocks to make in each class.
+ *                (POOL_CLASSES)
+ * @param huge    Non-zero to try and use huge pages.
+ *                Normal pages are used if there aren't
+ *                any to be had.
+ *
+ * @return FALSE on failure.
+ */
+int pool_init(mp_pool* const p, const unsigned* const counts, int huge)
+{
+	memset(p, 0, sizeof(mp_pool));
+	pthread_mutex_init(&p->lock, 0);
+	atomic_init(&p->overflow, 0);
+
+	for (int i = 0; i < POOL_CLASSES; ++i)
+	{
+		p->size += pool_class_size(i) * counts[i];
+	}
+	if (!p->size)
+	{
+		return TRUE;
+	}
+
+	// Get the memory, from huge pages if we can.
+	if (huge)
+	{
+		size_t size = (p->size + POOL_HUGE_PAGE - 1) & ~(size_t)(POOL_HUGE_PAGE - 1);
+		void* base = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (base != MAP_FAILED)
+		{
+			p->base = base;
+			p->size = size;
+			p->huge = TRUE;
+		}
+		else
+		{
+			log_warn("Huge pages unavailable, using normal pages.");
+		}
+	}
+	if (!p->base)
+	{
+		void* base = mmap(0, p->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (base == MAP_FAILED)
+		{
+			p->size = 0;
+			pthread_mutex_destroy(&p->lock);
+			return FALSE;
+		}
+		p->base = base;
+	}
+
+	// Lay out the classes one after another. Blocks are
+	// handed out in order until they've all been used,
+	// so pages nobody has needed yet stay untouched.
+	unsigned char* at = p->base;
+	for (int i = 0; i < POOL_CLASSES; ++i)
+	{
+		p->classes[i].count = counts[i];
+		p->classes[i].base = at;
+		at += pool_class_size(i) * counts[i];
+	}
+	return TRUE;
+}
+
+/*
+ * Free a pool's memory. Nothing may still be using it.
+ *
+ * @param p  Pool to free.
+ */
+void pool_deinit(mp_pool* const p)
+{
+	if (p->base)
+	{
+		munmap(p->base, p->size);
+		pthread_mutex_destroy(&p->lock);
+	}
+	memset(p, 0, sizeof(mp_pool));
+}
+
+// Find the class a block came from, or -1 if it came
+// from malloc.
+static int pool_owner(mp_pool* const p, const void* ptr)
+{
+	const unsigned char* b = ptr;
+	if (!p || !p->base || b < p->base || b >= p->base + p->size)
+	{
+		return -1;
+	}
+	for (int i = 0; i < POOL_CLASSES; ++i)
+	{
+		const mp_pool_class* c = &p->classes[i];
+		if (b >= c->base && b < c->base + pool_class_size(i) * c->count)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Allocate a block. Its contents are undefined.
+ *
+ * @param p     Pool to allocate from, or 0 to use
+ *              malloc.
+ * @param size  Bytes needed.
+ *
+ * @return the block, or 0 on failure.
+ */
+void* pool_alloc(mp_pool* const p, size_t size)
+{
+	int i = p && p->base ? pool_class(size) : -1;
+	if (i >= 0)
+	{
+		mp_pool_class* c = &p->classes[i];
+		pthread_mutex_lock(&p->lock);
+		void* b = c->free;
+		if (b)
+		{
+			c->free = *(void**)b;
+		}
+		else if (c->fresh < c->count)
+		{
+			b = c->base + pool_class_size(i) * c->fresh++;
+		}
+		if (b && ++c->used > c->peak)
+		{
+			c->peak = c->used;
+		}
+		pthread_mutex_unlock(&p->lock);
+		if (b)
+		{
+			return b;
+		}
+	}
+
+	if (p)
+	{
+		atomic_fetch_add_explicit(&p->overflow, 1, memory_order_relaxed);
+	}
+	return malloc(size);
+}
+
+/*
+ * Resize a block. If it's from the pool and the new
+ * size still fits, it's left where it is.
+ *
+ * @param p     Pool the block came from, or 0.
+ * @param ptr   Block to resize, or 0 to allocate.
+ * @param old   Bytes in use in the block, which are
+ *              kept.
+ * @param size  Bytes needed.
+ *
+ * @return the block, which may have moved, or 0 on
+ *         failure (when the old block is untouched).
+ */
+void* pool_realloc(mp_pool* const p, void* ptr, size_t old, size_t size)
+{
+	if (!ptr)
+	{
+		return pool_alloc(p, size);
+	}
+
+	int i = pool_owner(p, ptr);
+	if (i < 0)
+	{
+		return realloc(ptr, size);
+	}
+	if (size <= pool_class_size(i))
+	{
+		return ptr;
+	}
+
+	void* b = pool_alloc(p, size);
+	if (b)
+	{
+		memcpy(b, ptr, old < size ? old : size);
+		pool_free(p, ptr);
+	}
+	return b;
+}
+
+/*
+ * Free a block.
+ *
+ * @param p    Pool the block came from, or 0.
+ * @param ptr  Block to free. May be 0.
+ */
+void pool_free(mp_pool* const p, void* ptr)
+{
+	if (!ptr) return;
+
+	int i = pool_owner(p, ptr);
+	if (i < 0)
+	{
+		free(ptr);
+		return;
+	}
+
+	mp_pool_class* c = &p->classes[i];
+	pthread_mutex_lock(&p->lock);
+	*(void**)ptr = c->free;
+	c->free = ptr;
+	--c->used;
+	pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * Print how much of each class is in use.
+ *
+ * @param p  Pool to report on.
+ */
+void pool_stats(mp_pool* const p)
+{
+	log_info("Pool: %zu KB%s, %u allocations from malloc",
+		p->size / 1024, p->huge ? " (huge pages)" : "",
+		atomic_load_explicit(&p->overflow, memory_order_relaxed));
+	for (int i = 0; i < POOL_CLASSES; ++i)
+	{
+		const mp_pool_class* c = &p->classes[i];
+		if (!c->count) continue;
+		log_info("  %7zu B: %u of %u in use, peak %u", pool_class_size(i), c->used, c->count, c->peak);
+	}
+}
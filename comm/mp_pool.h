@@ -0,0 +1,78 @@
+#ifndef MP_POOL_H
+#define MP_POOL_H
+
+/*
+ * A pool of preallocated memory blocks, in size
+ * classes that double from POOL_MIN_SIZE up. Each
+ * class is a run of equal blocks in one mapping made
+ * up front, with a free list threaded through the
+ * blocks that aren't in use, so allocating and freeing
+ * never goes near malloc.
+ *
+ * Requests too big for any class, or for a class that
+ * has run out, fall back to malloc (and are counted),
+ * so running out makes things slower rather than
+ * failing. Everything here also accepts a null pool,
+ * meaning just use malloc.
+ */
+#define POOL_MIN_SHIFT 6
+#define POOL_MIN_SIZE (1 << POOL_MIN_SHIFT)
+#define POOL_CLASSES 16
+
+// Huge pages the mapping is rounded up to when using them.
+#define POOL_HUGE_PAGE (2 * 1024 * 1024)
+
+/*
+ * Blocks of one size.
+ */
+typedef struct mp_pool_class
+{
+	// Blocks in the class, and where they start.
+	unsigned count;
+	unsigned char* base;
+
+	// First block that's been freed. Each one starts
+	// with a pointer to the next.
+	void* free;
+
+	// Blocks that have ever been handed out. The rest
+	// come after them, and haven't been touched yet.
+	unsigned fresh;
+
+	// Blocks in use now, and the most there have been.
+	unsigned used, peak;
+} mp_pool_class;
+
+/*
+ * A pool.
+ */
+typedef struct mp_pool
+{
+	// The one mapping all the classes live in.
+	unsigned char* base;
+	size_t size;
+
+	// Set if the mapping is of huge pages.
+	int huge;
+
+	mp_pool_class classes[POOL_CLASSES];
+	pthread_mutex_t lock;
+
+	// Allocations that had to go to malloc instead.
+	atomic_uint overflow;
+} mp_pool;
+
+// Setup
+int pool_class(size_t);
+size_t pool_class_size(int);
+void pool_reserve(unsigned* const, size_t, unsigned);
+int pool_init(mp_pool* const, const unsigned* const, int);
+void pool_deinit(mp_pool* const);
+
+// Allocation
+void* pool_alloc(mp_pool* const, size_t);
+void* pool_realloc(mp_pool* const, void*, size_t, size_t);
+void pool_free(mp_pool* const, void*);
+void pool_stats(mp_pool* const);
+
+#endif
@@ -0,0 +1,405 @@
+/*
+ * mp_shm.c
+ *
+ * Shared memory transport for sessions on the same
+ * host.
+ */
+
+#include "pch.h"
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "mp_shm.h"
+
+// Memory for both rings. Ring 0 goes from the server
+// to the client, ring 1 the other way.
+#define SHM_SIZE (2 * sizeof(mp_shm_ring))
+
+// Descriptors passed when setting up a session: the
+// memory, then each ring's data and space eventfds.
+#define SHM_FDS 5
+
+// Copy into a ring, wrapping around its end.
+static void shm_copy_in(mp_shm_ring* const r, unsigned pos, const unsigned char* src, size_t n)
+{
+	unsigned at = pos & (SHM_RING_SIZE - 1);
+	size_t first = SHM_RING_SIZE - at < n ? SHM_RING_SIZE - at : n;
+	memcpy(r->data + at, src, first);
+	memcpy(r->data, src + first, n - first);
+}
+
+// Copy out of a ring, wrapping around its end.
+static void shm_copy_out(const mp_shm_ring* const r, unsigned pos, unsigned char* dst, size_t n)
+{
+	unsigned at = pos & (SHM_RING_SIZE - 1);
+	size_t first = SHM_RING_SIZE - at < n ? SHM_RING_SIZE - at : n;
+	memcpy(dst, r->data + at, first);
+	memcpy(dst + first, r->data, n - first);
+}
+
+// Sleep until an eventfd is written to, or the other
+// end goes.
+//
+// @return FALSE if the other end has gone.
+static int shm_wait(mp_shm* const s, int fd)
+{
+	// Nothing is sent over the socket once the session
+	// is set up, so anything on it means it's closing.
+	struct pollfd pfds[2] = { { fd, POLLIN, 0 }, { s->sock, POLLIN | POLLRDHUP, 0 } };
+	while (poll(pfds, 2, -1) < 0)
+	{
+		if (errno != EINTR) return FALSE;
+	}
+	if (pfds[1].revents)
+	{
+		return FALSE;
+	}
+	eventfd_t v;
+	eventfd_read(fd, &v);
+	return TRUE;
+}
+
+// Map a session's memory and set up our end of it.
+static mp_shm* shm_attach(SOCKET sock, int mem, const int* events, int server)
+{
+	mp_shm* s = malloc(sizeof(mp_shm));
+	if (!s)
+	{
+		return 0;
+	}
+	s->sock = sock;
+	s->base = mmap(0, SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, mem, 0);
+	if (s->base == MAP_FAILED)
+	{
+		free(s);
+		return 0;
+	}
+
+	mp_shm_ring* rings = s->base;
+	s->tx = &rings[server ? 0 : 1];
+	s->rx = &rings[server ? 1 : 0];
+	s->tx_data = events[server ? 0 : 2];
+	s->tx_space = events[server ? 1 : 3];
+	s->rx_data = events[server ? 2 : 0];
+	s->rx_space = events[server ? 3 : 1];
+	return s;
+}
+
+/*
+ * Listen for sessions on a Unix domain socket. Any
+ * old socket file at the path is replaced.
+ *
+ * @param path  Where to put the socket.
+ *
+ * @return the listening socket, which is non-blocking,
+ *         or -1 on failure.
+ */
+SOCKET shm_listen(const char* path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	SOCKET sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+	{
+		return -1;
+	}
+	unlink(path);
+	if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+		listen(sock, 16) != 0)
+	{
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/*
+ * Set up a session for a connection accepted on a
+ * socket from shm_listen, and hand it over.
+ *
+ * @param sock  The accepted connection.
+ *
+ * @return the server's end of the session, or 0 on
+ *         failure.
+ */
+mp_shm* shm_serve(SOCKET sock)
+{
+	mp_shm* s = 0;
+	int fds[SHM_FDS] = { -1, -1, -1, -1, -1 };
+
+	// The memory starts out zeroed, which is both rings
+	// empty with nobody waiting.
+	if ((fds[0] = memfd_create("mp_shm", MFD_CLOEXEC)) < 0 ||
+		ftruncate(fds[0], SHM_SIZE) != 0)
+	{
+		goto done;
+	}
+	for (int i = 1; i < SHM_FDS; ++i)
+	{
+		if ((fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		{
+			goto done;
+		}
+	}
+
+	// Pass everything over with a byte to carry it.
+	unsigned char byte = 0;
+	struct iovec iov = { &byte, 1 };
+	char ctrl[CMSG_SPACE(sizeof(fds))];
+	memset(ctrl, 0, sizeof(ctrl));
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl;
+	msg.msg_controllen = sizeof(ctrl);
+	struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+	if (TEMP_FAILURE_RETRY(sendmsg(sock, &msg, MSG_NOSIGNAL)) != 1)
+	{
+		goto done;
+	}
+
+	if ((s = shm_attach(sock, fds[0], fds + 1, TRUE)))
+	{
+		fds[1] = fds[2] = fds[3] = fds[4] = -1;
+	}
+
+done:
+	for (int i = 0; i < SHM_FDS; ++i)
+	{
+		if (fds[i] >= 0) close(fds[i]);
+	}
+	return s;
+}
+
+/*
+ * Connect to a server's session socket and set up a
+ * session with it.
+ *
+ * @param path  Where the server's socket is.
+ *
+ * @return our end of the session, or 0 on failure.
+ *         Close its socket after freeing it.
+ */
+mp_shm* shm_connect(const char* path)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		return 0;
+	}
+	strcpy(addr.sun_path, path);
+
+	SOCKET sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+	{
+		return 0;
+	}
+	if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+	{
+		close(sock);
+		return 0;
+	}
+
+	// Wait for the server to hand everything over. If it
+	// can't take us, it says why and hangs up instead.
+	int fds[SHM_FDS];
+	unsigned char byte;
+	struct iovec iov = { &byte, 1 };
+	char ctrl[CMSG_SPACE(sizeof(fds))];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl;
+	msg.msg_controllen = sizeof(ctrl);
+	struct cmsghdr* cm = 0;
+	if (TEMP_FAILURE_RETRY(recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) != 1 ||
+		!(cm = CMSG_FIRSTHDR(&msg)) ||
+		cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS ||
+		cm->cmsg_len != CMSG_LEN(sizeof(fds)))
+	{
+		close(sock);
+		return 0;
+	}
+	memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+
+	// Make sure it's what we're expecting before we
+	// touch it.
+	struct stat st;
+	mp_shm* s = 0;
+	if (fstat(fds[0], &st) == 0 && (size_t)st.st_size == SHM_SIZE)
+	{
+		s = shm_attach(sock, fds[0], fds + 1, FALSE);
+	}
+	close(fds[0]);
+	if (!s)
+	{
+		for (int i = 1; i < SHM_FDS; ++i) close(fds[i]);
+		close(sock);
+	}
+	return s;
+}
+
+/*
+ * Free our end of a session. Its socket is left open.
+ *
+ * @param s  Session to free. May be 0.
+ */
+void shm_free(mp_shm* const s)
+{
+	if (!s) return;
+	munmap(s->base, SHM_SIZE);
+	close(s->rx_data);
+	close(s->rx_space);
+	close(s->tx_data);
+	close(s->tx_space);
+	free(s);
+}
+
+/*
+ * Write to a session. Like send(), this waits for
+ * room, unless the session's socket is non-blocking.
+ * Only one thread may write to a session at a time.
+ *
+ * @param s    Session to write to.
+ * @param buf  Bytes to write.
+ * @param len  Number of bytes.
+ *
+ * @return the number of bytes written, which is less
+ *         than asked if the other end has gone, or
+ *         there wasn't room and we couldn't wait.
+ */
+size_t shm_write(mp_shm* const s, const void* buf, size_t len)
+{
+	mp_shm_ring* r = s->tx;
+	size_t done = 0;
+	while (done < len)
+	{
+		unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+		unsigned room = SHM_RING_SIZE - (tail - atomic_load(&r->head));
+		if (!room)
+		{
+			if (fcntl(s->sock, F_GETFL) & O_NONBLOCK)
+			{
+				break;
+			}
+
+			// Say we're waiting before looking again, so the
+			// reader can't make room without waking us.
+			atomic_store(&r->writer_waiting, TRUE);
+			int alive = tail - atomic_load(&r->head) < SHM_RING_SIZE || shm_wait(s, s->tx_space);
+			atomic_store(&r->writer_waiting, FALSE);
+			if (!alive) break;
+			continue;
+		}
+
+		size_t n = len - done < room ? len - done : room;
+		shm_copy_in(r, tail, (const unsigned char*)buf + done, n);
+		atomic_store(&r->tail, tail + (unsigned)n);
+		done += n;
+
+		// Only wake the reader if it's asleep.
+		if (atomic_load(&r->reader_waiting) && atomic_exchange(&r->reader_waiting, FALSE))
+		{
+			eventfd_write(s->tx_data, 1);
+		}
+	}
+	return done;
+}
+
+/*
+ * Read from a session, waiting until all of it has
+ * arrived. Only one thread may read from a session
+ * at a time.
+ *
+ * @param s    Session to read from.
+ * @param buf  Where to put what's read.
+ * @param len  Number of bytes to read.
+ *
+ * @return the number of bytes read, which is less
+ *         than asked only if the other end has gone.
+ */
+size_t shm_read(mp_shm* const s, void* buf, size_t len)
+{
+	mp_shm_ring* r = s->rx;
+	size_t done = 0;
+	int gone = FALSE;
+	while (done < len)
+	{
+		unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+		unsigned avail = atomic_load(&r->tail) - head;
+		if (!avail)
+		{
+			// Whatever the other end wrote before going is
+			// still read.
+			if (gone) break;
+			atomic_store(&r->reader_waiting, TRUE);
+			if (atomic_load(&r->tail) == head)
+			{
+				gone = !shm_wait(s, s->rx_data);
+			}
+			atomic_store(&r->reader_waiting, FALSE);
+			continue;
+		}
+
+		size_t n = len - done < avail ? len - done : avail;
+		shm_copy_out(r, head, (unsigned char*)buf + done, n);
+		atomic_store(&r->head, head + (unsigned)n);
+		done += n;
+
+		if (atomic_load(&r->writer_waiting) && atomic_exchange(&r->writer_waiting, FALSE))
+		{
+			eventfd_write(s->rx_space, 1);
+		}
+	}
+	return done;
+}
+
+/*
+ * Check whether a session has anything to read, for
+ * those that poll. If it hasn't, shm_fd polls as
+ * readable once it has.
+ *
+ * @param s  Session to check.
+ *
+ * @return TRUE if there's something to read.
+ */
+int shm_ready(mp_shm* const s)
+{
+	mp_shm_ring* r = s->rx;
+	unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	if (atomic_load(&r->tail) != head)
+	{
+		return TRUE;
+	}
+	eventfd_t v;
+	eventfd_read(s->rx_data, &v);
+	atomic_store(&r->reader_waiting, TRUE);
+	return atomic_load(&r->tail) != head;
+}
+
+/*
+ * @return a descriptor to poll for there being
+ *         something to read (see shm_ready). Poll the
+ *         session's socket as well, to hear about the
+ *         other end going.
+ */
+int shm_fd(const mp_shm* const s)
+{
+	return s->rx_data;
+}
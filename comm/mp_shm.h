@@ -0,0 +1,88 @@
+#ifndef MP_SHM_H
+#define MP_SHM_H
+
+/*
+ * Shared memory transport for sessions on the same
+ * host.
+ *
+ * A session is a pair of byte rings in a memfd that
+ * both ends map, one each way, so sending is a copy
+ * into the ring rather than a trip through the network
+ * stack. Each ring has one writer and one reader, and
+ * neither ever takes a lock. Whoever finds a ring
+ * empty (or full) says so in the ring and sleeps on an
+ * eventfd, which the other end only writes to when
+ * someone is waiting, so a busy session makes no
+ * system calls at all.
+ *
+ * Sessions are set up over a Unix domain socket: the
+ * server creates the memory and the eventfds and
+ * passes them over with SCM_RIGHTS. The socket then
+ * stays open for as long as the session does, so that
+ * either end can tell when the other has gone; nothing
+ * else is ever sent over it.
+ *
+ * Streams (mp_istream, mp_ostream) read and write
+ * through a session when given one, so nothing above
+ * them knows the difference.
+ */
+
+// Bytes in each ring. (Must be a power of two)
+#define SHM_RING_SIZE (256 * 1024)
+
+/*
+ * One direction of a session, in the shared memory.
+ */
+typedef struct mp_shm_ring
+{
+	// Positions. Only ever increase; masked to index.
+	// head is only written by the reader, tail by the
+	// writer.
+	_Alignas(64) atomic_uint head;
+	_Alignas(64) atomic_uint tail;
+
+	// Set by the reader while it's waiting for data,
+	// and by the writer while it's waiting for room.
+	_Alignas(64) atomic_int reader_waiting;
+	atomic_int writer_waiting;
+
+	unsigned char data[SHM_RING_SIZE];
+} mp_shm_ring;
+
+/*
+ * One end of a session.
+ */
+typedef struct mp_shm
+{
+	// Socket the session was set up over, which tells
+	// us when the other end has gone. Not owned by the
+	// session; whoever opened it closes it.
+	SOCKET sock;
+
+	// Both rings, as mapped.
+	void* base;
+
+	// Rings we read from and write to.
+	mp_shm_ring* rx;
+	mp_shm_ring* tx;
+
+	// Eventfds for when there's data to read, for when
+	// we've made room in what we read, for when we've
+	// written, and for when there's room to write.
+	int rx_data, rx_space;
+	int tx_data, tx_space;
+} mp_shm;
+
+// Setup
+SOCKET shm_listen(const char*);
+mp_shm* shm_serve(SOCKET);
+mp_shm* shm_connect(const char*);
+void shm_free(mp_shm* const);
+
+// Transfer
+size_t shm_write(mp_shm* const, const void*, size_t);
+size_t shm_read(mp_shm* const, void*, size_t);
+int shm_ready(mp_shm* const);
+int shm_fd(const mp_shm* const);
+
+#endif
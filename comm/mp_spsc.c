@@ -0,0 +1,112 @@
+/*
+ * mp_spsc.c
+ *
+ * Lock-free single-producer, single-consumer queue.
+ */
+
+#include "pch.h"
+#include "mp_spsc.h"
+
+/*
+ * Initialise a queue.
+ *
+ * @param q          Queue to initialise.
+ * @param elem_size  Size of each element.
+ * @param cap        Minimum number of elements it can hold.
+ *                   (Rounded up to a power of two)
+ *
+ * @return FALSE on failure.
+ */
+int spsc_init(mp_spsc* const q, unsigned elem_size, unsigned cap)
+{
+	memset(q, 0, sizeof(mp_spsc));
+
+	unsigned n = 1;
+	while (n < cap) n <<= 1;
+
+	if (!(q->buf = malloc((size_t)elem_size * n)))
+	{
+		return FALSE;
+	}
+	q->elem_size = elem_size;
+	q->cap = n;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	return TRUE;
+}
+
+/*
+ * Initialise a queue in storage the caller provides,
+ * which must be elem_size * cap bytes. The storage
+ * stays the caller's, so don't spsc_deinit the queue.
+ *
+ * @param q          Queue to initialise.
+ * @param buf        Storage for the elements.
+ * @param elem_size  Size of each element.
+ * @param cap        Number of elements it can hold.
+ *                   (Must be a power of two)
+ */
+void spsc_init_mem(mp_spsc* const q, void* buf, unsigned elem_size, unsigned cap)
+{
+	memset(q, 0, sizeof(mp_spsc));
+	q->buf = buf;
+	q->elem_size = elem_size;
+	q->cap = cap;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+}
+
+/*
+ * Free a queue's storage.
+ *
+ * @param q  Queue to deinitialise.
+ */
+void spsc_deinit(mp_spsc* const q)
+{
+	free(q->buf);
+	q->buf = 0;
+}
+
+/*
+ * Push an element. Only call from the producer thread.
+ *
+ * @param q     Queue.
+ * @param elem  Element to copy in.
+ *
+ * @return FALSE if the queue is full.
+ */
+int spsc_push(mp_spsc* const q, const void* elem)
+{
+	unsigned tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	unsigned head = atomic_load_explicit(&q->head, memory_order_acquire);
+	if (tail - head == q->cap)
+	{
+		return FALSE;
+	}
+
+	memcpy(q->buf + (size_t)(tail & (q->cap - 1)) * q->elem_size, elem, q->elem_size);
+	atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+	return TRUE;
+}
+
+/*
+ * Pop an element. Only call from the consumer thread.
+ *
+ * @param q     Queue.
+ * @param elem  Where to copy the element out to.
+ *
+ * @return FALSE if the queue is empty.
+ */
+int spsc_pop(mp_spsc* const q, void* elem)
+{
+	unsigned head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	unsigned tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+	if (head == tail)
+	{
+		return FALSE;
+	}
+
+	memcpy(elem, q->buf + (size_t)(head & (q->cap - 1)) * q->elem_size, q->elem_size);
+	atomic_store_explicit(&q->head, head + 1, memory_order_release);
+	return TRUE;
+}
@@ -0,0 +1,39 @@
+#ifndef MP_SPSC_H
+#define MP_SPSC_H
+
+/*
+ * Bounded single-producer, single-consumer queue.
+ *
+ * One thread pushes and one thread pops, without any
+ * locking. Elements are copied in and out, and all
+ * must be the same size.
+ */
+typedef struct mp_spsc
+{
+	// Element storage.
+	unsigned char* buf;
+
+	// Size of each element, and number of slots. The
+	// number of slots is always a power of two.
+	unsigned elem_size;
+	unsigned cap;
+
+	// Positions. Only ever increase; masked to index.
+	// Kept on separate cache lines so that the producer
+	// and consumer don't fight over them.
+	_Alignas(64) atomic_uint head;
+	_Alignas(64) atomic_uint tail;
+} mp_spsc;
+
+// Allocation
+int spsc_init(mp_spsc* const, unsigned, unsigned);
+void spsc_init_mem(mp_spsc* const, void*, unsigned, unsigned);
+void spsc_deinit(mp_spsc* const);
+
+// Producer
+int spsc_push(mp_spsc* const, const void*);
+
+// Consumer
+int spsc_pop(mp_spsc* const, void*);
+
+#endif
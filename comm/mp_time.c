@@ -0,0 +1,42 @@
+/*
+ * mp_time.c
+ *
+ * Monotonic clock helpers.
+ */
+
+#include "pch.h"
+#include "mp_time.h"
+
+/*
+ * @return the current monotonic time, in nanoseconds.
+ */
+unsigned long long time_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * NS_PER_SEC + (unsigned long long)ts.tv_nsec;
+}
+
+/*
+ * @return the current wall-clock time, in nanoseconds.
+ */
+unsigned long long time_real_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (unsigned long long)ts.tv_sec * NS_PER_SEC + (unsigned long long)ts.tv_nsec;
+}
+
+/*
+ * Sleep until the monotonic clock reaches the given time.
+ * Returns immediately if that time has already passed.
+ *
+ * @param t  Time to wake up at, in nanoseconds.
+ */
+void time_sleep_until_ns(unsigned long long t)
+{
+	struct timespec ts;
+	ts.tv_sec = (time_t)(t / NS_PER_SEC);
+	ts.tv_nsec = (long)(t % NS_PER_SEC);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR);
+}
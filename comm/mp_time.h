@@ -0,0 +1,14 @@
+#ifndef MP_TIME_H
+#define MP_TIME_H
+
+// Handy conversions.
+#define NS_PER_US 1000ULL
+#define NS_PER_MS 1000000ULL
+#define NS_PER_SEC 1000000000ULL
+
+// Time functions
+unsigned long long time_now_ns(void);
+unsigned long long time_real_ns(void);
+void time_sleep_until_ns(unsigned long long);
+
+#endif
@@ -0,0 +1,441 @@
+/*
+ * main.c
+ *
+ * Main translation unit of the gateway.
+ *
+ * The gateway sits in front of any number of servers.
+ * Clients connect to it as if it were a server; it reads
+ * their first packet, picks a server for them by room and
+ * load, hands the packet on, and from then on just passes
+ * traffic back and forth.
+ *
+ * Rooms are numbered across all the servers: gateway
+ * room n is room (n - 1) / count + 1 on server
+ * (n - 1) % count, where count is the number of
+ * servers, so everyone asking for the same room ends up
+ * in the same place.
+ */
+
+#include "pch.h"
+#include "mp_backend.h"
+#include "mp_forward.h"
+
+// Time a client has to send its first packet.
+#define GATEWAY_HANDSHAKE_MS 5000
+
+// For signal interupt handler.
+static volatile sig_atomic_t signal_interrupt_caught = 0;
+void signal_interrupt_handler(int param)
+{
+	(void)param;
+	signal_interrupt_caught = 1;
+}
+
+// Variables
+static mp_listener* listener;
+static unsigned port = PORT;
+
+// Function prototypes.
+int recv_loop(void);
+void* gateway_worker(void*);
+
+/*
+ * Print command line usage.
+ */
+static void usage(const char* name)
+{
+	printf("Usage: %s [-p port] server[:port] [server[:port]...]\n", name);
+	printf("  -p port  Port to listen on. (default %u)\n", PORT);
+}
+
+/*
+ * Entry point of the program.
+ *
+ * @return status. 0 on normal termination.
+ */
+int main(int argc, char** argv)
+{
+	// Parse options.
+	int opt;
+	while ((opt = getopt(argc, argv, "p:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'p': port = (unsigned)atoi(optarg); break;
+			default:
+			{
+				usage(argv[0]);
+				return opt == 'h' ? 0 : -1;
+			}
+		}
+	}
+	if (optind >= argc || !port || port > 0xFFFF)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+	for (int i = optind; i < argc; ++i)
+	{
+		if (!backend_add(argv[i]))
+		{
+			printf("Bad server address %s\n", argv[i]);
+			return -1;
+		}
+	}
+
+	printf("-- Simple Game Gateway --\n");
+
+	// Register signal interrupt handler. Writing to
+	// clients that have gone shouldn't kill us.
+	struct sigaction sigact_inter;
+	memset(&sigact_inter, 0, sizeof(sigact_inter));
+	sigact_inter.sa_handler = signal_interrupt_handler;
+	sigaction(SIGINT, &sigact_inter, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	// Find out how busy everyone is.
+	if (!backend_start())
+	{
+		printf("Failed to start polling servers.\n");
+		return -1;
+	}
+
+	// Start listening. Everyone comes through the
+	// gateway, so allow a long backlog.
+	if (!(listener = listener_new((unsigned short)port, SOMAXCONN)))
+	{
+		printf("Failed to listen on port %u: %s\n", port, strerror(errno));
+		backend_stop();
+		return -1;
+	}
+	printf("Forwarding port %u to %u servers...\n", port, backend_count());
+
+	// Accept connections until we're told to stop.
+	while (!signal_interrupt_caught)
+	{
+		struct pollfd pfd = { listener->handle, POLLIN, 0 };
+		if (poll(&pfd, 1, 1000) > 0 && !recv_loop())
+		{
+			break;
+		}
+	}
+
+	if (signal_interrupt_caught)
+	{
+		printf("Signal interrupt caught. Terminating...\n");
+	}
+
+	// Free memory. Connections still being forwarded
+	// simply end with the process.
+	listener_free(listener);
+	backend_stop();
+	return 0;
+}
+
+/*
+ * Main receiver loop.
+ *
+ * @return TRUE if loop should continue.
+ */
+int recv_loop(void)
+{
+	// Accept incoming connections
+	SOCKET csock = accept(listener->handle, 0, 0);
+	if (csock < 0)
+	{
+		// Failed to accept connection.
+		// Just continue listening.
+		return TRUE;
+	}
+
+	// Each connection gets a thread of its own, which
+	// does the handshake then the forwarding.
+	pthread_t thr;
+	if (pthread_create(&thr, 0, gateway_worker, (void*)(intptr_t)csock) != 0)
+	{
+		printf("Failed to create connection thread\n");
+		close(csock);
+		return TRUE;
+	}
+	pthread_detach(thr);
+	return TRUE;
+}
+
+/*
+ * Hand a client's first packet on to a server, and
+ * pass back its answer. A P_HELLO has its room
+ * renumbered to the gateway's numbering on the way.
+ *
+ * @param cos     Stream to the client.
+ * @param b       Index of the server.
+ * @param packet  P_JOIN, P_SPECTATE or P_RESUME.
+ * @param room    Room to join or watch on that server.
+ * @param token   Token to resume with, or that a
+ *                joining player had last time.
+ * @param tick    Tick to resume from.
+ * @param err     Set to the error if the client didn't
+ *                get in.
+ *
+ * @return the server's socket if the client got in,
+ *         otherwise -1 and nothing is sent to the client.
+ */
+static SOCKET gateway_hello(mp_ostream* const cos, unsigned b, enum mp_packet packet,
+	unsigned room, unsigned long long token, unsigned tick, enum mp_packet_err* err)
+{
+	*err = ERR_INTERNAL;
+	SOCKET s = backend_connect(backend_get(b));
+	if (s < 0)
+	{
+		return -1;
+	}
+
+	mp_ostream* os = ostream_new(s);
+	mp_istream* is = istream_new(s);
+	int ok = FALSE;
+	if (!os || !is)
+	{
+		goto fail;
+	}
+
+	ostream_begin(os, packet);
+	if (packet == P_RESUME)
+	{
+		owrite_u64(os, token);
+		owrite_u32(os, tick);
+	}
+	else
+	{
+		owrite_u16(os, (unsigned short)room);
+	}
+	if (packet == P_JOIN)
+	{
+		owrite_u64(os, token);
+	}
+	ostream_flush(os);
+
+	enum mp_packet res = iread_begin(is);
+	if (res == P_ERROR)
+	{
+		*err = iread_err(is);
+		goto fail;
+	}
+	if (res != P_HELLO)
+	{
+		goto fail;
+	}
+
+	// Read the whole P_HELLO before passing any of it on.
+	unsigned max = iread_u8(is);
+	unsigned idx = iread_u8(is);
+	unsigned w = iread_u16(is), h = iread_u16(is);
+	unsigned x = iread_u16(is), y = iread_u16(is);
+	unsigned join = iread_u16(is);
+	token = iread_u64(is);
+	room = iread_u16(is);
+	if (is->eof)
+	{
+		goto fail;
+	}
+	backend_remember(token, b);
+
+	ostream_begin(cos, P_HELLO);
+	owrite_u8(cos, (unsigned char)max);
+	owrite_u8(cos, (unsigned char)idx);
+	owrite_u16(cos, (unsigned short)w);
+	owrite_u16(cos, (unsigned short)h);
+	owrite_u16(cos, (unsigned short)x);
+	owrite_u16(cos, (unsigned short)y);
+	owrite_u16(cos, (unsigned short)join);
+	owrite_u64(cos, token);
+	owrite_u16(cos, (unsigned short)(room ? (room - 1) * backend_count() + b + 1 : 0));
+	ostream_flush(cos);
+	ok = TRUE;
+
+fail:
+	ostream_free(os);
+	istream_free(is);
+	if (!ok)
+	{
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+/*
+ * Get a new player into a server. A particular room
+ * can only be on the one server; otherwise the server
+ * that remembers the player from their last session is
+ * tried first, if we know it, then servers from the
+ * least loaded up.
+ *
+ * @return the server's socket, or -1.
+ */
+static SOCKET gateway_join(mp_ostream* const cos, unsigned room, unsigned long long token, enum mp_packet_err* err)
+{
+	unsigned count = backend_count();
+	if (room)
+	{
+		return gateway_hello(cos, (room - 1) % count, P_JOIN, (room - 1) / count + 1, token, 0, err);
+	}
+
+	*err = ERR_SERVER_FULL;
+	int first = token ? backend_recall(token) : -1;
+	if (first >= 0)
+	{
+		SOCKET s = gateway_hello(cos, first, P_JOIN, 0, token, 0, err);
+		if (s >= 0) return s;
+	}
+	for (unsigned n = 0; n < count; ++n)
+	{
+		int b = backend_pick();
+		if (b < 0) break;
+
+		SOCKET s = gateway_hello(cos, b, P_JOIN, 0, token, 0, err);
+		if (s >= 0) return s;
+	}
+	return -1;
+}
+
+/*
+ * Get a spectator into the room they want to watch,
+ * on the server it's on.
+ *
+ * @return the server's socket, or -1.
+ */
+static SOCKET gateway_spectate(mp_ostream* const cos, unsigned room, enum mp_packet_err* err)
+{
+	unsigned count = backend_count();
+	if (!room)
+	{
+		*err = ERR_NO_ROOM;
+		return -1;
+	}
+	return gateway_hello(cos, (room - 1) % count, P_SPECTATE, (room - 1) / count + 1, 0, 0, err);
+}
+
+/*
+ * Get a player back into their session, on whichever
+ * server it's on. The server it was started on is tried
+ * first if we remember it, then the rest.
+ *
+ * @return the server's socket, or -1.
+ */
+static SOCKET gateway_resume(mp_ostream* const cos, unsigned long long token, unsigned tick, enum mp_packet_err* err)
+{
+	int first = backend_recall(token);
+	if (first >= 0)
+	{
+		SOCKET s = gateway_hello(cos, first, P_RESUME, 0, token, tick, err);
+		if (s >= 0) return s;
+	}
+	for (unsigned b = 0; b < backend_count(); ++b)
+	{
+		if ((int)b == first || !atomic_load(&backend_get(b)->alive)) continue;
+		SOCKET s = gateway_hello(cos, b, P_RESUME, 0, token, tick, err);
+		if (s >= 0) return s;
+	}
+	*err = ERR_NO_SESSION;
+	return -1;
+}
+
+/*
+ * Tell a client how busy all the servers are put
+ * together.
+ */
+static void gateway_send_load(mp_ostream* const cos)
+{
+	unsigned players = 0, capacity = 0, rooms = 0, max_rooms = 0;
+	for (unsigned b = 0; b < backend_count(); ++b)
+	{
+		mp_backend* be = backend_get(b);
+		if (!atomic_load(&be->alive)) continue;
+		players += atomic_load(&be->players);
+		capacity += atomic_load(&be->capacity);
+		rooms += atomic_load(&be->rooms);
+		max_rooms += atomic_load(&be->max_rooms);
+	}
+	ostream_begin(cos, P_LOAD);
+	owrite_u32(cos, players);
+	owrite_u32(cos, capacity);
+	owrite_u16(cos, (unsigned short)(rooms < 0xFFFF ? rooms : 0xFFFF));
+	owrite_u16(cos, (unsigned short)(max_rooms < 0xFFFF ? max_rooms : 0xFFFF));
+	ostream_flush(cos);
+}
+
+/*
+ * Connection worker thread.
+ */
+void* gateway_worker(void* arg)
+{
+	SOCKET csock = (SOCKET)(intptr_t)arg;
+	SOCKET bsock = -1;
+	mp_istream* is = istream_new(csock);
+	mp_ostream* os = ostream_new(csock);
+	if (!is || !os)
+	{
+		goto done;
+	}
+
+	// Don't wait forever for them to say something.
+	struct timeval tv = { GATEWAY_HANDSHAKE_MS / 1000, (GATEWAY_HANDSHAKE_MS % 1000) * 1000 };
+	int opt = 1;
+	setsockopt(csock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(csock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+	// Their first packet says where they're going.
+	enum mp_packet_err err = ERR_SUCCESS;
+	enum mp_packet packet = iread_begin(is);
+	switch (packet)
+	{
+		case P_JOIN:
+		{
+			unsigned room = iread_u16(is);
+			unsigned long long token = iread_u64(is);
+			if (!is->eof) bsock = gateway_join(os, room, token, &err);
+		} break;
+
+		case P_SPECTATE:
+		{
+			unsigned room = iread_u16(is);
+			if (!is->eof) bsock = gateway_spectate(os, room, &err);
+		} break;
+
+		case P_RESUME:
+		{
+			unsigned long long token = iread_u64(is);
+			unsigned tick = iread_u32(is);
+			if (!is->eof) bsock = gateway_resume(os, token, tick, &err);
+		} break;
+
+		case P_STATUS:
+		{
+			gateway_send_load(os);
+		} break;
+
+		default:
+			break;
+	}
+	if (err != ERR_SUCCESS && bsock < 0)
+	{
+		ostream_begin(os, P_ERROR);
+		owrite_err(os, err);
+		ostream_flush(os);
+	}
+
+	// Then it's just a matter of passing things on.
+	if (bsock >= 0)
+	{
+		mp_forward_stats stats = { 0, 0 };
+		int ok = forward_run(csock, bsock, &stats);
+		printf("Connection %s after forwarding %llu bytes up, %llu down.\n",
+			ok ? "closed" : "dropped", stats.up, stats.down);
+		close(bsock);
+	}
+
+done:
+	ostream_free(os);
+	istream_free(is);
+	close(csock);
+	return 0;
+}
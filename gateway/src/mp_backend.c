@@ -0,0 +1,289 @@
+/*
+ * mp_backend.c
+ *
+ * The servers behind the gateway, and how busy
+ * each of them is.
+ */
+
+#include "pch.h"
+#include "mp_backend.h"
+
+// Most backends a gateway can have.
+#define BACKEND_MAX 64
+
+// Backends, in the order they were given.
+static mp_backend backends[BACKEND_MAX];
+static unsigned count = 0;
+
+// Load polling thread.
+static pthread_t poll_thr;
+static volatile int polling = FALSE;
+
+// Which backend each recent resume token came from.
+static unsigned long long tokens[BACKEND_TOKENS];
+static unsigned char token_backends[BACKEND_TOKENS];
+static pthread_mutex_t tokens_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Add a backend.
+ *
+ * @param spec  Backend's address, as "host:port". The
+ *              port defaults to PORT.
+ *
+ * @return FALSE if the address isn't valid, or there
+ *         are too many backends.
+ */
+int backend_add(const char* spec)
+{
+	if (count >= BACKEND_MAX || strlen(spec) >= sizeof(backends[0].name))
+	{
+		return FALSE;
+	}
+
+	mp_backend* b = &backends[count];
+	memset(b, 0, sizeof(mp_backend));
+	strcpy(b->name, spec);
+
+	// Split off the port.
+	char host[64];
+	strcpy(host, spec);
+	unsigned port = PORT;
+	char* colon = strchr(host, ':');
+	if (colon)
+	{
+		*colon = 0;
+		port = (unsigned)atoi(colon + 1);
+	}
+	if (strcmp(host, "localhost") == 0)
+	{
+		strcpy(host, "127.0.0.1");
+	}
+
+	b->addr.sin_family = AF_INET;
+	b->addr.sin_port = htons((unsigned short)port);
+	if (!port || port > 0xFFFF || inet_pton(AF_INET, host, &b->addr.sin_addr) != 1)
+	{
+		return FALSE;
+	}
+
+	++count;
+	return TRUE;
+}
+
+/*
+ * Get a backend.
+ *
+ * @param i  Index of the backend.
+ */
+mp_backend* backend_get(unsigned i)
+{
+	return &backends[i];
+}
+
+/*
+ * @return the number of backends.
+ */
+unsigned backend_count(void)
+{
+	return count;
+}
+
+/*
+ * Open a connection to a backend. The socket has
+ * BACKEND_TIMEOUT_MS timeouts on connecting and on
+ * each blocking read and write.
+ *
+ * @param b  Backend to connect to.
+ *
+ * @return the socket, or -1 on failure.
+ */
+SOCKET backend_connect(mp_backend* const b)
+{
+	SOCKET s = socket(AF_INET, SOCK_STREAM, 0);
+	if (s < 0)
+	{
+		return -1;
+	}
+
+	struct timeval tv = { BACKEND_TIMEOUT_MS / 1000, (BACKEND_TIMEOUT_MS % 1000) * 1000 };
+	int opt = 1;
+	setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+	if (connect(s, (struct sockaddr*)&b->addr, sizeof(b->addr)) != 0)
+	{
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+/*
+ * Ask a backend for its load.
+ *
+ * @param b  Backend to ask.
+ */
+static void backend_poll(mp_backend* const b)
+{
+	int ok = FALSE;
+	SOCKET s = backend_connect(b);
+	if (s >= 0)
+	{
+		mp_ostream* os = ostream_new(s);
+		mp_istream* is = istream_new(s);
+		if (os && is)
+		{
+			ostream_begin(os, P_STATUS);
+			ostream_flush(os);
+			if (iread_begin(is) == P_LOAD)
+			{
+				unsigned players = iread_u32(is);
+				unsigned capacity = iread_u32(is);
+				unsigned rooms = iread_u16(is);
+				unsigned max_rooms = iread_u16(is);
+				if (!is->eof)
+				{
+					atomic_store(&b->players, players);
+					atomic_store(&b->capacity, capacity);
+					atomic_store(&b->rooms, rooms);
+					atomic_store(&b->max_rooms, max_rooms);
+					atomic_store(&b->routed, 0);
+					ok = TRUE;
+				}
+			}
+		}
+		ostream_free(os);
+		istream_free(is);
+		close(s);
+	}
+
+	if (ok != atomic_load(&b->alive))
+	{
+		printf("Backend %s is %s.\n", b->name, ok ? "up" : "down");
+	}
+	atomic_store(&b->alive, ok);
+}
+
+/*
+ * Load polling thread.
+ */
+static void* backend_worker(void* arg)
+{
+	(void)arg;
+	unsigned long long next = time_now_ns();
+	while (polling)
+	{
+		next += BACKEND_POLL_MS * NS_PER_MS;
+		time_sleep_until_ns(next);
+		for (unsigned i = 0; i < count && polling; ++i)
+		{
+			backend_poll(&backends[i]);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Poll every backend once, then keep polling them in
+ * the background.
+ *
+ * @return FALSE if the polling thread couldn't start.
+ */
+int backend_start(void)
+{
+	for (unsigned i = 0; i < count; ++i)
+	{
+		backend_poll(&backends[i]);
+	}
+
+	polling = TRUE;
+	if (pthread_create(&poll_thr, 0, backend_worker, 0) != 0)
+	{
+		polling = FALSE;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Stop polling backends.
+ */
+void backend_stop(void)
+{
+	if (!polling) return;
+	polling = FALSE;
+	pthread_join(poll_thr, 0);
+}
+
+/*
+ * Choose the backend to send a new player to: the one
+ * that's least full, for its size, out of those that
+ * are up and have space.
+ *
+ * @return the backend's index, or -1 if they're all
+ *         full or down.
+ */
+int backend_pick(void)
+{
+	int best = -1;
+	unsigned long long best_load = 0, best_cap = 1;
+	for (unsigned i = 0; i < count; ++i)
+	{
+		mp_backend* b = &backends[i];
+		if (!atomic_load(&b->alive)) continue;
+
+		unsigned long long load = atomic_load(&b->players) + atomic_load(&b->routed);
+		unsigned long long cap = atomic_load(&b->capacity);
+		if (load >= cap) continue;
+
+		// load / cap < best_load / best_cap
+		if (best == -1 || load * best_cap < best_load * cap)
+		{
+			best = i;
+			best_load = load;
+			best_cap = cap;
+		}
+	}
+	if (best != -1)
+	{
+		atomic_fetch_add(&backends[best].routed, 1);
+	}
+	return best;
+}
+
+/*
+ * Remember which backend a session is on, so that
+ * resuming it goes straight there.
+ *
+ * @param token  Session's resume token.
+ * @param i      Index of the backend.
+ */
+void backend_remember(unsigned long long token, unsigned i)
+{
+	unsigned slot = (unsigned)(token ^ (token >> 32)) & (BACKEND_TOKENS - 1);
+	pthread_mutex_lock(&tokens_lock);
+	tokens[slot] = token;
+	token_backends[slot] = (unsigned char)i;
+	pthread_mutex_unlock(&tokens_lock);
+}
+
+/*
+ * Find which backend a session is on.
+ *
+ * @param token  Session's resume token.
+ *
+ * @return the backend's index, or -1 if it's been
+ *         forgotten.
+ */
+int backend_recall(unsigned long long token)
+{
+	unsigned slot = (unsigned)(token ^ (token >> 32)) & (BACKEND_TOKENS - 1);
+	int i = -1;
+	pthread_mutex_lock(&tokens_lock);
+	if (tokens[slot] == token)
+	{
+		i = token_backends[slot];
+	}
+	pthread_mutex_unlock(&tokens_lock);
+	return i;
+}
@@ -0,0 +1,53 @@
+#ifndef MP_BACKEND_H
+#define MP_BACKEND_H
+
+// How often backends are asked for their load, and
+// how long they have to answer.
+#define BACKEND_POLL_MS 1000
+#define BACKEND_TIMEOUT_MS 500
+
+// Size of the table remembering which backend each
+// resume token belongs to. (Power of two)
+#define BACKEND_TOKENS 4096
+
+/*
+ * A server the gateway sends players to.
+ *
+ * Load is what the server last reported with P_LOAD,
+ * plus however many players the gateway has sent it
+ * since, so that a burst of joins between reports is
+ * still spread out.
+ */
+typedef struct mp_backend
+{
+	// "host:port", for messages.
+	char name[64];
+	struct sockaddr_in addr;
+
+	// Whether it answered the last poll.
+	atomic_int alive;
+
+	// Players in it, and the most it can take.
+	atomic_uint players, capacity;
+
+	// Rooms open in it, and the most it can open.
+	atomic_uint rooms, max_rooms;
+
+	// Players sent to it since the last report.
+	atomic_uint routed;
+} mp_backend;
+
+// Setup
+int backend_add(const char*);
+mp_backend* backend_get(unsigned);
+unsigned backend_count(void);
+int backend_start(void);
+void backend_stop(void);
+
+// Routing
+int backend_pick(void);
+SOCKET backend_connect(mp_backend* const);
+void backend_remember(unsigned long long, unsigned);
+int backend_recall(unsigned long long);
+
+#endif
@@ -0,0 +1,134 @@
+/*
+ * mp_forward.c
+ *
+ * Forwarding of traffic between a client and its
+ * backend, without copying it through userspace.
+ */
+
+#include "pch.h"
+#include "mp_forward.h"
+
+/*
+ * One direction of a connection. Data is spliced from
+ * the source socket into a pipe, then from the pipe
+ * into the destination socket, so it never leaves the
+ * kernel.
+ */
+typedef struct mp_pipe
+{
+	SOCKET from, to;
+	int fds[2];
+
+	// Bytes in the pipe waiting to be sent on.
+	size_t queued;
+
+	// Set once the source has closed.
+	int eof;
+
+	// Where to count what's been sent.
+	unsigned long long* bytes;
+} mp_pipe;
+
+// Pull whatever has arrived into the pipe.
+static int pipe_fill(mp_pipe* const p)
+{
+	ssize_t n = splice(p->from, 0, p->fds[1], 0, FORWARD_CHUNK - p->queued, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (n > 0)
+	{
+		p->queued += n;
+		return TRUE;
+	}
+	if (n == 0)
+	{
+		p->eof = TRUE;
+		return TRUE;
+	}
+	return errno == EAGAIN || errno == EINTR;
+}
+
+// Push as much of the pipe on as will go.
+static int pipe_drain(mp_pipe* const p)
+{
+	ssize_t n = splice(p->fds[0], 0, p->to, 0, p->queued, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (n > 0)
+	{
+		p->queued -= n;
+		*p->bytes += n;
+		return TRUE;
+	}
+	return n < 0 && (errno == EAGAIN || errno == EINTR);
+}
+
+// Events to wait for on a socket, given the pipe
+// reading from it and the one writing to it.
+static short pipe_events(const mp_pipe* const in, const mp_pipe* const out)
+{
+	short events = 0;
+	if (!in->eof && in->queued < FORWARD_CHUNK) events |= POLLIN;
+	if (out->queued) events |= POLLOUT;
+	return events;
+}
+
+/*
+ * Forward traffic both ways between a client and a
+ * backend until either end closes. Anything already
+ * on its way when one end closes is still delivered
+ * to the other. Both sockets are made non-blocking.
+ *
+ * @param client   Client's socket.
+ * @param backend  Backend's socket.
+ * @param stats    Bytes forwarded each way are added
+ *                 to this.
+ *
+ * @return FALSE if forwarding couldn't be set up, or
+ *         either connection failed.
+ */
+int forward_run(SOCKET client, SOCKET backend, mp_forward_stats* const stats)
+{
+	mp_pipe up = { client, backend, { -1, -1 }, 0, FALSE, &stats->up };
+	mp_pipe down = { backend, client, { -1, -1 }, 0, FALSE, &stats->down };
+	int ok = FALSE;
+	if (pipe2(up.fds, O_NONBLOCK) != 0 || pipe2(down.fds, O_NONBLOCK) != 0)
+	{
+		goto fail;
+	}
+	fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+	fcntl(backend, F_SETFL, fcntl(backend, F_GETFL) | O_NONBLOCK);
+
+	ok = TRUE;
+	while (ok && !(up.eof && !up.queued) && !(down.eof && !down.queued))
+	{
+		struct pollfd pfd[2] =
+		{
+			{ client, pipe_events(&up, &down), 0 },
+			{ backend, pipe_events(&down, &up), 0 },
+		};
+		if (poll(pfd, 2, -1) < 0)
+		{
+			ok = errno == EINTR;
+			continue;
+		}
+		if ((pfd[0].revents | pfd[1].revents) & (POLLERR | POLLNVAL))
+		{
+			ok = FALSE;
+			break;
+		}
+
+		// A hangup still has to be read to find the end.
+		if (pfd[0].revents & (POLLIN | POLLHUP) && pfd[0].events & POLLIN) ok = pipe_fill(&up);
+		if (ok && pfd[1].revents & (POLLIN | POLLHUP) && pfd[1].events & POLLIN) ok = pipe_fill(&down);
+
+		// Send straight on rather than waiting to be told
+		// there's room; there nearly always is.
+		if (ok && up.queued) ok = pipe_drain(&up);
+		if (ok && down.queued) ok = pipe_drain(&down);
+	}
+
+fail:
+	for (unsigned i = 0; i < 2; ++i)
+	{
+		if (up.fds[i] >= 0) close(up.fds[i]);
+		if (down.fds[i] >= 0) close(down.fds[i]);
+	}
+	return ok;
+}
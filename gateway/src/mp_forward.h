@@ -0,0 +1,18 @@
+#ifndef MP_FORWARD_H
+#define MP_FORWARD_H
+
+// Most bytes moved by one splice, and the most left
+// sitting in a pipe before we stop reading into it.
+#define FORWARD_CHUNK (64 * 1024)
+
+/*
+ * Bytes forwarded over a connection, each way.
+ */
+typedef struct mp_forward_stats
+{
+	unsigned long long up, down;
+} mp_forward_stats;
+
+int forward_run(SOCKET, SOCKET, mp_forward_stats* const);
+
+#endif
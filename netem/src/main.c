@@ -0,0 +1,270 @@
+/*
+ * main.c
+ *
+ * Main translation unit of the network emulator.
+ *
+ * The emulator sits between clients and a server on
+ * the same machine, and puts the traffic each way
+ * through an emulated link: delay, jitter, loss,
+ * reordering and a limited rate, so netcode can be
+ * tried against a bad connection without needing tc
+ * or root. Each packet's timing can be logged, and a
+ * given seed always gives the same conditions.
+ */
+
+#include "pch.h"
+#include "mp_link.h"
+#include "mp_proxy.h"
+
+// Time to wait for the server to take a connection.
+#define NETEM_CONNECT_MS 5000
+
+// For signal interupt handler.
+static volatile sig_atomic_t signal_interrupt_caught = 0;
+void signal_interrupt_handler(int param)
+{
+	(void)param;
+	signal_interrupt_caught = 1;
+}
+
+/*
+ * A connection waiting for its thread to pick it up.
+ */
+typedef struct netem_conn
+{
+	unsigned id;
+	SOCKET sock;
+} netem_conn;
+
+// Variables
+static mp_listener* listener;
+static unsigned port = PORT;
+static struct sockaddr_in server_addr;
+static mp_link_conf conf;
+static unsigned long long seed = 1;
+static unsigned next_id = 1;
+
+// Function prototypes.
+int recv_loop(void);
+void* netem_worker(void*);
+
+/*
+ * Print command line usage.
+ */
+static void usage(const char* name)
+{
+	printf("Usage: %s [-p port] [-d delay_ms] [-j jitter_ms] [-D dist] [-l loss_%%] [-o reorder_%%] [-b kbit/s] [-s seed] [-L log_file] server[:port]\n", name);
+	printf("  -p port  Port to listen on. (default %u)\n", PORT);
+	printf("  -d ms    Delay each way. (default 0)\n");
+	printf("  -j ms    How much the delay varies. (default 0)\n");
+	printf("  -D dist  How it varies: uniform, normal or pareto.\n");
+	printf("           (default uniform)\n");
+	printf("  -l %%     Packets lost, and so late by a resend.\n");
+	printf("  -o %%     Packets that jump the queue.\n");
+	printf("  -b n     Most kbit/s each way. (default: no limit)\n");
+	printf("  -s seed  Seed for the randomness. (default %llu)\n", seed);
+	printf("  -L file  Log every packet's timing to file.\n");
+}
+
+// Parse the server's address, as "host:port".
+static int netem_server(const char* spec)
+{
+	char host[64];
+	if (strlen(spec) >= sizeof(host))
+	{
+		return FALSE;
+	}
+	strcpy(host, spec);
+	unsigned sport = PORT;
+	char* colon = strchr(host, ':');
+	if (colon)
+	{
+		*colon = 0;
+		sport = (unsigned)atoi(colon + 1);
+	}
+	if (strcmp(host, "localhost") == 0)
+	{
+		strcpy(host, "127.0.0.1");
+	}
+
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons((unsigned short)sport);
+	return sport && sport <= 0xFFFF && inet_pton(AF_INET, host, &server_addr.sin_addr) == 1;
+}
+
+/*
+ * Entry point of the program.
+ *
+ * @return status. 0 on normal termination.
+ */
+int main(int argc, char** argv)
+{
+	// Parse options.
+	const char* log_path = 0;
+	const char* dist = "uniform";
+	double delay_ms = 0, jitter_ms = 0, loss = 0, reorder = 0;
+	unsigned kbps = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "p:d:j:D:l:o:b:s:L:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'p': port = (unsigned)atoi(optarg); break;
+			case 'd': delay_ms = atof(optarg); break;
+			case 'j': jitter_ms = atof(optarg); break;
+			case 'D': dist = optarg; break;
+			case 'l': loss = atof(optarg); break;
+			case 'o': reorder = atof(optarg); break;
+			case 'b': kbps = (unsigned)atoi(optarg); break;
+			case 's': seed = strtoull(optarg, 0, 10); break;
+			case 'L': log_path = optarg; break;
+			default:
+			{
+				usage(argv[0]);
+				return opt == 'h' ? 0 : -1;
+			}
+		}
+	}
+
+	if (strcmp(dist, "uniform") == 0) conf.dist = LINK_UNIFORM;
+	else if (strcmp(dist, "normal") == 0) conf.dist = LINK_NORMAL;
+	else if (strcmp(dist, "pareto") == 0) conf.dist = LINK_PARETO;
+	else dist = 0;
+	if (optind != argc - 1 || !port || port > 0xFFFF || !dist ||
+		delay_ms < 0 || jitter_ms < 0 || loss < 0 || loss > 100 || reorder < 0 || reorder > 100)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+	if (!netem_server(argv[optind]))
+	{
+		printf("Bad server address %s\n", argv[optind]);
+		return -1;
+	}
+	conf.delay = (unsigned long long)(delay_ms * NS_PER_MS);
+	conf.jitter = (unsigned long long)(jitter_ms * NS_PER_MS);
+	conf.loss = loss / 100;
+	conf.reorder = reorder / 100;
+	conf.rate = (unsigned long long)kbps * 1000;
+
+	printf("-- Simple Game Network Emulator --\n");
+
+	// Register signal interrupt handler. Writing to
+	// connections that have gone shouldn't kill us.
+	struct sigaction sigact_inter;
+	memset(&sigact_inter, 0, sizeof(sigact_inter));
+	sigact_inter.sa_handler = signal_interrupt_handler;
+	sigaction(SIGINT, &sigact_inter, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (!proxy_init(log_path))
+	{
+		printf("Failed to open packet log %s\n", log_path);
+		return -1;
+	}
+
+	// Start listening. Load tests tend to connect all
+	// at once, so allow a long backlog.
+	if (!(listener = listener_new((unsigned short)port, SOMAXCONN)))
+	{
+		printf("Failed to listen on port %u: %s\n", port, strerror(errno));
+		proxy_deinit();
+		return -1;
+	}
+	printf("Forwarding port %u to %s with %.1f ms (%s, +-%.1f ms) delay, %.1f%% loss, %.1f%% reordering",
+		port, argv[optind], delay_ms, dist, jitter_ms, loss, reorder);
+	if (kbps) printf(", %u kbit/s", kbps);
+	printf("...\n");
+
+	// Accept connections until we're told to stop.
+	while (!signal_interrupt_caught)
+	{
+		struct pollfd pfd = { listener->handle, POLLIN, 0 };
+		if (poll(&pfd, 1, 1000) > 0 && !recv_loop())
+		{
+			break;
+		}
+	}
+
+	if (signal_interrupt_caught)
+	{
+		printf("Signal interrupt caught. Terminating...\n");
+	}
+
+	// Free memory. Connections still being forwarded
+	// simply end with the process.
+	listener_free(listener);
+	proxy_deinit();
+	return 0;
+}
+
+/*
+ * Main receiver loop.
+ *
+ * @return TRUE if loop should continue.
+ */
+int recv_loop(void)
+{
+	// Accept incoming connections
+	SOCKET csock = accept(listener->handle, 0, 0);
+	if (csock < 0)
+	{
+		// Failed to accept connection.
+		// Just continue listening.
+		return TRUE;
+	}
+
+	// Each connection gets a thread of its own.
+	netem_conn* c = malloc(sizeof(netem_conn));
+	pthread_t thr;
+	if (!c)
+	{
+		close(csock);
+		return TRUE;
+	}
+	c->id = next_id++;
+	c->sock = csock;
+	if (pthread_create(&thr, 0, netem_worker, c) != 0)
+	{
+		printf("Failed to create connection thread\n");
+		close(csock);
+		free(c);
+		return TRUE;
+	}
+	pthread_detach(thr);
+	return TRUE;
+}
+
+/*
+ * Connection worker thread. Connects to the server,
+ * then passes traffic through the link until either
+ * end closes.
+ */
+void* netem_worker(void* arg)
+{
+	netem_conn c = *(netem_conn*)arg;
+	free(arg);
+
+	SOCKET ssock = socket(AF_INET, SOCK_STREAM, 0);
+	if (ssock < 0)
+	{
+		close(c.sock);
+		return 0;
+	}
+	struct timeval tv = { NETEM_CONNECT_MS / 1000, (NETEM_CONNECT_MS % 1000) * 1000 };
+	setsockopt(ssock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if (connect(ssock, (struct sockaddr*)&server_addr, sizeof(server_addr)) != 0)
+	{
+		printf("Connection %u couldn't reach the server.\n", c.id);
+		close(ssock);
+		close(c.sock);
+		return 0;
+	}
+
+	// Connection n gets the same randomness each run.
+	int ok = proxy_run(c.id, c.sock, ssock, &conf, seed * 0x10000 + c.id);
+	printf("Connection %u %s.\n", c.id, ok ? "closed" : "dropped");
+	close(ssock);
+	close(c.sock);
+	return 0;
+}
@@ -0,0 +1,125 @@
+/*
+ * mp_link.c
+ *
+ * A model of a network link: how long each packet
+ * given to it takes to come out the other end.
+ */
+
+#include "pch.h"
+#include "mp_link.h"
+
+// Next random number from a link, in [0, 1).
+// (splitmix64)
+static double link_random(mp_link* const l)
+{
+	unsigned long long z = (l->rng += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	z ^= z >> 31;
+	return (double)(z >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Whether something with the given chance happens.
+static int link_chance(mp_link* const l, double p)
+{
+	return p > 0 && link_random(l) < p;
+}
+
+// Time a packet spends in flight, once it's on the
+// wire. (ns)
+static unsigned long long link_delay(mp_link* const l)
+{
+	const mp_link_conf* c = l->conf;
+	double d = (double)c->delay;
+	double j = (double)c->jitter;
+	if (j > 0)
+	{
+		switch (c->dist)
+		{
+			case LINK_UNIFORM:
+			{
+				d += j * (2 * link_random(l) - 1);
+			} break;
+
+			case LINK_NORMAL:
+			{
+				double u = 1 - link_random(l);
+				d += j * sqrt(-2 * log(u)) * cos(2 * M_PI * link_random(l));
+			} break;
+
+			case LINK_PARETO:
+			{
+				double u = 1 - link_random(l);
+				d += j * (pow(u, -1 / LINK_PARETO_SHAPE) - 1) * (LINK_PARETO_SHAPE - 1);
+			} break;
+		}
+	}
+	return d > 0 ? (unsigned long long)d : 0;
+}
+
+/*
+ * Set up one direction of a link.
+ *
+ * @param l     Link to set up.
+ * @param conf  Conditions on it. (Not copied)
+ * @param seed  Seed for its randomness.
+ */
+void link_init(mp_link* const l, const mp_link_conf* const conf, unsigned long long seed)
+{
+	l->conf = conf;
+	l->rng = seed;
+	l->busy_until = 0;
+	l->last_release = 0;
+}
+
+/*
+ * Send a packet over a link. It waits for the link to
+ * be free, takes as long as the rate allows to go onto
+ * it, then is delayed. Like on TCP, packets come out in
+ * the order they went in, so one held up holds up
+ * everything behind it; a lost one only comes out once
+ * it's been sent again. Packets that may be reordered
+ * can instead jump the queue, skipping the delay
+ * without holding anything up.
+ *
+ * @param l            Link to send over.
+ * @param now          Time the packet arrived. (ns)
+ * @param len          Bytes in the packet.
+ * @param may_reorder  Non-zero if the packet may jump
+ *                     the queue.
+ * @param flags        Set to LINK_LOST and/or
+ *                     LINK_REORDERED.
+ *
+ * @return the time the packet comes out. (ns)
+ */
+unsigned long long link_send(mp_link* const l, unsigned long long now, size_t len, int may_reorder, unsigned* const flags)
+{
+	const mp_link_conf* c = l->conf;
+	*flags = 0;
+
+	unsigned long long start = now > l->busy_until ? now : l->busy_until;
+	l->busy_until = start;
+	if (c->rate)
+	{
+		l->busy_until += (unsigned long long)len * 8 * NS_PER_SEC / c->rate;
+	}
+
+	if (may_reorder && link_chance(l, c->reorder))
+	{
+		*flags |= LINK_REORDERED;
+		return l->busy_until;
+	}
+
+	unsigned long long release = l->busy_until + link_delay(l);
+	if (link_chance(l, c->loss))
+	{
+		*flags |= LINK_LOST;
+		release += LINK_RETRANSMIT_MS * NS_PER_MS + link_delay(l);
+	}
+	if (release < l->last_release)
+	{
+		release = l->last_release;
+	}
+	l->last_release = release;
+	return release;
+}
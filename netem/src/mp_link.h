@@ -0,0 +1,72 @@
+#ifndef MP_LINK_H
+#define MP_LINK_H
+
+// Extra time a lost packet takes to get through, for
+// the sender to notice and send it again. (The
+// shortest retransmission timeout Linux's TCP uses)
+#define LINK_RETRANSMIT_MS 200
+
+// Shape of the pareto delay's tail. Lower is heavier.
+#define LINK_PARETO_SHAPE 3.0
+
+// Flags for what happened to a packet on a link.
+#define LINK_LOST 1
+#define LINK_REORDERED 2
+
+/*
+ * How the random part of a link's delay is spread.
+ */
+enum mp_link_dist
+{
+	// Anywhere within jitter either side of the delay.
+	LINK_UNIFORM,
+
+	// Around the delay, jitter being the standard
+	// deviation.
+	LINK_NORMAL,
+
+	// Never under the delay, with a long tail of
+	// spikes. Jitter is the average extra.
+	LINK_PARETO,
+};
+
+/*
+ * Conditions on an emulated link, the same each way.
+ */
+typedef struct mp_link_conf
+{
+	// One-way delay, and how much it varies. (ns)
+	unsigned long long delay, jitter;
+	enum mp_link_dist dist;
+
+	// Chance of a packet being lost, and of it jumping
+	// the queue. (0 to 1)
+	double loss, reorder;
+
+	// Most bits a second the link carries, or 0 for no
+	// limit.
+	unsigned long long rate;
+} mp_link_conf;
+
+/*
+ * One direction of an emulated link.
+ */
+typedef struct mp_link
+{
+	const mp_link_conf* conf;
+
+	// Random state. Seeded per link, so the same seed
+	// gives the same run.
+	unsigned long long rng;
+
+	// When the link has finished putting everything
+	// given to it on the wire, and when the last packet
+	// that kept its place comes out the other end. (ns)
+	unsigned long long busy_until;
+	unsigned long long last_release;
+} mp_link;
+
+void link_init(mp_link* const, const mp_link_conf* const, unsigned long long);
+unsigned long long link_send(mp_link* const, unsigned long long, size_t, int, unsigned* const);
+
+#endif
@@ -0,0 +1,436 @@
+/*
+ * mp_proxy.c
+ *
+ * Passing a connection's traffic through an emulated
+ * link each way. Traffic is split into the game's
+ * packets as it arrives, and each packet is held back
+ * until the link says it comes out.
+ */
+
+#include "pch.h"
+#include "mp_link.h"
+#include "mp_proxy.h"
+
+/*
+ * A packet being held back.
+ */
+typedef struct mp_held
+{
+	struct mp_held* next;
+
+	// When it arrived, and when it's due out. (ns)
+	unsigned long long arrived, release;
+
+	// What happened to it on the link. (LINK_*)
+	unsigned flags;
+
+	// Packet type, or P_UNKNOWN if we lost track of
+	// where packets start.
+	enum mp_packet type;
+
+	// Bytes in it, and bytes of those sent on so far.
+	unsigned len, sent;
+	unsigned char data[];
+} mp_held;
+
+/*
+ * One direction of a connection.
+ */
+typedef struct mp_flow
+{
+	SOCKET from, to;
+
+	// "up" (client to server) or "down".
+	const char* name;
+	int up;
+
+	mp_link link;
+
+	// What's been read but isn't a whole packet yet.
+	unsigned char buf[PROXY_READ_BYTES];
+	unsigned buf_len;
+
+	// Set if something arrived we couldn't find the end
+	// of; from then on, whatever arrives goes through as
+	// it comes.
+	int raw;
+
+	// Packets held back, by when they're due out.
+	mp_held* head;
+	mp_held* tail;
+	size_t queued;
+
+	// Set once the sender has closed.
+	int eof;
+
+	// Totals, for when the connection closes.
+	unsigned packets, lost, reordered;
+	unsigned long long held_ns, held_max;
+} mp_flow;
+
+// Per-packet log, if we're keeping one, and when we
+// started. (Log times are from then)
+static FILE* log_file = 0;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long start_ns;
+
+/*
+ * Get ready to run connections.
+ *
+ * @param log_path  File to log each packet to, or 0
+ *                  not to.
+ *
+ * @return FALSE if the log couldn't be opened.
+ */
+int proxy_init(const char* log_path)
+{
+	start_ns = time_now_ns();
+	if (!log_path)
+	{
+		return TRUE;
+	}
+	if (!(log_file = fopen(log_path, "w")))
+	{
+		return FALSE;
+	}
+	fprintf(log_file, "conn,dir,type,bytes,arrived_ms,sent_ms,held_ms,flags\n");
+	return TRUE;
+}
+
+/*
+ * Finish off the packet log. Connections still running
+ * log nothing more.
+ */
+void proxy_deinit(void)
+{
+	pthread_mutex_lock(&log_lock);
+	if (log_file)
+	{
+		fclose(log_file);
+		log_file = 0;
+	}
+	pthread_mutex_unlock(&log_lock);
+}
+
+// Bytes in the packet at the start of a buffer.
+//
+// @return its length, 0 if it hasn't all arrived yet,
+//         or -1 if it isn't a packet we know.
+static int proxy_frame(int up, const unsigned char* b, unsigned len)
+{
+	if (!len)
+	{
+		return 0;
+	}
+
+	int need = -1;
+	if (up)
+	{
+		switch ((enum mp_packet)b[0])
+		{
+			case P_DISCONN:
+			case P_HEARTBEAT:
+			case P_STATUS: need = 1; break;
+			case P_INPUT: need = len < 2 ? 2 : 2 + 4 * b[1]; break;
+			case P_PONG: need = 25; break;
+			case P_JOIN: need = 11; break;
+			case P_SPECTATE: need = 3; break;
+			case P_RESUME: need = 13; break;
+			default: break;
+		}
+	}
+	else
+	{
+		switch ((enum mp_packet)b[0])
+		{
+			case P_ERROR: need = 2; break;
+			case P_HELLO: need = 23; break;
+			case P_UPDATE:
+			{
+				// Then the gone players after the moved ones.
+				need = 8;
+				if (len >= 8) need = 9 + 5 * b[7];
+				if (len >= (unsigned)need) need += b[need - 1];
+			} break;
+			case P_PING: need = 9; break;
+			case P_JOIN_CHUNK: need = len < 2 ? 2 : 2 + 5 * b[1]; break;
+			case P_MAP_CHUNK: need = 5 + MAP_CHUNK_TILES; break;
+			case P_LOAD: need = 13; break;
+			default: break;
+		}
+	}
+	return need < 0 ? -1 : len >= (unsigned)need ? need : 0;
+}
+
+// Whether a packet stands on its own, so it means
+// the same whatever order it arrives in. Updates
+// don't: each is a delta the client applies in the
+// order it gets them.
+static int proxy_reorderable(enum mp_packet type)
+{
+	return type == P_INPUT || type == P_HEARTBEAT || type == P_PONG ||
+		type == P_PING;
+}
+
+// Put a packet on the link, and hold it back until
+// it comes out.
+static int proxy_hold(mp_flow* const f, const unsigned char* data, unsigned len, unsigned long long now)
+{
+	mp_held* p = malloc(sizeof(mp_held) + len);
+	if (!p)
+	{
+		return FALSE;
+	}
+	p->next = 0;
+	p->arrived = now;
+	p->type = f->raw ? P_UNKNOWN : (enum mp_packet)data[0];
+	p->len = len;
+	p->sent = 0;
+	memcpy(p->data, data, len);
+	p->release = link_send(&f->link, now, len, !f->raw && proxy_reorderable(p->type), &p->flags);
+
+	// Nearly everything goes on the end; only packets
+	// jumping the queue go anywhere else.
+	if (!f->tail || f->tail->release <= p->release)
+	{
+		if (f->tail) f->tail->next = p;
+		else f->head = p;
+		f->tail = p;
+	}
+	else if (f->head->release > p->release)
+	{
+		p->next = f->head;
+		f->head = p;
+	}
+	else
+	{
+		mp_held* at = f->head;
+		while (at->next->release <= p->release)
+		{
+			at = at->next;
+		}
+		p->next = at->next;
+		at->next = p;
+	}
+	f->queued += len;
+	return TRUE;
+}
+
+// Read whatever has arrived, and hold back each whole
+// packet in it.
+static int proxy_fill(mp_flow* const f, unsigned long long now)
+{
+	ssize_t n = recv(f->from, f->buf + f->buf_len, sizeof(f->buf) - f->buf_len, MSG_DONTWAIT);
+	if (n < 0)
+	{
+		return errno == EAGAIN || errno == EINTR;
+	}
+	if (n == 0)
+	{
+		// Anything left over still goes through.
+		f->eof = TRUE;
+		f->raw = TRUE;
+	}
+	f->buf_len += n;
+
+	unsigned pos = 0;
+	while (pos < f->buf_len)
+	{
+		int len = f->raw ? (int)(f->buf_len - pos) : proxy_frame(f->up, f->buf + pos, f->buf_len - pos);
+		if (len < 0)
+		{
+			printf("Unknown packet %u going %s; passing the rest straight through.\n", f->buf[pos], f->name);
+			f->raw = TRUE;
+			continue;
+		}
+		if (!len)
+		{
+			break;
+		}
+		if (!proxy_hold(f, f->buf + pos, len, now))
+		{
+			return FALSE;
+		}
+		pos += len;
+	}
+	memmove(f->buf, f->buf + pos, f->buf_len - pos);
+	f->buf_len -= pos;
+	return TRUE;
+}
+
+// Log a packet that has been sent on.
+static void proxy_log(unsigned id, const mp_flow* const f, const mp_held* const p, unsigned long long now)
+{
+	pthread_mutex_lock(&log_lock);
+	if (log_file)
+	{
+		const char* flags = p->flags & LINK_LOST ? "lost" : p->flags & LINK_REORDERED ? "reordered" : "-";
+		fprintf(log_file, "%u,%s,%u,%u,%.3f,%.3f,%.3f,%s\n", id, f->name, p->type, p->len,
+			(double)(p->arrived - start_ns) / NS_PER_MS, (double)(now - start_ns) / NS_PER_MS,
+			(double)(now - p->arrived) / NS_PER_MS, flags);
+	}
+	pthread_mutex_unlock(&log_lock);
+}
+
+// Send on every packet that's due.
+//
+// @return FALSE if the connection failed.
+static int proxy_flush(unsigned id, mp_flow* const f, unsigned long long now)
+{
+	while (f->head && f->head->release <= now)
+	{
+		mp_held* p = f->head;
+		ssize_t n = send(f->to, p->data + p->sent, p->len - p->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0)
+		{
+			return errno == EAGAIN || errno == EINTR;
+		}
+		p->sent += n;
+		if (p->sent < p->len)
+		{
+			continue;
+		}
+
+		// Time is counted from arriving to being sent on,
+		// which is what whoever's at the other end sees.
+		unsigned long long held = now - p->arrived;
+		proxy_log(id, f, p, now);
+		f->packets++;
+		f->lost += (p->flags & LINK_LOST) != 0;
+		f->reordered += (p->flags & LINK_REORDERED) != 0;
+		f->held_ns += held;
+		if (held > f->held_max) f->held_max = held;
+
+		f->head = p->next;
+		if (!f->head) f->tail = 0;
+		f->queued -= p->len;
+		free(p);
+	}
+	return TRUE;
+}
+
+// Events to wait for on a socket, given the flow
+// reading from it and the one writing to it.
+static short proxy_events(const mp_flow* const in, const mp_flow* const out, unsigned long long now)
+{
+	short events = 0;
+	if (!in->eof && in->queued < PROXY_QUEUE_BYTES) events |= POLLIN;
+	if (out->head && out->head->release <= now) events |= POLLOUT;
+	return events;
+}
+
+// Print what happened to a flow.
+static void proxy_report(unsigned id, const mp_flow* const f)
+{
+	printf("Connection %u %s: %u packets, %u lost, %u reordered, held %.1f ms on average, %.1f ms at most.\n",
+		id, f->name, f->packets, f->lost, f->reordered,
+		f->packets ? (double)f->held_ns / f->packets / NS_PER_MS : 0.0,
+		(double)f->held_max / NS_PER_MS);
+}
+
+/*
+ * Pass traffic both ways between a client and a server
+ * over an emulated link, until either end closes.
+ * Anything on its way when one end closes is still
+ * delivered to the other. Both sockets are left
+ * non-blocking.
+ *
+ * @param id      Connection's number, for the log.
+ * @param client  Client's socket.
+ * @param server  Server's socket.
+ * @param conf    Conditions on the link.
+ * @param seed    Seed for the link's randomness.
+ *
+ * @return FALSE if either connection failed.
+ */
+int proxy_run(unsigned id, SOCKET client, SOCKET server, const mp_link_conf* const conf, unsigned long long seed)
+{
+	mp_flow* up = calloc(1, sizeof(mp_flow));
+	mp_flow* down = calloc(1, sizeof(mp_flow));
+	mp_flow* flows[2] = { up, down };
+	int ok = FALSE;
+	if (!up || !down)
+	{
+		goto fail;
+	}
+	up->from = client;
+	up->to = server;
+	up->name = "up";
+	up->up = TRUE;
+	link_init(&up->link, conf, seed * 2);
+	down->from = server;
+	down->to = client;
+	down->name = "down";
+	link_init(&down->link, conf, seed * 2 + 1);
+
+	// Packets go out when we say, not when Nagle does.
+	int opt = 1;
+	setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+	setsockopt(server, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+	ok = TRUE;
+	while (ok)
+	{
+		unsigned long long now = time_now_ns();
+		ok = proxy_flush(id, up, now) && proxy_flush(id, down, now);
+		if (!ok || (up->eof && !up->head) || (down->eof && !down->head))
+		{
+			break;
+		}
+
+		// Sleep until something arrives, or the next packet
+		// held back is due.
+		struct pollfd pfd[2] =
+		{
+			{ client, proxy_events(up, down, now), 0 },
+			{ server, proxy_events(down, up, now), 0 },
+		};
+		unsigned long long wake = 0;
+		for (unsigned i = 0; i < 2; ++i)
+		{
+			mp_held* p = flows[i]->head;
+			if (p && p->release > now && (!wake || p->release < wake))
+			{
+				wake = p->release;
+			}
+		}
+		struct timespec ts = { 0, 0 };
+		if (wake)
+		{
+			ts.tv_sec = (time_t)((wake - now) / NS_PER_SEC);
+			ts.tv_nsec = (long)((wake - now) % NS_PER_SEC);
+		}
+		if (ppoll(pfd, 2, wake ? &ts : 0, 0) < 0)
+		{
+			ok = errno == EINTR;
+			continue;
+		}
+		if ((pfd[0].revents | pfd[1].revents) & (POLLERR | POLLNVAL))
+		{
+			ok = FALSE;
+			break;
+		}
+
+		// A hangup still has to be read to find the end.
+		now = time_now_ns();
+		if (pfd[0].revents & (POLLIN | POLLHUP) && pfd[0].events & POLLIN) ok = proxy_fill(up, now);
+		if (ok && pfd[1].revents & (POLLIN | POLLHUP) && pfd[1].events & POLLIN) ok = proxy_fill(down, now);
+	}
+
+	proxy_report(id, up);
+	proxy_report(id, down);
+
+fail:
+	for (unsigned i = 0; i < 2; ++i)
+	{
+		while (flows[i] && flows[i]->head)
+		{
+			mp_held* p = flows[i]->head;
+			flows[i]->head = p->next;
+			free(p);
+		}
+	}
+	free(up);
+	free(down);
+	return ok;
+}
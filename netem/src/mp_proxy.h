@@ -0,0 +1,17 @@
+#ifndef MP_PROXY_H
+#define MP_PROXY_H
+
+// Bytes read from a socket at a time, and the most
+// held back each way before we stop reading, so a slow
+// link pushes back on whoever is sending.
+#define PROXY_READ_BYTES (64 * 1024)
+#define PROXY_QUEUE_BYTES (256 * 1024)
+
+// Setup
+int proxy_init(const char*);
+void proxy_deinit(void);
+
+// Connections
+int proxy_run(unsigned, SOCKET, SOCKET, const mp_link_conf* const, unsigned long long);
+
+#endif
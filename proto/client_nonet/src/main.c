@@ -8,15 +8,14 @@
  */
 
 #include "pch.h"
+#include "mp_render.h"
+#include "mp_frame.h"
 
 // Grid constants
 #define GRID_WIDTH 40
 #define GRID_HEIGHT 15
 
 // Other constants
-#define TRUE 1
-#define FALSE 0
-#define FAIL 0
 #define CURSOR_HIDE 0
 #define CURSOR_SHOW 0
 #define GAME_SPEED 300
@@ -57,6 +56,8 @@ typedef struct
 static player* players;
 static size_t player_count;
 static const int player_idx;
+static mp_frame frame;
+static mp_render* render;
 
 /*
  * Entry point of the application.
@@ -83,6 +84,15 @@ int main(void)
 	keypad(stdscr, TRUE);  // Special keys (i.e arrows)
 	curs_set(CURSOR_HIDE); // Hide cursor
 
+	// Set up rendering.
+	if (!frame_init(&frame, GRID_WIDTH, GRID_HEIGHT) ||
+		!(render = render_new_curses()))
+	{
+		endwin();
+		printf("Failed to initialise rendering.\n");
+		return -1;
+	}
+
 	// Main game loop. Run until we get a interupt signal.
 	while (!signal_interrupt_caught)
 	{
@@ -106,6 +116,8 @@ int main(void)
 	curs_set(CURSOR_SHOW);
 	endwin();
 
+	render_free(render);
+	frame_deinit(&frame);
 	free(players);
 
 	return 0;
@@ -116,32 +128,17 @@ int main(void)
  */
 void draw_grid(void)
 {
-	// Clear old grid.
-	clear();
-
-	const int TILE_WID = 2;
-
-	// Draw rows
-	for (unsigned y = 0; y < GRID_HEIGHT; ++y)
-	{
-		// Draw columns
-		for (unsigned x = 0; x < GRID_WIDTH; ++x)
-		{
-			// Draw tile.
-			mvwaddch(stdscr, y, TILE_WID * x, TILE_DEFAULT);
-
-			// Draw a space.
-			mvwaddch(stdscr, y, TILE_WID * x + 1, ' ');
-		}
-	}
+	// Lay out the grid.
+	frame_fill(&frame, TILE_DEFAULT);
 
 	// Draw playres
 	for (unsigned p = 0; p < player_count; ++p)
 	{
-		mvwaddch(stdscr, players[p].y, TILE_WID * players[p].x, TILE_PLAYER);
+		frame_put(&frame, players[p].x, players[p].y, TILE_PLAYER);
 	}
 
-	refresh();
+	// Draw whatever changed.
+	frame_present(&frame, render);
 }
 
 /*
@@ -0,0 +1 @@
+../../../client/src/mp_frame.c
\ No newline at end of file
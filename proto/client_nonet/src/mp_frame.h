@@ -0,0 +1 @@
+../../../client/src/mp_frame.h
\ No newline at end of file
@@ -0,0 +1 @@
+../../../client/src/mp_render.c
\ No newline at end of file
@@ -0,0 +1 @@
+../../../client/src/mp_render.h
\ No newline at end of file
@@ -4,10 +4,16 @@
 // Standard includes.
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 #include <unistd.h>
 
 // Libraries
 #include <ncurses.h>
 
+// Some constants
+#define TRUE 1
+#define FALSE 0
+#define FAIL 0
+
 #endif
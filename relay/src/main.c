@@ -0,0 +1,392 @@
+/*
+ * main.c
+ *
+ * Main translation unit of the relay.
+ *
+ * The relay watches one room upstream as a single
+ * spectator, and passes what it sees on to any number
+ * of viewers of its own. Each packet is read once and
+ * the same bytes go to every viewer, so however many
+ * are watching, the server only has the one spectator
+ * to send to.
+ *
+ * Viewers talk to the relay just as they would to a
+ * server, so relays can be chained: a relay can watch
+ * another relay, for a tree of them as wide as needed.
+ */
+
+#include "pch.h"
+#include "mp_mirror.h"
+#include "mp_upstream.h"
+#include "mp_viewer.h"
+
+// For signal interupt handler.
+static volatile sig_atomic_t signal_interrupt_caught = 0;
+void signal_interrupt_handler(int param)
+{
+	(void)param;
+	signal_interrupt_caught = 1;
+}
+
+// Variables
+static mp_listener* listener;
+static unsigned port = PORT;
+static unsigned room = 0;
+static unsigned delay_ms = 0;
+static const char* upstream = 0;
+static mp_mirror mirror;
+static mp_viewer viewers[VIEWER_MAX];
+static unsigned viewer_count = 0;
+static mp_istream* mis;
+static mp_ostream* mos;
+
+// Function prototypes.
+void relay_loop(void);
+void relay_accept(void);
+void relay_packet(const mp_relay_packet* const);
+
+/*
+ * Print command line usage.
+ */
+static void usage(const char* name)
+{
+	printf("Usage: %s -u upstream[:port] -r room [-p port] [-d delay_ms]\n", name);
+	printf("  -u addr   Server, gateway or relay to watch, or the\n");
+	printf("            path of a server's same-host socket.\n");
+	printf("  -r room   Room to watch.\n");
+	printf("  -p port   Port to listen on. (default %u)\n", PORT);
+	printf("  -d ms     Hold everything back this long before\n");
+	printf("            passing it on. (default 0)\n");
+}
+
+/*
+ * Entry point of the program.
+ *
+ * @return status. 0 on normal termination.
+ */
+int main(int argc, char** argv)
+{
+	// Parse options.
+	int opt;
+	while ((opt = getopt(argc, argv, "u:r:p:d:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'u': upstream = optarg; break;
+			case 'r': room = (unsigned)atoi(optarg); break;
+			case 'p': port = (unsigned)atoi(optarg); break;
+			case 'd': delay_ms = (unsigned)atoi(optarg); break;
+			default:
+			{
+				usage(argv[0]);
+				return opt == 'h' ? 0 : -1;
+			}
+		}
+	}
+	if (!upstream || !room || room > 0xFFFF || !port || port > 0xFFFF)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+
+	printf("-- Simple Game Relay --\n");
+
+	// Register signal interrupt handler. Writing to
+	// viewers that have gone shouldn't kill us.
+	struct sigaction sigact_inter;
+	memset(&sigact_inter, 0, sizeof(sigact_inter));
+	sigact_inter.sa_handler = signal_interrupt_handler;
+	sigaction(SIGINT, &sigact_inter, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	// Streams for reading packets out of memory, and
+	// writing them into memory. (Neither has a socket)
+	int status = 0;
+	if (!(mis = istream_new(-1)) || !(mos = ostream_new(-1)))
+	{
+		printf("Failed to allocate streams.\n");
+		status = -1;
+		goto fail;
+	}
+
+	// Start listening. Viewers tend to arrive all at
+	// once, so allow a long backlog.
+	if (!(listener = listener_new((unsigned short)port, SOMAXCONN)))
+	{
+		printf("Failed to listen on port %u: %s\n", port, strerror(errno));
+		status = -1;
+		goto fail;
+	}
+
+	// Start watching.
+	if (!upstream_start(upstream, room))
+	{
+		printf("Failed to start watching upstream.\n");
+		status = -1;
+		goto fail;
+	}
+	printf("Relaying room %u from %s on port %u...\n", room, upstream, port);
+
+	relay_loop();
+
+	if (signal_interrupt_caught)
+	{
+		printf("Signal interrupt caught. Terminating...\n");
+	}
+
+fail:
+	// Free memory.
+	upstream_stop();
+	while (viewer_count)
+	{
+		viewer_deinit(&viewers[--viewer_count]);
+	}
+	mirror_reset(&mirror);
+	if (listener) listener_free(listener);
+	istream_free(mis);
+	ostream_free(mos);
+	return status;
+}
+
+/*
+ * Disconnect a viewer. The last viewer takes its place.
+ *
+ * @param i    Index of the viewer.
+ * @param why  Reason, for the log, or 0 to say nothing.
+ */
+static void relay_drop(unsigned i, const char* why)
+{
+	viewer_deinit(&viewers[i]);
+	viewers[i] = viewers[--viewer_count];
+	if (why)
+	{
+		printf("Viewer %s. (%u watching)\n", why, viewer_count);
+	}
+}
+
+/*
+ * Queue up whatever has been written to the memory
+ * stream for a viewer, and clear it.
+ *
+ * @return FALSE if the viewer has fallen too far
+ *         behind.
+ */
+static int relay_queue(mp_viewer* const v)
+{
+	int ok = viewer_queue(v, mos->buf, mos->buf_len);
+	ostream_flush(mos);
+	return ok;
+}
+
+/*
+ * Send a viewer some of the map they don't have yet.
+ *
+ * @return FALSE if the viewer has fallen too far
+ *         behind.
+ */
+static int relay_send_map(mp_viewer* const v)
+{
+	unsigned count = mirror_chunk_count(&mirror), sent = 0;
+	if (v->map_pos >= count)
+	{
+		return TRUE;
+	}
+	for (; v->map_pos < count && sent < VIEWER_MAP_CHUNKS; ++v->map_pos)
+	{
+		sent += mirror_write_chunk(&mirror, mos, v->map_pos);
+	}
+	return relay_queue(v);
+}
+
+/*
+ * Deal with a viewer's first packet, once it's all
+ * arrived. If it's the room we're relaying, they're
+ * sent the room as it stands and from then on get
+ * everything that's relayed.
+ *
+ * @return FALSE if they should be dropped.
+ */
+static int relay_greet(mp_viewer* const v)
+{
+	if (v->in_len && v->in[0] != P_SPECTATE)
+	{
+		return FALSE;
+	}
+	if (v->in_len < sizeof(v->in))
+	{
+		return TRUE;
+	}
+
+	// Anything else is somewhere else.
+	unsigned r = v->in[1] | (unsigned)v->in[2] << 8;
+	if (r != room || !mirror.ready)
+	{
+		ostream_begin(mos, P_ERROR);
+		owrite_err(mos, ERR_NO_ROOM);
+		relay_queue(v);
+		viewer_flush(v);
+		return FALSE;
+	}
+
+	// The map follows a bit at a time, along with
+	// whatever's relayed.
+	mirror_write_hello(&mirror, mos);
+	mirror_write_join(&mirror, mos);
+	v->synced = TRUE;
+	v->map_pos = 0;
+	printf("Viewer joined. (%u watching)\n", viewer_count);
+	return relay_queue(v) && relay_send_map(v);
+}
+
+/*
+ * Main loop. Relays packets as they come due, takes
+ * on new viewers and keeps the existing ones going,
+ * until we're told to stop.
+ */
+void relay_loop(void)
+{
+	static struct pollfd pfds[VIEWER_MAX + 2];
+	unsigned long long delay_ns = (unsigned long long)delay_ms * NS_PER_MS;
+	while (!signal_interrupt_caught)
+	{
+		// Pass on everything that's due.
+		unsigned long long now = time_now_ns();
+		int wait_ms = 1000;
+		mp_relay_packet* p;
+		while ((p = upstream_peek()))
+		{
+			if (p->time + delay_ns > now)
+			{
+				wait_ms = (int)((p->time + delay_ns - now + NS_PER_MS - 1) / NS_PER_MS);
+				break;
+			}
+			relay_packet(p);
+			upstream_pop();
+		}
+
+		// Send what we can. Anything left over waits for
+		// the socket to have room.
+		for (unsigned i = viewer_count; i-- > 0;)
+		{
+			if (!viewer_flush(&viewers[i]))
+			{
+				relay_drop(i, "dropped");
+			}
+		}
+
+		// While a packet is being held back, there's
+		// no point hearing about more.
+		pfds[0] = (struct pollfd){ listener->handle, POLLIN, 0 };
+		pfds[1] = (struct pollfd){ p ? -1 : upstream_fd(), POLLIN, 0 };
+		for (unsigned i = 0; i < viewer_count; ++i)
+		{
+			short events = POLLIN | (viewers[i].out_len ? POLLOUT : 0);
+			pfds[i + 2] = (struct pollfd){ viewers[i].sock, events, 0 };
+		}
+		if (poll(pfds, viewer_count + 2, wait_ms) < 0 && errno != EINTR)
+		{
+			break;
+		}
+
+		// Viewers, last first, so that dropping one
+		// doesn't move any that are still to be seen to.
+		now = time_now_ns();
+		for (unsigned i = viewer_count; i-- > 0;)
+		{
+			mp_viewer* v = &viewers[i];
+			short revents = pfds[i + 2].revents;
+			if (revents & (POLLIN | POLLHUP | POLLERR) && !viewer_recv(v))
+			{
+				relay_drop(i, v->synced ? "left" : 0);
+			}
+			else if (!v->synced && !relay_greet(v))
+			{
+				relay_drop(i, 0);
+			}
+			else if (now > v->last_rx + VIEWER_IDLE_MS * NS_PER_MS)
+			{
+				relay_drop(i, "timed out");
+			}
+		}
+
+		if (pfds[0].revents & POLLIN)
+		{
+			relay_accept();
+		}
+	}
+}
+
+/*
+ * Take on anyone waiting to connect. They're viewers
+ * from the start, but nothing is sent to them until
+ * they've asked to watch.
+ */
+void relay_accept(void)
+{
+	SOCKET csock;
+	while ((csock = accept(listener->handle, 0, 0)) >= 0)
+	{
+		if (viewer_count >= VIEWER_MAX)
+		{
+			unsigned char full[2] = { P_ERROR, ERR_SERVER_FULL };
+			send(csock, full, sizeof(full), MSG_NOSIGNAL);
+			close(csock);
+			continue;
+		}
+		if (!viewer_init(&viewers[viewer_count], csock))
+		{
+			close(csock);
+			continue;
+		}
+		++viewer_count;
+	}
+}
+
+/*
+ * Relay a packet from upstream. It's applied to our
+ * copy of the room, then its bytes are queued for
+ * every viewer as they are.
+ *
+ * @param p  Packet to relay.
+ */
+void relay_packet(const mp_relay_packet* const p)
+{
+	// Upstream was lost. The room as viewers know it
+	// is gone, so they'll have to start again.
+	if (!p->len)
+	{
+		while (viewer_count)
+		{
+			relay_drop(viewer_count - 1, 0);
+		}
+		mirror_reset(&mirror);
+		return;
+	}
+
+	istream_set_mem(mis, p->data, p->len);
+	enum mp_packet packet = mirror_read(&mirror, mis);
+
+	// Viewers got their own P_HELLO.
+	if (packet == P_HELLO)
+	{
+		return;
+	}
+
+	for (unsigned i = viewer_count; i-- > 0;)
+	{
+		mp_viewer* v = &viewers[i];
+		if (!v->synced) continue;
+
+		// Once a tick, a bit more of the map for anyone
+		// still catching up.
+		int ok = viewer_queue(v, p->data, p->len);
+		if (ok && packet == P_UPDATE)
+		{
+			ok = relay_send_map(v);
+		}
+		if (!ok)
+		{
+			relay_drop(i, "fell behind");
+		}
+	}
+}
@@ -0,0 +1,250 @@
+/*
+ * mp_mirror.c
+ *
+ * The relay's copy of the room it's watching.
+ */
+
+#include "pch.h"
+#include "mp_mirror.h"
+
+/*
+ * Forget everything about the room, e.g because the
+ * connection upstream was lost.
+ *
+ * @param m  Mirror to reset.
+ */
+void mirror_reset(mp_mirror* const m)
+{
+	free(m->players);
+	free(m->chunks);
+	map_free(&m->map);
+	memset(m, 0, sizeof(mp_mirror));
+}
+
+// Start again from a P_HELLO.
+static int mirror_hello(mp_mirror* const m, unsigned max, unsigned wid, unsigned hei, unsigned room)
+{
+	mirror_reset(m);
+	m->max_players = max;
+	m->room = room;
+	if (!map_new(&m->map, wid, hei, TILE_UNKNOWN) ||
+		!(m->players = calloc(max, sizeof(mp_mirror_player))) ||
+		!(m->chunks = calloc((m->map.chunks_x * m->map.chunks_y + 7) / 8, 1)))
+	{
+		mirror_reset(m);
+		return FALSE;
+	}
+	m->ready = TRUE;
+	return TRUE;
+}
+
+// Note where a player is, if they're one we can have.
+static void mirror_place(mp_mirror* const m, unsigned idx, unsigned x, unsigned y)
+{
+	if (!m || !m->ready || idx >= m->max_players) return;
+	m->players[idx].present = TRUE;
+	m->players[idx].x = (unsigned short)x;
+	m->players[idx].y = (unsigned short)y;
+}
+
+/*
+ * Read a whole packet of the spectator stream, and
+ * apply it to a mirror. Called without a mirror, this
+ * just reads the packet, which is how the upstream
+ * thread finds where each one ends.
+ *
+ * @param m   Mirror to apply the packet to, or 0.
+ * @param is  Stream to read from.
+ *
+ * @return the type of packet, or P_UNKNOWN if it
+ *         wasn't one that's in the stream (so the end
+ *         of it can't be found) or the stream ended.
+ */
+enum mp_packet mirror_read(mp_mirror* const m, mp_istream* const is)
+{
+	enum mp_packet packet = iread_begin(is);
+	switch (packet)
+	{
+		case P_HELLO:
+		{
+			unsigned max = iread_u8(is);
+			iread_u8(is);
+			unsigned wid = iread_u16(is), hei = iread_u16(is);
+			iread_u16(is);
+			iread_u16(is);
+			iread_u16(is);
+			iread_u64(is);
+			unsigned room = iread_u16(is);
+			if (m && !is->eof && !mirror_hello(m, max, wid, hei, room))
+			{
+				printf("Failed to allocate a copy of room %u.\n", room);
+			}
+		} break;
+
+		case P_JOIN_CHUNK:
+		{
+			unsigned n = iread_u8(is);
+			for (unsigned i = 0; i < n; ++i)
+			{
+				unsigned idx = iread_u8(is);
+				unsigned x = iread_u16(is), y = iread_u16(is);
+				mirror_place(m, idx, x, y);
+			}
+		} break;
+
+		case P_MAP_CHUNK:
+		{
+			unsigned cx = iread_u16(is), cy = iread_u16(is);
+			unsigned char tiles[MAP_CHUNK_TILES];
+			for (unsigned t = 0; t < MAP_CHUNK_TILES; ++t)
+			{
+				tiles[t] = iread_u8(is);
+			}
+
+			unsigned char* dst = m && m->ready ? map_chunk(&m->map, cx, cy) : 0;
+			if (dst && !is->eof)
+			{
+				unsigned i = cy * m->map.chunks_x + cx;
+				memcpy(dst, tiles, MAP_CHUNK_TILES);
+				m->chunks[i / 8] |= 1 << (i % 8);
+			}
+		} break;
+
+		case P_UPDATE:
+		{
+			unsigned tick = iread_u32(is);
+			iread_u16(is);
+			unsigned n = iread_u8(is);
+			for (unsigned i = 0; i < n; ++i)
+			{
+				unsigned idx = iread_u8(is);
+				unsigned x = iread_u16(is), y = iread_u16(is);
+				mirror_place(m, idx, x, y);
+			}
+			unsigned g = iread_u8(is);
+			for (unsigned i = 0; i < g; ++i)
+			{
+				unsigned idx = iread_u8(is);
+				if (m && m->ready && idx < m->max_players)
+				{
+					m->players[idx].present = FALSE;
+				}
+			}
+			if (m) m->tick = tick;
+		} break;
+
+		case P_PING:
+		{
+			iread_u64(is);
+		} break;
+
+		case P_ERROR:
+		{
+			iread_err(is);
+		} break;
+
+		case P_HEARTBEAT:
+		case P_DISCONN:
+			break;
+
+		default:
+			return P_UNKNOWN;
+	}
+	return is->eof ? P_UNKNOWN : packet;
+}
+
+/*
+ * Write the P_HELLO a new viewer gets. It's what the
+ * room's server would send a spectator.
+ *
+ * @param m   Mirror to describe.
+ * @param os  Stream to write to.
+ */
+void mirror_write_hello(const mp_mirror* const m, mp_ostream* const os)
+{
+	unsigned count = 0;
+	for (unsigned i = 0; i < m->max_players; ++i)
+	{
+		count += m->players[i].present != 0;
+	}
+
+	ostream_begin(os, P_HELLO);
+	owrite_u8(os, (unsigned char)m->max_players);
+	owrite_u8(os, 0xFF);
+	owrite_u16(os, (unsigned short)m->map.wid);
+	owrite_u16(os, (unsigned short)m->map.hei);
+	owrite_u16(os, 0);
+	owrite_u16(os, 0);
+	owrite_u16(os, (unsigned short)count);
+	owrite_u64(os, 0);
+	owrite_u16(os, (unsigned short)m->room);
+}
+
+/*
+ * Write P_JOIN_CHUNKs of everyone in the room.
+ *
+ * @param m   Mirror to describe.
+ * @param os  Stream to write to.
+ */
+void mirror_write_join(const mp_mirror* const m, mp_ostream* const os)
+{
+	unsigned i = 0;
+	while (i < m->max_players)
+	{
+		const mp_mirror_player* chunk[MIRROR_JOIN_CHUNK_PLAYERS];
+		unsigned idx[MIRROR_JOIN_CHUNK_PLAYERS];
+		unsigned count = 0;
+		for (; i < m->max_players && count < MIRROR_JOIN_CHUNK_PLAYERS; ++i)
+		{
+			if (!m->players[i].present) continue;
+			chunk[count] = &m->players[i];
+			idx[count++] = i;
+		}
+		if (!count) break;
+
+		ostream_begin(os, P_JOIN_CHUNK);
+		owrite_u8(os, (unsigned char)count);
+		for (unsigned j = 0; j < count; ++j)
+		{
+			owrite_u8(os, (unsigned char)idx[j]);
+			owrite_u16(os, chunk[j]->x);
+			owrite_u16(os, chunk[j]->y);
+		}
+	}
+}
+
+/*
+ * Write a P_MAP_CHUNK, if that chunk has arrived.
+ *
+ * @param m   Mirror to describe.
+ * @param os  Stream to write to.
+ * @param i   Index of the chunk, in rows.
+ *
+ * @return TRUE if it was written.
+ */
+int mirror_write_chunk(const mp_mirror* const m, mp_ostream* const os, unsigned i)
+{
+	if (!(m->chunks[i / 8] & (1 << (i % 8))))
+	{
+		return FALSE;
+	}
+
+	unsigned cx = i % m->map.chunks_x, cy = i / m->map.chunks_x;
+	const unsigned char* tiles = map_chunk(&m->map, cx, cy);
+	ostream_begin(os, P_MAP_CHUNK);
+	owrite_u16(os, (unsigned short)cx);
+	owrite_u16(os, (unsigned short)cy);
+	for (unsigned t = 0; t < MAP_CHUNK_TILES; ++t)
+	{
+		owrite_u8(os, tiles[t]);
+	}
+	return TRUE;
+}
+
+/*
+ * @return the number of chunks in the map.
+ */
+unsigned mirror_chunk_count(const mp_mirror* const m)
+{
+	return m->map.chunks_x * m->map.chunks_y;
+}
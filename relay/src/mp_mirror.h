@@ -0,0 +1,52 @@
+#ifndef MP_MIRROR_H
+#define MP_MIRROR_H
+
+// Most players sent to a viewer in one P_JOIN_CHUNK.
+#define MIRROR_JOIN_CHUNK_PLAYERS 64
+
+/*
+ * A player, as far as the relay knows.
+ */
+typedef struct mp_mirror_player
+{
+	int present;
+	unsigned short x, y;
+} mp_mirror_player;
+
+/*
+ * The relay's copy of the room it's watching, built up
+ * from the same packets it passes on. It's what a
+ * viewer that turns up late is sent to catch up.
+ */
+typedef struct mp_mirror
+{
+	// Set once the upstream P_HELLO has arrived.
+	int ready;
+
+	// From the P_HELLO.
+	unsigned max_players;
+	unsigned room;
+
+	// Everyone in the room, by index.
+	mp_mirror_player* players;
+
+	// The map, and a bitset of which chunks of it
+	// have arrived.
+	mp_map map;
+	unsigned char* chunks;
+
+	// Tick of the last P_UPDATE.
+	unsigned tick;
+} mp_mirror;
+
+// Setup
+void mirror_reset(mp_mirror* const);
+
+// Packets
+enum mp_packet mirror_read(mp_mirror* const, mp_istream* const);
+void mirror_write_hello(const mp_mirror* const, mp_ostream* const);
+void mirror_write_join(const mp_mirror* const, mp_ostream* const);
+int mirror_write_chunk(const mp_mirror* const, mp_ostream* const, unsigned);
+unsigned mirror_chunk_count(const mp_mirror* const);
+
+#endif
@@ -0,0 +1,348 @@
+/*
+ * mp_upstream.c
+ *
+ * The relay's connection to whatever it's relaying:
+ * a server, a gateway, or another relay. A thread of
+ * its own reads the spectator stream a packet at a
+ * time and queues each one up for the main thread.
+ */
+
+#include "pch.h"
+#include "mp_mirror.h"
+#include "mp_upstream.h"
+
+// Where to connect, and what to watch. If upstream is
+// a server on the same host, we connect to its Unix
+// socket and go through shared memory instead.
+static struct sockaddr_in addr;
+static char shm_path[108];
+static unsigned room;
+
+// Reader thread.
+static pthread_t thr;
+static volatile int running = FALSE;
+
+// Packets waiting for the main thread, oldest first.
+// The eventfd is signalled whenever one is added.
+static mp_relay_packet* head = 0;
+static mp_relay_packet* tail = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static int wake_fd = -1;
+
+// Add a packet to the end of the queue.
+static void upstream_push(const unsigned char* data, unsigned len)
+{
+	mp_relay_packet* p = malloc(sizeof(mp_relay_packet) + len);
+	if (!p)
+	{
+		printf("Failed to allocate a %u byte packet.\n", len);
+		return;
+	}
+	p->next = 0;
+	p->time = time_now_ns();
+	p->len = len;
+	memcpy(p->data, data, len);
+
+	pthread_mutex_lock(&queue_lock);
+	if (tail) tail->next = p;
+	else head = p;
+	tail = p;
+	pthread_mutex_unlock(&queue_lock);
+	eventfd_write(wake_fd, 1);
+}
+
+// Open a connection upstream, and ask to watch.
+static SOCKET upstream_connect(mp_shm** const shm)
+{
+	unsigned char req[3] = { P_SPECTATE, (unsigned char)room, (unsigned char)(room >> 8) };
+	*shm = 0;
+	if (shm_path[0])
+	{
+		if (!(*shm = shm_connect(shm_path)))
+		{
+			return -1;
+		}
+		SOCKET s = (*shm)->sock;
+		if (shm_write(*shm, req, sizeof(req)) != sizeof(req))
+		{
+			shm_free(*shm);
+			*shm = 0;
+			close(s);
+			return -1;
+		}
+		return s;
+	}
+
+	SOCKET s = socket(AF_INET, SOCK_STREAM, 0);
+	if (s < 0)
+	{
+		return -1;
+	}
+
+	struct timeval tv = { UPSTREAM_TIMEOUT_MS / 1000, (UPSTREAM_TIMEOUT_MS % 1000) * 1000 };
+	int opt = 1;
+	setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+	if (connect(s, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+	{
+		close(s);
+		return -1;
+	}
+
+	if (send(s, req, sizeof(req), MSG_NOSIGNAL) != sizeof(req))
+	{
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+// Pass on everything that arrives on a connection
+// until it's lost.
+static void upstream_read(SOCKET s, mp_shm* const shm)
+{
+	mp_istream* is = istream_new(s);
+	if (!is)
+	{
+		return;
+	}
+	is->shm = shm;
+	istream_capture(is, TRUE);
+
+	const unsigned char heartbeat = P_HEARTBEAT;
+	unsigned long long now = time_now_ns();
+	unsigned long long next_heartbeat = now + UPSTREAM_HEARTBEAT_MS * NS_PER_MS;
+	unsigned long long last_rx = now;
+	int got_hello = FALSE;
+	while (running)
+	{
+		// Shared memory only needs polling once it's
+		// empty. Its socket going tells us upstream has.
+		int ready = 1;
+		if (!shm || !shm_ready(shm))
+		{
+			struct pollfd pfds[2] = {
+				{ shm ? shm_fd(shm) : s, POLLIN, 0 },
+				{ s, POLLRDHUP, 0 }
+			};
+			ready = poll(pfds, shm ? 2 : 1, UPSTREAM_HEARTBEAT_MS);
+		}
+		if (ready < 0 && errno != EINTR)
+		{
+			break;
+		}
+
+		now = time_now_ns();
+		if (now >= next_heartbeat)
+		{
+			if (shm) shm_write(shm, &heartbeat, 1);
+			else send(s, &heartbeat, 1, MSG_NOSIGNAL);
+			next_heartbeat = now + UPSTREAM_HEARTBEAT_MS * NS_PER_MS;
+		}
+		if (ready <= 0)
+		{
+			if (now - last_rx > UPSTREAM_TIMEOUT_MS * NS_PER_MS)
+			{
+				printf("Upstream went quiet.\n");
+				break;
+			}
+			continue;
+		}
+
+		// Read the whole packet, so we know where it ends.
+		istream_capture_reset(is);
+		enum mp_packet packet = mirror_read(0, is);
+		last_rx = now;
+		if (packet == P_UNKNOWN)
+		{
+			break;
+		}
+		if (packet == P_ERROR)
+		{
+			printf("Upstream refused us. (Error %u)\n", is->cap[1]);
+			break;
+		}
+		if (packet == P_HELLO && !got_hello)
+		{
+			got_hello = TRUE;
+			printf("Watching room %u.\n", room);
+		}
+
+		// Pings are for the connection, not the room.
+		if (packet != P_PING)
+		{
+			upstream_push(is->cap, is->cap_len);
+		}
+	}
+	istream_free(is);
+
+	// Everyone downstream has to start again.
+	if (got_hello)
+	{
+		printf("Lost upstream.\n");
+		upstream_push(0, 0);
+	}
+}
+
+/*
+ * Upstream thread. Stays connected for as long as the
+ * relay is running, connecting again whenever the
+ * connection is lost.
+ */
+static void* upstream_worker(void* arg)
+{
+	(void)arg;
+	while (running)
+	{
+		mp_shm* shm;
+		SOCKET s = upstream_connect(&shm);
+		if (s >= 0)
+		{
+			upstream_read(s, shm);
+			shm_free(shm);
+			close(s);
+		}
+		if (running)
+		{
+			time_sleep_until_ns(time_now_ns() + UPSTREAM_RETRY_MS * NS_PER_MS);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Start watching a room upstream.
+ *
+ * @param spec  Upstream's address, as "host:port". The
+ *              port defaults to PORT. Anything with a
+ *              '/' in it is taken as the path of a
+ *              server's same-host socket instead.
+ * @param r     Room to watch.
+ *
+ * @return FALSE if the address isn't valid, or the
+ *         thread couldn't start.
+ */
+int upstream_start(const char* spec, unsigned r)
+{
+	room = r;
+	if (strchr(spec, '/'))
+	{
+		if (strlen(spec) >= sizeof(shm_path))
+		{
+			printf("Bad upstream path %s\n", spec);
+			return FALSE;
+		}
+		strcpy(shm_path, spec);
+	}
+	else
+	{
+		// Split off the port.
+		char host[64];
+		if (strlen(spec) >= sizeof(host))
+		{
+			return FALSE;
+		}
+		strcpy(host, spec);
+		unsigned port = PORT;
+		char* colon = strchr(host, ':');
+		if (colon)
+		{
+			*colon = 0;
+			port = (unsigned)atoi(colon + 1);
+		}
+		if (strcmp(host, "localhost") == 0)
+		{
+			strcpy(host, "127.0.0.1");
+		}
+
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons((unsigned short)port);
+		if (!port || port > 0xFFFF || inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+		{
+			printf("Bad upstream address %s\n", spec);
+			return FALSE;
+		}
+	}
+
+	if ((wake_fd = eventfd(0, EFD_NONBLOCK)) < 0)
+	{
+		return FALSE;
+	}
+	running = TRUE;
+	if (pthread_create(&thr, 0, upstream_worker, 0) != 0)
+	{
+		running = FALSE;
+		close(wake_fd);
+		wake_fd = -1;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Stop watching, and throw away anything still queued.
+ */
+void upstream_stop(void)
+{
+	if (!running) return;
+	running = FALSE;
+	pthread_join(thr, 0);
+	while (upstream_peek())
+	{
+		upstream_pop();
+	}
+	close(wake_fd);
+	wake_fd = -1;
+}
+
+/*
+ * @return a descriptor that polls as readable when
+ *         there are packets waiting.
+ */
+int upstream_fd(void)
+{
+	return wake_fd;
+}
+
+/*
+ * Look at the oldest packet waiting. It stays valid
+ * until it's popped. Only the main thread may call
+ * this.
+ *
+ * @return the packet, or 0 if there aren't any.
+ */
+mp_relay_packet* upstream_peek(void)
+{
+	pthread_mutex_lock(&queue_lock);
+	mp_relay_packet* p = head;
+	pthread_mutex_unlock(&queue_lock);
+
+	// Clear the wakeup once everything has been seen.
+	if (!p)
+	{
+		eventfd_t v;
+		eventfd_read(wake_fd, &v);
+
+		pthread_mutex_lock(&queue_lock);
+		p = head;
+		pthread_mutex_unlock(&queue_lock);
+	}
+	return p;
+}
+
+/*
+ * Throw away the oldest packet waiting.
+ */
+void upstream_pop(void)
+{
+	pthread_mutex_lock(&queue_lock);
+	mp_relay_packet* p = head;
+	if (p)
+	{
+		head = p->next;
+		if (!head) tail = 0;
+	}
+	pthread_mutex_unlock(&queue_lock);
+	free(p);
+}
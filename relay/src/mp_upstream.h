@@ -0,0 +1,36 @@
+#ifndef MP_UPSTREAM_H
+#define MP_UPSTREAM_H
+
+// How often we let upstream know we're still here,
+// how long it can go quiet before we give up on it,
+// and how long to wait before connecting again.
+#define UPSTREAM_HEARTBEAT_MS 1000
+#define UPSTREAM_TIMEOUT_MS 5000
+#define UPSTREAM_RETRY_MS 1000
+
+/*
+ * A packet from upstream, exactly as it arrived. A
+ * packet with no bytes marks the connection being
+ * lost.
+ */
+typedef struct mp_relay_packet
+{
+	struct mp_relay_packet* next;
+
+	// When it arrived. (ns)
+	unsigned long long time;
+
+	unsigned len;
+	unsigned char data[];
+} mp_relay_packet;
+
+// Setup
+int upstream_start(const char*, unsigned);
+void upstream_stop(void);
+
+// Packets
+int upstream_fd(void);
+mp_relay_packet* upstream_peek(void);
+void upstream_pop(void);
+
+#endif
@@ -0,0 +1,131 @@
+/*
+ * mp_viewer.c
+ *
+ * Connections from viewers. Their sockets are
+ * non-blocking, and whatever can't be sent straight
+ * away waits in a buffer of their own, so one slow
+ * viewer holds up nobody else.
+ */
+
+#include "pch.h"
+#include "mp_viewer.h"
+
+/*
+ * Set up a new viewer.
+ *
+ * @param v     Viewer to initialise.
+ * @param sock  Their socket.
+ *
+ * @return FALSE on failure.
+ */
+int viewer_init(mp_viewer* const v, SOCKET sock)
+{
+	memset(v, 0, sizeof(mp_viewer));
+	v->sock = sock;
+	v->last_rx = time_now_ns();
+
+	int opt = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+	return fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) == 0;
+}
+
+/*
+ * Disconnect a viewer.
+ *
+ * @param v  Viewer to deinitialise.
+ */
+void viewer_deinit(mp_viewer* const v)
+{
+	close(v->sock);
+	free(v->out);
+	memset(v, 0, sizeof(mp_viewer));
+	v->sock = -1;
+}
+
+/*
+ * Queue bytes to be sent to a viewer. They go out on
+ * the next viewer_flush.
+ *
+ * @param v     Viewer to send to.
+ * @param data  Bytes to send.
+ * @param len   Number of bytes.
+ *
+ * @return FALSE if the viewer has fallen too far
+ *         behind.
+ */
+int viewer_queue(mp_viewer* const v, const unsigned char* data, unsigned len)
+{
+	if (v->out_len + len > VIEWER_MAX_BACKLOG)
+	{
+		return FALSE;
+	}
+	if (v->out_len + len > v->out_size)
+	{
+		unsigned size = (v->out_len + len) * 2;
+		unsigned char* out = realloc(v->out, size);
+		if (!out)
+		{
+			return FALSE;
+		}
+		v->out = out;
+		v->out_size = size;
+	}
+	memcpy(v->out + v->out_len, data, len);
+	v->out_len += len;
+	return TRUE;
+}
+
+/*
+ * Send as much of what's queued for a viewer as the
+ * socket will take.
+ *
+ * @param v  Viewer to send to.
+ *
+ * @return FALSE if the connection failed.
+ */
+int viewer_flush(mp_viewer* const v)
+{
+	if (!v->out_len)
+	{
+		return TRUE;
+	}
+
+	ssize_t n = send(v->sock, v->out, v->out_len, MSG_NOSIGNAL);
+	if (n < 0)
+	{
+		return errno == EAGAIN || errno == EINTR;
+	}
+	memmove(v->out, v->out + n, v->out_len - n);
+	v->out_len -= n;
+	return TRUE;
+}
+
+/*
+ * Read whatever a viewer has sent. Until they've sent
+ * their P_SPECTATE it's kept; after that there's
+ * nothing we need from them, so it's thrown away.
+ *
+ * @param v  Viewer to read from.
+ *
+ * @return FALSE if they've gone.
+ */
+int viewer_recv(mp_viewer* const v)
+{
+	unsigned char buf[512];
+	ssize_t n = recv(v->sock, buf, sizeof(buf), 0);
+	if (n == 0)
+	{
+		return FALSE;
+	}
+	if (n < 0)
+	{
+		return errno == EAGAIN || errno == EINTR;
+	}
+
+	v->last_rx = time_now_ns();
+	for (ssize_t i = 0; i < n && v->in_len < sizeof(v->in); ++i)
+	{
+		v->in[v->in_len++] = buf[i];
+	}
+	return TRUE;
+}
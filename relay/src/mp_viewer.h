@@ -0,0 +1,55 @@
+#ifndef MP_VIEWER_H
+#define MP_VIEWER_H
+
+// Most viewers a relay takes.
+#define VIEWER_MAX 1024
+
+// Most bytes a viewer can have waiting to be sent to
+// it before it's dropped for falling behind.
+#define VIEWER_MAX_BACKLOG (1024 * 1024)
+
+// How long a viewer can go without saying anything.
+#define VIEWER_IDLE_MS 10000
+
+// Map chunks sent to a new viewer each time a packet
+// is relayed.
+#define VIEWER_MAP_CHUNKS 8
+
+/*
+ * Someone watching through the relay.
+ */
+typedef struct mp_viewer
+{
+	SOCKET sock;
+
+	// Set once they've asked to watch and been sent
+	// the room as it stands. Until then, nothing that's
+	// relayed goes to them.
+	int synced;
+
+	// Next map chunk to look at while catching them
+	// up on the map.
+	unsigned map_pos;
+
+	// Bytes waiting to be sent to them.
+	unsigned char* out;
+	unsigned out_len, out_size;
+
+	// Their first packet, as it arrives.
+	unsigned char in[3];
+	unsigned in_len;
+
+	// When we last heard from them. (ns)
+	unsigned long long last_rx;
+} mp_viewer;
+
+// Setup
+int viewer_init(mp_viewer* const, SOCKET);
+void viewer_deinit(mp_viewer* const);
+
+// I/O
+int viewer_queue(mp_viewer* const, const unsigned char*, unsigned);
+int viewer_flush(mp_viewer* const);
+int viewer_recv(mp_viewer* const);
+
+#endif
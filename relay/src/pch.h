@@ -0,0 +1,48 @@
+#ifndef MP_PCH_H
+#define MP_PCH_H
+
+// Standard includes.
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Networking
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+// Files
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Other defines
+#define TRUE 1
+#define FALSE 0
+#define FAIL 0
+#define SOCKET int
+#define PORT 39992
+
+// Local includes
+#include "comm/mp_packet.h"
+#include "comm/mp_ostream.h"
+#include "comm/mp_istream.h"
+#include "comm/mp_shm.h"
+#include "comm/mp_time.h"
+#include "comm/mp_map.h"
+#include "comm/mp_listener.h"
+
+#endif
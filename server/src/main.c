@@ -7,8 +7,16 @@
  */
 
 #include "pch.h"
-#include "mp_tcp.h"
+#include "mp_rtt.h"
+#include "mp_rate.h"
+#include "mp_timer.h"
+#include "mp_grid.h"
 #include "mp_client.h"
+#include "mp_region.h"
+#include "mp_room.h"
+#include "mp_overload.h"
+#include "mp_capture.h"
+#include "mp_world.h"
 
 // For signal interupt handler.
 static volatile sig_atomic_t signal_interrupt_caught = 0;
@@ -19,77 +27,354 @@ void signal_interrupt_handler(int param)
 }
 
 // Variables
-static mp_tcp* tcp;
-static mp_client* clients;
+static mp_listener* listener;
+static unsigned next_session = 1;
+
+// Unix domain socket clients on the same host set up
+// shared memory sessions over, if listening for them.
+static SOCKET shm_sock = -1;
+
+// Connections that haven't joined a room yet.
+static mp_room lobby;
+
+// Every room there can be. Room n is rooms[n - 1],
+// and is ticked by thread (n - 1) % g_tick_threads.
+// If rooms are split into regions, region k of room n
+// is ticked by thread (n - 1 + k) % g_tick_threads.
+static mp_room* rooms;
+
+// Held while deciding who opens a room. The room is
+// then set up outside the lock, and anyone else after
+// it waits for it to be signalled.
+static pthread_mutex_t rooms_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rooms_opened = PTHREAD_COND_INITIALIZER;
+
+// Threads that tick the rooms.
+static pthread_t* tick_threads;
+static volatile int ticking = FALSE;
 
 // Globals
+unsigned g_port = PORT;
+unsigned g_tick_ms = 50;
 unsigned g_max_players = 4;
+unsigned g_update_budget = 1024;
+unsigned g_max_handshakes = 16;
+unsigned g_max_rooms = 256;
+unsigned g_tick_threads = 0;
+unsigned g_region_cols = 1;
+unsigned g_region_rows = 1;
 unsigned g_map_wid = 32;
 unsigned g_map_hei = 12;
+mp_map g_map;
+uint64_t* g_walls;
+unsigned g_stats_secs = 10;
+int g_rx_timestamps = FALSE;
+int g_huge_pages = FALSE;
+mp_pool g_pool;
+mp_overload g_overload;
 
 // Function prototypes.
 int recv_loop(void);
+int shm_loop(void);
+void server_tick(void);
+void server_stats(void);
+mp_client* server_client_add(SOCKET);
+mp_client* server_client_join(mp_client* const, unsigned, unsigned long long, unsigned long long);
+mp_client* server_client_spectate(mp_client* const, unsigned);
+mp_room* server_room_get(unsigned);
+static int server_pool_init(void);
+static int server_start_ticking(void);
+static void server_stop_ticking(void);
+
+/*
+ * Print command line usage.
+ */
+static void usage(const char* name)
+{
+	printf("Usage: %s [-p port] [-U path] [-M map_file] [-P players] [-n rooms] [-b bytes] [-t threads] [-R cols[xrows]] [-w world_file] [-m secs] [-T] [-H] [-c capture_file] [-r replay_file [-f]] [-v]\n", name);
+	printf("  -p port  Port to listen on. (default %u)\n", g_port);
+	printf("  -U path  Also take same-host clients over shared memory,\n");
+	printf("           set up through a Unix socket at path.\n");
+	printf("  -M file  Load map from file. (default: empty %ux%u map)\n", g_map_wid, g_map_hei);
+	printf("  -P n     Players per room, up to 255. (default %u)\n", g_max_players);
+	printf("  -n n     Most rooms open at once. (default %u)\n", g_max_rooms);
+	printf("  -b bytes Most bytes in each update sent to a\n");
+	printf("           client. (default %u)\n", g_update_budget);
+	printf("  -t n     Threads to tick rooms on. (default: one per core)\n");
+	printf("  -R c[xr] Split each room's map into c by r regions,\n");
+	printf("           each ticked on its own thread. (default 1x1)\n");
+	printf("  -w file  Persist world state in file. (default %s)\n", WORLD_DEFAULT_PATH);
+	printf("  -m secs  Print session latency stats every secs. (0 = never)\n");
+	printf("  -T       Use kernel receive timestamps for latency.\n");
+	printf("  -H       Put session memory in huge pages.\n");
+	printf("  -c file  Record all inbound packets to file.\n");
+	printf("  -r file  Replay a capture instead of listening.\n");
+	printf("  -f       Replay as fast as possible.\n");
+	printf("  -v       Log more about what each session is doing.\n");
+}
 
 /*
  * Entry point of the program.
  *
  * @return status. 0 on normal termination.
  */
-int main(void)
+int main(int argc, char** argv)
 {
-	printf("-- Simple Game Server --\n");
+	// Parse options.
+	const char* map_path = 0;
+	const char* shm_path = 0;
+	const char* world_path = WORLD_DEFAULT_PATH;
+	const char* capture_path = 0;
+	const char* replay_path = 0;
+	int replay_fast = FALSE;
+	int verbose = FALSE;
+	int opt;
+	while ((opt = getopt(argc, argv, "p:U:M:P:n:b:t:R:w:m:THc:r:fvh")) != -1)
+	{
+		switch (opt)
+		{
+			case 'p': g_port = (unsigned)atoi(optarg); break;
+			case 'U': shm_path = optarg; break;
+			case 'M': map_path = optarg; break;
+			case 'P': g_max_players = (unsigned)atoi(optarg); break;
+			case 'n': g_max_rooms = (unsigned)atoi(optarg); break;
+			case 'b': g_update_budget = (unsigned)atoi(optarg); break;
+			case 't': g_tick_threads = (unsigned)atoi(optarg); break;
+			case 'R':
+			{
+				g_region_rows = 1;
+				if (sscanf(optarg, "%ux%u", &g_region_cols, &g_region_rows) < 1)
+				{
+					g_region_cols = 0;
+				}
+			} break;
+			case 'w': world_path = optarg; break;
+			case 'm': g_stats_secs = (unsigned)atoi(optarg); break;
+			case 'T': g_rx_timestamps = TRUE; break;
+			case 'H': g_huge_pages = TRUE; break;
+			case 'c': capture_path = optarg; break;
+			case 'r': replay_path = optarg; break;
+			case 'f': replay_fast = TRUE; break;
+			case 'v': verbose = TRUE; break;
+			default:
+			{
+				usage(argv[0]);
+				return opt == 'h' ? 0 : -1;
+			}
+		}
+	}
 
-	// Seed RNG
-	srand(time(0));
+	if (!g_port || g_port > 0xFFFF ||
+		!g_max_players || g_max_players > 255 ||
+		!g_max_rooms || g_max_rooms > 0xFFFF ||
+		g_update_budget < UPDATE_HEADER_BYTES + UPDATE_MOVED_BYTES || g_update_budget > 0xFFFF ||
+		!g_region_cols || !g_region_rows || g_region_cols * g_region_rows > REGION_MAX)
+	{
+		usage(argv[0]);
+		return -1;
+	}
+	if (!g_tick_threads)
+	{
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		g_tick_threads = cores > 0 ? (unsigned)cores : 1;
+	}
+	if (g_tick_threads > g_max_rooms * g_region_cols * g_region_rows)
+	{
+		g_tick_threads = g_max_rooms * g_region_cols * g_region_rows;
+	}
+
+	// From here on, logging is left to a thread of its
+	// own. Whatever is still waiting goes out on exit.
+	if (!log_init(verbose ? LOG_DEBUG : LOG_INFO))
+	{
+		printf("Failed to start logging.\n");
+		return -1;
+	}
+	atexit(log_deinit);
+	log_info("-- Simple Game Server --");
+
+	// Seed RNG. Replays use a fixed seed so that
+	// they're deterministic.
+	srand(replay_path ? 0 : time(0));
 
 	// Register signal interrupt handler.
 	struct sigaction sigact_inter;
 	sigact_inter.sa_handler = signal_interrupt_handler;
 	sigaction(SIGINT, &sigact_inter, NULL);
 
-	// Allocate TCP struct.
-	if (!(tcp = tcp_new()))
+	// Load the map, or make an empty one.
+	if (map_path)
+	{
+		if (!map_open(&g_map, map_path))
+		{
+			log_error("Failed to load map %s", map_path);
+			return -1;
+		}
+		log_info("Loaded %ux%u map from %s", g_map.wid, g_map.hei, map_path);
+	}
+	else if (!map_new(&g_map, g_map_wid, g_map_hei, TILE_FLOOR))
 	{
-		printf("Error initialising TCP connection!\n");
+		log_error("Failed to create map.");
 		return -1;
 	}
-	printf("TCP listener initialised. Listening...\n");
+	g_map_wid = g_map.wid;
+	g_map_hei = g_map.hei;
 
-	// Allocate memory for all the clients we will have.
-	size_t clients_size = sizeof(mp_client) * g_max_players;
-	if (!(clients = malloc(clients_size)))
+	// Every room shares the one set of walls.
+	if (!(g_walls = grid_walls(&g_map)))
 	{
-		printf("Failed to allocate memory for clients.");
-		exit(-1);
+		log_error("Failed to allocate memory for the map's walls.");
+		return -1;
 	}
-	memset(clients, 0, clients_size);
 
-	// Start receiving.
-	while (recv_loop() && !signal_interrupt_caught);
+	// Regions need to be wide enough that ghosts only
+	// ever come from the regions next to them.
+	if (g_region_cols * g_region_rows > 1 &&
+		((g_region_cols > 1 && g_map_wid / g_region_cols < REGION_GHOST_MARGIN * 2) ||
+		 (g_region_rows > 1 && g_map_hei / g_region_rows < REGION_GHOST_MARGIN * 2)))
+	{
+		log_error("%ux%u regions are too small for a %ux%u map.",
+			g_region_cols, g_region_rows, g_map_wid, g_map_hei);
+		return -1;
+	}
 
-	if (signal_interrupt_caught)
+	// Set up the lobby. Rooms themselves are only set
+	// up when someone first joins them.
+	if (!server_pool_init() ||
+		!room_init(&lobby, 0, g_max_handshakes, 0) ||
+		!(rooms = calloc(g_max_rooms, sizeof(mp_room))))
 	{
-		printf("Signal interrupt caught. Terminating...\n");
+		log_error("Failed to allocate memory for clients.");
+		exit(-1);
 	}
 
-	// Free memory
-	tcp_free(tcp);
-	if (clients)
+	int status = 0;
+	if (replay_path)
+	{
+		// Feed a capture through the server instead of
+		// listening for real connections.
+		status = replay_run(replay_path, replay_fast) ? 0 : -1;
+	}
+	else
 	{
-		for (unsigned i = 0; i < g_max_players; ++i)
+		// Map the world, resuming it if it exists.
+		if (!world_open(world_path))
+		{
+			return -1;
+		}
+
+		// Open capture file if requested.
+		if (capture_path)
+		{
+			if (!capture_open(capture_path))
+			{
+				log_error("Failed to open capture file %s", capture_path);
+				return -1;
+			}
+			log_info("Capturing inbound packets to %s", capture_path);
+		}
+
+		// Start listening.
+		if (!(listener = listener_new((unsigned short)g_port, 3)))
 		{
-			// Deinitialise each client before freeing all them.
-			// Need to do this to stop threads.
-			if (clients[i].initialised)
+			log_error("Failed to listen on port %u: %s", g_port, strerror(errno));
+			return -1;
+		}
+		log_info("Listening on port %u...", g_port);
+		if (shm_path)
+		{
+			if ((shm_sock = shm_listen(shm_path)) < 0)
+			{
+				log_error("Error listening for same-host clients on %s", shm_path);
+				return -1;
+			}
+			log_info("Listening for same-host clients on %s", shm_path);
+		}
+
+		// Rooms get ticked on their own threads.
+		if (!server_start_ticking())
+		{
+			return -1;
+		}
+		log_info("Up to %u rooms of %u players, ticked on %u threads.", g_max_rooms, g_max_players, g_tick_threads);
+		if (g_region_cols * g_region_rows > 1)
+		{
+			log_info("Each room is split into %ux%u regions.", g_region_cols, g_region_rows);
+		}
+
+		// Start receiving, keeping the lobby's timers
+		// going every tick.
+		unsigned long long tick_ns = g_tick_ms * NS_PER_MS;
+		unsigned long long next_tick = time_now_ns();
+		unsigned long long next_stats = next_tick + g_stats_secs * NS_PER_SEC;
+		while (!signal_interrupt_caught)
+		{
+			// Run the tick if it's due. If we've fallen
+			// behind, don't try and catch up.
+			unsigned long long now = time_now_ns();
+			if (g_stats_secs && now >= next_stats)
+			{
+				server_stats();
+				next_stats = now + g_stats_secs * NS_PER_SEC;
+			}
+			if (now >= next_tick)
+			{
+				timer_advance(&lobby.timers);
+				overload_update(&g_overload);
+				next_tick += tick_ns;
+				if (next_tick < now) next_tick = now + tick_ns;
+				continue;
+			}
+
+			// Otherwise wait for connections until it is.
+			struct pollfd pfds[2] = {
+				{ listener->handle, POLLIN, 0 },
+				{ shm_sock, POLLIN, 0 }
+			};
+			int wait_ms = (int)((next_tick - now + NS_PER_MS - 1) / NS_PER_MS);
+			if (poll(pfds, shm_sock >= 0 ? 2 : 1, wait_ms) <= 0)
+			{
+				continue;
+			}
+			if ((pfds[0].revents && !recv_loop()) ||
+				(pfds[1].revents && !shm_loop()))
 			{
-				client_deinit(&clients[i]);
+				break;
 			}
 		}
-		// Now free the array.
-		free(clients);
+
+		if (signal_interrupt_caught)
+		{
+			log_info("Signal interrupt caught. Terminating...");
+		}
+
+		// Free memory
+		server_stop_ticking();
+		listener_free(listener);
+		if (shm_sock >= 0)
+		{
+			close(shm_sock);
+			unlink(shm_path);
+		}
 	}
 
-	return 0;
+	// Deinitialise each room, which disconnects everyone
+	// in it, before freeing them all.
+	for (unsigned i = 0; i < g_max_rooms; ++i)
+	{
+		room_deinit(&rooms[i]);
+	}
+	free(rooms);
+	room_deinit(&lobby);
+	pool_deinit(&g_pool);
+
+	// Finish off the capture, and write the world out.
+	capture_close();
+	world_close();
+	free(g_walls);
+	map_free(&g_map);
+
+	return status;
 }
 
 /*
@@ -100,27 +385,259 @@ int main(void)
 int recv_loop(void)
 {
 	// Accept incoming connections
-	SOCKET csock = accept(tcp->handle, (struct sockaddr*)&tcp->addr, &tcp->addr_len);
+	struct sockaddr_in caddr;
+	socklen_t caddr_len = sizeof(caddr);
+	SOCKET csock = accept(listener->handle, (struct sockaddr*)&caddr, &caddr_len);
 	if (csock <= 0)
 	{
 		// Failed to accept connection.
 		// Just continue listening.
 		return TRUE;
 	}
-	printf("Accepted client connection request.\n");
+	log_debug("Accepted client connection request.");
 
-	// Now we initialise our client. Memory for it was
-	// allocated already on server startup.
+	// Find the client a slot.
+	mp_client* c = server_client_add(csock);
+	if (!c)
+	{
+		return TRUE;
+	}
+	c->addr = caddr.sin_addr.s_addr;
 
-	// Initialise client and their thread.
-	mp_client tmp;
-	client_init(&tmp, csock);
+	// All is good, we can actually start the client's worker thread.
+	client_start(c);
+
+	return TRUE;
+}
+
+/*
+ * Accept a client on the same host, and set up the
+ * shared memory its session goes through.
+ *
+ * @return TRUE if loop should continue.
+ */
+int shm_loop(void)
+{
+	SOCKET csock = accept(shm_sock, 0, 0);
+	if (csock < 0)
+	{
+		return TRUE;
+	}
+	log_debug("Accepted same-host connection request.");
 
+	mp_client* c = server_client_add(csock);
+	if (!c)
+	{
+		return TRUE;
+	}
+	mp_shm* shm = shm_serve(csock);
+	if (!shm)
+	{
+		log_warn("Couldn't set up shared memory for session %u.", c->session);
+		client_deinit(c);
+		return TRUE;
+	}
+	client_set_shm(c, shm);
+	c->addr = htonl(INADDR_LOOPBACK);
+
+	client_start(c);
+
+	return TRUE;
+}
+
+/*
+ * Tick thread. Ticks every room, or region of a room,
+ * that belongs to it, pinned to a core of its own
+ * where there are enough.
+ *
+ * @param arg  Thread's number.
+ */
+static void* server_tick_worker(void* arg)
+{
+	unsigned t = (unsigned)(uintptr_t)arg;
+
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cores > 0)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(t % cores, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		{
+			log_warn("Couldn't pin tick thread %u to a core.", t);
+		}
+	}
+
+	unsigned long long tick_ns = g_tick_ms * NS_PER_MS;
+	unsigned long long next_tick = time_now_ns();
+	unsigned long long next_shed = 0;
+	while (ticking)
+	{
+		// While shedding, each room loses a client every
+		// so often until the load comes down.
+		unsigned long long start = time_now_ns();
+		int shed = overload_stage(&g_overload) == OVERLOAD_SHED && start >= next_shed;
+		if (shed) next_shed = start + OVERLOAD_SHED_MS * NS_PER_MS;
+		for (unsigned i = 0; i < g_max_rooms; ++i)
+		{
+			mp_room* r = &rooms[i];
+			if (!atomic_load_explicit(&r->open, memory_order_acquire))
+			{
+				continue;
+			}
+			if (!r->region_count)
+			{
+				if (i % g_tick_threads != t) continue;
+				if (shed) room_shed(r);
+				room_tick(r);
+				continue;
+			}
+
+			// The first region's thread sheds for the room.
+			for (unsigned k = 0; k < r->region_count; ++k)
+			{
+				if ((i + k) % g_tick_threads != t) continue;
+				if (shed && !k) room_shed(r);
+				room_tick_region(r, k);
+			}
+		}
+
+		// Let the main thread know how long that took. If
+		// we've fallen behind, don't try and catch up.
+		unsigned long long now = time_now_ns();
+		overload_report(&g_overload, t, now - start, tick_ns);
+		next_tick += tick_ns;
+		if (next_tick < now) next_tick = now + tick_ns;
+		time_sleep_until_ns(next_tick);
+	}
+	return 0;
+}
+
+/*
+ * Start the tick threads.
+ *
+ * @return FALSE on failure.
+ */
+static int server_start_ticking(void)
+{
+	if (!(tick_threads = calloc(g_tick_threads, sizeof(pthread_t))) ||
+		!overload_init(&g_overload, g_tick_threads))
+	{
+		log_error("Failed to allocate tick threads.");
+		return FALSE;
+	}
+	ticking = TRUE;
+	for (unsigned t = 0; t < g_tick_threads; ++t)
+	{
+		if (pthread_create(&tick_threads[t], 0, server_tick_worker, (void*)(uintptr_t)t) != 0)
+		{
+			log_error("Failed to create tick thread");
+			g_tick_threads = t;
+			server_stop_ticking();
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Set up the pool that sessions come out of. It's
+ * sized for every connection and room slot there can
+ * be, so that connecting and disconnecting never
+ * allocate.
+ *
+ * @return FALSE on failure.
+ */
+static int server_pool_init(void)
+{
+	unsigned counts[POOL_CLASSES] = { 0 };
+	unsigned slots = g_max_rooms * (g_max_players + ROOM_MAX_SPECTATORS);
+
+	// The lobby's slots, the room slots, and one spare
+	// for turning people away when the lobby is full.
+	client_reserve(counts, g_max_handshakes + slots + 1, slots);
+	room_reserve(counts, 1, g_max_handshakes);
+	room_reserve(counts, g_max_rooms, g_max_players);
+
+	if (!pool_init(&g_pool, counts, g_huge_pages))
+	{
+		log_error("Failed to reserve memory for sessions.");
+		return FALSE;
+	}
+	log_info("Reserved %zu KB for %u sessions%s.", g_pool.size / 1024,
+		g_max_handshakes + slots, g_pool.huge ? " in huge pages" : "");
+	return TRUE;
+}
+
+/*
+ * Stop the tick threads, and wait for them to finish.
+ */
+static void server_stop_ticking(void)
+{
+	ticking = FALSE;
+	for (unsigned t = 0; t < g_tick_threads && tick_threads; ++t)
+	{
+		pthread_join(tick_threads[t], 0);
+	}
+	free(tick_threads);
+	tick_threads = 0;
+	overload_deinit(&g_overload);
+}
+
+/*
+ * Run a tick of everything on the calling thread: the
+ * lobby's timers, then every open room. (Replays use
+ * this, so that they run on a single thread)
+ */
+void server_tick(void)
+{
+	timer_advance(&lobby.timers);
+	for (unsigned i = 0; i < g_max_rooms; ++i)
+	{
+		if (atomic_load_explicit(&rooms[i].open, memory_order_acquire))
+		{
+			room_tick(&rooms[i]);
+		}
+	}
+}
+
+/*
+ * Print latency stats for each session, and how much
+ * of the session pool is in use.
+ */
+void server_stats(void)
+{
+	pool_stats(&g_pool);
+	if (g_overload.threads)
+	{
+		log_info("Tick load: %u%% of the tick, overload stage %d",
+			overload_load(&g_overload) / 10, overload_stage(&g_overload));
+	}
+	for (unsigned i = 0; i < g_max_rooms; ++i)
+	{
+		if (atomic_load_explicit(&rooms[i].open, memory_order_acquire))
+		{
+			room_stats(&rooms[i]);
+		}
+	}
+}
+
+/*
+ * Add a newly connected client to the server. They
+ * wait in the lobby until they've said whether they're
+ * joining or resuming.
+ *
+ * @param csock  The client's socket.
+ *
+ * @return the client's slot, or 0 if the server is full.
+ */
+mp_client* server_client_add(SOCKET csock)
+{
 	// Look for an empty slot to store the client.
 	int slot = -1;
-	for (unsigned i = 0; i < g_max_players; ++i)
+	for (unsigned i = 0; i < lobby.max_players; ++i)
 	{
-		if (!clients[i].initialised)
+		if (!lobby.clients[i].initialised)
 		{
 			slot = i;
 			break;
@@ -130,23 +647,152 @@ int recv_loop(void)
 	{
 		// Server is full. Send the SERVER_FULL error
 		// code back to client, and close their connection.
-		ostream_begin(tmp.os, P_ERROR);
-		owrite_err(tmp.os, ERR_SERVER_FULL);
-		ostream_flush(tmp.os);
+		// (Without setting up streams for them, which
+		// can fail just when the server is busiest)
+		if (csock >= 0)
+		{
+			unsigned char full[2] = { P_ERROR, ERR_SERVER_FULL };
+			send(csock, full, sizeof(full), MSG_NOSIGNAL);
+			close(csock);
+		}
+		return 0;
+	}
 
-		client_deinit(&tmp);
-		return TRUE;
+	// We have a slot, so initialise our client in it. Memory
+	// for it was allocated already on server startup.
+	mp_client* c = &lobby.clients[slot];
+	client_init(c, csock);
+	client_set_index(c, slot);
+	c->session = next_session++;
+
+	return c;
+}
+
+/*
+ * Get a room, setting it up if nobody has joined it
+ * before.
+ *
+ * @param id  Room's id.
+ *
+ * @return the room, or 0 if there's no such room or
+ *         it couldn't be set up.
+ */
+static mp_room* server_room_open(unsigned id)
+{
+	if (!id || id > g_max_rooms)
+	{
+		return 0;
 	}
 
-	// We have a slot, so copy the
-	// old structure into this.
-	clients[slot] = tmp;
-	client_set_index(&clients[slot], slot);
+	mp_room* r = &rooms[id - 1];
+	if (atomic_load_explicit(&r->open, memory_order_acquire))
+	{
+		return r;
+	}
 
-	// All is good, we can actually start the client's worker thread.
-	client_start(&clients[slot]);
+	// Only one thread sets each room up, and nobody
+	// waits on it to open any other room.
+	pthread_mutex_lock(&rooms_lock);
+	while (r->opening)
+	{
+		pthread_cond_wait(&rooms_opened, &rooms_lock);
+	}
+	int mine = !atomic_load(&r->open);
+	r->opening = mine;
+	pthread_mutex_unlock(&rooms_lock);
 
-	return TRUE;
+	if (mine)
+	{
+		if (room_init(r, id, g_max_players, &g_map))
+		{
+			log_info("Opened room %u.", id);
+		}
+		else
+		{
+			log_error("Failed to set up room %u.", id);
+		}
+
+		pthread_mutex_lock(&rooms_lock);
+		r->opening = FALSE;
+		pthread_cond_broadcast(&rooms_opened);
+		pthread_mutex_unlock(&rooms_lock);
+	}
+	return atomic_load(&r->open) ? r : 0;
+}
+
+/*
+ * Move a connection that has done its handshake out of
+ * the lobby into a player slot: either the session
+ * it's resuming, or a free slot in a room as a new
+ * player. The player is sent P_HELLO.
+ *
+ * @param c      The connection's lobby slot.
+ * @param room   Room to join, or 0 for any room with
+ *               space, opening a new one if need be.
+ * @param token  Token of the session to resume, or 0
+ *               to join as a new player.
+ * @param tick   Tick of the last update the client got,
+ *               if resuming.
+ *
+ * @return the player's slot, or 0 if there wasn't one.
+ */
+mp_client* server_client_join(mp_client* const c, unsigned room, unsigned long long token, unsigned long long tick)
+{
+	mp_client* p = 0;
+	if (token)
+	{
+		// The session could be in any room.
+		for (unsigned i = 0; i < g_max_rooms && !p; ++i)
+		{
+			if (atomic_load_explicit(&rooms[i].open, memory_order_acquire))
+			{
+				p = room_resume(&rooms[i], c, token, tick);
+			}
+		}
+	}
+	else if (room)
+	{
+		mp_room* r = server_room_open(room);
+		if (r) p = room_join(r, c);
+	}
+	else
+	{
+		// Fill up open rooms before opening new ones.
+		for (unsigned i = 0; i < g_max_rooms && !p; ++i)
+		{
+			mp_room* r = &rooms[i];
+			if (atomic_load_explicit(&r->open, memory_order_acquire) && !room_full(r))
+			{
+				p = room_join(r, c);
+			}
+		}
+		for (unsigned i = 0; i < g_max_rooms && !p; ++i)
+		{
+			if (!atomic_load_explicit(&rooms[i].open, memory_order_acquire))
+			{
+				mp_room* r = server_room_open(i + 1);
+				if (r) p = room_join(r, c);
+			}
+		}
+	}
+	return p;
+}
+
+/*
+ * Move a connection that has done its handshake out of
+ * the lobby into a spectator slot in a room. The room
+ * has to be open already; watching doesn't open it.
+ *
+ * @param c     The connection's lobby slot.
+ * @param room  Room to watch.
+ *
+ * @return the spectator's slot, or 0 if the room isn't
+ *         open or has no spectator slots left.
+ */
+mp_client* server_client_spectate(mp_client* const c, unsigned room)
+{
+	mp_room* r = room ? server_room_get(room) : 0;
+	return r ? room_spectate(r, c) : 0;
 }
 
 /*
@@ -154,25 +800,47 @@ int recv_loop(void)
  */
 unsigned server_player_count(void)
 {
-	// Iterate over the clients array, and count all
-	// those who are properly initialised.
+	// Add up the players in every room.
 	unsigned count = 0;
-	for (unsigned i = 0; i < g_max_players; ++i)
+	for (unsigned i = 0; i < g_max_rooms; ++i)
 	{
-		if (clients[i].initialised)
+		if (atomic_load_explicit(&rooms[i].open, memory_order_acquire))
 		{
-			++count;
+			count += atomic_load(&rooms[i].players);
 		}
 	}
 	return count;
 }
 
 /*
- * Get a client.
+ * @return the number of rooms open.
+ */
+unsigned server_room_count(void)
+{
+	unsigned count = 0;
+	for (unsigned i = 0; i < g_max_rooms; ++i)
+	{
+		count += atomic_load_explicit(&rooms[i].open, memory_order_relaxed) != 0;
+	}
+	return count;
+}
+
+/*
+ * Get a room.
+ *
+ * @param id  Id of the room, or 0 for the lobby.
  *
- * @param i  Index of client to get.
+ * @return the room, or 0 if it isn't open.
  */
-mp_client* server_client_get(size_t i)
+mp_room* server_room_get(unsigned id)
 {
-	return &clients[i];
+	if (!id)
+	{
+		return &lobby;
+	}
+	if (id > g_max_rooms || !atomic_load_explicit(&rooms[id - 1].open, memory_order_acquire))
+	{
+		return 0;
+	}
+	return &rooms[id - 1];
 }
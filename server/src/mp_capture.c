@@ -0,0 +1,304 @@
+/*
+ * mp_capture.c
+ *
+ * Recording of inbound packets, and replaying of
+ * those recordings through the server's dispatch
+ * path without any sockets.
+ */
+
+#include "pch.h"
+#include "mp_rtt.h"
+#include "mp_rate.h"
+#include "mp_timer.h"
+#include "mp_grid.h"
+#include "mp_client.h"
+#include "mp_region.h"
+#include "mp_room.h"
+#include "mp_capture.h"
+
+// Forward declarations of externals that we reference.
+extern unsigned g_tick_ms;
+extern unsigned g_max_rooms;
+extern void server_tick(void);
+extern mp_room* server_room_get(unsigned);
+extern mp_client* server_client_add(SOCKET);
+extern mp_client* server_client_join(mp_client* const, unsigned, unsigned long long, unsigned long long);
+
+// Capture state. Client threads all write to the
+// one file, so writes are serialised by the lock.
+static FILE* cap_file = 0;
+static unsigned long long cap_start = 0;
+static pthread_mutex_t cap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Write x into buf as n little-endian bytes.
+static void put_le(unsigned char* buf, unsigned long long x, unsigned n)
+{
+	for (unsigned i = 0; i < n; ++i)
+	{
+		buf[i] = (unsigned char)(x >> (i * 8));
+	}
+}
+
+// Read n little-endian bytes from buf.
+static unsigned long long get_le(const unsigned char* buf, unsigned n)
+{
+	unsigned long long x = 0;
+	for (unsigned i = 0; i < n; ++i)
+	{
+		x |= (unsigned long long)buf[i] << (i * 8);
+	}
+	return x;
+}
+
+/*
+ * Begin capturing to a file.
+ *
+ * @param path  File to write capture to. Truncated if it exists.
+ *
+ * @return FALSE on failure.
+ */
+int capture_open(const char* path)
+{
+	if (!(cap_file = fopen(path, "wb")))
+	{
+		return FALSE;
+	}
+
+	// Write header.
+	unsigned char hdr[CAPTURE_HEADER_SIZE];
+	memcpy(hdr, CAPTURE_MAGIC, 4);
+	put_le(hdr + 4, CAPTURE_VERSION, 4);
+	fwrite(hdr, sizeof(hdr), 1, cap_file);
+
+	cap_start = time_now_ns();
+	return TRUE;
+}
+
+/*
+ * Stop capturing, and flush anything left to disk.
+ */
+void capture_close(void)
+{
+	pthread_mutex_lock(&cap_lock);
+	if (cap_file)
+	{
+		fclose(cap_file);
+		cap_file = 0;
+	}
+	pthread_mutex_unlock(&cap_lock);
+}
+
+/*
+ * @return whether a capture is in progress.
+ */
+int capture_enabled(void)
+{
+	return cap_file != 0;
+}
+
+/*
+ * Append a record to the capture.
+ *
+ * @param type     Type of record.
+ * @param session  Session the record belongs to.
+ * @param data     Packet data. (May be null for non-packet records)
+ * @param len      Length of data.
+ */
+void capture_write(enum mp_capture_rec type, unsigned session, const unsigned char* data, unsigned len)
+{
+	// Take timestamp before waiting on the lock.
+	unsigned long long t = time_now_ns() - cap_start;
+
+	// Packets larger than a record can describe are cut
+	// short. (None of ours come close)
+	if (len > 0xFFFF) len = 0xFFFF;
+
+	unsigned char rec[CAPTURE_RECORD_SIZE];
+	rec[0] = (unsigned char)type;
+	put_le(rec + 1, session, 4);
+	put_le(rec + 5, t, 8);
+	put_le(rec + 13, len, 2);
+
+	pthread_mutex_lock(&cap_lock);
+	if (cap_file)
+	{
+		fwrite(rec, sizeof(rec), 1, cap_file);
+		if (len) fwrite(data, len, 1, cap_file);
+	}
+	pthread_mutex_unlock(&cap_lock);
+}
+
+/*
+ * Find the client slot that a replayed session is using,
+ * in the lobby or any room, as a player or spectator.
+ *
+ * @return the client, or 0 if the session isn't connected.
+ */
+static mp_client* replay_find(unsigned session)
+{
+	for (unsigned id = 0; id <= g_max_rooms; ++id)
+	{
+		mp_room* r = server_room_get(id);
+		if (!r) continue;
+		for (unsigned i = 0; i < r->max_players; ++i)
+		{
+			mp_client* c = &r->clients[i];
+			if (c->initialised && c->session == session)
+			{
+				return c;
+			}
+		}
+		for (unsigned i = 0; i < ROOM_MAX_SPECTATORS; ++i)
+		{
+			mp_client* c = &r->spectators[i];
+			if (c->initialised && c->session == session)
+			{
+				return c;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Replay a capture file through the server. Everything
+ * runs on the calling thread. Responses are encoded as
+ * usual but go nowhere. Ticks are run in capture time,
+ * so they line up with the packets the same way no
+ * matter how fast we're replaying.
+ *
+ * @param path  Capture file to replay.
+ * @param fast  If non-zero, don't wait between packets.
+ *
+ * @return FALSE on failure.
+ */
+int replay_run(const char* path, int fast)
+{
+	// Read the whole capture in.
+	FILE* f = fopen(path, "rb");
+	if (!f)
+	{
+		log_error("Failed to open capture file %s", path);
+		return FALSE;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	unsigned char* buf = malloc(size > 0 ? size : 1);
+	if (!buf || fread(buf, 1, size, f) != (size_t)size)
+	{
+		log_error("Failed to read capture file %s", path);
+		fclose(f);
+		free(buf);
+		return FALSE;
+	}
+	fclose(f);
+
+	// Check header.
+	if (size < CAPTURE_HEADER_SIZE ||
+		memcmp(buf, CAPTURE_MAGIC, 4) != 0 ||
+		get_le(buf + 4, 4) != CAPTURE_VERSION)
+	{
+		log_error("%s is not a valid capture file.", path);
+		free(buf);
+		return FALSE;
+	}
+
+	log_info("Replaying %s (%s)...", path, fast ? "fast" : "original speed");
+
+	unsigned long long packets = 0, bytes = 0;
+	unsigned long long start = time_now_ns();
+	unsigned long long tick_ns = g_tick_ms * NS_PER_MS, next_tick = 0, ticks = 0;
+	size_t pos = CAPTURE_HEADER_SIZE;
+	while (pos + CAPTURE_RECORD_SIZE <= (size_t)size)
+	{
+		// Decode the record.
+		const unsigned char* rec = buf + pos;
+		enum mp_capture_rec type = (enum mp_capture_rec)rec[0];
+		unsigned session = (unsigned)get_le(rec + 1, 4);
+		unsigned long long t = get_le(rec + 5, 8);
+		unsigned len = (unsigned)get_le(rec + 13, 2);
+		pos += CAPTURE_RECORD_SIZE;
+		if (pos + len > (size_t)size)
+		{
+			log_warn("Capture is truncated.");
+			break;
+		}
+		const unsigned char* data = buf + pos;
+		pos += len;
+
+		// Keep to the original timing.
+		if (!fast)
+		{
+			time_sleep_until_ns(start + t);
+		}
+
+		// Run any ticks that happened before this.
+		while (next_tick <= t)
+		{
+			server_tick();
+			next_tick += tick_ns;
+			++ticks;
+		}
+
+		mp_client* c = replay_find(session);
+		switch (type)
+		{
+			case CAP_CONNECT:
+			{
+				if (c) break;
+				if (!(c = server_client_add(-1)))
+				{
+					log_warn("Replay: no slot for session %u", session);
+					break;
+				}
+				c->session = session;
+			} break;
+
+			case CAP_PACKET:
+			{
+				if (!c) break;
+
+				// Dispatch exactly as a client thread would.
+				// Their first packet gets them out of the lobby.
+				// (Resume tokens are random, so sessions can't be
+				// found again; they join afresh instead)
+				istream_set_mem(c->is, data, len);
+				if (!c->room->id)
+				{
+					if (len && data[0] == P_RESUME ?
+						!server_client_join(c, 0, 0, 0) :
+						!client_handshake(c))
+					{
+						log_warn("Replay: no slot for session %u", session);
+						client_deinit(c);
+					}
+				}
+				else if (!client_process(c))
+				{
+					client_deinit(c);
+				}
+				++packets;
+				bytes += len;
+			} break;
+
+			case CAP_DISCONN:
+			{
+				if (c) client_deinit(c);
+			} break;
+
+			default:
+			{
+				log_warn("Replay: skipping unknown record type %d", type);
+			} break;
+		}
+	}
+
+	// Report how it went.
+	double secs = (double)(time_now_ns() - start) / NS_PER_SEC;
+	log_info("Replayed %llu packets (%llu bytes) and %llu ticks in %.3f s (%.0f packets/s)",
+		packets, bytes, ticks, secs, secs > 0 ? packets / secs : 0.0);
+
+	free(buf);
+	return TRUE;
+}
@@ -0,0 +1,43 @@
+#ifndef MP_CAPTURE_H
+#define MP_CAPTURE_H
+
+/*
+ * Inbound packet capture.
+ *
+ * The capture file is an append-only binary log. It
+ * begins with a header:
+ *   + [4 bytes] magic "MPCP"
+ *   + [u32] format version
+ *
+ * followed by any number of records:
+ *   + [u8] record type (see below)
+ *   + [u32] session id
+ *   + [u64] time since capture began, in nanoseconds
+ *   + [u16] length of packet data
+ *   + packet data (as received, including control code)
+ *
+ * All values are little-endian.
+ */
+#define CAPTURE_MAGIC "MPCP"
+#define CAPTURE_VERSION 2 // 2: P_JOIN carries a token.
+#define CAPTURE_HEADER_SIZE 8
+#define CAPTURE_RECORD_SIZE 15
+
+// Record types.
+enum mp_capture_rec
+{
+	CAP_CONNECT = 1,
+	CAP_PACKET  = 2,
+	CAP_DISCONN = 3,
+};
+
+// Capturing
+int capture_open(const char*);
+void capture_close(void);
+int capture_enabled(void);
+void capture_write(enum mp_capture_rec, unsigned, const unsigned char*, unsigned);
+
+// Replaying
+int replay_run(const char*, int);
+
+#endif
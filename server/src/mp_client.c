@@ -5,14 +5,86 @@
  */
 
 #include "pch.h"
+#include "mp_rtt.h"
+#include "mp_rate.h"
+#include "mp_timer.h"
+#include "mp_grid.h"
 #include "mp_client.h"
+#include "mp_region.h"
+#include "mp_room.h"
+#include "mp_overload.h"
+#include "mp_capture.h"
+#include "mp_world.h"
 
 // Forward declarations of externals that we reference.
-extern unsigned g_max_players;
 extern unsigned g_map_wid;
 extern unsigned g_map_hei;
+extern mp_map g_map;
+extern int g_rx_timestamps;
+extern mp_pool g_pool;
+extern unsigned g_max_players;
+extern unsigned g_max_rooms;
+extern unsigned g_update_budget;
+extern unsigned g_region_cols;
+extern unsigned g_region_rows;
+extern mp_overload g_overload;
 extern unsigned server_player_count(void);
-extern mp_client* server_client_get(size_t);
+extern unsigned server_room_count(void);
+extern mp_client* server_client_join(mp_client* const, unsigned, unsigned long long, unsigned long long);
+extern mp_client* server_client_spectate(mp_client* const, unsigned);
+extern mp_room* server_room_get(unsigned);
+
+static void client_idle_check(mp_timer*);
+static void client_ping_due(mp_timer*);
+
+/*
+ * @return the most bytes in any packet the server
+ *         sends, which is how big a client's output
+ *         buffer is made so it never has to grow.
+ */
+static unsigned client_packet_max(void)
+{
+	unsigned hello = 23;
+	unsigned update = UPDATE_HEADER_BYTES + (UPDATE_MOVED_BYTES + UPDATE_GONE_BYTES) * g_max_players;
+	if (update > g_update_budget) update = g_update_budget;
+	unsigned join = 2 + 5 * JOIN_CHUNK_PLAYERS;
+	unsigned map = 5 + MAP_CHUNK_TILES;
+	unsigned max = hello;
+	if (update > max) max = update;
+	if (join > max) max = join;
+	if (map > max) max = map;
+	return max;
+}
+
+/*
+ * Count the pool blocks that clients need.
+ *
+ * @param counts       Blocks in each pool class, to
+ *                     add to.
+ * @param connections  Most connections there can be
+ *                     at once.
+ * @param slots        Player and spectator slots in
+ *                     all the rooms.
+ */
+void client_reserve(unsigned* const counts, unsigned connections, unsigned slots)
+{
+	// A connection's streams, and its output buffer.
+	pool_reserve(counts, sizeof(mp_ostream), connections);
+	pool_reserve(counts, sizeof(mp_istream), connections);
+	pool_reserve(counts, client_packet_max(), connections);
+
+	// A slot's join stream, what it's seen of everyone,
+	// and its map bitset.
+	pool_reserve(counts, g_max_players * sizeof(unsigned long long), slots);
+	pool_reserve(counts, g_max_players * sizeof(mp_client_seen), slots);
+	pool_reserve(counts, (g_map.chunks_x * g_map.chunks_y + 7) / 8, slots);
+
+	// Players' inputs, if rooms are split into regions.
+	if (g_region_cols * g_region_rows > 1)
+	{
+		pool_reserve(counts, CLIENT_INPUT_QUEUE * sizeof(mp_client_input), slots);
+	}
+}
 
 /*
  * Initialise a client.
@@ -25,24 +97,96 @@ void client_init(mp_client* const c, SOCKET sock)
 	// Set main members. (We set to initialised after
 	// all these initialisations)
 	c->initialised = FALSE;
+	c->ready = FALSE;
+	c->held = FALSE;
+	c->left = FALSE;
+	c->token = 0;
+	c->sent_tick = 0;
 	c->thr_running = FALSE;
 	c->sock = sock;
+	c->shm = 0;
 	c->x = c->y = 0;
+	c->placed = FALSE;
+	c->input_seq = 0;
+	c->input_queued = 0;
+	c->inputs.buf = 0;
+	rtt_init(&c->rtt);
+	rate_init(&c->rate);
+	c->connected = 0;
+	atomic_store(&c->last_rx, TIMER_NEVER);
+	timer_init(&c->idle_timer, client_idle_check, c);
+	timer_init(&c->ping_timer, client_ping_due, c);
 	c->index = -1;
+	c->session = 0;
+	c->addr = 0;
+	c->save = -1;
+	c->join_len = c->join_pos = 0;
+	c->map_pos = 0;
+	c->join = 0;
+	c->seen = 0;
+	c->map_sent = 0;
+	c->os = 0;
+	c->is = 0;
 
-	// Initialise I/O streams.
-	if (!(c->os = ostream_new(sock)))
+	// Connections arrive in the lobby, and their
+	// streams go with them when they join a room. (See
+	// client_take) Room slots instead need room for
+	// the join stream to list everyone, and to keep
+	// track of what they've been sent of everyone and
+	// which parts of the map they have.
+	// Everything comes from the pool; see
+	// client_reserve.
+	if (!c->room->id)
 	{
-		printf("Failed to allocate ostream for client!");
-		return;
+		if (!(c->os = ostream_new_pool(sock, client_packet_max(), &g_pool)))
+		{
+			log_error("Failed to allocate ostream for client!");
+			return;
+		}
+		if (!(c->is = istream_new_pool(sock, &g_pool)))
+		{
+			log_error("Failed to allocate istream for client!");
+			return;
+		}
 	}
-	if (!(c->is = istream_new(sock)))
+	else
 	{
-		printf("Failed to allocate istream for client!");
-		return;
+		size_t map_bytes = (g_map.chunks_x * g_map.chunks_y + 7) / 8;
+		if (!(c->join = pool_alloc(&g_pool, c->room->max_players * sizeof(unsigned long long))))
+		{
+			log_error("Failed to allocate join stream for client!");
+			return;
+		}
+		if (!(c->seen = pool_alloc(&g_pool, c->room->max_players * sizeof(mp_client_seen))))
+		{
+			log_error("Failed to allocate player state for client!");
+			return;
+		}
+		if (!(c->map_sent = pool_alloc(&g_pool, map_bytes)))
+		{
+			log_error("Failed to allocate map state for client!");
+			return;
+		}
+		memset(c->map_sent, 0, map_bytes);
+
+		// Players' moves wait for their region's tick.
+		if (c->room->region_count && !c->spectator)
+		{
+			void* inputs = pool_alloc(&g_pool, CLIENT_INPUT_QUEUE * sizeof(mp_client_input));
+			if (!inputs)
+			{
+				log_error("Failed to allocate input queue for client!");
+				return;
+			}
+			spsc_init_mem(&c->inputs, inputs, sizeof(mp_client_input), CLIENT_INPUT_QUEUE);
+		}
 	}
 
 	c->initialised = TRUE;
+	if (!c->spectator)
+	{
+		atomic_fetch_add(&c->room->players, 1);
+	}
 }
 
 /*
@@ -56,6 +200,21 @@ void client_set_index(mp_client* const c, int idx)
 	c->index = idx;
 }
 
+/*
+ * Have a client's streams go through a shared memory
+ * session instead of their socket. The client owns it
+ * from then on.
+ *
+ * @param c    Client to modify.
+ * @param shm  Session, set up over the client's socket.
+ */
+void client_set_shm(mp_client* const c, mp_shm* const shm)
+{
+	c->shm = shm;
+	c->os->shm = shm;
+	c->is->shm = shm;
+}
+
 /*
  * Actually start the client's worker thread.
  *
@@ -63,12 +222,17 @@ void client_set_index(mp_client* const c, int idx)
  */
 void client_start(mp_client* const c)
 {
+	// Give them a while to say something.
+	c->connected = timer_now(&c->room->timers);
+	timer_arm(&c->room->timers, &c->idle_timer, CLIENT_HANDSHAKE_MS);
+	timer_arm(&c->room->timers, &c->ping_timer, RTT_PING_MS);
+
 	// Start the client's thread.
 	c->thr_running = TRUE;
 	int status = pthread_create(&c->thr, 0, client_worker, (void*)c);
 	if (status != 0)
 	{
-		printf("Failed to create client thread\n");
+		log_error("Failed to create client thread");
 		c->thr_running = FALSE;
 		return;
 	}
@@ -84,6 +248,11 @@ void client_start(mp_client* const c)
  */
 void client_deinit(mp_client* const c)
 {
+	if (c->initialised && !c->spectator)
+	{
+		atomic_fetch_sub(&c->room->players, 1);
+	}
+
 	// Tell thread to stop and join.
 	if (c->thr_running)
 	{
@@ -91,114 +260,945 @@ void client_deinit(mp_client* const c)
 		pthread_join(c->thr, 0);
 	}
 
+	// Stop the timers.
+	timer_cancel(&c->room->timers, &c->idle_timer);
+	timer_cancel(&c->room->timers, &c->ping_timer);
+
+	// Remember where the player was, and free
+	// up their tile.
+	world_leave(c);
+	if (c->placed)
+	{
+		grid_release(&c->room->grid, c->x, c->y);
+		c->placed = FALSE;
+	}
+
 	// De-allocate everything.
 	ostream_free(c->os);
 	istream_free(c->is);
+	c->os = 0;
+	c->is = 0;
+	shm_free(c->shm);
+	c->shm = 0;
+	pool_free(&g_pool, c->join);
+	c->join = 0;
+	pool_free(&g_pool, c->seen);
+	c->seen = 0;
+	pool_free(&g_pool, c->map_sent);
+	c->map_sent = 0;
+	pool_free(&g_pool, c->inputs.buf);
+	c->inputs.buf = 0;
 
-	// Close socket.
-	close(c->sock);
-	c->sock = 0;
+	// Close socket. (Replayed sessions don't have one)
+	if (c->sock >= 0)
+	{
+		close(c->sock);
+	}
+	c->sock = -1;
+
+	// Everyone else gets told they've gone.
+	if (c->ready && !c->spectator)
+	{
+		atomic_store(&c->changed, timer_now(&c->room->timers));
+	}
 
 	c->x = c->y = 0;
 
+	c->ready = FALSE;
+	c->held = FALSE;
 	c->initialised = FALSE;
 }
 
 /*
- * Client worker thread
+ * Move a client's connection into another slot,
+ * leaving the first slot free. This is how clients
+ * get from the slot they did their handshake in to
+ * their player slot. Both clients must be locked,
+ * and the calling thread becomes the new slot's
+ * worker.
+ *
+ * @param c     Client to move the connection into.
+ * @param from  Client to take it from.
  */
-void* client_worker(void* arg)
+void client_take(mp_client* const c, mp_client* const from)
 {
-	// Cast argument back to a client struct.
-	mp_client* const c = (mp_client* const)arg;
+	// Swap the old streams out for the new ones.
+	ostream_free(c->os);
+	istream_free(c->is);
+	shm_free(c->shm);
+	c->os = from->os;
+	c->is = from->is;
+	c->sock = from->sock;
+	c->shm = from->shm;
+	from->os = 0;
+	from->is = 0;
+	from->sock = -1;
+	from->shm = 0;
 
-	printf("Started client worker thread.\n");
+	c->addr = from->addr;
+	c->session = from->session;
+	c->thr = from->thr;
+	c->thr_running = from->thr_running;
+	c->connected = from->connected;
+	atomic_store(&c->last_rx, atomic_load(&from->last_rx));
+	c->held = FALSE;
+	c->left = FALSE;
+	rate_init(&c->rate);
 
-	// Send a hello packet to client, telling them that they're in.
+	// The timers follow the connection. Spectators
+	// aren't pinged; they only need to stay connected.
+	timer_arm(&c->room->timers, &c->idle_timer, CLIENT_IDLE_MS);
+	if (!c->spectator)
 	{
-		ostream_begin(c->os, P_HELLO);
+		timer_arm(&c->room->timers, &c->ping_timer, RTT_PING_MS);
+	}
+
+	from->thr_running = FALSE;
+	client_deinit(from);
+}
+
+/*
+ * Hold a player's session after their connection
+ * has dropped. They stay in the game, standing still,
+ * and can take the session back with P_RESUME until
+ * the hold runs out. The caller must hold the lock.
+ *
+ * @param c  Client whose connection dropped.
+ */
+void client_hold(mp_client* const c)
+{
+	log_info("Holding session %u for %u s.", c->session, CLIENT_RESUME_MS / 1000);
+	close(c->sock);
+	c->sock = -1;
+	istream_set_sock(c->is, -1);
+	c->os->sock = -1;
+	shm_free(c->shm);
+	c->shm = c->is->shm = c->os->shm = 0;
+	c->thr_running = FALSE;
+	c->held = TRUE;
+
+	// The idle timer ends the hold.
+	timer_cancel(&c->room->timers, &c->ping_timer);
+	timer_arm(&c->room->timers, &c->idle_timer, CLIENT_RESUME_MS);
+}
+
+// Order join stream entries nearest first.
+static int join_cmp(const void* a, const void* b)
+{
+	unsigned long long x = *(const unsigned long long*)a;
+	unsigned long long y = *(const unsigned long long*)b;
+	return (x > y) - (x < y);
+}
 
-		// Player counts (cur, max)
-		owrite_u8(c->os, (unsigned char)server_player_count());
-		owrite_u8(c->os, (unsigned char)g_max_players);
-		owrite_u8(c->os, (unsigned char)c->index);
+// Distance between two coordinates on a map that wraps.
+static unsigned wrap_dist(int a, int b, unsigned size)
+{
+	unsigned d = (unsigned)abs(a - b);
+	return d < size - d ? d : size - d;
+}
+
+// Write the P_HELLO packet.
+static void client_write_hello(mp_client* const c)
+{
+	ostream_begin(c->os, P_HELLO);
+
+	// Max player count, and our index.
+	owrite_u8(c->os, (unsigned char)c->room->max_players);
+	owrite_u8(c->os, (unsigned char)(c->spectator ? 0xFF : c->index));
+
+	// Map width/height
+	owrite_u16(c->os, (unsigned short)g_map_wid);
+	owrite_u16(c->os, (unsigned short)g_map_hei);
 
-		// Map width/height
-		owrite_u8(c->os, (unsigned char)g_map_wid);
-		owrite_u8(c->os, (unsigned char)g_map_hei);
+	// Position
+	owrite_u16(c->os, (unsigned short)c->x);
+	owrite_u16(c->os, (unsigned short)c->y);
 
-		// Generate a random spawn position
-		c->x = (unsigned char)(rand() % g_map_wid);
-		c->y = (unsigned char)(rand() % g_map_hei);
+	// How much is coming in the join stream.
+	owrite_u16(c->os, (unsigned short)(c->join_len - c->join_pos));
 
-		// Iterate over all the players, and write their
-		// initial positions.
-		for (unsigned i = 0; i < g_max_players; ++i)
+	// How to get back in, and which room we're in.
+	owrite_u64(c->os, c->token);
+	owrite_u16(c->os, (unsigned short)c->room->id);
+
+	ostream_flush(c->os);
+}
+
+/*
+ * Send the hello packet to a client, telling them
+ * that they're in. This also decides their spawn,
+ * unless they're a spectator. Everything else is
+ * streamed to them afterwards, a chunk at a time, by
+ * client_send_join. The caller must hold the client's
+ * lock.
+ *
+ * @param c  Client to greet.
+ */
+void client_hello(mp_client* const c)
+{
+	// Make up a token for them to resume with. It
+	// only needs to be hard to guess. (Spectators
+	// just start again) Until now it's whatever they
+	// joined with.
+	unsigned long long prev = c->token;
+	if (c->spectator)
+	{
+		c->token = 0;
+	}
+	else if (getrandom(&c->token, sizeof(c->token), 0) != sizeof(c->token))
+	{
+		c->token = ((unsigned long long)rand() << 32) ^ rand() ^ time_now_ns();
+	}
+
+	// Put returning players back where they were if
+	// nobody's taken their spot, otherwise spawn them
+	// on the nearest free tile to a random one.
+	c->placed = !c->spectator && world_join(c, prev) && grid_claim(&c->room->grid, c->x, c->y);
+	if (!c->placed && !c->spectator)
+	{
+		unsigned x = rand() % g_map_wid, y = rand() % g_map_hei;
+		if (!(c->placed = grid_claim_free(&c->room->grid, x, y, &x, &y)))
+		{
+			log_error("No free tiles to spawn client on!");
+		}
+		c->x = x;
+		c->y = y;
+		world_store(c);
+	}
+
+	// Queue up everyone else, nearest first, so the
+	// client can draw what's around them straight away.
+	// (In rooms split into regions, updates bring them
+	// whoever their region can see instead)
+	c->join_len = c->join_pos = 0;
+	for (unsigned i = 0; i < c->room->max_players && !c->room->region_count; ++i)
+	{
+		mp_client* p = &c->room->clients[i];
+		if (!p->initialised || p == c) continue;
+		unsigned long long dx = wrap_dist(p->x, c->x, g_map_wid);
+		unsigned long long dy = wrap_dist(p->y, c->y, g_map_hei);
+		c->join[c->join_len++] = ((dx * dx + dy * dy) << 32) | i;
+	}
+	qsort(c->join, c->join_len, sizeof(unsigned long long), join_cmp);
+
+	client_write_hello(c);
+
+	// Now they can be sent the rest. The join stream
+	// has everything up to now; updates do the rest.
+	c->sent_tick = timer_now(&c->room->timers);
+	for (unsigned i = 0; i < c->room->max_players; ++i)
+	{
+		c->seen[i].tick = c->sent_tick;
+		c->seen[i].priority = 0;
+		c->seen[i].known = FALSE;
+	}
+	atomic_store(&c->changed, c->sent_tick);
+	c->ready = TRUE;
+}
+
+/*
+ * Welcome a client back into their held session.
+ * They're sent P_HELLO as usual, but with no join
+ * stream; instead, the next update brings them up to
+ * date from the last one they got. The caller must
+ * hold the client's lock.
+ *
+ * @param c     Client that is resuming.
+ * @param tick  Tick of the last update they got.
+ */
+void client_resume(mp_client* const c, unsigned long long tick)
+{
+	c->join_pos = c->join_len;
+	client_write_hello(c);
+
+	// Updates carry on from wherever they left off.
+	// (They can't have seen anything newer than what
+	// we last sent)
+	// In rooms split into regions, we can't tell who
+	// they still have, so they're sent everyone they can
+	// see again, and told everyone else has gone.
+	if (tick < c->sent_tick) c->sent_tick = tick;
+	for (unsigned i = 0; i < c->room->max_players; ++i)
+	{
+		if (tick < c->seen[i].tick) c->seen[i].tick = tick;
+		if (c->room->region_count)
+		{
+			c->seen[i].tick = 0;
+			c->seen[i].known = TRUE;
+		}
+	}
+}
+
+/*
+ * Send a client the next few chunks of the join
+ * stream. Positions are read as they are now, not
+ * as they were at P_HELLO. The caller must hold the
+ * client's lock.
+ *
+ * @param c  Client to send to.
+ */
+void client_send_join(mp_client* const c)
+{
+	for (unsigned n = 0; n < JOIN_CHUNKS_PER_TICK && c->join_pos < c->join_len; ++n)
+	{
+		// Take the next lot of players who are still here.
+		mp_client* chunk[JOIN_CHUNK_PLAYERS];
+		unsigned count = 0;
+		while (count < JOIN_CHUNK_PLAYERS && c->join_pos < c->join_len)
 		{
-			mp_client* p = server_client_get(i);
-			if (!p->initialised) continue;
-			owrite_u8(c->os, (unsigned char)p->index);
-			owrite_u8(c->os, (unsigned char)p->x);
-			owrite_u8(c->os, (unsigned char)p->y);
+			mp_client* p = &c->room->clients[c->join[c->join_pos++] & 0xFFFFFFFF];
+			if (p->initialised) chunk[count++] = p;
 		}
+		if (!count) break;
 
+		ostream_begin(c->os, P_JOIN_CHUNK);
+		owrite_u8(c->os, (unsigned char)count);
+		for (unsigned i = 0; i < count; ++i)
+		{
+			owrite_u8(c->os, (unsigned char)chunk[i]->index);
+			owrite_u16(c->os, (unsigned short)chunk[i]->x);
+			owrite_u16(c->os, (unsigned short)chunk[i]->y);
+		}
 		ostream_flush(c->os);
 	}
+}
 
-	// Run until we get signalled to stop.
-	while (c->thr_running)
+/*
+ * Send a chunk of the map to a client if it hasn't
+ * been sent already.
+ *
+ * @param c   Client to send to.
+ * @param cx  Chunk's X position.
+ * @param cy  Chunk's Y position.
+ *
+ * @return TRUE if it was sent.
+ */
+static int client_send_map_chunk(mp_client* const c, unsigned cx, unsigned cy)
+{
+	unsigned i = cy * g_map.chunks_x + cx;
+	if (c->map_sent[i / 8] & (1 << (i % 8)))
 	{
-		// Block until we get a packet, then process it
-		enum mp_packet packet = iread_begin(c->is);
-		switch(packet)
+		return FALSE;
+	}
+	c->map_sent[i / 8] |= 1 << (i % 8);
+
+	ostream_begin(c->os, P_MAP_CHUNK);
+	owrite_u16(c->os, (unsigned short)cx);
+	owrite_u16(c->os, (unsigned short)cy);
+	const unsigned char* tiles = map_chunk(&g_map, cx, cy);
+	for (unsigned t = 0; t < MAP_CHUNK_TILES; ++t)
+	{
+		owrite_u8(c->os, tiles[t]);
+	}
+	ostream_flush(c->os);
+	return TRUE;
+}
+
+/*
+ * Send a client the parts of the map around them
+ * that they don't have yet, nearest first. The caller
+ * must hold the client's lock.
+ *
+ * @param c  Client to send to.
+ */
+void client_send_map(mp_client* const c)
+{
+	// Spectators can look anywhere, so they get the
+	// lot, a few chunks a tick. While the server is
+	// overloaded, fewer chunks go at a time, and players
+	// are only sent what's closest.
+	int narrow = overload_stage(&g_overload) >= OVERLOAD_NARROW;
+	unsigned max_chunks = narrow ? MAP_CHUNKS_PER_TICK / 2 : MAP_CHUNKS_PER_TICK;
+	int radius = narrow ? MAP_SEND_RADIUS / 2 : MAP_SEND_RADIUS;
+	if (c->spectator)
+	{
+		unsigned count = g_map.chunks_x * g_map.chunks_y, sent = 0;
+		for (; c->map_pos < count && sent < max_chunks; ++c->map_pos)
 		{
-			// Client updated
-			case P_POS_UPDATE:
-			{
-				// Read player's position.
-				c->x = (int)iread_u8(c->is);
-				c->y = (int)iread_u8(c->is);
+			sent += client_send_map_chunk(c, c->map_pos % g_map.chunks_x, c->map_pos / g_map.chunks_x);
+		}
+		return;
+	}
 
-				// Respond with state update.
-				ostream_begin(c->os, P_UPDATE);
-				owrite_u8(c->os, (unsigned char)server_player_count());
+	int cw = (int)g_map.chunks_x, ch = (int)g_map.chunks_y;
+	int px = c->x / MAP_CHUNK_SIZE, py = c->y / MAP_CHUNK_SIZE;
+	unsigned sent = 0;
 
-				// Iterate over all the initialised players.
-				for (unsigned i = 0; i < g_max_players; ++i)
-				{
-					mp_client* p = server_client_get(i);
-					if (!p->initialised) continue;
+	// Work outwards a ring at a time. The map wraps,
+	// so so do the chunks.
+	for (int r = 0; r <= radius; ++r)
+	{
+		for (int dy = -r; dy <= r; ++dy)
+		{
+			for (int dx = -r; dx <= r; ++dx)
+			{
+				// Only the edge of the ring.
+				if (abs(dx) != r && abs(dy) != r) continue;
 
-					owrite_u8(c->os, (unsigned char)p->index);
-					owrite_u8(c->os, (unsigned char)p->x);
-					owrite_u8(c->os, (unsigned char)p->y);
+				unsigned cx = (unsigned)(((px + dx) % cw + cw) % cw);
+				unsigned cy = (unsigned)(((py + dy) % ch + ch) % ch);
+				if (client_send_map_chunk(c, cx, cy) && ++sent >= max_chunks)
+				{
+					return;
 				}
+			}
+		}
+	}
+}
+
+// Sort update candidates, highest priority first.
+static int priority_cmp(const void* a, const void* b)
+{
+	unsigned long long x = *(const unsigned long long*)a;
+	unsigned long long y = *(const unsigned long long*)b;
+	return (x < y) - (x > y);
+}
+
+// Priority a player waiting to be sent to a client
+// builds up each tick. The client's own player always
+// goes first, and spectators, who are everywhere at
+// once, weigh everyone the same.
+static unsigned client_priority(const mp_client* const c, const mp_client* const p, int x, int y)
+{
+	if (p == c)
+	{
+		return UINT_MAX;
+	}
+	if (c->spectator)
+	{
+		return PRIORITY_NEAR;
+	}
+	unsigned d = wrap_dist(c->x, x, g_map_wid) + wrap_dist(c->y, y, g_map_hei);
+	return PRIORITY_NEAR * PRIORITY_FALLOFF / (PRIORITY_FALLOFF + d);
+}
+
+/*
+ * Send a client what has changed since their last
+ * update, as much of it as fits in g_update_budget.
+ * Players who have left go first, as they take next
+ * to nothing. The rest are sent in order of the
+ * priority they've built up waiting, which is reset
+ * once they're sent; anyone who doesn't fit waits for
+ * the next update, with a better chance of making it.
+ * The caller must hold the client's lock.
+ *
+ * In rooms split into regions, the client is sent
+ * what their region can see instead: everyone in it
+ * that has changed, or that the client doesn't have
+ * yet, and everyone that has gone out of sight.
+ *
+ * @param c     Client to update.
+ * @param view  What the client's region can see, or 0
+ *              to send from everyone as they are now.
+ */
+void client_send_update(mp_client* const c, const mp_sighting* const view)
+{
+	// Sort out who's changed since the client last
+	// heard about them. A player that changed on the
+	// same tick as that may have done so after it was
+	// sent, so they go again.
+	unsigned long long now = timer_now(&c->room->timers);
+	mp_room* const r = c->room;
+	unsigned long long moved[r->max_players];
+	int gone[r->max_players];
+	unsigned moved_count = 0, gone_count = 0;
+	for (unsigned i = 0; i < r->max_players; ++i)
+	{
+		mp_client* p = &r->clients[i];
+		mp_client_seen* s = &c->seen[i];
+		int changed = atomic_load_explicit(&p->changed, memory_order_relaxed) >= s->tick;
+		int here = view ? view[i].seen : p->initialised && p->ready;
+		int pending = view ? (here ? !s->known || changed : s->known) : changed;
+		if (!pending) continue;
+		if (here)
+		{
+			unsigned w = view ?
+				client_priority(c, p, view[i].x, view[i].y) :
+				client_priority(c, p, p->x, p->y);
+			s->priority = s->priority > UINT_MAX - w ? UINT_MAX : s->priority + w;
+			moved[moved_count++] = (unsigned long long)s->priority << 32 | i;
+		}
+		else
+		{
+			gone[gone_count++] = i;
+		}
+	}
+
+	// Fit in what we can, always leaving room for at
+	// least one player that moved. While the server is
+	// overloaded there's only room for half as many,
+	// which leaves those nearest.
+	unsigned budget = g_update_budget - UPDATE_HEADER_BYTES;
+	if (overload_stage(&g_overload) >= OVERLOAD_NARROW && budget / 2 >= UPDATE_MOVED_BYTES)
+	{
+		budget /= 2;
+	}
+	if (gone_count * UPDATE_GONE_BYTES > budget - UPDATE_MOVED_BYTES)
+	{
+		gone_count = (budget - UPDATE_MOVED_BYTES) / UPDATE_GONE_BYTES;
+	}
+	budget -= gone_count * UPDATE_GONE_BYTES;
+	if (moved_count * UPDATE_MOVED_BYTES > budget)
+	{
+		qsort(moved, moved_count, sizeof(unsigned long long), priority_cmp);
+		moved_count = budget / UPDATE_MOVED_BYTES;
+	}
 
-				ostream_flush(c->os);
-			} break;
+	// Let the client know which of its inputs
+	// this state reflects.
+	ostream_begin(c->os, P_UPDATE);
+	owrite_u32(c->os, (unsigned)now);
+	owrite_u16(c->os, c->input_seq);
 
-			// Client is disconnecting.
-			case P_DISCONN:
+	owrite_u8(c->os, (unsigned char)moved_count);
+	for (unsigned i = 0; i < moved_count; ++i)
+	{
+		unsigned idx = moved[i] & 0xFFFFFFFF;
+		mp_client* p = &r->clients[idx];
+		owrite_u8(c->os, (unsigned char)idx);
+		owrite_u16(c->os, (unsigned short)(view ? view[idx].x : p->x));
+		owrite_u16(c->os, (unsigned short)(view ? view[idx].y : p->y));
+		c->seen[idx].tick = now;
+		c->seen[idx].priority = 0;
+		c->seen[idx].known = TRUE;
+	}
+
+	owrite_u8(c->os, (unsigned char)gone_count);
+	for (unsigned i = 0; i < gone_count; ++i)
+	{
+		owrite_u8(c->os, (unsigned char)gone[i]);
+		c->seen[gone[i]].tick = now;
+		c->seen[gone[i]].priority = 0;
+		c->seen[gone[i]].known = FALSE;
+	}
+
+	ostream_flush(c->os);
+	c->sent_tick = now;
+}
+
+/*
+ * Ping a client, to measure latency. The caller
+ * must hold the client's lock.
+ *
+ * @param c  Client to ping.
+ */
+void client_send_ping(mp_client* const c)
+{
+	c->rtt.last_ping = time_now_ns();
+	ostream_begin(c->os, P_PING);
+	owrite_u64(c->os, c->rtt.last_ping);
+	ostream_flush(c->os);
+}
+
+/*
+ * Tell a client why they're being dropped and shut
+ * their socket down, which their thread picks up as
+ * the connection closing. They leave for good; the
+ * session isn't held. The caller must hold the
+ * client's lock.
+ *
+ * @param c    Client to drop.
+ * @param err  Reason to give them.
+ */
+void client_kick(mp_client* const c, enum mp_packet_err err)
+{
+	// Whoever is dropped may well have stopped reading,
+	// so we don't wait for there to be room to tell them.
+	fcntl(c->sock, F_SETFL, fcntl(c->sock, F_GETFL) | O_NONBLOCK);
+	ostream_begin(c->os, P_ERROR);
+	owrite_err(c->os, err);
+	ostream_flush(c->os);
+	shutdown(c->sock, SHUT_RDWR);
+	c->left = TRUE;
+}
+
+/*
+ * Called when a client's idle timer goes off. If
+ * they've been heard from since it was armed, it's
+ * simply armed again for the new deadline. Otherwise
+ * they've timed out: we tell them so and shut their
+ * socket down, which their thread picks up as the
+ * connection closing.
+ *
+ * @param t  The client's idle timer.
+ */
+static void client_idle_check(mp_timer* t)
+{
+	mp_client* const c = (mp_client*)t->arg;
+	pthread_mutex_lock(&c->lock);
+	if (!c->initialised || timer_pending(&c->room->timers, t))
+	{
+		// Gone, or rearmed (say, by a hold) while we
+		// waited for the lock.
+	}
+	else if (c->held)
+	{
+		// Nobody came back for it.
+		log_info("Session %u expired.", c->session);
+		client_deinit(c);
+	}
+	else
+	{
+		unsigned long long last = atomic_load_explicit(&c->last_rx, memory_order_relaxed);
+		unsigned long long deadline = last == TIMER_NEVER ?
+			c->connected + timer_ticks(&c->room->timers, CLIENT_HANDSHAKE_MS) :
+			last + timer_ticks(&c->room->timers, CLIENT_IDLE_MS);
+		if (deadline > timer_now(&c->room->timers))
+		{
+			timer_arm_at(&c->room->timers, t, deadline);
+		}
+		else
+		{
+			log_info("Session %u timed out.", c->session);
+			client_kick(c, ERR_TIMED_OUT);
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * Called when it's time to ping a client.
+ *
+ * @param t  The client's ping timer.
+ */
+static void client_ping_due(mp_timer* t)
+{
+	mp_client* const c = (mp_client*)t->arg;
+	pthread_mutex_lock(&c->lock);
+	if (c->initialised && !c->held && !timer_pending(&c->room->timers, t))
+	{
+		if (c->ready)
+		{
+			client_send_ping(c);
+		}
+		timer_arm(&c->room->timers, t, RTT_PING_MS);
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * Apply one of a player's inputs, moving them a tile,
+ * wrapping around the edges of the map, as long as
+ * there's no wall or player in the way. Players
+ * without a tile get one by moving. Inputs that have
+ * been seen before are skipped.
+ *
+ * @param c    Player to move.
+ * @param seq  Input's sequence number.
+ * @param dx   Tiles to move across. (-1 to 1)
+ * @param dy   Tiles to move down. (-1 to 1)
+ *
+ * @return TRUE if they moved.
+ */
+int client_input(mp_client* const c, unsigned short seq, int dx, int dy)
+{
+	// Skip anything we've already seen.
+	if ((short)(seq - c->input_seq) <= 0) return FALSE;
+	c->input_seq = seq;
+
+	// Players only move one tile at a time.
+	if (dx < -1 || dx > 1 || dy < -1 || dy > 1) return FALSE;
+
+	int nx = (c->x + dx + (int)g_map_wid) % (int)g_map_wid;
+	int ny = (c->y + dy + (int)g_map_hei) % (int)g_map_hei;
+	if (c->placed ?
+		!grid_move(&c->room->grid, c->x, c->y, nx, ny) :
+		!grid_claim(&c->room->grid, nx, ny))
+	{
+		return FALSE;
+	}
+	c->placed = TRUE;
+	c->x = nx;
+	c->y = ny;
+	atomic_store_explicit(&c->changed, timer_now(&c->room->timers), memory_order_relaxed);
+	return TRUE;
+}
+
+/*
+ * Read a single packet from a client and handle it.
+ * Blocks until a packet arrives.
+ *
+ * @param c  Client to read from.
+ *
+ * @return FALSE if the client should be disconnected.
+ */
+int client_process(mp_client* const c)
+{
+	enum mp_packet packet = iread_begin(c->is);
+	unsigned long long rx_time = time_now_ns();
+	atomic_store_explicit(&c->last_rx, timer_now(&c->room->timers), memory_order_relaxed);
+	switch(packet)
+	{
+		// Client moved
+		case P_INPUT:
+		{
+			// Apply each of the player's inputs in order. In
+			// rooms split into regions, they're left for the
+			// player's region to apply on its next tick.
+			unsigned count = (unsigned)iread_u8(c->is);
+			int regions = c->room->region_count != 0;
+			for (unsigned i = 0; i < count; ++i)
+			{
+				unsigned short seq = (unsigned short)iread_u16(c->is);
+				int dx = (signed char)iread_u8(c->is);
+				int dy = (signed char)iread_u8(c->is);
+				if (c->spectator) continue;
+
+				if (!regions)
+				{
+					client_input(c, seq, dx, dy);
+				}
+				else if ((short)(seq - c->input_queued) > 0)
+				{
+					mp_client_input in = { seq, (signed char)dx, (signed char)dy };
+					if (!spsc_push(&c->inputs, &in)) continue;
+					c->input_queued = seq;
+				}
+			}
+			if (!regions)
 			{
-				// Stop the worker thread.
-				goto worker_exit;
+				world_store(c);
 			}
 
-			default:
+			// The new state goes out with the next tick.
+		} break;
+
+		// Client is still there, but hasn't moved.
+		case P_HEARTBEAT:
+		{
+		} break;
+
+		// Response to our ping.
+		case P_PONG:
+		{
+			unsigned long long t0 = iread_u64(c->is);
+			unsigned long long t1 = iread_u64(c->is);
+			unsigned long long t2 = iread_u64(c->is);
+
+			// If the kernel timestamped the packet, use that
+			// instead, so our own scheduling delays don't count.
+			if (c->is->timestamps && c->is->rx_time)
 			{
-				// Unknown packet?
-				printf("Ignoring unimplemented packet with code %d...\n", packet);
-				goto worker_exit;
+				unsigned long long age = time_real_ns() - c->is->rx_time;
+				rx_time = time_now_ns() - age;
 			}
+			rtt_sample(&c->rtt, t0, t1, t2, rx_time);
+		} break;
+
+		// Only expected as the first packet, which the
+		// worker handles itself. Seen here in replays.
+		case P_JOIN:
+		{
+			iread_u16(c->is);
+			iread_u64(c->is);
+		} break;
+		case P_SPECTATE:
+		{
+			iread_u16(c->is);
+		} break;
+		case P_RESUME:
+		{
+			iread_u64(c->is);
+			iread_u32(c->is);
+		} break;
+
+		// Client is disconnecting.
+		case P_DISCONN:
+		{
+			c->left = TRUE;
+			return FALSE;
+		}
+
+		// Connection was closed.
+		case P_UNKNOWN:
+		{
+			return FALSE;
+		}
+
+		default:
+		{
+			// Unknown packet?
+			log_warn("Ignoring unimplemented packet with code %d...", packet);
+			return FALSE;
 		}
 	}
 
-worker_exit:
-	printf("Exiting client worker thread.\n");
+	return TRUE;
+}
 
-	// We can deinitialise the client itself here if not already done.
-	c->thr_running = FALSE;
-	client_deinit(c);
+// Log the packet just read, exactly as it was received.
+static void client_log_packet(mp_client* const c)
+{
+	if (c->is->capturing)
+	{
+		if (c->is->cap_len)
+		{
+			capture_write(CAP_PACKET, c->session, c->is->cap, c->is->cap_len);
+		}
+		istream_capture_reset(c->is);
+	}
+}
+
+/*
+ * Tell a client how busy the server is. Gateways ask
+ * this of their servers to balance players between
+ * them.
+ *
+ * @param c  Client to send to.
+ */
+static void client_send_load(mp_client* const c)
+{
+	ostream_begin(c->os, P_LOAD);
+	owrite_u32(c->os, server_player_count());
+	owrite_u32(c->os, g_max_rooms * g_max_players);
+	owrite_u16(c->os, (unsigned short)server_room_count());
+	owrite_u16(c->os, (unsigned short)g_max_rooms);
+	ostream_flush(c->os);
+}
+
+/*
+ * Read a client's first packet, which says whether
+ * they're joining (and which room) or resuming, and
+ * move them out of the lobby into their player slot.
+ * If there isn't one, they're sent an error. Clients
+ * that only want to know the server's load are told
+ * it, and don't get a slot.
+ *
+ * @param c  Client's lobby slot.
+ *
+ * @return the player's slot, or 0 if they didn't get
+ *         one.
+ */
+mp_client* client_handshake(mp_client* const c)
+{
+	unsigned room = 0;
+	unsigned long long token = 0, tick = 0;
+	enum mp_packet packet = iread_begin(c->is);
+	if (packet == P_JOIN || packet == P_SPECTATE)
+	{
+		room = iread_u16(c->is);
+	}
+	if (packet == P_JOIN)
+	{
+		// Kept with the connection until P_HELLO, to
+		// find the player's saved spot.
+		c->token = iread_u64(c->is);
+	}
+	else if (packet == P_RESUME)
+	{
+		token = iread_u64(c->is);
+		tick = iread_u32(c->is);
+	}
+	client_log_packet(c);
+	if (packet == P_STATUS)
+	{
+		client_send_load(c);
+		return 0;
+	}
+	if (c->is->eof || !(packet == P_JOIN || packet == P_SPECTATE || (packet == P_RESUME && token)))
+	{
+		return 0;
+	}
+
+	// Nobody new gets in while the server is struggling
+	// with who it has; sessions can still be resumed.
+	mp_client* p = 0;
+	enum mp_packet_err err = ERR_SERVER_FULL;
+	if (packet != P_RESUME && overload_stage(&g_overload) >= OVERLOAD_REFUSE)
+	{
+		err = ERR_OVERLOADED;
+	}
+	else if (packet == P_SPECTATE)
+	{
+		p = server_client_spectate(c, room);
+		if (!room || !server_room_get(room)) err = ERR_NO_ROOM;
+	}
+	else
+	{
+		p = server_client_join(c, room, token, tick);
+		if (token) err = ERR_NO_SESSION;
+	}
+	if (!p)
+	{
+		ostream_begin(c->os, P_ERROR);
+		owrite_err(c->os, err);
+		ostream_flush(c->os);
+	}
+	return p;
+}
+
+/*
+ * Client worker thread
+ */
+void* client_worker(void* arg)
+{
+	// Cast argument back to a client struct. This is the
+	// slot the connection was accepted into, until the
+	// handshake moves it into a player slot.
+	mp_client* c = (mp_client*)arg;
+
+	log_debug("Started client worker thread.");
+
+	// Record the connection if we're capturing.
+	if (capture_enabled())
+	{
+		capture_write(CAP_CONNECT, c->session, 0, 0);
+		istream_capture(c->is, TRUE);
+	}
+
+	// Have the kernel timestamp what we receive, if asked.
+	if (g_rx_timestamps && !istream_timestamps(c->is, TRUE))
+	{
+		log_warn("Couldn't enable receive timestamps for client.");
+	}
+
+	// Find out whether they're new or coming back, and
+	// give them their player slot.
+	mp_client* p = client_handshake(c);
+	if (p)
+	{
+		c = p;
+	}
+	else
+	{
+		c->thr_running = FALSE;
+	}
+
+	// Run until we get signalled to stop.
+	while (c->thr_running)
+	{
+		// Block until we get a packet, then process it
+		int keep = client_process(c);
+		client_log_packet(c);
+		if (!keep) break;
+	}
+
+	log_debug("Exiting client worker thread.");
+	if (c->is->capturing)
+	{
+		capture_write(CAP_DISCONN, c->session, 0, 0);
+	}
+
+	// If the connection just dropped, hold on to the
+	// player in case they come back. Otherwise we can
+	// deinitialise the client itself here if not already
+	// done. (Holding the lock so the tick isn't sending
+	// to it meanwhile)
+	pthread_mutex_lock(&c->lock);
+	if (c->ready && !c->left && !c->spectator)
+	{
+		client_hold(c);
+	}
+	else
+	{
+		c->thr_running = FALSE;
+		client_deinit(c);
+	}
+	if (!c->spectator)
+	{
+		pthread_cond_broadcast(&c->released);
+	}
+	pthread_mutex_unlock(&c->lock);
 
 	pthread_exit(NULL);
 	return 0;
@@ -1,6 +1,75 @@
 #ifndef MP_CLIENT_H
 #define MP_CLIENT_H
 
+// Most players sent in a single P_JOIN_CHUNK, and the
+// most chunks sent to a client per tick.
+#define JOIN_CHUNK_PLAYERS 64
+#define JOIN_CHUNKS_PER_TICK 4
+
+// Map chunks within this many chunks of a player are
+// sent to them, at most this many per tick.
+#define MAP_SEND_RADIUS 4
+#define MAP_CHUNKS_PER_TICK 8
+
+// Bytes in a P_UPDATE before any players, and for each
+// player that moved or is gone.
+#define UPDATE_HEADER_BYTES 9
+#define UPDATE_MOVED_BYTES 5
+#define UPDATE_GONE_BYTES 1
+
+// Priority a player waiting to be sent builds up each
+// tick: PRIORITY_NEAR if they're right by the client,
+// half that PRIORITY_FALLOFF tiles away, a third twice
+// as far, and so on.
+#define PRIORITY_NEAR 1024
+#define PRIORITY_FALLOFF 8
+
+// Inputs a player in a room split into regions can
+// have waiting for their region's next tick.
+#define CLIENT_INPUT_QUEUE 32
+
+// Time a client has to send its first packet after
+// connecting, and the longest it can go quiet after.
+#define CLIENT_HANDSHAKE_MS 5000
+#define CLIENT_IDLE_MS 10000
+
+// How long a dropped player's session is held for
+// them to P_RESUME.
+#define CLIENT_RESUME_MS 30000
+
+// Longest a P_RESUME waits for the session's old
+// connection to let go of it.
+#define CLIENT_TAKEOVER_MS 2000
+
+/*
+ * What a client has been sent about another player.
+ */
+typedef struct mp_client_seen
+{
+	// Tick of the last update they were in.
+	unsigned long long tick;
+
+	// Built up while they're waiting to be sent, so
+	// those far away still get their turn.
+	unsigned priority;
+
+	// Whether the client has them. Only used in rooms
+	// split into regions, where players come and go from
+	// what the client can see.
+	int known;
+} mp_client_seen;
+
+/*
+ * A move waiting to be applied by the player's region.
+ */
+typedef struct mp_client_input
+{
+	unsigned short seq;
+	signed char dx, dy;
+} mp_client_input;
+
+struct mp_sighting;
+
 /*
  * Structure containing info
  * about a client.
@@ -10,12 +79,58 @@ typedef struct mp_client
 	// Whether this client has been initialised.
 	int initialised;
 
-	// Index of this client in main player list.
+	// Whether this client has been sent P_HELLO, and so
+	// can be sent state updates.
+	int ready;
+
+	// Set while the player's connection has dropped, but
+	// their session is being held for them to resume.
+	int held;
+
+	// Set when the client is leaving for good.
+	int left;
+
+	// Set if the slot is for a spectator rather than a
+	// player. Set once per slot by the room.
+	int spectator;
+
+	// Secret the client resumes the session with.
+	unsigned long long token;
+
+	// Held while sending to, or tearing down, the client.
+	// This is initialised once per slot by the server.
+	pthread_mutex_t lock;
+
+	// Signalled (under the lock) when the client's
+	// worker thread lets go of its connection, for a
+	// P_RESUME that is taking the session over. Not
+	// initialised for spectators' slots.
+	pthread_cond_t released;
+
+	// Room the slot belongs to, and the slot's index
+	// in it. The room is set once per slot by the room.
+	struct mp_room* room;
 	int index;
 
+	// Unique id of this connection. (Used to tell
+	// sessions apart in packet captures)
+	unsigned session;
+
 	// The socket connection.
 	SOCKET sock;
 
+	// Shared memory session the streams go through
+	// instead of the socket, for clients on the same
+	// host, or 0. (See mp_shm.h)
+	mp_shm* shm;
+
+	// IPv4 address the client connected from.
+	unsigned addr;
+
+	// Index of this client's record in the world
+	// file, or -1 if it doesn't have one.
+	int save;
+
 	// Pointer to this client's thread.
 	pthread_t thr;
 
@@ -28,12 +143,85 @@ typedef struct mp_client
 
 	// Player information
 	int x, y;
+
+	// Whether the player is holding their tile in
+	// the collision grid.
+	int placed;
+
+	// Sequence number of the last input we processed.
+	unsigned short input_seq;
+
+	// In rooms split into regions, inputs wait here for
+	// the player's region to apply them on its next
+	// tick. (mp_client_input) Pushed to by the client's
+	// thread, which skips any it has queued before.
+	mp_spsc inputs;
+	unsigned short input_queued;
+
+	// Latency estimates.
+	mp_rtt rtt;
+
+	// How often the client's link can take being sent
+	// to. Starts over with each connection.
+	mp_rate rate;
+
+	// Tick the player last joined, moved, or left on.
+	// Kept across sessions in the same slot.
+	atomic_ullong changed;
+
+	// Tick of the last update sent to the client, and
+	// what it's been sent of each player. Updates only
+	// have room for so many of them (g_update_budget),
+	// so each one has whoever has changed since they
+	// were last sent and has waited longest, nearest
+	// first.
+	unsigned long long sent_tick;
+	mp_client_seen* seen;
+
+	// Tick the client connected on, and the tick its
+	// last packet arrived on (TIMER_NEVER until the
+	// first). The latter is all that's touched per
+	// packet; the idle timer checks it when it goes off.
+	unsigned long long connected;
+	atomic_ullong last_rx;
+
+	// Timers for when the client may have been quiet
+	// too long, and for when to ping it next.
+	mp_timer idle_timer;
+	mp_timer ping_timer;
+
+	// Initial state still to be streamed to the client.
+	// Each entry is a player's squared distance from our
+	// spawn in the high 32 bits and their slot in the low
+	// 32, sorted so the nearest go first.
+	unsigned long long* join;
+	unsigned join_len, join_pos;
+
+	// Bitset of the map chunks that have been sent.
+	// Spectators are sent the whole map, in order;
+	// map_pos is the next chunk to look at.
+	unsigned char* map_sent;
+	unsigned map_pos;
 } mp_client;
 
 void client_init(mp_client* const, SOCKET);
+void client_reserve(unsigned* const, unsigned, unsigned);
 void client_set_index(mp_client* const, int);
+void client_set_shm(mp_client* const, mp_shm* const);
 void client_deinit(mp_client* const);
 void client_start(mp_client* const);
+void client_take(mp_client* const, mp_client* const);
+void client_hold(mp_client* const);
+void client_hello(mp_client* const);
+void client_resume(mp_client* const, unsigned long long);
+mp_client* client_handshake(mp_client* const);
+void client_send_join(mp_client* const);
+void client_send_map(mp_client* const);
+void client_send_update(mp_client* const, const struct mp_sighting* const);
+void client_send_ping(mp_client* const);
+void client_kick(mp_client* const, enum mp_packet_err);
+int client_input(mp_client* const, unsigned short, int, int);
+int client_process(mp_client* const);
 void* client_worker(void*);
 
 #endif
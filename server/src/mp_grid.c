@@ -0,0 +1,197 @@
+/*
+ * mp_grid.c
+ *
+ * Bitsets of blocked and occupied tiles, used to
+ * check player movement.
+ */
+
+#include "pch.h"
+#include "mp_grid.h"
+
+// Word, and bit within it, of a tile.
+#define GRID_WORD(g, x, y) ((size_t)(y) * (g)->stride + (x) / 64)
+#define GRID_BIT(x) ((uint64_t)1 << ((x) % 64))
+
+/*
+ * Build the bitset of a map's walls. The map never
+ * changes, so this is done once and shared by every
+ * grid on it.
+ *
+ * @param m  Map to take walls from.
+ *
+ * @return the bitset, to be freed with free(), or 0
+ *         on failure.
+ */
+uint64_t* grid_walls(const mp_map* const m)
+{
+	unsigned stride = (m->wid + 63) / 64;
+	uint64_t* blocked = calloc((size_t)stride * m->hei, sizeof(uint64_t));
+	if (!blocked)
+	{
+		return 0;
+	}
+
+	// Go a chunk at a time, since that's how the
+	// tiles are laid out.
+	for (unsigned cy = 0; cy < m->chunks_y; ++cy)
+	{
+		for (unsigned cx = 0; cx < m->chunks_x; ++cx)
+		{
+			const unsigned char* tiles = map_chunk(m, cx, cy);
+			for (unsigned ty = 0; ty < MAP_CHUNK_SIZE; ++ty)
+			{
+				unsigned y = cy * MAP_CHUNK_SIZE + ty;
+				if (y >= m->hei) break;
+				for (unsigned tx = 0; tx < MAP_CHUNK_SIZE; ++tx)
+				{
+					unsigned x = cx * MAP_CHUNK_SIZE + tx;
+					if (x >= m->wid) break;
+					if (tiles[ty * MAP_CHUNK_SIZE + tx] == TILE_WALL)
+					{
+						blocked[(size_t)y * stride + x / 64] |= GRID_BIT(x);
+					}
+				}
+			}
+		}
+	}
+	return blocked;
+}
+
+/*
+ * Set up the grid for a map. Nobody is on it to
+ * begin with.
+ *
+ * @param g      Grid to initialise.
+ * @param m      Map the grid is for.
+ * @param walls  The map's walls, from grid_walls. Must
+ *               outlive the grid.
+ *
+ * @return FALSE on failure.
+ */
+int grid_init(mp_grid* const g, const mp_map* const m, const uint64_t* const walls)
+{
+	memset(g, 0, sizeof(mp_grid));
+	g->wid = m->wid;
+	g->hei = m->hei;
+	g->stride = (m->wid + 63) / 64;
+	g->blocked = walls;
+	if (!(g->occupied = calloc((size_t)g->stride * g->hei, sizeof(atomic_uint_least64_t))))
+	{
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Free a grid.
+ *
+ * @param g  Grid to free.
+ */
+void grid_deinit(mp_grid* const g)
+{
+	free((void*)g->occupied);
+	memset(g, 0, sizeof(mp_grid));
+}
+
+/*
+ * Put a player on a tile, if it's free.
+ *
+ * @param g  Grid.
+ * @param x  X position.
+ * @param y  Y position.
+ *
+ * @return TRUE if the tile was claimed.
+ */
+int grid_claim(mp_grid* const g, unsigned x, unsigned y)
+{
+	if (x >= g->wid || y >= g->hei) return FALSE;
+
+	size_t w = GRID_WORD(g, x, y);
+	uint64_t bit = GRID_BIT(x);
+	if (g->blocked[w] & bit) return FALSE;
+
+	// Whoever sets the bit first gets the tile.
+	return !(atomic_fetch_or(&g->occupied[w], bit) & bit);
+}
+
+/*
+ * Take a player off a tile.
+ *
+ * @param g  Grid.
+ * @param x  X position.
+ * @param y  Y position.
+ */
+void grid_release(mp_grid* const g, unsigned x, unsigned y)
+{
+	if (x >= g->wid || y >= g->hei) return;
+	atomic_fetch_and(&g->occupied[GRID_WORD(g, x, y)], ~GRID_BIT(x));
+}
+
+/*
+ * Move a player from one tile to another, if the
+ * destination is free.
+ *
+ * @param g   Grid.
+ * @param fx  X position moving from.
+ * @param fy  Y position moving from.
+ * @param tx  X position moving to.
+ * @param ty  Y position moving to.
+ *
+ * @return TRUE if the player moved.
+ */
+int grid_move(mp_grid* const g, unsigned fx, unsigned fy, unsigned tx, unsigned ty)
+{
+	if (!grid_claim(g, tx, ty)) return FALSE;
+	grid_release(g, fx, fy);
+	return TRUE;
+}
+
+/*
+ * Claim the first free tile at or after a position,
+ * scanning along rows and wrapping around the map.
+ * Whole words of tiles are checked at once.
+ *
+ * @param g   Grid.
+ * @param sx  X position to start from.
+ * @param sy  Y position to start from.
+ * @param x   Set to the X position claimed.
+ * @param y   Set to the Y position claimed.
+ *
+ * @return FALSE if the map is full.
+ */
+int grid_claim_free(mp_grid* const g, unsigned sx, unsigned sy, unsigned* x, unsigned* y)
+{
+	if (sx >= g->wid || sy >= g->hei) sx = sy = 0;
+
+	size_t words = (size_t)g->stride * g->hei;
+	size_t start = GRID_WORD(g, sx, sy);
+	for (size_t n = 0; n <= words; ++n)
+	{
+		size_t w = (start + n) % words;
+		unsigned row = (unsigned)(w / g->stride);
+		unsigned base = (unsigned)(w % g->stride) * 64;
+
+		// Bits past the end of the row aren't tiles.
+		uint64_t valid = ~(uint64_t)0;
+		if (g->wid - base < 64) valid = ((uint64_t)1 << (g->wid - base)) - 1;
+
+		// On the first word, don't go back before the start.
+		if (n == 0) valid &= ~(uint64_t)0 << (sx % 64);
+
+		uint64_t free_bits = ~(g->blocked[w] | atomic_load(&g->occupied[w])) & valid;
+		while (free_bits)
+		{
+			unsigned bx = base + (unsigned)__builtin_ctzll(free_bits);
+			if (grid_claim(g, bx, row))
+			{
+				*x = bx;
+				*y = row;
+				return TRUE;
+			}
+
+			// Somebody beat us to it.
+			free_bits &= free_bits - 1;
+		}
+	}
+	return FALSE;
+}
@@ -0,0 +1,48 @@
+#ifndef MP_GRID_H
+#define MP_GRID_H
+
+/*
+ * Collision grid.
+ *
+ * Two bitsets the size of the map, one bit per tile:
+ * one of tiles that are blocked by walls, built from
+ * the map once at startup and shared by every room,
+ * and one of tiles that have a player on them, which
+ * each room has its own of. Rows are padded out to
+ * whole 64-bit words.
+ *
+ * Client threads move their players concurrently, so
+ * the occupancy bits are only ever changed with atomic
+ * word operations. Claiming a tile is a single fetch-or,
+ * so two players can never end up on the same one, and
+ * checking a move costs the same however big the map is
+ * or however many players are on it.
+ */
+typedef struct mp_grid
+{
+	// Size in tiles.
+	unsigned wid, hei;
+
+	// Number of 64-bit words in each row.
+	unsigned stride;
+
+	// Tiles that can't be walked on. (Not owned by
+	// the grid; see grid_walls)
+	const uint64_t* blocked;
+
+	// Tiles that have a player on them.
+	atomic_uint_least64_t* occupied;
+} mp_grid;
+
+// Allocation
+uint64_t* grid_walls(const mp_map* const);
+int grid_init(mp_grid* const, const mp_map* const, const uint64_t* const);
+void grid_deinit(mp_grid* const);
+
+// Occupancy
+int grid_claim(mp_grid* const, unsigned, unsigned);
+void grid_release(mp_grid* const, unsigned, unsigned);
+int grid_move(mp_grid* const, unsigned, unsigned, unsigned, unsigned);
+int grid_claim_free(mp_grid* const, unsigned, unsigned, unsigned*, unsigned*);
+
+#endif
@@ -0,0 +1,137 @@
+/*
+ * mp_overload.c
+ *
+ * Watching the tick threads for overruns, and stepping
+ * down in stages when they can't keep up.
+ */
+
+#include "pch.h"
+#include "mp_overload.h"
+
+static const char* stage_names[] =
+{
+	"back to normal",
+	"sending less often",
+	"sending only what's nearest",
+	"turning new players away",
+	"shedding the slowest clients"
+};
+
+/*
+ * Set up for a number of tick threads.
+ *
+ * @param o        State to initialise.
+ * @param threads  Number of tick threads.
+ *
+ * @return FALSE on failure.
+ */
+int overload_init(mp_overload* const o, unsigned threads)
+{
+	memset(o, 0, sizeof(mp_overload));
+	if (!(o->load = calloc(threads, sizeof(atomic_uint))))
+	{
+		return FALSE;
+	}
+	o->threads = threads;
+	atomic_init(&o->stage, OVERLOAD_NONE);
+	return TRUE;
+}
+
+/*
+ * Free the state.
+ *
+ * @param o  State to deinitialise.
+ */
+void overload_deinit(mp_overload* const o)
+{
+	free(o->load);
+	memset(o, 0, sizeof(mp_overload));
+}
+
+/*
+ * Called by a tick thread after each tick.
+ *
+ * @param o        State.
+ * @param thread   Tick thread's number.
+ * @param busy_ns  How long the tick took.
+ * @param tick_ns  How long it had.
+ */
+void overload_report(mp_overload* const o, unsigned thread, unsigned long long busy_ns, unsigned long long tick_ns)
+{
+	if (thread >= o->threads)
+	{
+		return;
+	}
+	unsigned long long sample = busy_ns * 1000 / tick_ns;
+	if (sample > 4000) sample = 4000;
+
+	// Smoothed over the last several ticks, so one slow
+	// tick doesn't set anything off.
+	unsigned load = atomic_load_explicit(&o->load[thread], memory_order_relaxed);
+	load = (unsigned)((long long)load + ((long long)sample - load) / 8);
+	atomic_store_explicit(&o->load[thread], load, memory_order_relaxed);
+}
+
+/*
+ * @return the busiest tick thread's share of its tick
+ *         spent ticking. (per mille)
+ */
+unsigned overload_load(mp_overload* const o)
+{
+	unsigned max = 0;
+	for (unsigned t = 0; t < o->threads; ++t)
+	{
+		unsigned load = atomic_load_explicit(&o->load[t], memory_order_relaxed);
+		if (load > max) max = load;
+	}
+	return max;
+}
+
+/*
+ * Called once a tick by the main thread. Steps the
+ * stage down if the busiest tick thread has been over
+ * the high mark for long enough, or back up if it's
+ * been under the low mark for long enough.
+ *
+ * @param o  State.
+ */
+void overload_update(mp_overload* const o)
+{
+	unsigned load = overload_load(o);
+	o->over = load > OVERLOAD_HIGH * 10 ? o->over + 1 : 0;
+	o->under = load < OVERLOAD_LOW * 10 ? o->under + 1 : 0;
+
+	int stage = atomic_load_explicit(&o->stage, memory_order_relaxed);
+	int next = stage;
+	if (o->over >= OVERLOAD_UP_TICKS && stage < OVERLOAD_SHED)
+	{
+		next = stage + 1;
+	}
+	else if (o->under >= OVERLOAD_DOWN_TICKS && stage > OVERLOAD_NONE)
+	{
+		next = stage - 1;
+	}
+	if (next == stage)
+	{
+		return;
+	}
+
+	o->over = o->under = 0;
+	atomic_store_explicit(&o->stage, next, memory_order_relaxed);
+	if (next > stage)
+	{
+		log_warn("Ticks are overrunning (%u%% of the tick), %s.", load / 10, stage_names[next]);
+	}
+	else
+	{
+		log_info("Load is down (%u%% of the tick), %s.", load / 10, stage_names[next]);
+	}
+}
+
+/*
+ * @return the stage the server is at.
+ */
+enum mp_overload_stage overload_stage(mp_overload* const o)
+{
+	return atomic_load_explicit(&o->stage, memory_order_relaxed);
+}
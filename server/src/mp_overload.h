@@ -0,0 +1,73 @@
+#ifndef MP_OVERLOAD_H
+#define MP_OVERLOAD_H
+
+// Share of a tick, in percent, that a tick thread can
+// spend ticking before the server steps down a stage,
+// and that it has to get back under to step up again.
+#define OVERLOAD_HIGH 90
+#define OVERLOAD_LOW 60
+
+// Ticks in a row the load has to stay past either
+// mark before the stage changes. Recovering is slower,
+// so the server doesn't flap between stages.
+#define OVERLOAD_UP_TICKS 10
+#define OVERLOAD_DOWN_TICKS 40
+
+// How often a client is shed from each room while
+// shedding.
+#define OVERLOAD_SHED_MS 1000
+
+/*
+ * Stages the server steps down through as it falls
+ * behind, each keeping what the ones before it do.
+ */
+enum mp_overload_stage
+{
+	// All as normal.
+	OVERLOAD_NONE,
+
+	// Clients are sent to every other tick at most.
+	OVERLOAD_THROTTLE,
+
+	// Updates and map streaming are cut back to what's
+	// nearest each client.
+	OVERLOAD_NARROW,
+
+	// New players and spectators are turned away with
+	// ERR_OVERLOADED.
+	OVERLOAD_REFUSE,
+
+	// Every so often, each room's slowest client is
+	// dropped with ERR_OVERLOADED.
+	OVERLOAD_SHED
+};
+
+/*
+ * How far behind the tick threads are. Each thread
+ * reports how long it spent ticking; once a tick the
+ * main thread looks at the busiest and moves the stage
+ * one step if it needs to.
+ */
+typedef struct mp_overload
+{
+	// Each tick thread's smoothed share of its tick
+	// spent ticking. (per mille)
+	atomic_uint* load;
+	unsigned threads;
+
+	// Current stage, read by everyone.
+	atomic_int stage;
+
+	// Ticks in a row the load has been over the high
+	// mark, and under the low.
+	unsigned over, under;
+} mp_overload;
+
+int overload_init(mp_overload* const, unsigned);
+void overload_deinit(mp_overload* const);
+void overload_report(mp_overload* const, unsigned, unsigned long long, unsigned long long);
+void overload_update(mp_overload* const);
+enum mp_overload_stage overload_stage(mp_overload* const);
+unsigned overload_load(mp_overload* const);
+
+#endif
@@ -0,0 +1,123 @@
+/*
+ * mp_rate.c
+ *
+ * Per-client send rate control.
+ */
+
+#include "pch.h"
+#include "mp_rtt.h"
+#include "mp_rate.h"
+
+/*
+ * Start sending every tick.
+ *
+ * @param r  Controller to reset.
+ */
+void rate_init(mp_rate* const r)
+{
+	memset(r, 0, sizeof(mp_rate));
+	r->interval = 1;
+}
+
+// Take in a new ping, if there's been one, and see if
+// it was held up behind a queue.
+static void rate_ping(mp_rate* const r, const mp_rtt* const rtt)
+{
+	if (rtt->samples == r->samples)
+	{
+		return;
+	}
+
+	// The floor is the lowest round trip time over the
+	// last couple of windows.
+	long long t = rtt->last;
+	if (!r->next_min_rtt || t < r->next_min_rtt) r->next_min_rtt = t;
+	if (!r->min_rtt || t < r->min_rtt) r->min_rtt = t;
+	if (rtt->samples % RATE_MIN_RTT_SAMPLES == 0)
+	{
+		r->min_rtt = r->next_min_rtt;
+		r->next_min_rtt = 0;
+	}
+
+	// Delay that's above the floor but on its way back
+	// down is a queue draining, so isn't held against
+	// the link, though it doesn't count as clear either.
+	r->queued = t > r->min_rtt + RATE_QUEUE_DELAY_MS * NS_PER_MS;
+	r->rising = r->queued && t >= r->rtt;
+	r->rtt = t;
+	r->samples = rtt->samples;
+}
+
+// Look at how the link is doing, and change the
+// interval to suit.
+static void rate_check(mp_rate* const r, SOCKET sock, const mp_rtt* const rtt)
+{
+	// Sockets that aren't TCP (as when replaying) have
+	// nothing to go on, so are left as they are.
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	int unsent = 0;
+	if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) != 0 ||
+		ioctl(sock, SIOCOUTQNSD, &unsent) != 0)
+	{
+		return;
+	}
+
+	rate_ping(r, rtt);
+	int retransmitted = info.tcpi_total_retrans != r->retrans;
+	int backlogged = unsent > RATE_UNSENT_BYTES;
+	int congested = backlogged || retransmitted || r->rising;
+	r->retrans = info.tcpi_total_retrans;
+
+	if (congested)
+	{
+		r->interval = r->interval * 2 > RATE_MAX_INTERVAL ? RATE_MAX_INTERVAL : r->interval * 2;
+		r->clear = 0;
+	}
+	else if (r->queued)
+	{
+		r->clear = 0;
+	}
+	else if (++r->clear >= RATE_CLEAR_CHECKS && r->interval > 1)
+	{
+		--r->interval;
+		r->clear = 0;
+	}
+	if (r->wait >= r->interval)
+	{
+		r->wait = r->interval - 1;
+	}
+
+	// A rising ping only counts the once.
+	r->rising = FALSE;
+}
+
+/*
+ * Called once a tick for each client.
+ *
+ * @param r     Client's controller.
+ * @param sock  Client's socket.
+ * @param rtt   Client's latency estimates.
+ * @param min   Fewest ticks between sends, whatever
+ *              the link can take.
+ *
+ * @return TRUE if the client should be sent to this
+ *         tick.
+ */
+int rate_due(mp_rate* const r, SOCKET sock, const mp_rtt* const rtt, unsigned min)
+{
+	if (!r->check)
+	{
+		r->check = RATE_CHECK_TICKS;
+		rate_check(r, sock, rtt);
+	}
+	--r->check;
+
+	if (r->wait)
+	{
+		--r->wait;
+		return FALSE;
+	}
+	r->wait = (r->interval > min ? r->interval : min) - 1;
+	return TRUE;
+}
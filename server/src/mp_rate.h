@@ -0,0 +1,71 @@
+#ifndef MP_RATE_H
+#define MP_RATE_H
+
+// How often, in ticks, each client's link is looked
+// at to decide how often to send to it.
+#define RATE_CHECK_TICKS 4
+
+// Most ticks between sends to a client whose link is
+// struggling. Good links are sent to every tick.
+#define RATE_MAX_INTERVAL 8
+
+// Checks in a row a link has to look clear before it
+// is sent to more often.
+#define RATE_CLEAR_CHECKS 2
+
+// Bytes waiting in the kernel to go out to a client
+// before the link counts as congested.
+#define RATE_UNSENT_BYTES 4096
+
+// How far a session's round trip time can climb above
+// the lowest it's been before it counts as queueing
+// delay. (ms)
+#define RATE_QUEUE_DELAY_MS 20
+
+// Pings the lowest round trip time is kept for, so
+// that a route that has got slower for good isn't
+// mistaken for congestion forever.
+#define RATE_MIN_RTT_SAMPLES 10
+
+/*
+ * How often a client is sent to. Every few ticks the
+ * controller reads the connection's TCP_INFO and how
+ * much is still waiting to go out, and looks at the
+ * latest ping. If bytes are piling up, segments are
+ * being retransmitted, or the round trip time is above
+ * its floor and still climbing, the gap between sends
+ * is doubled; once the link has looked clear for a
+ * while it's brought back down a tick at a time.
+ *
+ * Round trip times come from our own pings rather than
+ * TCP_INFO, as the kernel's include however long the
+ * client sat on its ACKs, which is often longer than
+ * any queue.
+ */
+typedef struct mp_rate
+{
+	// Ticks from one send to the next, and ticks left
+	// until the next.
+	unsigned interval, wait;
+
+	// Ticks until the link is next looked at, and
+	// checks in a row it's looked clear.
+	unsigned check, clear;
+
+	// Pings seen so far, the last one's round trip time,
+	// and the lowest this window and last. (ns)
+	unsigned samples;
+	long long rtt, min_rtt, next_min_rtt;
+
+	// Set if the last ping was held up behind a queue,
+	// and if that queue was still growing.
+	int queued, rising;
+
+	// Retransmits on the connection at the last check.
+	unsigned retrans;
+} mp_rate;
+
+void rate_init(mp_rate* const);
+int rate_due(mp_rate* const, SOCKET, const mp_rtt* const, unsigned);
+
+#endif
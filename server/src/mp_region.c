@@ -0,0 +1,348 @@
+/*
+ * mp_region.c
+ *
+ * Splitting a room's map into regions, each simulated
+ * by its own tick thread.
+ */
+
+#include "pch.h"
+#include "mp_rtt.h"
+#include "mp_rate.h"
+#include "mp_timer.h"
+#include "mp_grid.h"
+#include "mp_client.h"
+#include "mp_region.h"
+#include "mp_room.h"
+#include "mp_world.h"
+
+// Forward declarations of externals that we reference.
+extern unsigned g_map_wid;
+extern unsigned g_map_hei;
+
+// Column or row a coordinate is in, with the map split
+// into count pieces along an axis size long.
+static unsigned region_piece(unsigned v, unsigned count, unsigned size)
+{
+	return ((v + 1) * count - 1) / size;
+}
+
+// Distance from a coordinate to the nearest part of
+// [lo, hi) on an axis that wraps.
+static unsigned region_gap(unsigned v, unsigned lo, unsigned hi, unsigned size)
+{
+	if (v >= lo && v < hi)
+	{
+		return 0;
+	}
+	unsigned before = (lo + size - v) % size;
+	unsigned after = (v + size - (hi - 1)) % size;
+	return before < after ? before : after;
+}
+
+/*
+ * Split a room's map into regions. Can't be undone
+ * while the room is open.
+ *
+ * @param r     Room to split.
+ * @param cols  Regions across.
+ * @param rows  Regions down.
+ *
+ * @return FALSE on failure.
+ */
+int region_split(mp_room* const r, unsigned cols, unsigned rows)
+{
+	unsigned count = cols * rows;
+	if (!(r->regions = calloc(count, sizeof(mp_region))))
+	{
+		return FALSE;
+	}
+	r->region_cols = cols;
+	r->region_rows = rows;
+	r->region_count = count;
+
+	// Queues only ever hold each player once, except
+	// ghosts, which can be a few ticks' worth if the
+	// neighbour's thread falls behind.
+	unsigned players = r->max_players;
+	for (unsigned k = 0; k < count; ++k)
+	{
+		mp_region* g = &r->regions[k];
+		unsigned cx = k % cols, cy = k / cols;
+		g->x0 = cx * g_map_wid / cols;
+		g->x1 = (cx + 1) * g_map_wid / cols;
+		g->y0 = cy * g_map_hei / rows;
+		g->y1 = (cy + 1) * g_map_hei / rows;
+
+		// Everything around us, once each. (With only a
+		// couple of regions, the same one can be on more
+		// than one side)
+		for (int dy = -1; dy <= 1; ++dy)
+		{
+			for (int dx = -1; dx <= 1; ++dx)
+			{
+				unsigned n = ((cy + rows + dy) % rows) * cols + (cx + cols + dx) % cols;
+				int known = n == k;
+				for (unsigned i = 0; i < g->neighbour_count && !known; ++i)
+				{
+					known = g->neighbours[i] == n;
+				}
+				if (!known)
+				{
+					g->neighbours[g->neighbour_count++] = n;
+				}
+			}
+		}
+
+		if (!(g->owned = calloc(players, sizeof(unsigned))) ||
+			!(g->view = calloc(players, sizeof(mp_sighting))) ||
+			!spsc_init(&g->arrivals, sizeof(mp_handoff), players * 2))
+		{
+			goto fail;
+		}
+		for (unsigned i = 0; i < g->neighbour_count; ++i)
+		{
+			if (!spsc_init(&g->handoff[i], sizeof(mp_handoff), players) ||
+				!spsc_init(&g->ghosts_in[i], sizeof(mp_ghost), (players + 1) * 4) ||
+				!(g->ghosts[i] = malloc(players * sizeof(mp_ghost))) ||
+				!(g->next_ghosts[i] = malloc(players * sizeof(mp_ghost))))
+			{
+				goto fail;
+			}
+		}
+	}
+
+	// Where each region is in its neighbours' lists, for
+	// pushing to them.
+	for (unsigned k = 0; k < count; ++k)
+	{
+		mp_region* g = &r->regions[k];
+		for (unsigned i = 0; i < g->neighbour_count; ++i)
+		{
+			mp_region* n = &r->regions[g->neighbours[i]];
+			for (unsigned j = 0; j < n->neighbour_count; ++j)
+			{
+				if (n->neighbours[j] == k) g->back[i] = j;
+			}
+		}
+	}
+	return TRUE;
+
+fail:
+	region_free(r);
+	return FALSE;
+}
+
+/*
+ * Free a room's regions. Its tick threads must have
+ * stopped.
+ *
+ * @param r  Room whose regions to free.
+ */
+void region_free(mp_room* const r)
+{
+	for (unsigned k = 0; k < r->region_count && r->regions; ++k)
+	{
+		mp_region* g = &r->regions[k];
+		for (unsigned i = 0; i < g->neighbour_count; ++i)
+		{
+			spsc_deinit(&g->handoff[i]);
+			spsc_deinit(&g->ghosts_in[i]);
+			free(g->ghosts[i]);
+			free(g->next_ghosts[i]);
+		}
+		spsc_deinit(&g->arrivals);
+		free(g->owned);
+		free(g->view);
+	}
+	free(r->regions);
+	r->regions = 0;
+	r->region_count = 0;
+}
+
+/*
+ * @return the region a tile is in.
+ */
+unsigned region_at(const mp_room* const r, unsigned x, unsigned y)
+{
+	return region_piece(y, r->region_rows, g_map_hei) * r->region_cols +
+		region_piece(x, r->region_cols, g_map_wid);
+}
+
+/*
+ * Hand a player who has just joined or resumed to the
+ * region they're standing in. The caller must hold the
+ * room's lock, and the player's.
+ *
+ * @param r  Room they're in.
+ * @param c  The player.
+ */
+void region_arrive(mp_room* const r, mp_client* const c)
+{
+	mp_handoff h = { (unsigned)c->index, c->session };
+	if (!spsc_push(&r->regions[region_at(r, c->x, c->y)].arrivals, &h))
+	{
+		log_error("Too many arrivals in room %u; session %u is stuck.", r->id, c->session);
+	}
+}
+
+// Take in everyone handed to a region since last tick,
+// and the latest ghosts from around it.
+static void region_receive(mp_room* const r, mp_region* const g)
+{
+	mp_handoff h;
+	while (spsc_pop(&g->arrivals, &h))
+	{
+		g->owned[h.index] = h.session;
+	}
+	for (unsigned i = 0; i < g->neighbour_count; ++i)
+	{
+		while (spsc_pop(&g->handoff[i], &h))
+		{
+			g->owned[h.index] = h.session;
+		}
+
+		// A batch only replaces the last once all of it has
+		// arrived. (Should one ever be cut short, the next
+		// just adds to it)
+		mp_ghost e;
+		while (spsc_pop(&g->ghosts_in[i], &e))
+		{
+			if (e.index == REGION_GHOST_END)
+			{
+				mp_ghost* t = g->ghosts[i];
+				g->ghosts[i] = g->next_ghosts[i];
+				g->ghost_count[i] = g->next_ghost_count[i];
+				g->next_ghosts[i] = t;
+				g->next_ghost_count[i] = 0;
+			}
+			else if (g->next_ghost_count[i] < r->max_players)
+			{
+				g->next_ghosts[i][g->next_ghost_count[i]++] = e;
+			}
+		}
+	}
+}
+
+// Apply a player's inputs, as long as they stay in the
+// region. Once they step out, they're handed over and
+// the rest is left to their new region.
+//
+// @return the neighbour they were handed to, or -1 if
+//         they're still ours.
+static int region_move(mp_room* const r, unsigned k, mp_client* const c)
+{
+	mp_region* g = &r->regions[k];
+	mp_client_input in;
+	while (spsc_pop(&c->inputs, &in))
+	{
+		if (!client_input(c, in.seq, in.dx, in.dy))
+		{
+			continue;
+		}
+		world_store(c);
+
+		unsigned to = region_at(r, c->x, c->y);
+		if (to == k)
+		{
+			continue;
+		}
+		for (unsigned i = 0; i < g->neighbour_count; ++i)
+		{
+			if (g->neighbours[i] != to) continue;
+
+			mp_handoff h = { (unsigned)c->index, c->session };
+			if (spsc_push(&r->regions[to].handoff[g->back[i]], &h))
+			{
+				return (int)i;
+			}
+		}
+		log_error("Couldn't hand session %u to region %u.", c->session, to);
+		return -1;
+	}
+	return -1;
+}
+
+/*
+ * Run the simulation side of a region's tick: take in
+ * players handed over from around it, apply the inputs
+ * of everyone in it, hand over anyone who has left it,
+ * and send ghosts to the neighbours. After, the region's
+ * view has everyone it can see. Only call from the
+ * region's tick thread.
+ *
+ * @param r  Room the region is in.
+ * @param k  Region's number.
+ */
+void region_simulate(mp_room* const r, unsigned k)
+{
+	mp_region* g = &r->regions[k];
+	region_receive(r, g);
+
+	// Our own players, where they are after this tick.
+	memset(g->view, 0, r->max_players * sizeof(mp_sighting));
+	for (unsigned i = 0; i < r->max_players; ++i)
+	{
+		if (!g->owned[i]) continue;
+
+		mp_client* c = &r->clients[i];
+		pthread_mutex_lock(&c->lock);
+		if (!c->initialised || c->session != g->owned[i])
+		{
+			// They've gone, or someone else has the slot.
+			g->owned[i] = 0;
+			pthread_mutex_unlock(&c->lock);
+			continue;
+		}
+
+		// Anyone handed over is still seen where they
+		// ended up, and kept as a ghost until their new
+		// region's ghosts take over.
+		int n = region_move(r, k, c);
+		if (c->ready)
+		{
+			g->view[i] = (mp_sighting){ (unsigned short)c->x, (unsigned short)c->y, TRUE };
+			if (n >= 0 && g->ghost_count[n] < r->max_players)
+			{
+				g->ghosts[n][g->ghost_count[n]++] = (mp_ghost){ (unsigned short)i, g->view[i].x, g->view[i].y };
+			}
+		}
+		if (n >= 0)
+		{
+			g->owned[i] = 0;
+		}
+		pthread_mutex_unlock(&c->lock);
+	}
+
+	// Tell the neighbours who's near them.
+	for (unsigned i = 0; i < g->neighbour_count; ++i)
+	{
+		mp_region* n = &r->regions[g->neighbours[i]];
+		mp_spsc* q = &n->ghosts_in[g->back[i]];
+		for (unsigned p = 0; p < r->max_players; ++p)
+		{
+			mp_sighting* s = &g->view[p];
+			if (s->seen &&
+				region_gap(s->x, n->x0, n->x1, g_map_wid) <= REGION_GHOST_MARGIN &&
+				region_gap(s->y, n->y0, n->y1, g_map_hei) <= REGION_GHOST_MARGIN)
+			{
+				mp_ghost e = { (unsigned short)p, s->x, s->y };
+				spsc_push(q, &e);
+			}
+		}
+		mp_ghost end = { REGION_GHOST_END, 0, 0 };
+		spsc_push(q, &end);
+	}
+
+	// Then add the ghosts from around us to what we can see.
+	for (unsigned i = 0; i < g->neighbour_count; ++i)
+	{
+		for (unsigned j = 0; j < g->ghost_count[i]; ++j)
+		{
+			mp_ghost* e = &g->ghosts[i][j];
+			if (!g->view[e->index].seen)
+			{
+				g->view[e->index] = (mp_sighting){ e->x, e->y, TRUE };
+			}
+		}
+	}
+}
@@ -0,0 +1,121 @@
+#ifndef MP_REGION_H
+#define MP_REGION_H
+
+/*
+ * Regions: a room's map split into a grid of
+ * rectangles, so one big world can be simulated on
+ * several cores.
+ *
+ * Each region belongs to one tick thread, which
+ * applies the inputs of the players standing in it and
+ * sends them their updates. A player who walks over a
+ * border is handed to the neighbouring region through a
+ * lock-free queue, and from then on only that region
+ * touches them. Players near a border are also copied
+ * to the neighbour each tick as ghosts, so that each
+ * region can tell its players about everyone nearby,
+ * whichever region they're in, without reading another
+ * thread's players while it's moving them.
+ *
+ * What a player is sent is what their region can see:
+ * everyone in it, and the ghosts from around it.
+ */
+
+// Most regions a room's map can be split into, and
+// most distinct neighbours each can have.
+#define REGION_MAX 64
+#define REGION_NEIGHBOURS 8
+
+// Players within this many tiles of a neighbouring
+// region are copied to it as ghosts. Regions must be
+// at least twice this across.
+#define REGION_GHOST_MARGIN 8
+
+// Marks the end of a tick's batch of ghosts.
+#define REGION_GHOST_END 0xFFFF
+
+/*
+ * A player changing hands: their slot, and the session
+ * in it when they were handed over, so a region never
+ * picks up someone who has since left.
+ */
+typedef struct mp_handoff
+{
+	unsigned index;
+	unsigned session;
+} mp_handoff;
+
+/*
+ * A copy of a player standing near a neighbour's border.
+ */
+typedef struct mp_ghost
+{
+	unsigned short index;
+	unsigned short x, y;
+} mp_ghost;
+
+/*
+ * What a region can see of a slot this tick.
+ */
+typedef struct mp_sighting
+{
+	unsigned short x, y;
+	unsigned char seen;
+} mp_sighting;
+
+/*
+ * A region. Everything here but the queues is only
+ * touched by the region's own tick thread.
+ */
+typedef struct mp_region
+{
+	// Tiles covered: from (x0, y0) up to, but not
+	// including, (x1, y1).
+	unsigned x0, y0, x1, y1;
+
+	// Regions around this one (the map wraps, so every
+	// region has some), and where this one is in each of
+	// their lists.
+	unsigned neighbour_count;
+	unsigned neighbours[REGION_NEIGHBOURS];
+	unsigned back[REGION_NEIGHBOURS];
+
+	// Players (mp_handoff) and ghosts (mp_ghost) from
+	// each neighbour. Only ever pushed to by the
+	// neighbour's tick thread.
+	mp_spsc handoff[REGION_NEIGHBOURS];
+	mp_spsc ghosts_in[REGION_NEIGHBOURS];
+
+	// Players who have joined or resumed inside the
+	// region. (mp_handoff) Pushed to under the room's
+	// lock, so only one thread pushes at a time.
+	mp_spsc arrivals;
+
+	// Session of the player in each slot that belongs
+	// to the region, or 0 if it isn't ours.
+	unsigned* owned;
+
+	// Each neighbour's last complete batch of ghosts,
+	// and the one still arriving.
+	mp_ghost* ghosts[REGION_NEIGHBOURS];
+	mp_ghost* next_ghosts[REGION_NEIGHBOURS];
+	unsigned ghost_count[REGION_NEIGHBOURS];
+	unsigned next_ghost_count[REGION_NEIGHBOURS];
+
+	// Everyone the region can see, by slot. Rebuilt
+	// each tick.
+	mp_sighting* view;
+} mp_region;
+
+struct mp_room;
+
+// Setup
+int region_split(struct mp_room* const, unsigned, unsigned);
+void region_free(struct mp_room* const);
+
+// Simulation
+unsigned region_at(const struct mp_room* const, unsigned, unsigned);
+void region_arrive(struct mp_room* const, mp_client* const);
+void region_simulate(struct mp_room* const, unsigned);
+
+#endif
@@ -0,0 +1,487 @@
+/*
+ * mp_room.c
+ *
+ * Rooms, each an independent game with its own
+ * players, grid and timers.
+ */
+
+#include "pch.h"
+#include "mp_rtt.h"
+#include "mp_rate.h"
+#include "mp_timer.h"
+#include "mp_grid.h"
+#include "mp_client.h"
+#include "mp_region.h"
+#include "mp_room.h"
+#include "mp_overload.h"
+
+// Forward declarations of externals that we reference.
+extern unsigned g_tick_ms;
+extern unsigned g_region_cols;
+extern unsigned g_region_rows;
+extern mp_overload g_overload;
+extern mp_pool g_pool;
+extern uint64_t* g_walls;
+
+/*
+ * Count the pool blocks that rooms need for their
+ * client slots.
+ *
+ * @param counts       Blocks in each pool class, to
+ *                     add to.
+ * @param rooms        Number of rooms.
+ * @param max_players  Player slots in each.
+ */
+void room_reserve(unsigned* const counts, unsigned rooms, unsigned max_players)
+{
+	pool_reserve(counts, max_players * sizeof(mp_client), rooms);
+	pool_reserve(counts, ROOM_MAX_SPECTATORS * sizeof(mp_client), rooms);
+}
+
+/*
+ * Set up a room.
+ *
+ * @param r            Room to initialise.
+ * @param id           Room's id.
+ * @param max_players  Number of player slots.
+ * @param map          Map the room is played on, or 0
+ *                     for a room nobody plays in (the
+ *                     lobby). Its walls are g_walls.
+ *
+ * @return FALSE on failure.
+ */
+int room_init(mp_room* const r, unsigned id, unsigned max_players, const mp_map* const map)
+{
+	int slots_ready = FALSE;
+	r->id = id;
+	r->max_players = max_players;
+	atomic_init(&r->players, 0);
+	memset(&r->grid, 0, sizeof(mp_grid));
+	r->regions = 0;
+	r->region_count = 0;
+	timer_wheel_init(&r->timers, g_tick_ms);
+	pthread_mutex_init(&r->lock, 0);
+
+	// Memory for all the clients the room will have.
+	if (!(r->clients = pool_alloc(&g_pool, max_players * sizeof(mp_client))) ||
+		!(r->spectators = pool_alloc(&g_pool, ROOM_MAX_SPECTATORS * sizeof(mp_client))))
+	{
+		goto fail;
+	}
+	memset(r->clients, 0, max_players * sizeof(mp_client));
+	memset(r->spectators, 0, ROOM_MAX_SPECTATORS * sizeof(mp_client));
+	for (unsigned i = 0; i < max_players; ++i)
+	{
+		pthread_mutex_init(&r->clients[i].lock, 0);
+		pthread_cond_init(&r->clients[i].released, 0);
+		r->clients[i].room = r;
+	}
+	for (unsigned i = 0; i < ROOM_MAX_SPECTATORS; ++i)
+	{
+		pthread_mutex_init(&r->spectators[i].lock, 0);
+		r->spectators[i].room = r;
+		r->spectators[i].spectator = TRUE;
+	}
+	slots_ready = TRUE;
+
+	// Work out where players can go, and who simulates
+	// which part of the map.
+	if (map && !grid_init(&r->grid, map, g_walls))
+	{
+		goto fail;
+	}
+	if (map && g_region_cols * g_region_rows > 1 &&
+		!region_split(r, g_region_cols, g_region_rows))
+	{
+		goto fail;
+	}
+
+	atomic_store_explicit(&r->open, TRUE, memory_order_release);
+	return TRUE;
+
+fail:
+	// A later attempt sets everything up again.
+	if (slots_ready)
+	{
+		for (unsigned i = 0; i < max_players; ++i)
+		{
+			pthread_mutex_destroy(&r->clients[i].lock);
+			pthread_cond_destroy(&r->clients[i].released);
+		}
+		for (unsigned i = 0; i < ROOM_MAX_SPECTATORS; ++i)
+		{
+			pthread_mutex_destroy(&r->spectators[i].lock);
+		}
+	}
+	grid_deinit(&r->grid);
+	pool_free(&g_pool, r->clients);
+	pool_free(&g_pool, r->spectators);
+	r->clients = r->spectators = 0;
+	timer_wheel_deinit(&r->timers);
+	pthread_mutex_destroy(&r->lock);
+	return FALSE;
+}
+
+/*
+ * Tear down a room, disconnecting everyone in it.
+ * Its tick thread must have stopped.
+ *
+ * @param r  Room to deinitialise.
+ */
+void room_deinit(mp_room* const r)
+{
+	if (!atomic_load(&r->open)) return;
+	atomic_store(&r->open, FALSE);
+
+	for (unsigned i = 0; i < r->max_players; ++i)
+	{
+		// Need to do this to stop threads.
+		if (r->clients[i].initialised)
+		{
+			client_deinit(&r->clients[i]);
+		}
+		pthread_mutex_destroy(&r->clients[i].lock);
+		pthread_cond_destroy(&r->clients[i].released);
+	}
+	for (unsigned i = 0; i < ROOM_MAX_SPECTATORS; ++i)
+	{
+		if (r->spectators[i].initialised)
+		{
+			client_deinit(&r->spectators[i]);
+		}
+		pthread_mutex_destroy(&r->spectators[i].lock);
+	}
+	pool_free(&g_pool, r->clients);
+	pool_free(&g_pool, r->spectators);
+	r->clients = r->spectators = 0;
+
+	region_free(r);
+	grid_deinit(&r->grid);
+	timer_wheel_deinit(&r->timers);
+	pthread_mutex_destroy(&r->lock);
+}
+
+/*
+ * @return whether every slot in the room is taken.
+ */
+int room_full(mp_room* const r)
+{
+	return atomic_load_explicit(&r->players, memory_order_relaxed) >= r->max_players;
+}
+
+/*
+ * Move a connection that has done its handshake into
+ * a free slot in the room as a new player. They're
+ * sent P_HELLO.
+ *
+ * @param r  Room to join.
+ * @param c  The connection's lobby slot.
+ *
+ * @return the player's slot, or 0 if the room is full.
+ */
+mp_client* room_join(mp_room* const r, mp_client* const c)
+{
+	mp_client* p = 0;
+	pthread_mutex_lock(&r->lock);
+	for (unsigned i = 0; i < r->max_players && !p; ++i)
+	{
+		mp_client* s = &r->clients[i];
+		pthread_mutex_lock(&s->lock);
+		if (!s->initialised)
+		{
+			p = s;
+			client_init(p, -1);
+			client_set_index(p, i);
+			pthread_mutex_lock(&c->lock);
+			client_take(p, c);
+			p->token = c->token;
+			pthread_mutex_unlock(&c->lock);
+			client_hello(p);
+			if (r->region_count) region_arrive(r, p);
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return p;
+}
+
+// Shut down the connection a session is still live
+// on, if it's in this room, and wait for its worker
+// thread to hold the session. A client that drops and
+// comes straight back usually beats us to noticing.
+static void room_takeover(mp_room* const r, mp_client* const c, unsigned long long token)
+{
+	for (unsigned i = 0; i < r->max_players; ++i)
+	{
+		mp_client* s = &r->clients[i];
+		if (s->held || s->token != token) continue;
+
+		pthread_mutex_lock(&s->lock);
+		if (s->initialised && !s->held && !s->left && s->sock >= 0 && s->token == token)
+		{
+			log_info("Session %u is being taken over by session %u.", s->session, c->session);
+			shutdown(s->sock, SHUT_RDWR);
+
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec += CLIENT_TAKEOVER_MS / 1000;
+			until.tv_nsec += (CLIENT_TAKEOVER_MS % 1000) * 1000000L;
+			if (until.tv_nsec >= 1000000000L)
+			{
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000L;
+			}
+			while (s->initialised && !s->held && s->token == token &&
+				pthread_cond_timedwait(&s->released, &s->lock, &until) == 0);
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+/*
+ * Move a connection that has done its handshake into
+ * the session it's resuming, if it's in this room. A
+ * session still live on another connection is taken
+ * over: that connection is shut down, and the session
+ * handed on once it's been held.
+ *
+ * @param r      Room to look in.
+ * @param c      The connection's lobby slot.
+ * @param token  Token of the session to resume.
+ * @param tick   Tick of the last update the client got.
+ *
+ * @return the player's slot, or 0 if the session
+ *         isn't here.
+ */
+mp_client* room_resume(mp_room* const r, mp_client* const c, unsigned long long token, unsigned long long tick)
+{
+	room_takeover(r, c, token);
+
+	mp_client* p = 0;
+	pthread_mutex_lock(&r->lock);
+	for (unsigned i = 0; i < r->max_players && !p; ++i)
+	{
+		// Cheap check first, so that looking through
+		// every room doesn't take every lock.
+		mp_client* s = &r->clients[i];
+		if (!s->held || s->token != token) continue;
+
+		pthread_mutex_lock(&s->lock);
+		if (s->initialised && s->held && s->token == token)
+		{
+			p = s;
+			log_info("Session %u resumed as session %u in room %u.", p->session, c->session, r->id);
+			pthread_mutex_lock(&c->lock);
+			client_take(p, c);
+			pthread_mutex_unlock(&c->lock);
+			client_resume(p, tick);
+			if (r->region_count) region_arrive(r, p);
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return p;
+}
+
+/*
+ * Move a connection that has done its handshake into
+ * a spectator slot in the room. They're sent P_HELLO.
+ *
+ * @param r  Room to watch.
+ * @param c  The connection's lobby slot.
+ *
+ * @return the spectator's slot, or 0 if there are no
+ *         free ones.
+ */
+mp_client* room_spectate(mp_room* const r, mp_client* const c)
+{
+	mp_client* p = 0;
+	pthread_mutex_lock(&r->lock);
+	for (unsigned i = 0; i < ROOM_MAX_SPECTATORS && !p; ++i)
+	{
+		mp_client* s = &r->spectators[i];
+		pthread_mutex_lock(&s->lock);
+		if (!s->initialised)
+		{
+			p = s;
+			client_init(p, -1);
+			client_set_index(p, i);
+			pthread_mutex_lock(&c->lock);
+			client_take(p, c);
+			pthread_mutex_unlock(&c->lock);
+			client_hello(p);
+			log_info("Session %u is watching room %u.", p->session, r->id);
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+	pthread_mutex_unlock(&r->lock);
+	return p;
+}
+
+// Send a client whatever it's due this tick, if its
+// link is up to being sent to this tick. While the
+// server is overloaded, nobody is sent to every tick.
+// Players in regions are sent what their region sees.
+static void room_send(mp_client* const c, unsigned min_interval, const mp_sighting* const view)
+{
+	pthread_mutex_lock(&c->lock);
+	if (c->initialised && c->ready && !c->held && rate_due(&c->rate, c->sock, &c->rtt, min_interval))
+	{
+		client_send_map(c);
+		if (c->join_pos < c->join_len)
+		{
+			client_send_join(c);
+		}
+		else
+		{
+			client_send_update(c, view);
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+// Fewest ticks between sends to anyone, which goes up
+// while the server is overloaded.
+static unsigned room_min_interval(void)
+{
+	return overload_stage(&g_overload) >= OVERLOAD_THROTTLE ? 2 : 1;
+}
+
+/*
+ * Run a tick of the room. Any timers that are due go
+ * off, then every client that's in the game, and every
+ * spectator, gets sent what's changed. Clients that
+ * are still joining get sent more of the join stream
+ * instead. A room split into regions has each of them
+ * ticked in turn. (Replays use this, so that they run
+ * on a single thread)
+ *
+ * @param r  Room to tick.
+ */
+void room_tick(mp_room* const r)
+{
+	if (r->region_count)
+	{
+		for (unsigned k = 0; k < r->region_count; ++k)
+		{
+			room_tick_region(r, k);
+		}
+		return;
+	}
+
+	unsigned min_interval = room_min_interval();
+	timer_advance(&r->timers);
+	for (unsigned i = 0; i < r->max_players; ++i)
+	{
+		room_send(&r->clients[i], min_interval, 0);
+	}
+	for (unsigned i = 0; i < ROOM_MAX_SPECTATORS; ++i)
+	{
+		room_send(&r->spectators[i], min_interval, 0);
+	}
+}
+
+/*
+ * Run a tick of one of a room's regions: its players
+ * move, and are sent what the region can see. The first
+ * region also runs the room's timers first, and sends
+ * to spectators, who see the whole room. Only called
+ * from the region's tick thread.
+ *
+ * @param r  Room the region is in.
+ * @param k  Region's number.
+ */
+void room_tick_region(mp_room* const r, unsigned k)
+{
+	unsigned min_interval = room_min_interval();
+	if (!k)
+	{
+		timer_advance(&r->timers);
+	}
+
+	mp_region* g = &r->regions[k];
+	region_simulate(r, k);
+	for (unsigned i = 0; i < r->max_players; ++i)
+	{
+		if (g->owned[i])
+		{
+			room_send(&r->clients[i], min_interval, g->view);
+		}
+	}
+
+	for (unsigned i = 0; i < ROOM_MAX_SPECTATORS && !k; ++i)
+	{
+		room_send(&r->spectators[i], min_interval, 0);
+	}
+}
+
+// Find the client in the room with the slowest link:
+// the one sent to least often, then the one with the
+// longest round trip. Held sessions aren't counted,
+// as nothing is being sent to them.
+static mp_client* room_slowest(mp_room* const r)
+{
+	mp_client* slowest = 0;
+	unsigned interval = 0;
+	long long rtt = -1;
+	for (unsigned i = 0; i < r->max_players + ROOM_MAX_SPECTATORS; ++i)
+	{
+		mp_client* c = i < r->max_players ? &r->clients[i] : &r->spectators[i - r->max_players];
+		pthread_mutex_lock(&c->lock);
+		if (c->initialised && c->ready && !c->held && !c->left &&
+			(c->rate.interval > interval || (c->rate.interval == interval && c->rtt.rtt > rtt)))
+		{
+			slowest = c;
+			interval = c->rate.interval;
+			rtt = c->rtt.rtt;
+		}
+		pthread_mutex_unlock(&c->lock);
+	}
+	return slowest;
+}
+
+/*
+ * Drop the room's slowest client to lighten the load,
+ * telling them why. Only called from the room's tick
+ * thread.
+ *
+ * @param r  Room to shed a client from.
+ */
+void room_shed(mp_room* const r)
+{
+	mp_client* c = room_slowest(r);
+	if (!c)
+	{
+		return;
+	}
+	pthread_mutex_lock(&c->lock);
+	if (c->initialised && c->ready && !c->held && !c->left)
+	{
+		log_warn("Shedding session %u from room %u. (sent every %u ticks, rtt %.2f ms)",
+			c->session, r->id, c->rate.interval, (double)c->rtt.rtt / NS_PER_MS);
+		client_kick(c, ERR_OVERLOADED);
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * Print latency stats for each session in the room.
+ *
+ * @param r  Room to report on.
+ */
+void room_stats(mp_room* const r)
+{
+	for (unsigned i = 0; i < r->max_players; ++i)
+	{
+		mp_client* c = &r->clients[i];
+		if (!c->initialised || !c->rtt.samples) continue;
+		log_info("Room %u session %u: rtt %.2f ms, jitter %.2f ms, clock offset %.2f ms (%u samples), sent every %u ticks",
+			r->id,
+			c->session,
+			(double)c->rtt.rtt / NS_PER_MS,
+			(double)c->rtt.jitter / NS_PER_MS,
+			(double)c->rtt.offset / NS_PER_MS,
+			c->rtt.samples,
+			c->rate.interval);
+	}
+}
@@ -0,0 +1,84 @@
+#ifndef MP_ROOM_H
+#define MP_ROOM_H
+
+/*
+ * A room: one game, with its own players, collision
+ * grid and timers. All rooms play on the same map.
+ *
+ * Each room belongs to one tick thread for its whole
+ * life, so its tick, its timers and everything it sends
+ * stay on one core, and rooms never have to wait on
+ * each other. Connections that haven't joined a room
+ * yet sit in the lobby, which is a room with no grid
+ * whose timers are run by the main thread.
+ *
+ * A room can instead have its map split into regions,
+ * each ticked by a thread of its own, so that one big
+ * world can use several cores. (See mp_region.h) Its
+ * first region's thread then also runs its timers and
+ * sends to its spectators.
+ */
+// Spectator slots in each room. Spectators are meant
+// to be relays, which pass the room on to any number
+// of viewers, so only a few are needed.
+#define ROOM_MAX_SPECTATORS 8
+
+typedef struct mp_room
+{
+	// Room's id. Rooms are numbered from 1; the lobby
+	// is 0.
+	unsigned id;
+
+	// Set once the room has been set up. Tick threads
+	// skip rooms until then.
+	atomic_int open;
+
+	// Set while a thread is setting the room up. (Only
+	// touched under the server's rooms lock)
+	int opening;
+
+	// Player slots.
+	mp_client* clients;
+	unsigned max_players;
+
+	// Number of slots in use, counting held sessions.
+	atomic_uint players;
+
+	// Slots for spectators. These aren't players, and
+	// aren't counted in players.
+	mp_client* spectators;
+
+	// Who's standing where.
+	mp_grid grid;
+
+	// Regions the map is split into, if it is, and how
+	// many across and down. (region_count is 0 if not)
+	mp_region* regions;
+	unsigned region_count;
+	unsigned region_cols, region_rows;
+
+	// Timers of everyone in the room. Turned once a tick.
+	mp_timer_wheel timers;
+
+	// Held while moving connections into player slots.
+	pthread_mutex_t lock;
+} mp_room;
+
+// Allocation
+void room_reserve(unsigned* const, unsigned, unsigned);
+int room_init(mp_room* const, unsigned, unsigned, const mp_map* const);
+void room_deinit(mp_room* const);
+
+// Players
+mp_client* room_join(mp_room* const, mp_client* const);
+mp_client* room_resume(mp_room* const, mp_client* const, unsigned long long, unsigned long long);
+mp_client* room_spectate(mp_room* const, mp_client* const);
+int room_full(mp_room* const);
+
+// Ticking
+void room_tick(mp_room* const);
+void room_tick_region(mp_room* const, unsigned);
+void room_shed(mp_room* const);
+void room_stats(mp_room* const);
+
+#endif
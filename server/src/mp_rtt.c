@@ -0,0 +1,54 @@
+/*
+ * mp_rtt.c
+ *
+ * Round trip time, jitter and clock offset estimation.
+ */
+
+#include "pch.h"
+#include "mp_rtt.h"
+
+/*
+ * Reset estimates.
+ *
+ * @param r  Estimates to reset.
+ */
+void rtt_init(mp_rtt* const r)
+{
+	memset(r, 0, sizeof(mp_rtt));
+}
+
+/*
+ * Take in the times from a ping/pong exchange.
+ *
+ * @param r   Estimates to update.
+ * @param t0  Our time when the ping was sent.
+ * @param t1  Client's time when the ping arrived.
+ * @param t2  Client's time when the pong was sent.
+ * @param t3  Our time when the pong arrived.
+ */
+void rtt_sample(mp_rtt* const r, unsigned long long t0, unsigned long long t1, unsigned long long t2, unsigned long long t3)
+{
+	// Time on the wire, not counting the time the client
+	// took to respond.
+	long long rtt = (long long)(t3 - t0) - (long long)(t2 - t1);
+	if (rtt < 0) rtt = 0;
+
+	// Assuming the trip is the same length both ways.
+	long long offset = ((long long)(t1 - t0) + (long long)(t2 - t3)) / 2;
+
+	r->last = rtt;
+	if (r->samples++ == 0)
+	{
+		r->rtt = rtt;
+		r->jitter = rtt / 2;
+		r->offset = offset;
+		return;
+	}
+
+	// Smooth the same way TCP does (RFC 6298): the
+	// deviation with a gain of 1/4, the rest 1/8.
+	long long err = rtt - r->rtt;
+	r->jitter += ((err < 0 ? -err : err) - r->jitter) / 4;
+	r->rtt += err / 8;
+	r->offset += (offset - r->offset) / 8;
+}
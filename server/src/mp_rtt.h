@@ -0,0 +1,41 @@
+#ifndef MP_RTT_H
+#define MP_RTT_H
+
+// How often each client is pinged.
+#define RTT_PING_MS 1000
+
+/*
+ * Latency estimates for a session, built up from
+ * P_PING/P_PONG exchanges.
+ *
+ * For each exchange we have four times: t0 when we
+ * sent the ping, t1 when the client got it, t2 when
+ * the client replied and t3 when the reply arrived.
+ * t0/t3 are on our clock and t1/t2 on the client's.
+ */
+typedef struct mp_rtt
+{
+	// Number of samples taken so far.
+	unsigned samples;
+
+	// Smoothed round trip time. (ns)
+	long long rtt;
+
+	// Smoothed mean deviation of the round trip time.
+	long long jitter;
+
+	// Smoothed offset of the client's clock from ours,
+	// such that client time = our time + offset. (ns)
+	long long offset;
+
+	// Most recent raw round trip time. (ns)
+	long long last;
+
+	// When the last ping was sent. (ns)
+	unsigned long long last_ping;
+} mp_rtt;
+
+void rtt_init(mp_rtt* const);
+void rtt_sample(mp_rtt* const, unsigned long long, unsigned long long, unsigned long long, unsigned long long);
+
+#endif
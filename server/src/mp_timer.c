@@ -0,0 +1,206 @@
+/*
+ * mp_timer.c
+ *
+ * Hashed timing wheel.
+ */
+
+#include "pch.h"
+#include "mp_timer.h"
+
+/*
+ * Initialise a wheel.
+ *
+ * @param w        Wheel to initialise.
+ * @param tick_ms  Length of each tick.
+ */
+void timer_wheel_init(mp_timer_wheel* const w, unsigned tick_ms)
+{
+	for (unsigned i = 0; i < TIMER_SLOTS; ++i)
+	{
+		w->slots[i].next = w->slots[i].prev = &w->slots[i];
+	}
+	w->firing.next = w->firing.prev = &w->firing;
+	atomic_init(&w->now, 0);
+	w->tick_ms = tick_ms ? tick_ms : 1;
+	pthread_mutex_init(&w->lock, 0);
+}
+
+/*
+ * Tear down a wheel. Any timers left in it are
+ * simply forgotten.
+ *
+ * @param w  Wheel.
+ */
+void timer_wheel_deinit(mp_timer_wheel* const w)
+{
+	pthread_mutex_destroy(&w->lock);
+}
+
+/*
+ * @return the wheel's current tick.
+ */
+unsigned long long timer_now(mp_timer_wheel* const w)
+{
+	return atomic_load_explicit(&w->now, memory_order_relaxed);
+}
+
+/*
+ * @return the number of ticks in the given time,
+ *         rounded up.
+ */
+unsigned long long timer_ticks(mp_timer_wheel* const w, unsigned ms)
+{
+	return (ms + w->tick_ms - 1) / w->tick_ms;
+}
+
+// Take a timer out of its slot, or the firing list.
+// Wheel must be locked.
+static void timer_unlink(mp_timer* const t)
+{
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = t->prev = 0;
+	t->armed = FALSE;
+}
+
+/*
+ * Move the wheel on a tick, and fire any timers that
+ * are due.
+ *
+ * @param w  Wheel.
+ */
+void timer_advance(mp_timer_wheel* const w)
+{
+	// Pull out everything that's due while locked...
+	pthread_mutex_lock(&w->lock);
+	unsigned long long now = atomic_load(&w->now) + 1;
+	atomic_store(&w->now, now);
+
+	mp_timer* head = &w->slots[now & (TIMER_SLOTS - 1)];
+	mp_timer* firing = &w->firing;
+	for (mp_timer* t = head->next; t != head;)
+	{
+		mp_timer* next = t->next;
+		if (t->expires <= now)
+		{
+			// Still armed, so other threads can cancel or
+			// rearm it until it's run.
+			t->prev->next = t->next;
+			t->next->prev = t->prev;
+			t->prev = firing->prev;
+			t->next = firing;
+			firing->prev->next = t;
+			firing->prev = t;
+		}
+		t = next;
+	}
+
+	// ...then run them unlocked, one at a time, so
+	// they're free to take other locks and rearm
+	// themselves.
+	while (firing->next != firing)
+	{
+		mp_timer* t = firing->next;
+		timer_unlink(t);
+		pthread_mutex_unlock(&w->lock);
+		t->fn(t);
+		pthread_mutex_lock(&w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * Initialise a timer.
+ *
+ * @param t    Timer.
+ * @param fn   Function to call when it goes off.
+ * @param arg  Passed along in the timer.
+ */
+void timer_init(mp_timer* const t, void (*fn)(mp_timer*), void* arg)
+{
+	t->next = t->prev = 0;
+	t->expires = TIMER_NEVER;
+	t->armed = FALSE;
+	t->fn = fn;
+	t->arg = arg;
+}
+
+/*
+ * Arm a timer to go off on a tick, replacing any
+ * time it was already armed for, even if it was
+ * about to go off. Ticks that have already passed go
+ * off on the next one.
+ *
+ * @param w     Wheel.
+ * @param t     Timer.
+ * @param tick  Tick to go off on.
+ */
+void timer_arm_at(mp_timer_wheel* const w, mp_timer* const t, unsigned long long tick)
+{
+	pthread_mutex_lock(&w->lock);
+	if (t->armed)
+	{
+		timer_unlink(t);
+	}
+
+	unsigned long long now = atomic_load(&w->now);
+	if (tick <= now) tick = now + 1;
+
+	mp_timer* head = &w->slots[tick & (TIMER_SLOTS - 1)];
+	t->expires = tick;
+	t->prev = head;
+	t->next = head->next;
+	head->next->prev = t;
+	head->next = t;
+	t->armed = TRUE;
+	pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * Arm a timer to go off after a while.
+ *
+ * @param w   Wheel.
+ * @param t   Timer.
+ * @param ms  Time until it goes off.
+ */
+void timer_arm(mp_timer_wheel* const w, mp_timer* const t, unsigned ms)
+{
+	timer_arm_at(w, t, timer_now(w) + timer_ticks(w, ms));
+}
+
+/*
+ * Stop a timer from going off. Does nothing if it
+ * isn't armed. A timer that is already being run may
+ * still be running when this returns, so callbacks
+ * must check (under their own lock) that they're
+ * still wanted.
+ *
+ * @param w  Wheel.
+ * @param t  Timer.
+ */
+void timer_cancel(mp_timer_wheel* const w, mp_timer* const t)
+{
+	pthread_mutex_lock(&w->lock);
+	if (t->armed)
+	{
+		timer_unlink(t);
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * Check whether a timer is armed. Lets a callback
+ * that had to wait for its owner's lock see that it
+ * was rearmed meanwhile, and leave it to that run.
+ *
+ * @param w  Wheel.
+ * @param t  Timer.
+ * @return   TRUE if the timer is yet to go off.
+ */
+int timer_pending(mp_timer_wheel* const w, mp_timer* const t)
+{
+	pthread_mutex_lock(&w->lock);
+	int armed = t->armed;
+	pthread_mutex_unlock(&w->lock);
+	return armed ? TRUE : FALSE;
+}
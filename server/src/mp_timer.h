@@ -0,0 +1,79 @@
+#ifndef MP_TIMER_H
+#define MP_TIMER_H
+
+// Number of slots in the wheel. (Power of two)
+#define TIMER_SLOTS 1024
+
+// Deadline of a timer that isn't going to happen.
+#define TIMER_NEVER (~0ULL)
+
+/*
+ * A timer. Timers live inside whatever owns them, and
+ * are linked into the wheel's slots while armed.
+ */
+typedef struct mp_timer
+{
+	// Links within the slot, or the list of timers
+	// about to go off.
+	struct mp_timer* next;
+	struct mp_timer* prev;
+
+	// Wheel tick the timer goes off on.
+	unsigned long long expires;
+
+	// Non-zero while in the wheel, including while
+	// waiting to go off.
+	int armed;
+
+	// Called when it goes off, with the wheel unlocked,
+	// on the thread advancing the wheel.
+	void (*fn)(struct mp_timer*);
+	void* arg;
+} mp_timer;
+
+/*
+ * Hashed timing wheel.
+ *
+ * Time is counted in ticks. A timer is kept in the slot
+ * for the tick it expires on, modulo the number of
+ * slots, so arming, rearming and cancelling are all
+ * constant time, and each tick only has to look at the
+ * one slot. Timers further off than a full turn of the
+ * wheel just get passed over until their turn comes.
+ *
+ * Timers can be armed and cancelled from any thread.
+ * Due timers are moved to a list of their own and taken
+ * off it one at a time as they're run, so one cancelled
+ * or rearmed before its turn simply doesn't go off.
+ */
+typedef struct mp_timer_wheel
+{
+	// List heads for each slot, and for timers that
+	// are due but haven't been run yet.
+	mp_timer slots[TIMER_SLOTS];
+	mp_timer firing;
+
+	// Current tick.
+	atomic_ullong now;
+
+	// Length of a tick.
+	unsigned tick_ms;
+
+	pthread_mutex_t lock;
+} mp_timer_wheel;
+
+// Wheel
+void timer_wheel_init(mp_timer_wheel* const, unsigned);
+void timer_wheel_deinit(mp_timer_wheel* const);
+unsigned long long timer_now(mp_timer_wheel* const);
+unsigned long long timer_ticks(mp_timer_wheel* const, unsigned);
+void timer_advance(mp_timer_wheel* const);
+
+// Timers
+void timer_init(mp_timer* const, void (*)(mp_timer*), void*);
+void timer_arm_at(mp_timer_wheel* const, mp_timer* const, unsigned long long);
+void timer_arm(mp_timer_wheel* const, mp_timer* const, unsigned);
+void timer_cancel(mp_timer_wheel* const, mp_timer* const);
+int timer_pending(mp_timer_wheel* const, mp_timer* const);
+
+#endif
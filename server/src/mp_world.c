@@ -0,0 +1,192 @@
+/*
+ * mp_world.c
+ *
+ * Memory-mapped persistent world state.
+ */
+
+#include "pch.h"
+#include "mp_rtt.h"
+#include "mp_rate.h"
+#include "mp_timer.h"
+#include "mp_client.h"
+#include "mp_world.h"
+
+// Forward declarations of externals that we reference.
+extern unsigned g_map_wid;
+extern unsigned g_map_hei;
+
+// The mapped file. Null when persistence is disabled.
+static mp_world_file* world = 0;
+
+// Serialises joins/leaves, which pick records.
+static pthread_mutex_t world_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Map the world file, creating or resetting it
+ * if needed.
+ *
+ * @param path  Path of the world file.
+ *
+ * @return FALSE on failure.
+ */
+int world_open(const char* path)
+{
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+	{
+		log_error("Failed to open world file %s", path);
+		return FALSE;
+	}
+
+	// Make sure the file is the right size before mapping.
+	struct stat st;
+	int fresh = fstat(fd, &st) != 0 || st.st_size != sizeof(mp_world_file);
+	if (fresh && ftruncate(fd, sizeof(mp_world_file)) != 0)
+	{
+		log_error("Failed to resize world file %s", path);
+		close(fd);
+		return FALSE;
+	}
+
+	mp_world_file* w = mmap(0, sizeof(mp_world_file), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (w == MAP_FAILED)
+	{
+		log_error("Failed to map world file %s", path);
+		return FALSE;
+	}
+
+	// Wipe the file if it's from another version, or
+	// was made for a different map.
+	if (fresh ||
+		memcmp(w->magic, WORLD_MAGIC, 4) != 0 ||
+		w->version != WORLD_VERSION ||
+		w->map_wid != g_map_wid ||
+		w->map_hei != g_map_hei ||
+		w->player_cap != WORLD_MAX_SAVED)
+	{
+		log_info("Starting new world in %s", path);
+		memset(w, 0, sizeof(mp_world_file));
+		w->version = WORLD_VERSION;
+		w->map_wid = g_map_wid;
+		w->map_hei = g_map_hei;
+		w->player_cap = WORLD_MAX_SAVED;
+		memcpy(w->magic, WORLD_MAGIC, 4);
+	}
+	else
+	{
+		// Nobody's connected yet, whatever the file says.
+		unsigned count = 0;
+		for (unsigned i = 0; i < WORLD_MAX_SAVED; ++i)
+		{
+			w->players[i].online = FALSE;
+			count += w->players[i].used;
+		}
+		log_info("Resumed world from %s (%u players remembered)", path, count);
+	}
+
+	world = w;
+	return TRUE;
+}
+
+/*
+ * Flush and unmap the world file.
+ */
+void world_close(void)
+{
+	if (!world) return;
+	msync(world, sizeof(mp_world_file), MS_SYNC);
+	munmap(world, sizeof(mp_world_file));
+	world = 0;
+}
+
+/*
+ * Find the client's record in the world, restoring
+ * their position if they've been here before. The
+ * record is then kept under the client's new token.
+ *
+ * @param c     Client that is joining.
+ * @param prev  Token of the client's earlier session,
+ *              or 0 if it's new.
+ *
+ * @return TRUE if the client's position was restored.
+ */
+int world_join(mp_client* const c, unsigned long long prev)
+{
+	c->save = -1;
+	if (!world) return FALSE;
+
+	pthread_mutex_lock(&world_lock);
+
+	// Look for a record belonging to this player, while
+	// keeping track of the best one to use otherwise.
+	int found = -1, spare = -1;
+	for (unsigned i = 0; i < WORLD_MAX_SAVED; ++i)
+	{
+		mp_world_player* p = &world->players[i];
+		if (prev && p->used && !p->online && p->token == prev)
+		{
+			found = i;
+			break;
+		}
+
+		// Prefer empty records, then the stalest one.
+		if (p->online) continue;
+		if (spare == -1 ||
+			(!p->used && world->players[spare].used) ||
+			(p->used == world->players[spare].used && p->last_seen < world->players[spare].last_seen))
+		{
+			spare = i;
+		}
+	}
+
+	int restored = found != -1;
+	int rec = restored ? found : spare;
+	if (rec != -1)
+	{
+		mp_world_player* p = &world->players[rec];
+		if (restored)
+		{
+			c->x = p->x;
+			c->y = p->y;
+		}
+		p->used = TRUE;
+		p->online = TRUE;
+		p->token = c->token;
+		p->last_seen = time(0);
+		c->save = rec;
+	}
+
+	pthread_mutex_unlock(&world_lock);
+	return restored;
+}
+
+/*
+ * Write a client's current state through to the world.
+ *
+ * @param c  Client to store.
+ */
+void world_store(mp_client* const c)
+{
+	if (!world || c->save < 0) return;
+	world->players[c->save].x = c->x;
+	world->players[c->save].y = c->y;
+}
+
+/*
+ * Mark a client as having left. Their record is kept
+ * for when they come back.
+ *
+ * @param c  Client that is leaving.
+ */
+void world_leave(mp_client* const c)
+{
+	if (!world || c->save < 0) return;
+
+	pthread_mutex_lock(&world_lock);
+	world->players[c->save].online = FALSE;
+	world->players[c->save].last_seen = time(0);
+	pthread_mutex_unlock(&world_lock);
+
+	c->save = -1;
+}
@@ -0,0 +1,74 @@
+#ifndef MP_WORLD_H
+#define MP_WORLD_H
+
+/*
+ * Persistent world state.
+ *
+ * The world is kept in a memory-mapped file with the
+ * fixed layout below, so player state is written
+ * straight through to it and a restarted server can
+ * resume by simply mapping it again, with no parsing.
+ *
+ * The layout is versioned; if the version (or the map
+ * size) doesn't match what the server expects, the
+ * file is wiped and started fresh.
+ */
+#define WORLD_MAGIC "MPWS"
+#define WORLD_VERSION 2
+#define WORLD_DEFAULT_PATH "mp_world.bin"
+
+// Number of players remembered in the file. This is
+// more than the player limit so that players who have
+// left still get their spot back when they return.
+#define WORLD_MAX_SAVED 256
+
+/*
+ * A player remembered in the world file.
+ */
+typedef struct mp_world_player
+{
+	// Non-zero while this record is in use at all.
+	uint8_t used;
+
+	// Non-zero while the player is connected.
+	uint8_t online;
+
+	uint8_t pad[6];
+
+	// Token of the player's last session. There are no
+	// accounts, so returning players are recognised by
+	// handing it back in P_JOIN.
+	uint64_t token;
+
+	// Last known position.
+	int32_t x, y;
+
+	// Wall-clock time the player was last seen (seconds).
+	int64_t last_seen;
+} mp_world_player;
+
+/*
+ * The whole file, as it's laid out on disk.
+ */
+typedef struct mp_world_file
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t map_wid;
+	uint32_t map_hei;
+	uint32_t player_cap;
+	uint32_t pad;
+
+	mp_world_player players[WORLD_MAX_SAVED];
+} mp_world_file;
+
+// Opening/closing
+int world_open(const char*);
+void world_close(void);
+
+// Player state
+int world_join(mp_client* const, unsigned long long);
+void world_store(mp_client* const);
+void world_leave(mp_client* const);
+
+#endif
@@ -3,19 +3,35 @@
 
 // Standard includes.
 #include <errno.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
 #include <time.h>
 #include <unistd.h>
 
 // Networking
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <linux/sockios.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
 #include <fcntl.h>
+#include <poll.h>
+
+// Files
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 // Other defines
 #define TRUE 1
@@ -28,5 +44,12 @@
 #include "comm/mp_packet.h"
 #include "comm/mp_ostream.h"
 #include "comm/mp_istream.h"
+#include "comm/mp_shm.h"
+#include "comm/mp_time.h"
+#include "comm/mp_spsc.h"
+#include "comm/mp_log.h"
+#include "comm/mp_map.h"
+#include "comm/mp_pool.h"
+#include "comm/mp_listener.h"
 
 #endif
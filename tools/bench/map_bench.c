@@ -0,0 +1,171 @@
+/*
+ * map_bench.c
+ *
+ * Benchmark of map loading.
+ *
+ * For each map we time opening it (which just maps the
+ * file in), then reading every tile once, which is when
+ * the pages actually get faulted in. For comparison we
+ * also time reading the whole file into memory, which
+ * is what loading it any other way would cost at least.
+ *
+ * With no arguments, maps of a range of sizes are
+ * generated into temporary files. Map files can be
+ * given instead.
+ */
+
+#include "pch.h"
+
+// Number of times each measurement is repeated.
+#define BENCH_RUNS 20
+
+// Results for one map.
+typedef struct
+{
+	double open_us, scan_us, read_us;
+	unsigned long long walls;
+} bench_result;
+
+/*
+ * Time loading a map.
+ *
+ * @return FALSE if the map couldn't be loaded.
+ */
+static int bench_run(const char* path, unsigned runs, mp_map* info, bench_result* res)
+{
+	memset(res, 0, sizeof(bench_result));
+	unsigned long long open_ns = 0, scan_ns = 0, read_ns = 0;
+	for (unsigned r = 0; r < runs; ++r)
+	{
+		// Open (map) it.
+		mp_map m;
+		unsigned long long t0 = time_now_ns();
+		if (!map_open(&m, path))
+		{
+			return FALSE;
+		}
+		unsigned long long t1 = time_now_ns();
+
+		// Touch every tile.
+		unsigned long long walls = 0;
+		for (unsigned y = 0; y < m.hei; ++y)
+		{
+			for (unsigned x = 0; x < m.wid; ++x)
+			{
+				walls += map_tile(&m, x, y) == TILE_WALL;
+			}
+		}
+		unsigned long long t2 = time_now_ns();
+
+		open_ns += t1 - t0;
+		scan_ns += t2 - t1;
+		res->walls = walls;
+		*info = m;
+		map_free(&m);
+
+		// Read it the old fashioned way.
+		t0 = time_now_ns();
+		FILE* f = fopen(path, "rb");
+		unsigned char* buf = malloc(info->size);
+		if (!f || !buf || fread(buf, info->size, 1, f) != 1)
+		{
+			if (f) fclose(f);
+			free(buf);
+			return FALSE;
+		}
+		fclose(f);
+		free(buf);
+		read_ns += time_now_ns() - t0;
+	}
+
+	res->open_us = (double)open_ns / runs / NS_PER_US;
+	res->scan_us = (double)scan_ns / runs / NS_PER_US;
+	res->read_us = (double)read_ns / runs / NS_PER_US;
+	return TRUE;
+}
+
+/*
+ * Print a result line.
+ */
+static void bench_print(const char* name, const mp_map* m, const bench_result* r)
+{
+	printf("%-24s %11ux%-5u %12zu %10.2f %12.2f %12.2f %10llu\n",
+		name, m->wid, m->hei, m->size,
+		r->open_us, r->scan_us, r->read_us, r->walls);
+}
+
+/*
+ * Entry point.
+ */
+int main(int argc, char** argv)
+{
+	unsigned runs = BENCH_RUNS;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'n': runs = (unsigned)atoi(optarg); break;
+			default:
+			{
+				printf("Usage: %s [-n runs] [map_file...]\n", argv[0]);
+				return opt == 'h' ? 0 : -1;
+			}
+		}
+	}
+	if (!runs) runs = 1;
+
+	printf("%-24s %17s %12s %10s %12s %12s %10s\n",
+		"map", "size", "bytes", "open us", "scan us", "read us", "walls");
+
+	// Benchmark the maps we were given.
+	if (optind < argc)
+	{
+		int status = 0;
+		for (int i = optind; i < argc; ++i)
+		{
+			mp_map m;
+			bench_result r;
+			if (!bench_run(argv[i], runs, &m, &r))
+			{
+				printf("Failed to load map %s\n", argv[i]);
+				status = -1;
+				continue;
+			}
+			bench_print(argv[i], &m, &r);
+		}
+		return status;
+	}
+
+	// Otherwise generate maps of different sizes.
+	const unsigned sizes[][2] = { { 32, 12 }, { 256, 256 }, { 1024, 1024 }, { 4096, 4096 } };
+	for (unsigned s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+	{
+		char path[] = "/tmp/mp_map_bench_XXXXXX";
+		int fd = mkstemp(path);
+		if (fd < 0)
+		{
+			printf("Failed to create temporary file.\n");
+			return -1;
+		}
+		close(fd);
+
+		mp_map m;
+		if (!map_new(&m, sizes[s][0], sizes[s][1], TILE_FLOOR) || !map_save(&m, path))
+		{
+			printf("Failed to generate %ux%u map.\n", sizes[s][0], sizes[s][1]);
+			unlink(path);
+			return -1;
+		}
+		map_free(&m);
+
+		bench_result r;
+		if (bench_run(path, runs, &m, &r))
+		{
+			bench_print("generated", &m, &r);
+		}
+		unlink(path);
+	}
+
+	return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ * mapgen.c
+ *
+ * Builds map files for the server.
+ *
+ * A map can be drawn in a text file, one line per row,
+ * with '#' for walls and anything else for floor. Rows
+ * shorter than the longest are filled out with floor.
+ * Alternatively a map of any size can be generated,
+ * with walls scattered randomly over it.
+ */
+
+#include "pch.h"
+
+/*
+ * Print command line usage.
+ */
+static void usage(const char* name)
+{
+	printf("Usage: %s (-i text_file | -g WIDxHEI [-d density] [-s seed]) map_file\n", name);
+	printf("  -i file     Build map from a text file.\n");
+	printf("  -g WxH      Generate a map of the given size.\n");
+	printf("  -d percent  Percentage of generated tiles that are walls. (default 10)\n");
+	printf("  -s seed     Seed for generating. (default 1)\n");
+}
+
+/*
+ * Build a map from a text file.
+ *
+ * @param m     Map to create.
+ * @param path  Text file to read.
+ *
+ * @return FALSE on failure.
+ */
+static int map_from_text(mp_map* const m, const char* path)
+{
+	FILE* f = fopen(path, "r");
+	if (!f)
+	{
+		printf("Failed to open %s\n", path);
+		return FALSE;
+	}
+
+	// Find out how big the map is first.
+	unsigned wid = 0, hei = 0, len = 0;
+	int ch;
+	while ((ch = fgetc(f)) != EOF)
+	{
+		if (ch == '\n')
+		{
+			++hei;
+			len = 0;
+		}
+		else if (ch != '\r' && ++len > wid)
+		{
+			wid = len;
+		}
+	}
+	if (len) ++hei;
+
+	if (!map_new(m, wid, hei, TILE_FLOOR))
+	{
+		printf("%s doesn't hold a valid map. (%ux%u)\n", path, wid, hei);
+		fclose(f);
+		return FALSE;
+	}
+
+	// Then fill in the walls.
+	rewind(f);
+	unsigned x = 0, y = 0;
+	while ((ch = fgetc(f)) != EOF)
+	{
+		if (ch == '\n')
+		{
+			++y;
+			x = 0;
+		}
+		else if (ch != '\r')
+		{
+			if (ch == '#') map_set_tile(m, x, y, TILE_WALL);
+			++x;
+		}
+	}
+
+	fclose(f);
+	return TRUE;
+}
+
+/*
+ * Generate a map with walls scattered over it.
+ *
+ * @param m        Map to create.
+ * @param wid      Width in tiles.
+ * @param hei      Height in tiles.
+ * @param density  Percentage of tiles to make walls.
+ *
+ * @return FALSE on failure.
+ */
+static int map_generate(mp_map* const m, unsigned wid, unsigned hei, unsigned density)
+{
+	if (!map_new(m, wid, hei, TILE_FLOOR))
+	{
+		printf("Can't make a %ux%u map.\n", wid, hei);
+		return FALSE;
+	}
+
+	for (unsigned y = 0; y < hei; ++y)
+	{
+		for (unsigned x = 0; x < wid; ++x)
+		{
+			if ((unsigned)(rand() % 100) < density)
+			{
+				map_set_tile(m, x, y, TILE_WALL);
+			}
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * Entry point.
+ */
+int main(int argc, char** argv)
+{
+	const char* text_path = 0;
+	unsigned wid = 0, hei = 0, density = 10, seed = 1;
+	int opt;
+	while ((opt = getopt(argc, argv, "i:g:d:s:h")) != -1)
+	{
+		switch (opt)
+		{
+			case 'i': text_path = optarg; break;
+			case 'g':
+			{
+				if (sscanf(optarg, "%ux%u", &wid, &hei) != 2)
+				{
+					usage(argv[0]);
+					return -1;
+				}
+			} break;
+			case 'd': density = (unsigned)atoi(optarg); break;
+			case 's': seed = (unsigned)atoi(optarg); break;
+			default:
+			{
+				usage(argv[0]);
+				return opt == 'h' ? 0 : -1;
+			}
+		}
+	}
+	if (optind != argc - 1 || (!text_path && !wid))
+	{
+		usage(argv[0]);
+		return -1;
+	}
+	const char* out_path = argv[optind];
+
+	mp_map m;
+	srand(seed);
+	if (text_path ? !map_from_text(&m, text_path) : !map_generate(&m, wid, hei, density))
+	{
+		return -1;
+	}
+
+	int status = 0;
+	if (map_save(&m, out_path))
+	{
+		printf("Wrote %ux%u map (%ux%u chunks, %zu bytes) to %s\n",
+			m.wid, m.hei, m.chunks_x, m.chunks_y, m.size, out_path);
+	}
+	else
+	{
+		printf("Failed to write %s\n", out_path);
+		status = -1;
+	}
+
+	map_free(&m);
+	return status;
+}
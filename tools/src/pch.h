@@ -0,0 +1,27 @@
+#ifndef MP_PCH_H
+#define MP_PCH_H
+
+// Standard includes.
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Files
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Some constants
+#define TRUE 1
+#define FALSE 0
+#define FAIL 0
+
+// Local includes.
+#include "comm/mp_time.h"
+#include "comm/mp_map.h"
+
+#endif